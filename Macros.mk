@@ -129,6 +129,26 @@ ifndef DEFAULT_DOCKER_PASSWORD
 DEFAULT_DOCKER_PASSWORD :=
 endif
 
+ifndef DEFAULT_DOCKER_SESSION_CPULIMIT
+DEFAULT_DOCKER_SESSION_CPULIMIT :=
+endif
+
+ifndef DEFAULT_DOCKER_SESSION_MEMLIMIT
+DEFAULT_DOCKER_SESSION_MEMLIMIT :=
+endif
+
+ifndef DEFAULT_DOCKER_SESSION_PIDSLIMIT
+DEFAULT_DOCKER_SESSION_PIDSLIMIT :=
+endif
+
+ifndef DEFAULT_DOCKER_POW_BITS
+DEFAULT_DOCKER_POW_BITS :=
+endif
+
+ifndef DEFAULT_DOCKER_POW_SCALE
+DEFAULT_DOCKER_POW_SCALE :=
+endif
+
 
 # Any of these values indicate that a variable is "true"
 TRUE_VALUES  := 1 true  True  TRUE  yes y Yes Y YES on  On  ON
@@ -160,6 +180,15 @@ is_var_false = $(and $(call is_var_defined,$1),$(call is_value_false,$($1)))
 # Returns 1 when $1 names an undefined variable or when $1's value is the empty string or in $(FALSE_VALUES)
 is_var_false_or_undefined = $(or $(call is_var_undefined,$1),$(call is_value_empty,$($1)),$(call is_value_false,$($1)))
 
+# Functions wrapped by stdio_unbuffer.c in coalesced mode, each built as its own
+# archive member so that a challenge only links the wrappers for what it calls
+STDIO_WRAPPERS := \
+	read __read_chk fgets __fgets_chk gets __gets_chk getchar getc _IO_getc \
+	fgetc fread getdelim getline scanf __isoc99_scanf __isoc23_scanf fscanf \
+	__isoc99_fscanf __isoc23_fscanf write fputs fputc putc _IO_putc fwrite \
+	perror vfprintf __vfprintf_chk fprintf __fprintf_chk dprintf __dprintf_chk \
+	system popen execve execv execvp _exit
+
 
 #####
 # generate_target($1: subdirectory, $2: target)
@@ -326,10 +355,11 @@ $2_UBUNTU_VERSION_INT := $$($2_UBUNTU_VERSION_MAJOR)$$($2_UBUNTU_VERSION_MINOR)
 
 # Run compiler commands in a pwncc container?
 $2_PWNCC :=
+$2_PWNCC_CC :=
 $2_PWNCC_DEPS :=
 $2_PWNCC_DESC :=
 ifdef CONFIG_USE_PWNCC
-$$(call pwncc_prepare,$1,$$($2_UBUNTU_VERSION),$2_PWNCC,$2_PWNCC_DEPS)
+$$(call pwncc_prepare,$1,$$($2_UBUNTU_VERSION),$2_PWNCC,$2_PWNCC_DEPS,$2_PWNCC_CC)
 # Format string for a printed message prefix
 $2_PWNCC_DESC := [$$($2_UBUNTU_VERSION)]$$(SPACE)
 endif #CONFIG_USE_PWNCC
@@ -363,6 +393,11 @@ ifeq "$$(origin $2_NO_UNBUFFERED_STDIO)" "undefined"
 $2_NO_UNBUFFERED_STDIO := $$($1+NO_UNBUFFERED_STDIO)
 endif
 
+# Ensure that target_COALESCED_STDIO has a value
+ifeq "$$(origin $2_COALESCED_STDIO)" "undefined"
+$2_COALESCED_STDIO := $$($1+COALESCED_STDIO)
+endif
+
 # Ensure that target_NO_RPATH has a value
 ifeq "$$(origin $2_NO_RPATH)" "undefined"
 $2_NO_RPATH := $$($1+NO_RPATH)
@@ -622,6 +657,17 @@ ifdef MKTRACE
 $$(info Adding rule for $1+$2's stdio_unbuffer.o)
 endif #MKTRACE
 
+# Coalesced mode buffers stdout and flushes it from a timer thread, and it finds
+# the libc functions it wraps with dlsym(). The wrappers come from an archive,
+# which must be searched before any library that defines the same functions.
+ifdef $2_COALESCED_STDIO
+$2_UNBUFFER_CPPFLAGS := -DPWNABLE_COALESCED_STDIO=1
+$2_STDIO_WRAP_DIR := $$($1+BUILD)/$2_objs/stdio_wrap
+$2_STDIO_WRAP_OBJS := $$(patsubst %,$$($2_STDIO_WRAP_DIR)/%.o,$$(STDIO_WRAPPERS))
+$2_STDIO_WRAP_LIB := $$($1+BUILD)/$2_objs/stdio_wrap.a
+$2_LDLIBS := $$($2_STDIO_WRAP_LIB) $$($2_LDLIBS) -pthread -ldl
+endif #COALESCED_STDIO
+
 ifndef UNBUFFER_DIR
 ifdef CONTAINER_BUILD
 UNBUFFER_DIR := $$(BUILD)/core
@@ -645,7 +691,27 @@ endif #UNBUFFER_DIR
 # Compiler rule for stdio_unbuffer.o
 $$($1+BUILD)/$2_objs/stdio_unbuffer.o: $$(UNBUFFER_DIR)/stdio_unbuffer.c $$($2_PWNCC_DEPS)
 	$$(_V)echo "$$($2_PWNCC_DESC)Compiling $$(<F) for $$(patsubst ./%,%,$1/$2)"
-	$$(_v)$$($2_PWNCC)$$($2_CC) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_CFLAGS) $$($2_ALL_OFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
+	$$(_v)$$($2_PWNCC_CC)$$($2_CC) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_UNBUFFER_CPPFLAGS) $$($2_ALL_CFLAGS) $$($2_ALL_OFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
+
+ifdef $2_COALESCED_STDIO
+# Each wrapper is compiled from a stub source that selects it and includes
+# stdio_unbuffer.c. All of the stubs are compiled by one compiler command run
+# from the wrapper directory, where it writes their objects, and those objects
+# become the members of an archive. The linker only takes members from it for
+# functions that the challenge's objects call.
+$$($2_STDIO_WRAP_LIB): $$(UNBUFFER_DIR)/stdio_unbuffer.c $$($2_PWNCC_DEPS) $$($1+BUILD_MK) $$(ROOT_DIR)/Macros.mk | $$($2_STDIO_WRAP_DIR)/.dir
+	$$(_V)echo "$$($2_PWNCC_DESC)Compiling stdio wrappers for $$(patsubst ./%,%,$1/$2)"
+	$$(_v)$$(foreach w,$$(STDIO_WRAPPERS),printf '#define PWNABLE_STDIO_WRAPPER 1\n#define PWNABLE_WRAP_%s 1\n#include "%s"\n' \
+		$$w $$(UNBUFFER_DIR)/stdio_unbuffer.c > $$($2_STDIO_WRAP_DIR)/$$w.c && ) true
+	$$(_v)$$($2_PWNCC)/bin/sh -c 'cd "$$$$0" && exec "$$$$@" -I"$$$$OLDPWD"' $$($2_STDIO_WRAP_DIR) \
+		$$($2_CC) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_UNBUFFER_CPPFLAGS) $$($2_ALL_CFLAGS) $$($2_ALL_OFLAGS) \
+		-c $$(patsubst %,%.c,$$(STDIO_WRAPPERS))
+	$$(_V)echo "$$($2_PWNCC_DESC)Archiving stdio wrappers for $$(patsubst ./%,%,$1/$2)"
+	$$(_v)rm -f $$@
+	$$(_v)$$($2_PWNCC)$$($2_AR) rcs $$@ $$($2_STDIO_WRAP_OBJS)
+
+$$($2_PRODUCT): $$($2_STDIO_WRAP_LIB)
+endif #COALESCED_STDIO
 
 endif #NO_UNBUFFERED_STDIO
 endif #BINTYPE == executable
@@ -670,17 +736,17 @@ endif #MKTRACE
 # Compiler rule for C sources
 $$(filter %.c.o,$$($2_OBJS)): $$($1+BUILD)/$2_objs/%.c.o: $1/%.c $$($2_PWNCC_DEPS)
 	$$(_V)echo "$$($2_PWNCC_DESC)Compiling $$< for $$(patsubst ./%,%,$1/$2)"
-	$$(_v)$$($2_PWNCC)$$($2_CC) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_CFLAGS) $$($2_ALL_OFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
+	$$(_v)$$($2_PWNCC_CC)$$($2_CC) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_CFLAGS) $$($2_ALL_OFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
 
 # Compiler rule for C++ sources
 $$(filter %.cpp.o,$$($2_OBJS)): $$($1+BUILD)/$2_objs/%.cpp.o: $1/%.cpp $$($2_PWNCC_DEPS)
 	$$(_V)echo "$$($2_PWNCC_DESC)Compiling $$< for $$(patsubst ./%,%,$1/$2)"
-	$$(_v)$$($2_PWNCC)$$($2_CXX) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_CXXFLAGS) $$($2_ALL_OFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
+	$$(_v)$$($2_PWNCC_CC)$$($2_CXX) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_CXXFLAGS) $$($2_ALL_OFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
 
 # Assembler rule
 $$(filter %.S.o,$$($2_OBJS)): $$($1+BUILD)/$2_objs/%.S.o: $1/%.S $$($2_PWNCC_DEPS)
 	$$(_V)echo "$$($2_PWNCC_DESC)Assembling $$< for $$(patsubst ./%,%,$1/$2)"
-	$$(_v)$$($2_PWNCC)$$($2_AS) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_ASFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
+	$$(_v)$$($2_PWNCC_CC)$$($2_AS) -m$$($2_BITS) $$($2_ALL_CPPFLAGS) $$($2_ALL_ASFLAGS) -MD -MP -MF $$(@:.o=.d) -c -o $$@ $$<
 
 clean-one[$1]: clean-objs[$1+$2]
 
@@ -780,6 +846,14 @@ docker-restart-one[$1]:
 	$$(_V)echo "Restarting containers with docker-compose in $1"
 	$$(_v)cd $1 && docker-compose restart
 
+$$(call add_phony_target,docker-reload[$1])
+docker-reload[$1]: docker-reload-one[$1]
+
+$$(call add_phony_target,docker-reload-one[$1])
+docker-reload-one[$1]:
+	$$(_V)echo "Reloading containers with docker-compose in $1"
+	$$(_v)cd $1 && docker-compose kill -s HUP
+
 $$(call add_phony_target,docker-stop[$1])
 docker-stop[$1]: docker-stop-one[$1]
 
@@ -890,6 +964,9 @@ PROJECT_LIST += $1
 TARGET :=
 TARGETS :=
 
+# Targets that are only built when another rule depends on them
+OPTIONAL_TARGETS :=
+
 # For advanced users that want to define custom build rules for a directory
 PRODUCT :=
 PRODUCTS :=
@@ -933,6 +1010,16 @@ DOCKER_MEMLIMIT := $$(DEFAULT_DOCKER_MEMLIMIT)
 DOCKER_TIMELIMIT := $$(DEFAULT_DOCKER_TIMELIMIT)
 DOCKER_WRITEABLE :=
 DOCKER_PASSWORD := $$(DEFAULT_DOCKER_PASSWORD)
+DOCKER_SESSION_CPULIMIT := $$(DEFAULT_DOCKER_SESSION_CPULIMIT)
+DOCKER_SESSION_MEMLIMIT := $$(DEFAULT_DOCKER_SESSION_MEMLIMIT)
+DOCKER_SESSION_PIDSLIMIT := $$(DEFAULT_DOCKER_SESSION_PIDSLIMIT)
+DOCKER_CGROUP_PARENT :=
+DOCKER_ALLOW_SYS_ADMIN :=
+DOCKER_PID_NAMESPACE :=
+DOCKER_SESSION_WORKDIR :=
+DOCKER_SESSION_WORKDIR_SIZE :=
+DOCKER_POW_BITS := $$(DEFAULT_DOCKER_POW_BITS)
+DOCKER_POW_SCALE := $$(DEFAULT_DOCKER_POW_SCALE)
 
 # These can optionally be defined to set directory-specific variables
 BITS := $$(DEFAULT_BITS)
@@ -960,6 +1047,7 @@ LIBS :=
 LDLIBS :=
 USE_LIBPWNABLEHARNESS :=
 NO_UNBUFFERED_STDIO :=
+COALESCED_STDIO :=
 NO_RPATH :=
 
 # Ubuntu/glibc versions
@@ -1012,6 +1100,7 @@ endif
 $1+TARGETS :=
 endif
 $1+NUM_TARGETS := $$(words $$($1+TARGETS))
+$1+OPTIONAL_TARGETS := $$(OPTIONAL_TARGETS)
 
 # Path where the build target binary will be written
 $1+PRODUCT := $$(PRODUCT)
@@ -1073,6 +1162,16 @@ $1+DOCKER_MEMLIMIT := $$(DOCKER_MEMLIMIT)
 $1+DOCKER_TIMELIMIT := $$(DOCKER_TIMELIMIT)
 $1+DOCKER_WRITEABLE := $$(DOCKER_WRITEABLE)
 $1+DOCKER_PASSWORD := $$(DOCKER_PASSWORD)
+$1+DOCKER_SESSION_CPULIMIT := $$(DOCKER_SESSION_CPULIMIT)
+$1+DOCKER_SESSION_MEMLIMIT := $$(DOCKER_SESSION_MEMLIMIT)
+$1+DOCKER_SESSION_PIDSLIMIT := $$(DOCKER_SESSION_PIDSLIMIT)
+$1+DOCKER_CGROUP_PARENT := $$(DOCKER_CGROUP_PARENT)
+$1+DOCKER_ALLOW_SYS_ADMIN := $$(DOCKER_ALLOW_SYS_ADMIN)
+$1+DOCKER_PID_NAMESPACE := $$(DOCKER_PID_NAMESPACE)
+$1+DOCKER_SESSION_WORKDIR := $$(DOCKER_SESSION_WORKDIR)
+$1+DOCKER_SESSION_WORKDIR_SIZE := $$(DOCKER_SESSION_WORKDIR_SIZE)
+$1+DOCKER_POW_BITS := $$(DOCKER_POW_BITS)
+$1+DOCKER_POW_SCALE := $$(DOCKER_POW_SCALE)
 $1+DOCKER_COMPOSE := $$(wildcard $1/docker-compose.yml)
 
 # Directory specific variables
@@ -1101,6 +1200,7 @@ $1+LIBS := $$(LIBS)
 $1+LDLIBS := $$(LDLIBS)
 $1+USE_LIBPWNABLEHARNESS := $$(USE_LIBPWNABLEHARNESS)
 $1+NO_UNBUFFERED_STDIO := $$(NO_UNBUFFERED_STDIO)
+$1+COALESCED_STDIO := $$(COALESCED_STDIO)
 $1+NO_RPATH := $$(NO_RPATH)
 
 # Ubuntu/glibc versions
@@ -1142,7 +1242,7 @@ $1+DEBUG := $$(DEBUG)
 
 # Produce target specific variables and build rules
 # $$(foreach target,$$($1+TARGETS),$$(info $$(call _generate_target,$1,$$(target))))
-$$(foreach target,$$($1+TARGETS),$$(call generate_target,$1,$$(target)))
+$$(foreach target,$$($1+TARGETS) $$($1+OPTIONAL_TARGETS),$$(call generate_target,$1,$$(target)))
 
 
 ## Directory specific build rules
@@ -1180,7 +1280,7 @@ endif #DIR+DEPLOY_COMMAND
 # Clean rules
 clean[$1]: clean-one[$1]
 
-$1+TO_CLEAN := $$($1+PRODUCTS)
+$1+TO_CLEAN := $$($1+PRODUCTS) $$(addprefix $$($1+BUILD)/,$$($1+OPTIONAL_TARGETS))
 ifneq "$$($1+BUILD)" ".build"
 $1+TO_CLEAN += $$($1+BUILD)
 endif
@@ -1287,6 +1387,35 @@ ifdef $1+DOCKER_RUN_ARGS
 $1+DOCKER_RUNNABLE := true
 endif
 
+# Run each session in its own PID namespace, which pwnableserver needs
+# CAP_SYS_ADMIN to create. The flag must come before any challenge args.
+ifdef $1+DOCKER_PID_NAMESPACE
+ifndef $1+DOCKER_ALLOW_SYS_ADMIN
+$$(error $$($1+BUILD_MK) defined DOCKER_PID_NAMESPACE, which needs CAP_SYS_ADMIN in the container, without opting in with DOCKER_ALLOW_SYS_ADMIN)
+endif #DOCKER_ALLOW_SYS_ADMIN
+$1+DOCKER_PWNABLESERVER_ARGS := --pid-namespace $$($1+DOCKER_PWNABLESERVER_ARGS)
+$1+DOCKER_RUN_ARGS += --cap-add=SYS_ADMIN
+endif #DOCKER_PID_NAMESPACE
+
+# Give each session a private copy-on-write view of a directory. Mounting it
+# needs CAP_SYS_ADMIN, and Docker's default AppArmor profile forbids mounts.
+ifdef $1+DOCKER_SESSION_WORKDIR
+ifndef $1+DOCKER_ALLOW_SYS_ADMIN
+$$(error $$($1+BUILD_MK) defined DOCKER_SESSION_WORKDIR, which needs CAP_SYS_ADMIN without AppArmor in the container, without opting in with DOCKER_ALLOW_SYS_ADMIN)
+endif #DOCKER_ALLOW_SYS_ADMIN
+ifdef $1+DOCKER_SESSION_WORKDIR_SIZE
+$1+DOCKER_PWNABLESERVER_ARGS := --workdir-size $$($1+DOCKER_SESSION_WORKDIR_SIZE) $$($1+DOCKER_PWNABLESERVER_ARGS)
+endif
+$1+DOCKER_PWNABLESERVER_ARGS := --session-workdir $$($1+DOCKER_SESSION_WORKDIR) $$($1+DOCKER_PWNABLESERVER_ARGS)
+$1+DOCKER_RUN_ARGS += --cap-add=SYS_ADMIN --security-opt apparmor=unconfined
+endif #DOCKER_SESSION_WORKDIR
+
+# Challenges built with COALESCED_STDIO report their own progress with --trace,
+# and only those may be handed the trace pipe
+ifdef $1+COALESCED_STDIO
+$1+DOCKER_PWNABLESERVER_ARGS := --trace-reports $$($1+DOCKER_PWNABLESERVER_ARGS)
+endif #COALESCED_STDIO
+
 # Append args for the challenge binary to pwnableserver's args (after a "--" sentinel)
 ifdef $1+DOCKER_CHALLENGE_ARGS
 $1+DOCKER_PWNABLESERVER_ARGS += -- $$($1+DOCKER_CHALLENGE_ARGS)
@@ -1313,11 +1442,57 @@ ifdef $1+DOCKER_MEMLIMIT
 $1+DOCKER_RUN_ARGS += --memory=$$($1+DOCKER_MEMLIMIT) --memory-swap=$$($1+DOCKER_MEMLIMIT)
 endif #DOCKER_MEMLIMIT
 
+# Pass the per-session limits through as build args. Each session gets its own
+# cgroup, which pwnableserver needs a writable cgroup filesystem to create, but
+# Docker mounts it read-only. The preferred way is to delegate a host cgroup:
+# the container is started under DOCKER_CGROUP_PARENT, and only that subtree is
+# bind-mounted writable over the read-only cgroup filesystem.
+$1+HAS_SESSION_LIMITS :=
+ifdef $1+DOCKER_SESSION_CPULIMIT
+$1+HAS_SESSION_LIMITS := true
+$1+DOCKER_BUILD_ARGS += --build-arg "SESSION_CPULIMIT=$$($1+DOCKER_SESSION_CPULIMIT)"
+endif #DOCKER_SESSION_CPULIMIT
+ifdef $1+DOCKER_SESSION_MEMLIMIT
+$1+HAS_SESSION_LIMITS := true
+$1+DOCKER_BUILD_ARGS += --build-arg "SESSION_MEMLIMIT=$$($1+DOCKER_SESSION_MEMLIMIT)"
+endif #DOCKER_SESSION_MEMLIMIT
+ifdef $1+DOCKER_SESSION_PIDSLIMIT
+$1+HAS_SESSION_LIMITS := true
+$1+DOCKER_BUILD_ARGS += --build-arg "SESSION_PIDSLIMIT=$$($1+DOCKER_SESSION_PIDSLIMIT)"
+endif #DOCKER_SESSION_PIDSLIMIT
+ifdef $1+HAS_SESSION_LIMITS
+ifdef $1+DOCKER_CGROUP_PARENT
+$1+DOCKER_RUN_ARGS += --cgroupns=host --cgroup-parent=$$($1+DOCKER_CGROUP_PARENT)
+$1+DOCKER_RUN_ARGS += -v /sys/fs/cgroup/$$($1+DOCKER_CGROUP_PARENT):/sys/fs/cgroup/$$($1+DOCKER_CGROUP_PARENT)
+else ifdef $1+DOCKER_ALLOW_SYS_ADMIN
+# WARNING: This gives root in the container CAP_SYS_ADMIN and turns off AppArmor
+# for the whole container so that pwnableserver can remount the cgroup
+# filesystem read-write. Sessions never get CAP_SYS_ADMIN, as pwnableserver
+# drops it from their bounding set, but anything else running as root in the
+# container keeps it. Use DOCKER_CGROUP_PARENT instead wherever possible.
+$1+DOCKER_PWNABLESERVER_ARGS := --cgroup-remount $$($1+DOCKER_PWNABLESERVER_ARGS)
+$1+DOCKER_RUN_ARGS += --cgroupns=private --cap-add=SYS_ADMIN --security-opt apparmor=unconfined
+else
+$$(error $$($1+BUILD_MK) defined per-session limits without DOCKER_CGROUP_PARENT to delegate a cgroup for them, or opting in to DOCKER_ALLOW_SYS_ADMIN)
+endif #DOCKER_CGROUP_PARENT
+endif #HAS_SESSION_LIMITS
+
 # If there's a password, supply it as an argument to pwnableserver
 ifdef $1+DOCKER_PASSWORD
 $1+DOCKER_BUILD_ARGS += --build-arg "CHALLENGE_PASSWORD=$$($1+DOCKER_PASSWORD)"
 endif #DOCKER_PASSWORD
 
+# Pass the proof of work difficulty through as build args
+ifdef $1+DOCKER_POW_BITS
+$1+DOCKER_BUILD_ARGS += --build-arg "POW_BITS=$$($1+DOCKER_POW_BITS)"
+endif #DOCKER_POW_BITS
+ifdef $1+DOCKER_POW_SCALE
+ifndef $1+DOCKER_POW_BITS
+$$(error $$($1+BUILD_MK) defined DOCKER_POW_SCALE without DOCKER_POW_BITS, which it scales)
+endif #DOCKER_POW_BITS
+$1+DOCKER_BUILD_ARGS += --build-arg "POW_SCALE=$$($1+DOCKER_POW_SCALE)"
+endif #DOCKER_POW_SCALE
+
 # Check if DOCKER_PWNABLESERVER_ARGS was defined
 ifdef $1+DOCKER_PWNABLESERVER_ARGS
 $1+DOCKER_BUILD_ARGS += --build-arg "PWNABLESERVER_EXTRA_ARGS=$$($1+DOCKER_PWNABLESERVER_ARGS)"
@@ -1398,6 +1573,18 @@ endif #MKTRACE
 # been changed since the last docker build
 docker-build-one[$1]: $$($1+BUILD)/.docker_build_marker
 
+# Images that this image is built FROM. The default Dockerfile is only
+# generated later, but it's known to use the PwnableHarness base image.
+ifeq "$$($1+DOCKERFILE)" "$1/default.Dockerfile"
+$1+DOCKER_FROM := $$($1+DOCKER_FULL_BASE)
+else
+$1+DOCKER_FROM := $$(shell awk 'toupper($$$$1) == "FROM" { for(i = 2; i <= NF; i++) if($$$$i !~ /^--/) { print $$$$i; break } }' '$$($1+DOCKERFILE)' 2>/dev/null)
+endif
+
+# Register this image, so images built FROM it are built after it (see docker_build_order)
+DOCKER_BUILD_MARKER[$$(call docker_image_key,$$($1+DOCKER_TAG_ARG))] := $$($1+BUILD)/.docker_build_marker
+DOCKER_PROJECTS += $1
+
 # Create a marker file to track last docker build time
 $$($1+BUILD)/.docker_build_marker: $$($1+PRODUCTS) $$($1+DOCKER_BUILD_DEPS) $$($1+BUILD)/.dir
 	$$(_V)echo "Building docker image $$($1+DOCKER_TAG_ARG)"
@@ -1462,6 +1649,11 @@ docker-restart-one[$1]:
 	$$(_V)echo "Restarting docker container $$($1+DOCKER_CONTAINER)"
 	$$(_v)$$(DOCKER) restart $$($1+DOCKER_CONTAINER)
 
+# Re-exec pwnableserver in a running container without dropping connections
+docker-reload-one[$1]:
+	$$(_V)echo "Reloading docker container $$($1+DOCKER_CONTAINER)"
+	$$(_v)$$(DOCKER) kill --signal HUP $$($1+DOCKER_CONTAINER)
+
 # Stop the docker container
 docker-stop-one[$1]:
 	$$(_V)echo "Stopping docker container $$($1+DOCKER_CONTAINER)"
@@ -1615,3 +1807,33 @@ endif #exists($1)
 endef #_recurse_subdir
 recurse_subdir = $(eval $(call _recurse_subdir,$1))
 #####
+
+
+#####
+# docker_image_key($1: image name)
+#
+# Names a Docker image in a variable name, where ":" can't be used. An image
+# without a tag is the same as its "latest" tag.
+#####
+docker_image_key = $(subst :,+,$(if $(findstring :,$(lastword $(subst /, ,$1))),$1,$1:latest))
+#####
+
+
+#####
+# docker_build_order($1: project directory)
+#
+# Once all projects are known, makes the project's Docker image build after
+# any images in the workspace that it's built FROM. Images that don't depend
+# on each other can then be built in parallel with `make -j`.
+#####
+define _docker_build_order
+$1+DOCKER_FROM_MARKERS := $$(filter-out $$($1+BUILD)/.docker_build_marker,$$(strip \
+	$$(foreach i,$$($1+DOCKER_FROM),$$(DOCKER_BUILD_MARKER[$$(call docker_image_key,$$i)]))))
+
+ifdef $1+DOCKER_FROM_MARKERS
+$$($1+BUILD)/.docker_build_marker: $$($1+DOCKER_FROM_MARKERS)
+docker-rebuild-one[$1]: | $$($1+DOCKER_FROM_MARKERS)
+endif
+endef #_docker_build_order
+docker_build_order = $(eval $(call _docker_build_order,$1))
+#####
@@ -6,13 +6,13 @@
 
 # Update any time the PwnableHarness makefiles (or anything else in the pwnmake
 # image) are changed.
-PHMAKE_VERSION  := v2.3.1
+PHMAKE_VERSION  := v2.4.0
 PHMAKE_RELEASED := v2.3.1
 
 # This only needs to update when there's a change that would affect the base
 # images. Changes that only affect PwnableHarness as a build system don't need
 # to update the base image version.
-BASE_VERSION  := v2.1
+BASE_VERSION  := v2.2
 BASE_RELEASED := v2.1
 
 # This updates slower than PWNABLEHARNESS_VERSION. It's expected that a given
@@ -47,6 +47,10 @@ $$(CORE_BUILD)/.docker_base_build_marker-$1: $$(PWNABLE_CORE_DEPS-$1)
 			-t $$(PWNABLEHARNESS_REPO):base-$1-$$(BASE_VERSION) . \
 		&& mkdir -p $$(@D) && touch $$@
 
+# Challenge images built FROM this base image are built after it
+DOCKER_BUILD_MARKER[$$(call docker_image_key,$$(PWNABLEHARNESS_REPO):base-$1-$$(BASE_VERSION))] := \
+	$$(CORE_BUILD)/.docker_base_build_marker-$1
+
 endef
 $(call generate_ubuntu_versioned_rules,docker_base_build_template)
 
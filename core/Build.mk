@@ -11,6 +11,10 @@ CORE_LIB32 := libpwnableharness32.so
 CORE_LIB64 := libpwnableharness64.so
 CORE_SERVER := pwnableserver
 
+# Sources that make up libpwnableharness, sharing declarations through pwnable_internal.h
+CORE_LIB_SRCS := pwnable_harness.c pwnable_log.c pwnable_relay.c pwnable_fork_server.c \
+	pwnable_auth.c pwnable_metrics.c pwnable_upgrade.c pwnable_threaded.c
+
 CFLAGS := -Wall -Wextra -Werror
 
 ASLR := 1
@@ -25,8 +29,9 @@ define core_target_def
 CORE_TARGETS-$1 := $1/$$(CORE_LIB64) $1/$$(CORE_SERVER)
 
 $1/$$(CORE_LIB64)_BITS := 64
-$1/$$(CORE_LIB64)_SRCS := pwnable_harness.c
+$1/$$(CORE_LIB64)_SRCS := $$(CORE_LIB_SRCS)
 $1/$$(CORE_LIB64)_DEBUG := true
+$1/$$(CORE_LIB64)_LDLIBS := -pthread
 $1/$$(CORE_LIB64)_UBUNTU_VERSION := $1
 
 $1/$$(CORE_SERVER)_BITS := 64
@@ -39,8 +44,9 @@ ifndef CONFIG_IGNORE_32BIT
 CORE_TARGETS-$1 += $1/$$(CORE_LIB32)
 
 $1/$$(CORE_LIB32)_BITS := 32
-$1/$$(CORE_LIB32)_SRCS := pwnable_harness.c
+$1/$$(CORE_LIB32)_SRCS := $$(CORE_LIB_SRCS)
 $1/$$(CORE_LIB32)_DEBUG := true
+$1/$$(CORE_LIB32)_LDLIBS := -pthread
 $1/$$(CORE_LIB32)_UBUNTU_VERSION := $1
 
 endif #32bit
@@ -58,8 +64,95 @@ endif #CONFIG_PUBLISH_LIBPWNABLEHARNESS
 endef #core_target_def
 $(call generate_ubuntu_versioned_rules,core_target_def)
 
+# Load generator for benchmarking pwnableserver. It isn't part of the base
+# images, so it's only built for the default Ubuntu version.
+CORE_BENCH := $(DEFAULT_UBUNTU_VERSION)/pwnablebench
+$(CORE_BENCH)_BITS := 64
+$(CORE_BENCH)_SRCS := pwnable_bench.c pwnable_bench_common.c
+$(CORE_BENCH)_UBUNTU_VERSION := $(DEFAULT_UBUNTU_VERSION)
+
+# Replays client traffic recorded with `pwnableserver --capture <file>`. Like
+# the load generator, it's only built for the default Ubuntu version.
+CORE_REPLAY := $(DEFAULT_UBUNTU_VERSION)/pwnablereplay
+$(CORE_REPLAY)_BITS := 64
+$(CORE_REPLAY)_SRCS := pwnable_replay.c pwnable_bench_common.c
+$(CORE_REPLAY)_UBUNTU_VERSION := $(DEFAULT_UBUNTU_VERSION)
+
+# Spawn path microbenchmark. It's built for every Ubuntu version and bitness,
+# since the cost of each way to spawn a session differs between them.
+CORE_SPAWNBENCH :=
+
+# `make bench-spawn` runs it in each base image (build them first with
+# `make docker-base-build`), preloading libpwnableharness like --inject would.
+# Use BENCH_SPAWN_ARGS for other options, like BENCH_SPAWN_ARGS="-n 5000 -m 512".
+BENCH_SPAWN_USER ?= nobody
+BENCH_SPAWN_ARGS ?=
+
+$(call add_phony_target,bench-spawn)
+$(call generate_dependency_list,bench-spawn,$(UBUNTU_VERSIONS))
+
+define core_spawnbench_def
+CORE_SPAWNBENCH-$1 := $1/pwnablespawnbench64
+
+$1/pwnablespawnbench64_BITS := 64
+$1/pwnablespawnbench64_SRCS := pwnable_spawnbench.c pwnable_bench_common.c
+$1/pwnablespawnbench64_UBUNTU_VERSION := $1
+
+ifndef CONFIG_IGNORE_32BIT
+CORE_SPAWNBENCH-$1 += $1/pwnablespawnbench32
+
+$1/pwnablespawnbench32_BITS := 32
+$1/pwnablespawnbench32_SRCS := pwnable_spawnbench.c pwnable_bench_common.c
+$1/pwnablespawnbench32_UBUNTU_VERSION := $1
+
+endif #32bit
+
+CORE_SPAWNBENCH += $$(CORE_SPAWNBENCH-$1)
+
+.PHONY: bench-spawn[$1]
+bench-spawn[$1]: $$(addprefix $$(CORE_BUILD)/,$$(CORE_SPAWNBENCH-$1))
+	$$(_v)$$(foreach x,$$(CORE_SPAWNBENCH-$1),\
+		echo "Benchmarking spawn strategies for $$(notdir $$x) on ubuntu:$1" && \
+		$$(DOCKER) run --rm -v $$(abspath $$(CORE_BUILD)/$1):/bench:ro \
+			$$(PWNABLEHARNESS_REPO):base-$1-$$(BASE_VERSION) \
+			/bench/$$(notdir $$x) --user $$(BENCH_SPAWN_USER) \
+			--preload libpwnableharness$$(patsubst pwnablespawnbench%,%,$$(notdir $$x)).so \
+			$$(BENCH_SPAWN_ARGS) && ) true
+
+endef #core_spawnbench_def
+$(call generate_ubuntu_versioned_rules,core_spawnbench_def)
+
 TARGETS := $(CORE_TARGETS)
 
+# Benchmark and replay tools are only built by the rules that run them
+OPTIONAL_TARGETS := $(CORE_BENCH) $(CORE_REPLAY) $(CORE_SPAWNBENCH)
+
+# `make bench` runs the load generator against an already running challenge,
+# by default examples/GimmeArgs (`make WITH_EXAMPLES=1 docker-start[examples/GimmeArgs]`).
+# Use BENCH_ARGS for other options, like BENCH_ARGS="-n 5000 -c 200 -r 500".
+BENCH_HOST ?= 127.0.0.1
+BENCH_PORT ?= 32323
+BENCH_ARGS ?=
+
+$(call add_phony_target,bench)
+bench: $(CORE_BUILD)/$(CORE_BENCH)
+	$(_V)echo "Benchmarking pwnableserver at $(BENCH_HOST):$(BENCH_PORT)"
+	$(_v)$< --host $(BENCH_HOST) --port $(BENCH_PORT) $(BENCH_ARGS)
+
+# `make replay REPLAY_FILE=<capture-file>` replays captured sessions against
+# the same server as `make bench`. Use REPLAY_ARGS for other options, like
+# REPLAY_ARGS="--speed 0 --repeat 10 -c 100" to replay them as fast as possible.
+REPLAY_FILE ?=
+REPLAY_ARGS ?=
+
+$(call add_phony_target,replay)
+replay: $(CORE_BUILD)/$(CORE_REPLAY)
+ifndef REPLAY_FILE
+	$(error Set REPLAY_FILE to a file written by pwnableserver --capture)
+endif
+	$(_V)echo "Replaying $(REPLAY_FILE) against pwnableserver at $(BENCH_HOST):$(BENCH_PORT)"
+	$(_v)$< --host $(BENCH_HOST) --port $(BENCH_PORT) $(REPLAY_ARGS) $(REPLAY_FILE)
+
 # Responsible for building, tagging, and pushing the base PwnableHarness images
 ifdef MKDEBUG
 $(info Including $(CORE_DIR)/BaseImage.mk)
@@ -0,0 +1,453 @@
+//
+//  pwnable_auth.c
+//  PwnableHarness
+//
+//  Authentication of connections before they start a session: the password
+//  prompt and the hashcash proof of work.
+//
+
+#include "pwnable_internal.h"
+
+/*! Number of seconds a client has to send its proof of work. */
+#define POW_TIMEOUT 60
+
+/*! Most bits that scaling with the connection rate may add to the proof of work. */
+#define POW_SCALE_MAX_BITS 8
+
+/*! Number of seconds over which the connection rate is measured for scaling the proof of work. */
+#define POW_RATE_WINDOW 5
+
+/*! Compares an entered password with the expected one in constant time, so
+ * that how long the check takes reveals nothing about the guess.
+ */
+static bool password_matches(const char* entered, size_t len, const char* expected) {
+	size_t expected_len = strlen(expected);
+	unsigned char diff = len != expected_len;
+	size_t i;
+	for(i = 0; i < PASSWORD_MAX; i++) {
+		unsigned char a = i < len ? entered[i] : 0;
+		unsigned char b = i < expected_len ? expected[i] : 0;
+		diff |= a ^ b;
+	}
+	return diff == 0;
+}
+
+/*! Tells a client why it failed to authenticate, then hangs up on it. */
+static void fail_auth(auth_conn* a, log_type type, const char* message) {
+	send_message(a->conn, message);
+	close(a->conn);
+	
+	if(type == LOG_POW_FAILED) {
+		STAT_ADD(pow_failures, 1);
+	}
+	else {
+		STAT_ADD(password_failures, 1);
+	}
+	
+	if(type == LOG_PASSWORD_BAD || (type == LOG_POW_FAILED && a->len > 0)) {
+		log_event(0, type, &a->cli_addr, 0, "%.*s", (int)a->len, a->entered);
+	}
+	else {
+		log_event(0, type, &a->cli_addr, 0, NULL);
+	}
+	memset(a->entered, 0, sizeof(a->entered));
+}
+
+/*! Hangs up on a client that didn't finish authenticating, like when it ran out of time. */
+static void give_up_auth(auth_conn* a, const char* message) {
+	fail_auth(a, a->pow_bits > 0 ? LOG_POW_FAILED : LOG_PASSWORD_MISSING, message);
+}
+
+/*! Computes the SHA-1 hash of a message, as used by hashcash stamps. */
+static void sha1(const void* data, size_t len, uint8_t digest[20]) {
+	uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+	const uint8_t* bytes = data;
+	uint64_t bit_len = (uint64_t)len * 8;
+	size_t total = (len + 9 + 63) / 64 * 64;
+	size_t offset;
+	unsigned i;
+	
+	for(offset = 0; offset < total; offset += 64) {
+		/* Padding is a 1 bit, zeros, then the message length in bits */
+		uint8_t block[64];
+		for(i = 0; i < 64; i++) {
+			size_t pos = offset + i;
+			if(pos < len) {
+				block[i] = bytes[pos];
+			}
+			else if(pos == len) {
+				block[i] = 0x80;
+			}
+			else if(pos >= total - 8) {
+				block[i] = (uint8_t)(bit_len >> (8 * (total - 1 - pos)));
+			}
+			else {
+				block[i] = 0;
+			}
+		}
+		
+		uint32_t w[80];
+		for(i = 0; i < 16; i++) {
+			w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16
+				| (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+		}
+		for(i = 16; i < 80; i++) {
+			uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = x << 1 | x >> 31;
+		}
+		
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for(i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if(i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			}
+			else if(i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			}
+			else if(i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			}
+			else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			
+			uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = b << 30 | b >> 2;
+			b = a;
+			a = t;
+		}
+		
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+	
+	for(i = 0; i < 20; i++) {
+		digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+	}
+}
+
+/*! Reads the secret that makes resource strings unpredictable. This must
+ * happen before entering the chroot, which has no /dev/urandom.
+ * @return True on success
+ */
+bool init_pow_secret(void) {
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		perror("/dev/urandom");
+		return false;
+	}
+	
+	ssize_t n = read(fd, pow_secret, sizeof(pow_secret));
+	close(fd);
+	if(n != (ssize_t)sizeof(pow_secret)) {
+		fprintf(stderr, "Error: Couldn't read the proof of work secret\n");
+		return false;
+	}
+	return true;
+}
+
+/*! Makes a fresh resource string for a client's hashcash stamp, so that
+ * stamps can't be computed ahead of time or reused.
+ */
+static void make_pow_resource(char resource[POW_RESOURCE_LEN + 1]) {
+	static uint64_t counter = 0;
+	struct {
+		uint8_t secret[sizeof(pow_secret)];
+		uint64_t counter;
+		uint64_t time_ns;
+		pid_t pid;
+	} seed;
+	memset(&seed, 0, sizeof(seed));
+	memcpy(seed.secret, pow_secret, sizeof(seed.secret));
+	seed.counter = counter++;
+	seed.time_ns = monotonic_ns();
+	seed.pid = getpid();
+	
+	uint8_t digest[20];
+	sha1(&seed, sizeof(seed), digest);
+	
+	unsigned i;
+	for(i = 0; i < POW_RESOURCE_LEN / 2; i++) {
+		snprintf(&resource[2 * i], 3, "%02x", digest[i]);
+	}
+}
+
+/*! Decides how many bits of proof of work a new connection must provide. With
+ * --pow-scale, this goes up by one bit each time the server's connection rate
+ * doubles past that rate, which makes connection floods expensive. Services
+ * without a proof of work never get one this way.
+ */
+static unsigned pow_difficulty(const service* svc) {
+	static struct timespec window_start;
+	static unsigned long window_accepts = 0;
+	static unsigned extra_bits = 0;
+	
+	if(pow_scale <= 0 || svc->pow_bits == 0) {
+		return svc->pow_bits;
+	}
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = elapsed_seconds(&window_start, &now);
+	if(elapsed >= POW_RATE_WINDOW) {
+		/* Every acceptor counts towards the rate */
+		unsigned long accepts = __atomic_load_n(&shared->accepts, __ATOMIC_RELAXED);
+		if(window_accepts != 0) {
+			double rate = (accepts - window_accepts) / elapsed;
+			double threshold = pow_scale;
+			extra_bits = 0;
+			while(rate >= threshold && extra_bits < POW_SCALE_MAX_BITS) {
+				extra_bits++;
+				threshold *= 2;
+			}
+		}
+		window_start = now;
+		window_accepts = accepts;
+	}
+	
+	return svc->pow_bits + extra_bits;
+}
+
+/*! Checks a hashcash stamp ("1:bits:date:resource:ext:rand:counter") sent as
+ * proof of work. It must be for the resource this client was given, and its
+ * SHA-1 hash must start with enough zero bits. The date isn't checked, as
+ * every resource is only ever used once.
+ */
+static bool check_stamp(const auth_conn* a) {
+	size_t len = a->len;
+	if(len > 0 && a->entered[len - 1] == '\r') {
+		len--;
+	}
+	if(len < 2 || memcmp(a->entered, "1:", 2) != 0) {
+		return false;
+	}
+	
+	/* Split into fields, of which the resource is the fourth */
+	const char* fields[7];
+	size_t field_lens[7];
+	unsigned field_count = 0;
+	size_t pos = 0;
+	while(field_count < ARRAYSIZE(fields)) {
+		const char* field = &a->entered[pos];
+		const char* colon = memchr(field, ':', len - pos);
+		fields[field_count] = field;
+		field_lens[field_count] = colon != NULL ? (size_t)(colon - field) : len - pos;
+		field_count++;
+		if(colon == NULL) {
+			break;
+		}
+		pos = colon - a->entered + 1;
+	}
+	if(field_count != ARRAYSIZE(fields) || fields[6] + field_lens[6] != a->entered + len) {
+		return false;
+	}
+	
+	if(field_lens[3] != strlen(a->resource) || memcmp(fields[3], a->resource, field_lens[3]) != 0) {
+		return false;
+	}
+	
+	uint8_t digest[20];
+	sha1(a->entered, len, digest);
+	
+	unsigned zero_bits = 0;
+	unsigned i;
+	for(i = 0; i < sizeof(digest) && zero_bits < a->pow_bits; i++) {
+		if(digest[i] != 0) {
+			uint8_t byte = digest[i];
+			while(!(byte & 0x80)) {
+				zero_bits++;
+				byte <<= 1;
+			}
+			break;
+		}
+		zero_bits += 8;
+	}
+	return zero_bits >= a->pow_bits;
+}
+
+/*! Asks the client for the next thing it must send: a proof of work, or the password. */
+static void prompt_auth(auth_conn* a) {
+	clock_gettime(CLOCK_MONOTONIC, &a->start);
+	a->len = 0;
+	
+	if(a->pow_bits > 0) {
+		char prompt[256];
+		snprintf(prompt, sizeof(prompt),
+			"Proof of work required. Send a hashcash stamp of %u bits for the resource %s,\n"
+			"like the output of: hashcash -mb%u %s\n"
+			"Stamp: ",
+			a->pow_bits, a->resource, a->pow_bits, a->resource);
+		a->limit = POW_TIMEOUT;
+		send_message(a->conn, prompt);
+	}
+	else {
+		a->limit = auth_timeout;
+		send_message(a->conn, "Password: ");
+	}
+}
+
+/*! Asks a new connection for a proof of work and/or the password. The answers
+ * are read by the event loop, so a client that is slow to answer costs no process.
+ * @note This takes ownership of the connection socket.
+ */
+void begin_auth(service* svc, int conn, const struct sockaddr_in* cli_addr, const conn_trace* trace) {
+	int flags = fcntl(conn, F_GETFL);
+	if(flags == -1 || fcntl(conn, F_SETFL, flags | O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		close(conn);
+		return;
+	}
+	
+	/* Make room by dropping the client that has been taking the longest */
+	if(svc->auth_count == AUTH_PENDING_MAX) {
+		give_up_auth(&svc->auths[0], "Server busy, please try again later.\n");
+		svc->auth_count--;
+		memmove(&svc->auths[0], &svc->auths[1], svc->auth_count * sizeof(*svc->auths));
+	}
+	
+	auth_conn* a = &svc->auths[svc->auth_count++];
+	memset(a, 0, sizeof(*a));
+	a->conn = conn;
+	a->cli_addr = *cli_addr;
+	a->trace = *trace;
+	a->pow_bits = pow_difficulty(svc);
+	if(a->pow_bits > 0) {
+		make_pow_resource(a->resource);
+	}
+	prompt_auth(a);
+}
+/*! Results of reading a line from a client that is authenticating. */
+typedef enum line_result {
+	LINE_WAITING,                  /*!< The line isn't complete yet */
+	LINE_READ,                     /*!< The line is in entered */
+	LINE_MISSING,                  /*!< The client hung up without sending anything */
+} line_result;
+
+/*! Reads what a client has sent of its current line so far. Nothing past the
+ * end of the line is consumed, as that belongs to what comes next.
+ */
+static line_result read_line(auth_conn* a) {
+	char buf[PASSWORD_MAX];
+	size_t room = sizeof(a->entered) - 1 - a->len;
+	ssize_t n = recv(a->conn, buf, room, MSG_PEEK);
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return LINE_WAITING;
+		}
+		return LINE_MISSING;
+	}
+	
+	size_t take = n;
+	const char* newline = memchr(buf, '\n', n);
+	if(newline != NULL) {
+		take = newline - buf + 1;
+	}
+	if(take > 0 && recv(a->conn, buf, take, 0) != (ssize_t)take) {
+		return LINE_MISSING;
+	}
+	
+	memcpy(&a->entered[a->len], buf, newline != NULL ? take - 1 : take);
+	a->len += newline != NULL ? take - 1 : take;
+	
+	/* Like fgets(), stop at the end of the line, at EOF, or once the buffer is full */
+	if(newline == NULL && n > 0 && a->len < sizeof(a->entered) - 1) {
+		return LINE_WAITING;
+	}
+	
+	if(newline == NULL && n == 0 && a->len == 0) {
+		return LINE_MISSING;
+	}
+	return LINE_READ;
+}
+
+/*! Reads what a client has sent of its proof of work or password so far, and
+ * checks it once the line is complete.
+ * @return True once the client is done authenticating, either by being handed
+ *   to admission control or by being hung up on
+ */
+static bool progress_auth(service* svc, auth_conn* a) {
+	line_result result = read_line(a);
+	if(result == LINE_WAITING) {
+		return false;
+	}
+	
+	if(a->pow_bits > 0) {
+		if(result == LINE_MISSING || !check_stamp(a)) {
+			fail_auth(a, LOG_POW_FAILED, "Invalid proof of work.\n");
+			return true;
+		}
+		
+		a->pow_bits = 0;
+		trace_step(&a->trace, svc->port, "proof_of_work");
+		if(svc->password != NULL) {
+			/* The password may already be waiting, but poll() will report it */
+			prompt_auth(a);
+			return false;
+		}
+	}
+	else {
+		if(result == LINE_MISSING) {
+			fail_auth(a, LOG_PASSWORD_MISSING, "Must enter a password.\n");
+			return true;
+		}
+		
+		if(!password_matches(a->entered, a->len, svc->password)) {
+			fail_auth(a, LOG_PASSWORD_BAD, "Incorrect password.\n");
+			return true;
+		}
+		
+		memset(a->entered, 0, sizeof(a->entered));
+		log_event(0, LOG_PASSWORD_OK, &a->cli_addr, 0, NULL);
+		trace_step(&a->trace, svc->port, "password");
+	}
+	
+	/* The challenge expects a blocking socket */
+	int flags = fcntl(a->conn, F_GETFL);
+	if(flags == -1 || fcntl(a->conn, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		close(a->conn);
+		return true;
+	}
+	
+	admit_session(svc, a->conn, &a->cli_addr, &a->trace);
+	return true;
+}
+
+/*! Makes progress on the connections that are authenticating after poll(),
+ * and hangs up on those that have run out of time.
+ */
+void serve_auths(service* svc, const struct pollfd* fds) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	unsigned done = 0;
+	unsigned j;
+	for(j = 0; j < svc->auth_count; j++) {
+		auth_conn* a = &svc->auths[j];
+		bool finished = fds[j].revents != 0 && progress_auth(svc, a);
+		if(!finished && a->limit > 0 && elapsed_seconds(&a->start, &now) >= a->limit) {
+			give_up_auth(a, a->pow_bits > 0
+				? "\nTimed out waiting for the proof of work.\n"
+				: "\nTimed out waiting for the password.\n");
+			finished = true;
+		}
+		
+		if(finished) {
+			done++;
+		}
+		else if(done > 0) {
+			svc->auths[j - done] = *a;
+		}
+	}
+	svc->auth_count -= done;
+}
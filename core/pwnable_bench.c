@@ -0,0 +1,341 @@
+//
+//  pwnable_bench.c
+//  PwnableHarness
+//
+//  Load generator for measuring how pwnableserver behaves under many
+//  concurrent connections.
+//
+
+#include "pwnable_bench_common.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*! State of one benchmark connection. */
+typedef enum conn_state {
+	CONN_CONNECTING,               /*!< Waiting for the TCP handshake to finish */
+	CONN_SENDING,                  /*!< Sending the request data */
+	CONN_READING,                  /*!< Reading output until the server hangs up */
+} conn_state;
+
+/*! A connection to the server being measured. */
+typedef struct bench_conn {
+	int sock;                      /*!< Socket, or -1 for a free slot */
+	conn_state state;              /*!< What the connection is waiting for */
+	size_t sent;                   /*!< Bytes of the request data sent so far */
+	bool got_byte;                 /*!< Whether any output has been received */
+	double start;                  /*!< Time when the connection was started */
+} bench_conn;
+
+/*! Data sent on each connection after it is established. */
+static const char* request = "";
+static size_t request_len = 0;
+
+static samples connect_times;
+static samples first_byte_times;
+static samples session_times;
+static unsigned long failures[FAIL_KINDS];
+
+/*! Starts a non-blocking connection to the server.
+ * @return True if the connection was started
+ */
+static bool start_conn(bench_conn* c) {
+	c->start = now_seconds();
+	c->state = CONN_CONNECTING;
+	c->sent = 0;
+	c->got_byte = false;
+	if(!connect_server(&c->sock)) {
+		return false;
+	}
+	if(c->sock == -1) {
+		failures[FAIL_CONNECT]++;
+	}
+	return true;
+}
+
+/*! Closes a connection, counting it as a failure of the given kind, or as a
+ * completed session if kind is -1.
+ */
+static void finish_conn(bench_conn* c, int kind, double now) {
+	if(kind < 0) {
+		add_sample(&session_times, now - c->start);
+	}
+	else {
+		failures[kind]++;
+	}
+	
+	close(c->sock);
+	c->sock = -1;
+}
+
+/*! Sends as much of the request as the socket will take right now. */
+static void send_request(bench_conn* c, double now) {
+	while(c->sent < request_len) {
+		ssize_t n = send(c->sock, request + c->sent, request_len - c->sent, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EINTR) {
+				finish_conn(c, FAIL_RESET, now);
+			}
+			return;
+		}
+		c->sent += n;
+	}
+	
+	c->state = CONN_READING;
+}
+
+/*! Handles a poll() event on a connection. */
+static void service_conn(bench_conn* c, short revents, double now) {
+	if(c->state == CONN_CONNECTING) {
+		if(!server_connected(c->sock)) {
+			finish_conn(c, FAIL_CONNECT, now);
+			return;
+		}
+		
+		add_sample(&connect_times, now - c->start);
+		c->state = CONN_SENDING;
+	}
+	
+	if(c->state == CONN_SENDING) {
+		send_request(c, now);
+		if(c->sock == -1) {
+			return;
+		}
+	}
+	
+	if(!(revents & (POLLIN | POLLHUP | POLLERR))) {
+		return;
+	}
+	
+	/* Output is discarded, as only its timing matters */
+	char buf[4096];
+	while(1) {
+		ssize_t n = recv(c->sock, buf, sizeof(buf), 0);
+		if(n > 0) {
+			if(!c->got_byte) {
+				c->got_byte = true;
+				add_sample(&first_byte_times, now - c->start);
+			}
+			continue;
+		}
+		
+		if(n == 0) {
+			finish_conn(c, c->got_byte ? -1 : FAIL_EMPTY, now);
+		}
+		else if(errno != EAGAIN && errno != EINTR) {
+			finish_conn(c, FAIL_RESET, now);
+		}
+		return;
+	}
+}
+
+/*! Interprets backslash escapes like "\n" in the request data in place. */
+static size_t unescape(char* str) {
+	char* out = str;
+	const char* in = str;
+	while(*in != '\0') {
+		if(*in == '\\' && in[1] != '\0') {
+			in++;
+			switch(*in) {
+				case 'n': *out++ = '\n'; break;
+				case 'r': *out++ = '\r'; break;
+				case 't': *out++ = '\t'; break;
+				case '0': *out++ = '\0'; break;
+				default: *out++ = *in; break;
+			}
+			in++;
+		}
+		else {
+			*out++ = *in++;
+		}
+	}
+	return out - str;
+}
+
+static void show_usage(const char* progname) {
+	printf("Usage: %s [options]\n"
+		"  Options:\n"
+		"    -h, --help                            "
+			"Display this help message\n"
+		"    -H, --host <host=127.0.0.1>           "
+			"Host that pwnableserver is running on\n"
+		"    -p, --port <port=32323>               "
+			"Port that pwnableserver is listening on\n"
+		"    -n, --connections <count=1000>        "
+			"Total number of connections to make\n"
+		"    -c, --concurrency <count=50>          "
+			"Maximum number of connections open at once\n"
+		"    -r, --rate <connections-per-second>   "
+			"Rate to start new connections at, or 0 for as fast as possible\n"
+		"    -s, --send <data>                     "
+			"Data to send on each connection (backslash escapes allowed)\n"
+		"    -t, --timeout <seconds=10>            "
+			"Give up on sessions that take longer than this\n",
+		progname);
+}
+
+int main(int argc, char** argv) {
+	const char* host = "127.0.0.1";
+	const char* port = "32323";
+	unsigned total = 1000;
+	unsigned concurrency = 50;
+	double rate = 0;
+	double timeout = 10;
+	
+	int i;
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if(i + 1 == argc) {
+			printf("Error: Missing value for argument '%s'\n", argv[i]);
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if(strcmp(argv[i], "--host") == 0 || strcmp(argv[i], "-H") == 0) {
+			host = argv[++i];
+		}
+		else if(strcmp(argv[i], "--port") == 0 || strcmp(argv[i], "-p") == 0) {
+			port = argv[++i];
+		}
+		else if(strcmp(argv[i], "--connections") == 0 || strcmp(argv[i], "-n") == 0) {
+			total = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--concurrency") == 0 || strcmp(argv[i], "-c") == 0) {
+			concurrency = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--rate") == 0 || strcmp(argv[i], "-r") == 0) {
+			rate = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--send") == 0 || strcmp(argv[i], "-s") == 0) {
+			char* data = argv[++i];
+			request_len = unescape(data);
+			request = data;
+		}
+		else if(strcmp(argv[i], "--timeout") == 0 || strcmp(argv[i], "-t") == 0) {
+			timeout = atof(argv[++i]);
+		}
+		else {
+			printf("Error: Unknown argument '%s'\n", argv[i]);
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	if(total == 0 || concurrency == 0) {
+		printf("Error: The connection count and concurrency must be positive\n");
+		return EXIT_FAILURE;
+	}
+	
+	if(!resolve_server(host, port)) {
+		return EXIT_FAILURE;
+	}
+	
+	connect_times.values = calloc(total, sizeof(double));
+	first_byte_times.values = calloc(total, sizeof(double));
+	session_times.values = calloc(total, sizeof(double));
+	bench_conn* conns = calloc(concurrency, sizeof(*conns));
+	struct pollfd* fds = calloc(concurrency, sizeof(*fds));
+	if(connect_times.values == NULL || first_byte_times.values == NULL
+	   || session_times.values == NULL || conns == NULL || fds == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	
+	unsigned c;
+	for(c = 0; c < concurrency; c++) {
+		conns[c].sock = -1;
+	}
+	
+	printf("Benchmarking %s:%s with %u connections, %u at a time", host, port, total, concurrency);
+	if(rate > 0) {
+		printf(", %g per second", rate);
+	}
+	printf("\n");
+	
+	unsigned started = 0;
+	unsigned open_conns = 0;
+	double begin = now_seconds();
+	double now = begin;
+	while(started < total || open_conns > 0) {
+		/* Start as many connections as the concurrency and rate allow */
+		for(c = 0; c < concurrency && started < total; c++) {
+			if(conns[c].sock != -1) {
+				continue;
+			}
+			if(rate > 0 && started >= (now - begin) * rate) {
+				break;
+			}
+			if(!start_conn(&conns[c])) {
+				return EXIT_FAILURE;
+			}
+			started++;
+		}
+		
+		open_conns = 0;
+		for(c = 0; c < concurrency; c++) {
+			fds[c].fd = conns[c].sock;
+			fds[c].events = 0;
+			fds[c].revents = 0;
+			if(conns[c].sock == -1) {
+				continue;
+			}
+			
+			open_conns++;
+			if(conns[c].state == CONN_CONNECTING || conns[c].state == CONN_SENDING) {
+				fds[c].events |= POLLOUT;
+			}
+			fds[c].events |= POLLIN;
+		}
+		
+		if(open_conns == 0 && started == total) {
+			break;
+		}
+		
+		/* Wake up for the next rate-limited start and to check timeouts */
+		int wait_ms = 100;
+		if(rate > 0 && started < total) {
+			double next = begin + started / rate - now;
+			if(next * 1000 < wait_ms) {
+				wait_ms = next > 0 ? (int)(next * 1000) + 1 : 0;
+			}
+		}
+		
+		if(poll(fds, concurrency, wait_ms) < 0 && errno != EINTR) {
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+		
+		now = now_seconds();
+		for(c = 0; c < concurrency; c++) {
+			bench_conn* conn = &conns[c];
+			if(conn->sock == -1) {
+				continue;
+			}
+			
+			if(fds[c].revents != 0) {
+				service_conn(conn, fds[c].revents, now);
+			}
+			if(conn->sock != -1 && now - conn->start > timeout) {
+				finish_conn(conn, FAIL_TIMEOUT, now);
+			}
+		}
+	}
+	
+	double elapsed = now_seconds() - begin;
+	unsigned long failed = report_results(session_times.count, elapsed, failures);
+	printf("\n");
+	report_samples("Connect", &connect_times);
+	report_samples("First byte", &first_byte_times);
+	report_samples("Session", &session_times);
+	
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,147 @@
+//
+//  pwnable_bench_common.c
+//  PwnableHarness
+//
+//  Helpers shared by the benchmarking tools: latency statistics, and opening
+//  connections to the server being measured.
+//
+
+#include "pwnable_bench_common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const char* const fail_names[FAIL_KINDS] = {
+	"connect",
+	"reset",
+	"timeout",
+	"no output",
+};
+
+/*! Address of the server being measured. */
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+
+double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void add_sample(samples* s, double value) {
+	s->values[s->count++] = value;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+void sort_samples(samples* s) {
+	qsort(s->values, s->count, sizeof(*s->values), &compare_doubles);
+}
+
+double percentile(const samples* s, double pct) {
+	size_t rank = (size_t)(pct / 100 * s->count + 0.5);
+	if(rank == 0) {
+		rank = 1;
+	}
+	if(rank > s->count) {
+		rank = s->count;
+	}
+	return s->values[rank - 1];
+}
+
+void report_samples(const char* name, samples* s) {
+	if(s->count == 0) {
+		printf("%-14s (no samples)\n", name);
+		return;
+	}
+	
+	sort_samples(s);
+	printf("%-14s p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms\n",
+		name,
+		percentile(s, 50) * 1000,
+		percentile(s, 90) * 1000,
+		percentile(s, 99) * 1000,
+		s->values[s->count - 1] * 1000);
+}
+
+unsigned long report_results(size_t completed, double elapsed, const unsigned long failures[FAIL_KINDS]) {
+	unsigned long failed = 0;
+	int i;
+	for(i = 0; i < FAIL_KINDS; i++) {
+		failed += failures[i];
+	}
+	
+	printf("\n");
+	printf("Completed:     %lu sessions in %.2f s (%.1f per second)\n",
+		(unsigned long)completed, elapsed, completed / elapsed);
+	printf("Failed:        %lu", failed);
+	for(i = 0; i < FAIL_KINDS; i++) {
+		if(failures[i] != 0) {
+			printf(" (%s: %lu)", fail_names[i], failures[i]);
+		}
+	}
+	printf("\n");
+	return failed;
+}
+
+bool resolve_server(const char* host, const char* port) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	struct addrinfo* res;
+	int err = getaddrinfo(host, port, &hints, &res);
+	if(err != 0) {
+		fprintf(stderr, "Error: Couldn't resolve %s:%s: %s\n", host, port, gai_strerror(err));
+		return false;
+	}
+	
+	memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+	server_addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+bool connect_server(int* sock) {
+	*sock = socket(server_addr.ss_family, SOCK_STREAM, 0);
+	if(*sock == -1) {
+		perror("socket");
+		return false;
+	}
+	
+	if(fcntl(*sock, F_SETFL, O_NONBLOCK) != 0) {
+		perror("fcntl");
+		close(*sock);
+		*sock = -1;
+		return false;
+	}
+	
+	int one = 1;
+	setsockopt(*sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	
+	if(connect(*sock, (struct sockaddr*)&server_addr, server_addr_len) != 0 && errno != EINPROGRESS) {
+		close(*sock);
+		*sock = -1;
+	}
+	return true;
+}
+
+bool server_connected(int sock) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	return getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0;
+}
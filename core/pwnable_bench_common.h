@@ -0,0 +1,67 @@
+//
+//  pwnable_bench_common.h
+//  PwnableHarness
+//
+//  Helpers shared by the benchmarking tools: latency statistics, and opening
+//  connections to the server being measured.
+//
+
+#ifndef PWNABLE_BENCH_COMMON_H
+#define PWNABLE_BENCH_COMMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*! Latency samples of one kind, in seconds. */
+typedef struct samples {
+	double* values;                /*!< Recorded samples */
+	size_t count;                  /*!< Number of entries in values */
+} samples;
+
+/*! Kinds of failed connections. */
+enum {
+	FAIL_CONNECT,                  /*!< The connection couldn't be made */
+	FAIL_RESET,                    /*!< A send or receive failed, like from a reset */
+	FAIL_TIMEOUT,                  /*!< The session took longer than the timeout */
+	FAIL_EMPTY,                    /*!< The server hung up without sending anything */
+	FAIL_KINDS
+};
+
+/*! Reads the monotonic clock in seconds. */
+double now_seconds(void);
+
+/*! Records one latency sample. The array must be sized for every sample up front. */
+void add_sample(samples* s, double value);
+
+/*! Sorts samples so that percentiles can be looked up. */
+void sort_samples(samples* s);
+
+/*! Looks up a percentile from sorted samples, using the nearest rank. */
+double percentile(const samples* s, double pct);
+
+/*! Prints a line with the percentiles of one kind of latency in milliseconds. */
+void report_samples(const char* name, samples* s);
+
+/*! Prints how many sessions completed and how many failed of each kind.
+ * @return Total number of failed connections
+ */
+unsigned long report_results(size_t completed, double elapsed, const unsigned long failures[FAIL_KINDS]);
+
+/*! Resolves the address of the server to connect to.
+ * @return True on success
+ */
+bool resolve_server(const char* host, const char* port);
+
+/*! Starts a non-blocking connection to the server with TCP_NODELAY set.
+ * @param sock Set to the new socket, or to -1 if the connection failed right away
+ * @return False if no socket could be made at all
+ */
+bool connect_server(int* sock);
+
+/*! Checks whether a connection started by connect_server() was established,
+ * once its socket is ready.
+ */
+bool server_connected(int sock);
+
+
+#endif /* PWNABLE_BENCH_COMMON_H */
@@ -0,0 +1,40 @@
+//
+//  pwnable_capture.h
+//  PwnableHarness
+//
+//  Format of the capture files written by `pwnableserver --capture` and read
+//  by pwnablereplay.
+//
+
+#ifndef PWNABLE_CAPTURE_H
+#define PWNABLE_CAPTURE_H
+
+#include <stdint.h>
+
+/*! Kinds of records in a capture file. */
+enum {
+	CAPTURE_START,                 /*!< A session started */
+	CAPTURE_DATA,                  /*!< The client sent len bytes, which follow the record */
+	CAPTURE_EOF,                   /*!< The client shut down its side of the connection */
+	CAPTURE_END,                   /*!< The session ended */
+};
+
+/*! Bytes at the start of every capture file. */
+#define CAPTURE_MAGIC "PHCAP01\n"
+
+/*! Record appended to the capture file with `--capture` for each event of a
+ * relayed session. Records of sessions running at the same time are
+ * interleaved, so each one says which session it belongs to. Fields are in
+ * the server's native byte order, like accounting records.
+ */
+typedef struct capture_record {
+	uint64_t time_us;              /*!< Microseconds since the session started, or for CAPTURE_START, the wall-clock time in microseconds since the epoch */
+	uint32_t session;              /*!< Number of the session, unique for the lifetime of the server */
+	uint32_t len;                  /*!< Number of bytes of client data following a CAPTURE_DATA record */
+	uint16_t port;                 /*!< Port of the service the client connected to */
+	uint8_t type;                  /*!< One of the CAPTURE_* record kinds */
+	uint8_t reserved[5];
+} capture_record;
+
+
+#endif /* PWNABLE_CAPTURE_H */
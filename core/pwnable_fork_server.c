@@ -0,0 +1,472 @@
+//
+//  pwnable_fork_server.c
+//  PwnableHarness
+//
+//  SERVER_FORK_SERVER mode: a template process that runs the init function once
+//  and forks a session for each connection handed to it.
+//
+
+#include "pwnable_internal.h"
+
+/*! Message from a fork server's template process about one of its sessions,
+ * both when it has forked the session and once the session has exited.
+ */
+typedef struct fork_server_report {
+	pid_t pid;                     /*!< Process ID of the session, or -1 if forking it failed */
+	int status;                    /*!< Wait status of the session once it has exited */
+	struct rusage usage;           /*!< Resources used by the session once it has exited */
+} fork_server_report;
+
+/*! Ends the sessions that a fork server's template process has reported as
+ * exited, as they are its children rather than the server's.
+ */
+void reap_fork_server(service* svc) {
+	fork_server_report r;
+	while(svc->template_exits != -1 && read(svc->template_exits, &r, sizeof(r)) == (ssize_t)sizeof(r)) {
+		unsigned i;
+		for(i = 0; i < svc->session_count; i++) {
+			if(svc->sessions[i].pid == r.pid) {
+				session_exited(svc, i, r.status, &r.usage);
+				break;
+			}
+		}
+	}
+}
+/*! Closes the file descriptors from first to last, which may be past the
+ * highest one open.
+ */
+static void close_fd_range(int first, int last) {
+	if(first > last) {
+		return;
+	}
+	
+#ifdef SYS_close_range
+	if(syscall(SYS_close_range, (unsigned)first, (unsigned)last, 0) == 0) {
+		return;
+	}
+#endif
+	
+	/* Kernels before 5.9 need them closed one at a time */
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX) {
+		rl.rlim_cur = 1024;
+	}
+	int fd;
+	for(fd = first; fd <= last && fd < (int)rl.rlim_cur; fd++) {
+		close(fd);
+	}
+}
+
+/*! Closes every file descriptor above standard error except the given ones.
+ * A process forked from the server that won't exec would otherwise hold on to
+ * its listening sockets and the connections of other sessions.
+ */
+static void close_fds_except(int* keep, unsigned count) {
+	/* Sort the descriptors to keep, so the ones between them can be closed as ranges */
+	unsigned i, j;
+	for(i = 1; i < count; i++) {
+		for(j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+			int fd = keep[j];
+			keep[j] = keep[j - 1];
+			keep[j - 1] = fd;
+		}
+	}
+	
+	int next = STDERR_FILENO + 1;
+	for(i = 0; i < count; i++) {
+		close_fd_range(next, keep[i] - 1);
+		if(keep[i] >= next) {
+			next = keep[i] + 1;
+		}
+	}
+	close_fd_range(next, INT_MAX);
+}
+
+/*! Runs a session forked by a fork server's template process once the server
+ * has set it up, by calling the connection handler.
+ * @note This never returns.
+ */
+static void run_forked_session(int conn, int go) {
+	/* Wait until the server has moved this process into its session cgroup */
+	char c;
+	ssize_t n;
+	do {
+		n = read(go, &c, 1);
+	} while(n == -1 && errno == EINTR);
+	if(n != 1) {
+		_exit(EXIT_FAILURE);
+	}
+	close(go);
+	
+	limit_session_process();
+	if(!redirect_output(conn)) {
+		_exit(EXIT_FAILURE);
+	}
+	
+	/* The challenge must not get a hold of the server's log */
+	fclose(stderr_fp);
+	stderr_fp = NULL;
+	
+	/* Whatever the init function did to standard IO must not leak into the session */
+	clearerr(stdin);
+	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stderr, NULL, _IONBF, 0);
+	
+	challenge_handler(conn);
+	exit(EXIT_SUCCESS);
+}
+
+/*! Body of a fork server's template process. It runs the challenge's init
+ * function once, then forks a session for each connection handed to it over
+ * its channel, and reports each session that exits over its exits pipe.
+ * @param server_wake Write end of the server's self-pipe, to wake it up for the reports
+ * @note This never returns. The template exits once the channel is closed,
+ *   leaving any sessions still running to the server, which is their subreaper.
+ */
+static void run_fork_server(int chan, int exits, int server_wake) {
+	/* Exited sessions wake up the template's own loop, through a new self-pipe */
+	close(sigchld_pipe[0]);
+	if(!open_wake_pipe()) {
+		_exit(EXIT_FAILURE);
+	}
+	
+	/* Init output has nowhere to go, and nothing may stay buffered for the sessions to flush */
+	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stderr, NULL, _IONBF, 0);
+	if(init_hook != NULL) {
+		init_hook();
+	}
+	
+	/* Connections only start coming in once the server hears that init is done */
+	fork_server_report ready;
+	memset(&ready, 0, sizeof(ready));
+	if(send(chan, &ready, sizeof(ready), 0) != (ssize_t)sizeof(ready)) {
+		_exit(EXIT_FAILURE);
+	}
+	
+	while(1) {
+		struct pollfd fds[2];
+		fds[0].fd = chan;
+		fds[0].events = POLLIN;
+		fds[1].fd = sigchld_pipe[0];
+		fds[1].events = POLLIN;
+		if(poll(fds, 2, -1) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			_exit(EXIT_FAILURE);
+		}
+		
+		/* Report exited sessions first, so the server never hears about a PID after it's reused */
+		fork_server_report r;
+		bool reported = false;
+		char buf[64];
+		while(read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+			/* Just draining the pipe */
+		}
+		memset(&r, 0, sizeof(r));
+		while((r.pid = wait4(-1, &r.status, WNOHANG, &r.usage)) > 0) {
+			if(write(exits, &r, sizeof(r)) != (ssize_t)sizeof(r)) {
+				_exit(EXIT_FAILURE);
+			}
+			reported = true;
+		}
+		if(reported && write(server_wake, "", 1) < 0) {
+			/* The server is already awake if its pipe is full */
+		}
+		
+		if(!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+		
+		pool_handoff msg;
+		int conn = recv_fd(chan, &msg, sizeof(msg));
+		if(conn == -1) {
+			/* The server went away or is done with this template */
+			_exit(EXIT_SUCCESS);
+		}
+		
+		int go[2] = {-1, -1};
+		memset(&r, 0, sizeof(r));
+		r.pid = -1;
+		if(pipe(go) == 0) {
+			r.pid = fork();
+			if(r.pid == 0) {
+				close(chan);
+				close(exits);
+				close(server_wake);
+				close(sigchld_pipe[0]);
+				close(sigchld_pipe[1]);
+				close(go[1]);
+				signal(SIGCHLD, SIG_DFL);
+				run_forked_session(conn, go[0]);
+			}
+			close(go[0]);
+		}
+		close(conn);
+		
+		/* The server releases the session by writing to the pipe */
+		if(r.pid > 0) {
+			send_fd(chan, go[1], &r, sizeof(r));
+		}
+		else if(send(chan, &r, sizeof(r), 0) < 0) {
+			/* The server gives up waiting on us either way */
+		}
+		if(go[1] != -1) {
+			close(go[1]);
+		}
+	}
+}
+
+/*! Spawns a fork server's template process, which drops privileges and runs
+ * the challenge's init function. The server holds on to connections until
+ * the template says that it's ready.
+ * @return True if the template process was created
+ */
+bool fork_server_spawn(service* svc) {
+	int chans[2];
+	if(socketpair(AF_UNIX, POOL_CHAN_TYPE, 0, chans) != 0) {
+		PERROR("socketpair");
+		return false;
+	}
+	
+	int exits[2];
+	if(pipe(exits) != 0) {
+		PERROR("pipe");
+		close(chans[0]);
+		close(chans[1]);
+		return false;
+	}
+	
+	/* The template's answers are read from the event loop, which must never wait on it */
+	if(fcntl(chans[0], F_SETFD, FD_CLOEXEC) != 0
+	   || fcntl(chans[0], F_SETFL, O_NONBLOCK) != 0
+	   || fcntl(exits[0], F_SETFD, FD_CLOEXEC) != 0
+	   || fcntl(exits[0], F_SETFL, O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		close(chans[0]);
+		close(chans[1]);
+		close(exits[0]);
+		close(exits[1]);
+		return false;
+	}
+	
+	pid_t pid = fork();
+	if(pid < 0) {
+		STAT_ADD(fork_failures, 1);
+		PERROR("fork");
+		close(chans[0]);
+		close(chans[1]);
+		close(exits[0]);
+		close(exits[1]);
+		return false;
+	}
+	else if(pid == 0) {
+		unpin_cpu();
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		
+		/* Nothing else of the server's may be inherited by the sessions, as they never exec */
+		int keep[] = {chans[1], exits[1], sigchld_pipe[0], sigchld_pipe[1], real_stderr};
+		close_fds_except(keep, ARRAYSIZE(keep));
+		fclose(stdin_fp);
+		fclose(stdout_fp);
+		stdin_fp = stdout_fp = NULL;
+		munmap(shared, sizeof(*shared));
+		shared = NULL;
+		munmap(logs, sizeof(*logs));
+		logs = NULL;
+		
+		/* The sessions are a plain fork of the server, so wipe the secrets it
+		 * keeps in memory. The rest of its settings stay readable to them.
+		 */
+		memset(pow_secret, 0, sizeof(pow_secret));
+		if(inherited != NULL) {
+			memset(inherited->pow_secret, 0, sizeof(inherited->pow_secret));
+		}
+		if(password != NULL) {
+			memset((char*)password, 0, strlen(password));
+		}
+		
+		/* The init function's errors go to the server's log */
+		if(dup2(real_stderr, STDERR_FILENO) == -1) {
+			_exit(EXIT_FAILURE);
+		}
+		
+		if(!drop_privileges(svc->pw)) {
+			log_event(0, LOG_ERROR, NULL, 0, "Unable to drop privileges... Committing suicide.");
+			_exit(EXIT_FAILURE);
+		}
+		
+		clean_env();
+		run_fork_server(chans[1], exits[1], sigchld_pipe[1]);
+	}
+	
+	close(chans[1]);
+	close(exits[1]);
+	svc->template_pid = pid;
+	svc->template_chan = chans[0];
+	svc->template_exits = exits[0];
+	svc->template_ready = false;
+	return true;
+}
+
+/*! Closes the channel to a fork server's template process and waits for it
+ * to exit. Its sessions that are still running become children of the
+ * server, which is their subreaper, so a template that is stopped rather
+ * than killed gets a moment to report the ones it has already reaped.
+ * @param kill_now Whether to kill the template right away, as it's stuck or gone
+ */
+static void fork_server_close(service* svc, bool kill_now) {
+	if(svc->template_chan == -1) {
+		return;
+	}
+	close(svc->template_chan);
+	svc->template_chan = -1;
+	svc->template_ready = false;
+	
+	/* It exits as soon as it sees its channel close, unless it's stuck */
+	if(svc->template_pid > 0) {
+		unsigned tries;
+		for(tries = 0; !kill_now && tries < 100 && waitpid(svc->template_pid, NULL, WNOHANG) == 0; tries++) {
+			usleep(10000);
+		}
+		if(kill_now || tries == 100) {
+			kill(svc->template_pid, SIGKILL);
+			waitpid(svc->template_pid, NULL, 0);
+		}
+		svc->template_pid = -1;
+	}
+	
+	reap_fork_server(svc);
+	close(svc->template_exits);
+	svc->template_exits = -1;
+}
+/*! Starts sessions by spawning processes for the connections handed to a
+ * fork server's template process that it won't answer for anymore.
+ */
+static void fork_server_fail_handoffs(service* svc) {
+	unsigned i;
+	for(i = 0; i < svc->handoff_count; i++) {
+		fork_handoff* h = &svc->handoffs[i];
+		log_event(0, LOG_MESSAGE, &h->cli_addr, 0, "Fork server didn't fork a session, spawning a process for this connection");
+		launch_session(svc, -1, h->conn, h->session_conn, &h->r, &h->cli_addr, &h->trace, -1, false);
+	}
+	svc->handoff_count = 0;
+}
+
+/*! Handles the messages from a fork server's template process: that it has
+ * run the init function, or that it has forked a session for the oldest
+ * connection handed to it. Each session only starts running once it's in
+ * its session cgroup.
+ * @return False if the template has hung up
+ */
+bool serve_fork_server(service* svc) {
+	while(svc->template_chan != -1) {
+		fork_server_report r;
+		int go;
+		ssize_t n = recv_msg(svc->template_chan, &r, sizeof(r), &go);
+		if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if(n != (ssize_t)sizeof(r)) {
+			if(go != -1) {
+				close(go);
+			}
+			return false;
+		}
+		
+		if(!svc->template_ready) {
+			svc->template_ready = true;
+			log_event(0, LOG_MESSAGE, NULL, 0, "Fork server template is ready on port %hu", svc->port);
+			admit_queued(svc);
+			continue;
+		}
+		
+		if(svc->handoff_count == 0) {
+			if(go != -1) {
+				close(go);
+			}
+			continue;
+		}
+		fork_handoff h = svc->handoffs[0];
+		svc->handoff_count--;
+		memmove(&svc->handoffs[0], &svc->handoffs[1], svc->handoff_count * sizeof(*svc->handoffs));
+		
+		/* Closing the pipe without writing to it makes the session exit */
+		pid_t pid = -1;
+		if(go != -1) {
+			pid = r.pid;
+			if(!enter_session_cgroup(pid)) {
+				pid = -1;
+			}
+			else if(write(go, "", 1) != 1) {
+				PERROR("write");
+				pid = -1;
+			}
+			close(go);
+		}
+		
+		if(pid != -1) {
+			log_connection(pid, &h.cli_addr);
+			trace_step(&h.trace, svc->port, "fork_server");
+		}
+		else {
+			log_event(0, LOG_MESSAGE, &h.cli_addr, 0, "Fork server couldn't fork a session, spawning a process for this connection");
+		}
+		launch_session(svc, pid, h.conn, h.session_conn, &h.r, &h.cli_addr, &h.trace, -1, false);
+	}
+	return true;
+}
+
+/*! Gives up on a fork server's template process that hung up or stopped
+ * answering. One that had finished running the init function is replaced,
+ * while without one that did, each connection gets a process spawned for it.
+ */
+void fork_server_lost(service* svc, const char* why) {
+	bool was_ready = svc->template_ready;
+	fork_server_close(svc, true);
+	fork_server_fail_handoffs(svc);
+	
+	if(was_ready) {
+		log_event(0, LOG_ERROR, NULL, 0, "Fork server template %s, restarting it", why);
+		fork_server_spawn(svc);
+	}
+	else {
+		log_event(0, LOG_ERROR, NULL, 0, "Fork server template %s before it was ready, spawning a process for each connection", why);
+	}
+	admit_queued(svc);
+}
+
+/*! Restarts a fork server's template process that has taken too long to
+ * fork a session, once it has run the init function.
+ */
+void enforce_fork_server_deadline(service* svc) {
+	if(svc->handoff_count == 0) {
+		return;
+	}
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(elapsed_seconds(&svc->handoffs[0].sent, &now) >= FORK_SERVER_REPLY_TIMEOUT) {
+		fork_server_lost(svc, "stopped answering");
+	}
+}
+
+/*! Stops a fork server's template process, once the sessions it's forking
+ * for connections already handed to it have started.
+ */
+void fork_server_stop(service* svc) {
+	while(svc->template_chan != -1 && svc->handoff_count > 0) {
+		struct pollfd pfd;
+		pfd.fd = svc->template_chan;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, FORK_SERVER_REPLY_TIMEOUT * 1000) <= 0 || !serve_fork_server(svc)) {
+			break;
+		}
+	}
+	
+	fork_server_close(svc, false);
+	fork_server_fail_handoffs(svc);
+}
@@ -6,22 +6,7 @@
 //  Copyright (c) 2013 C0deH4cker. All rights reserved.
 //
 
-#include "pwnable_harness.h"
-#include <stdlib.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <errno.h>
-#include <sys/types.h>
-#include <time.h>
-#include <signal.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <grp.h>
-#include <pwd.h>
-
-#define ARRAYSIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#include "pwnable_internal.h"
 
 /* For reading argv[0] without access to argv. */
 #if defined(__linux__)
@@ -51,22 +36,302 @@ static const char* PROC_SELF_EXE(void) {
 }
 #endif
 
-/*! Actually output to standard error after it has been moved. */
-#define PERROR(msg) fprintf(stderr_fp, "%s: %s\n", (msg), strerror(errno))
-
-/* Original file descriptors */
-static int real_stdin, real_stdout, real_stderr;
-static FILE* stdin_fp, *stdout_fp, *stderr_fp;
+/* Settings and state shared with the rest of the library, documented in pwnable_internal.h */
+int real_stdin, real_stdout, real_stderr;
+FILE* stdin_fp, *stdout_fp, *stderr_fp;
+const char* password = NULL;
+unsigned pool_size = 0;
+unsigned auth_timeout = 10;
+unsigned pow_bits = 0;
+double pow_scale = 0;
+uint8_t pow_secret[20];
+unsigned acceptor_count = 1;
+pid_t* acceptor_pids = NULL;
+int listen_backlog = 128;
+unsigned max_sessions = 0;
+unsigned max_per_ip = 0;
+unsigned queue_size = 0;
+shared_state* shared = NULL;
+int sigchld_pipe[2] = {-1, -1};
+int capture_fd = -1;
+unsigned short metrics_port = 0;
+const char* metrics_path = NULL;
+pid_t outer_pid = 0;
+unsigned relay_rate = 0;
+unsigned drain_timeout = 8;
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
+bool draining = false;
+bool shutting_down = false;
+struct timespec drain_deadline;
+server_mode handler_mode = SERVER_FORK_EXEC;
+conn_handler* challenge_handler = NULL;
+challenge_init* init_hook = NULL;
+unsigned thread_count = 0;
+pid_t* retired_pids = NULL;
+unsigned retired_count = 0;
+char** server_argv = NULL;
+char* server_exe = NULL;
+bool server_chrooted = false;
+int shared_fd = -1;
+bool shared_inherited = false;
+upgrade_header* inherited = NULL;
 
 /*! Name of the environment variable used to mark a connection handler process. */
 static const char* kEnvMarker = "PWNABLE_CONNECTION";
 
+/*! Name of the environment variable used to mark a pre-exec'd pool worker process. */
+static const char* kEnvPool = "PWNABLE_POOL";
+
 /*! Need to avoid setenv(), which does a hidden malloc */
 static bool skipListen = true;
 
-/*! Password that must be entered by the user after connecting. */
-static const char* password = NULL;
+/*! Config file listing the services to host, or NULL for the one given on the command line. */
+static const char* config_path = NULL;
+
+/*! Whether pool workers may exec --exec programs with this library preloaded into them. */
+static bool pool_exec = false;
+
+/*! Connection handed to this process by the server while it was parked as a pool worker. */
+static int pool_conn = -1;
+
+/*! How a session's process ended, in an acct_record. */
+enum {
+	ACCT_EXITED,                   /*!< exit_value is the exit status */
+	ACCT_SIGNALED,                 /*!< exit_value is the terminating signal */
+};
+
+/*! Binary accounting record appended to the accounting file for each ended
+ * session with `--accounting-format binary`. Fields are in the server's
+ * native byte order, and the layout has no padding besides the reserved
+ * bytes at the end. The CSV format has the same fields in the same order,
+ * starting with start_us and ending with bytes_out, with times in seconds.
+ */
+typedef struct acct_record {
+	uint64_t start_us;             /*!< Wall-clock start time, in microseconds since the epoch */
+	uint64_t duration_us;          /*!< Wall-clock duration of the session */
+	uint64_t utime_us;             /*!< User CPU time */
+	uint64_t stime_us;             /*!< System CPU time */
+	uint64_t maxrss_kb;            /*!< Peak resident set size in kilobytes */
+	uint64_t minflt;               /*!< Minor page faults */
+	uint64_t majflt;               /*!< Major page faults */
+	uint64_t nvcsw;                /*!< Voluntary context switches */
+	uint64_t nivcsw;               /*!< Involuntary context switches */
+	uint64_t bytes_in;             /*!< Bytes received from the client */
+	uint64_t bytes_out;            /*!< Bytes sent to and acknowledged by the client */
+	int32_t pid;                   /*!< Process ID of the session */
+	uint32_t ip;                   /*!< Client's IPv4 address (host byte order) */
+	uint16_t port;                 /*!< Client's port */
+	uint8_t exit_kind;             /*!< ACCT_EXITED or ACCT_SIGNALED */
+	uint8_t exit_value;            /*!< Exit status or signal number */
+	uint8_t reserved[4];
+} acct_record;
+
+/*! Column names written at the top of a new CSV accounting file. */
+#define ACCT_CSV_HEADER "start,pid,ip,port,duration,exit_kind,exit_value,utime,stime,maxrss_kb,minflt,majflt,nvcsw,nivcsw,bytes_in,bytes_out\n"
+
+/*! Message logged for each reject_reason. */
+static const char* const reject_messages[REJECT_REASONS] = {
+	"connection rate limit exceeded",
+	"too many connections from this IP",
+	"too many live sessions",
+	"unable to start a session",
+};
+
+/*! Seconds the kernel holds a new connection until the client sends data (TCP_DEFER_ACCEPT), or 0. */
+static int tcp_defer_accept = 0;
+
+/*! Number of pending TCP Fast Open requests allowed on each listening socket, or 0 to disable. */
+static int tcp_fastopen = 0;
+
+/*! Whether connections send small writes right away instead of coalescing them (TCP_NODELAY). */
+static bool tcp_nodelay = false;
+
+/*! Size of each connection's send and receive buffers in bytes, or 0 for the kernel's default. */
+static int tcp_sndbuf = 0;
+static int tcp_rcvbuf = 0;
+
+/*! Seconds a connection may sit idle before keepalive probes check on the client, or 0 to disable. */
+static int tcp_keepalive = 0;
+
+/*! Seconds sent data may go unacknowledged before the connection is dropped
+ * (TCP_USER_TIMEOUT), 0 for the kernel's default, or -1 to match --keepalive.
+ */
+static int tcp_user_timeout = -1;
+
+/*! TCP options given explicitly on the command line, which --tcp-profile leaves alone. */
+enum {
+	TCP_SET_BACKLOG      = 1 << 0, /*!< --backlog */
+	TCP_SET_DEFER_ACCEPT = 1 << 1, /*!< --defer-accept */
+	TCP_SET_FASTOPEN     = 1 << 2, /*!< --fastopen */
+	TCP_SET_NODELAY      = 1 << 3, /*!< --nodelay */
+	TCP_SET_KEEPALIVE    = 1 << 4, /*!< --keepalive */
+};
+static unsigned tcp_options_set = 0;
+
+/*! Whether each acceptor is pinned to its own CPU. */
+static bool pin_cpus = false;
+
+#ifdef __linux__
+/*! CPUs the server was allowed to run on before any acceptor was pinned. */
+static cpu_set_t allowed_cpus;
+#endif
+
+/*! Number of new connections per second allowed from a single IP address, or 0 for no limit. */
+static double conn_rate = 0;
+
+/*! Number of connections an IP address may make in a burst, or 0 to derive it from conn_rate. */
+static unsigned conn_burst = 0;
+
+/*! Path of the file to append session accounting records to, or NULL to disable. */
+static const char* accounting_path = NULL;
+
+/*! Whether accounting records are written in binary instead of CSV. */
+static bool accounting_binary = false;
+
+/*! Open accounting file, or -1 when disabled. */
+static int accounting_fd = -1;
+
+/*! Path of the file to append captured client traffic to, or NULL to disable. */
+static const char* capture_path = NULL;
+
+/*! Path of the file to append the steps of each connection to in Chrome's trace format, or NULL to disable. */
+static const char* trace_path = NULL;
+
+/*! Open trace file, or -1 when disabled. */
+static int trace_fd = -1;
+
+/*! Whether --exec programs report their progress on the trace pipe, like ones built with COALESCED_STDIO. */
+static bool exec_reports_trace = false;
+
+/*! Name of the environment variable telling a traced session where to report its progress. */
+static const char* kEnvTrace = "PWNABLE_TRACE_FD";
+
+/*! Fraction of a CPU that each session may use, or 0 for no limit. */
+static double session_cpu = 0;
+
+/*! Maximum memory usage of each session (like "50m"), or NULL for no limit. */
+static const char* session_mem = NULL;
 
+/*! Maximum number of processes and threads in each session, or 0 for no limit. */
+static unsigned session_pids = 0;
+
+/*! Seconds of CPU time each session may use before it is killed, or 0 for no limit. */
+static unsigned cpu_limit = 0;
+
+/*! Whether each session runs in a PID namespace of its own. */
+static bool pid_namespaces = false;
+
+/*! Directory each session gets a private copy-on-write view of, or NULL. */
+static const char* session_workdir = NULL;
+
+/*! Megabytes each session may write to its private workdir. */
+static unsigned workdir_size = 64;
+
+/*! How often in milliseconds the CPU usage of session cgroups is checked. */
+#define CPU_POLL_MS 1000
+
+/*! Whether sessions talk to their client through the server instead of using its socket directly. */
+static bool relay_mode = false;
+
+/*! Seconds a relayed session may go without any traffic before it is killed, or 0 for no limit. */
+static unsigned idle_timeout = 0;
+
+/*! Cgroup directory to create session cgroups in, or NULL for the server's own cgroup. */
+static const char* cgroup_dir = NULL;
+
+/*! Whether a read-only cgroup filesystem may be remounted read-write, which
+ * needs CAP_SYS_ADMIN and an unconfined AppArmor profile in a container.
+ */
+static bool cgroup_remount = false;
+
+/*! Open directory of the cgroup that holds the session cgroups, or -1 when disabled. */
+static int cgroup_fd = -1;
+
+/*! Where the cgroup v2 filesystem is mounted. */
+#define CGROUP_MOUNT "/sys/fs/cgroup"
+
+/*! Name of the leaf cgroup the server moves itself into. */
+#define CGROUP_SERVER "pwnableserver"
+
+/*! Scheduling period in microseconds used for each session's CPU quota. */
+#define CGROUP_CPU_PERIOD 100000
+
+/*! Smallest CPU quota in microseconds that the kernel accepts in cpu.max. */
+#define CGROUP_CPU_QUOTA_MIN 1000
+
+/*! How incoming connections are distributed between the acceptors' sockets. */
+static enum {
+	STEER_NONE,                    /*!< Kernel's default hash of the connection 4-tuple */
+	STEER_CPU,                     /*!< Acceptor for the CPU that received the SYN */
+	STEER_IP,                      /*!< Acceptor chosen by the client's IP address */
+} steer_mode = STEER_NONE;
+
+/*! Whether the sessions still running at drain_deadline have been killed. */
+static bool drain_killed = false;
+
+/*! Whether this process is an acceptor, which retires on SIGHUP instead of re-exec-ing. */
+static bool is_acceptor = false;
+
+/*! Returns the current monotonic time in nanoseconds. */
+uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*! Maps memory that is shared with forked processes. When possible, it's
+ * backed by a memory file, which unlike anonymous memory can be handed down
+ * to a re-exec'd server.
+ * @param fd Set to the memory file, or -1 when the memory is anonymous
+ * @return The zero-filled mapping, or NULL on error
+ */
+void* map_shared(size_t size, int* fd) {
+	*fd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+	*fd = syscall(SYS_memfd_create, "pwnableserver", MFD_CLOEXEC);
+	if(*fd != -1 && ftruncate(*fd, size) != 0) {
+		close(*fd);
+		*fd = -1;
+	}
+#endif
+	
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, *fd != -1 ? MAP_SHARED : MAP_SHARED | MAP_ANON, *fd, 0);
+	if(mem == MAP_FAILED) {
+		if(*fd != -1) {
+			close(*fd);
+			*fd = -1;
+		}
+		return NULL;
+	}
+	
+	return mem;
+}
+
+/*! Maps shared memory handed down by the server that re-exec'd this one.
+ * @param fd Memory file, which is closed if it can't be used
+ * @param size Size the memory file must have
+ * @return The mapping, or NULL if it can't be used
+ */
+void* map_inherited(int fd, size_t size) {
+	struct stat st;
+	if(fd == -1) {
+		return NULL;
+	}
+	
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size != size || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+		close(fd);
+		return NULL;
+	}
+	
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mem == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	
+	return mem;
+}
 
 /*! Changes directory to the user's home directory, chroots there, and then
  * changes to the user's home directory relative to the chroot.
@@ -105,29 +370,41 @@ static bool enter_chroot(struct passwd* pw) {
 }
 
 /*! Reduce privileges from root to the specified user. */
-static bool drop_privileges(struct passwd* pw) {
+bool drop_privileges(struct passwd* pw) {
+#ifdef PR_CAPBSET_DROP
+	/* The server may have been given CAP_SYS_ADMIN for session cgroups, PID
+	 * namespaces, or workdirs. Drop it from the bounding set so that a setuid
+	 * root program can't bring it back for the challenge.
+	 */
+	if(prctl(PR_CAPBSET_READ, CAP_SYS_ADMIN, 0, 0, 0) == 1
+	   && prctl(PR_CAPBSET_DROP, CAP_SYS_ADMIN, 0, 0, 0) != 0) {
+		log_event(0, LOG_ERROR, NULL, errno, "Couldn't drop CAP_SYS_ADMIN from the bounding set");
+		return false;
+	}
+#endif
+	
 	/* Clear supplementary groups list */
 	if(initgroups(pw->pw_name, pw->pw_gid)) {
-		fprintf(stderr_fp, "Error: Couldn't clear groups list.\n");
+		log_event(0, LOG_ERROR, NULL, errno, "Couldn't clear groups list");
 		return false;
 	}
 	
 	/* Set group id */
 	if(setgid(pw->pw_gid)) {
-		fprintf(stderr_fp, "Error: Couldn't set group id.\n");
+		log_event(0, LOG_ERROR, NULL, errno, "Couldn't set group id");
 		return false;
 	}
 	
 	/* Set user id */
 	if(setuid(pw->pw_uid)) {
-		fprintf(stderr_fp, "Error: Couldn't set user id.\n");
+		log_event(0, LOG_ERROR, NULL, errno, "Couldn't set user id");
 		return false;
 	}
 	
 	/* If unable to restore root, it was successful */
 	if(setuid(0) != -1) {
 		/* Root privileges restored? This is very bad. Commit suicide */
-		fprintf(stderr_fp, "Error: root privileges restored: %d\n", getuid());
+		log_event(0, LOG_ERROR, NULL, 0, "Root privileges restored: %d", getuid());
 		return false;
 	}
 	
@@ -135,6 +412,27 @@ static bool drop_privileges(struct passwd* pw) {
 	return true;
 }
 
+/*! Points the standard file descriptors at /dev/null once they have been
+ * moved, so that nothing else gets them. These are what a re-exec'd server
+ * gets its standard IO through, so they must be free to be put back.
+ */
+void park_stdio(void) {
+	int devnull = open("/dev/null", O_RDWR);
+	if(devnull == -1) {
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+		return;
+	}
+	
+	dup2(devnull, STDIN_FILENO);
+	dup2(devnull, STDOUT_FILENO);
+	dup2(devnull, STDERR_FILENO);
+	if(devnull > STDERR_FILENO) {
+		close(devnull);
+	}
+}
+
 /* Moves standard IO file descriptors away from the default values. */
 static bool move_stdio(void) {
 	/* Make sure these are NULL */
@@ -163,10 +461,11 @@ static bool move_stdio(void) {
 		goto fail;
 	}
 	
-	/* Close original standard file descriptors */
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+	/* Flush each log line so forked children don't inherit and repeat buffered output */
+	setvbuf(stderr_fp, NULL, _IOLBF, 0);
+	
+	/* Replace original standard file descriptors */
+	park_stdio();
 	
 	return true;
 	
@@ -200,7 +499,7 @@ fail:
 }
 
 /* Redirects standard IO file descriptors to the socket. */
-static bool redirect_output(int sock) {
+bool redirect_output(int sock) {
 	if(dup2(sock, STDIN_FILENO) == -1) {
 		PERROR("dup2(stdin)");
 		return false;
@@ -222,274 +521,3606 @@ static bool redirect_output(int sock) {
 	return true;
 }
 
-static void handle_term(int signum) {
-	fprintf(stderr_fp, "Got SIGTERM, exiting...");
-	exit(signum);
+#ifdef __linux__
+/*! Writes a value to a control file in a cgroup directory.
+ * @return True on success
+ */
+static bool write_cgroup_file(int dirfd, const char* name, const char* value) {
+	int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+	if(fd == -1) {
+		return false;
+	}
+	
+	size_t len = strlen(value);
+	bool ok = write(fd, value, len) == (ssize_t)len;
+	close(fd);
+	return ok;
 }
 
-static void clean_env(void) {
-	const char* vars[] = {
-		"CHALLENGE_NAME",
-		"CHALLENGE_PASSWORD",
-		"PORT",
-		"TIMELIMIT",
-		"PWNABLESERVER_EXTRA_ARGS"
-	};
+/*! Finds the directory of the cgroup v2 that this process belongs to.
+ * @return Path to the cgroup directory (in a static buffer), or NULL on error
+ */
+static const char* find_own_cgroup(void) {
+	static char path[sizeof(CGROUP_MOUNT) + PATH_MAX];
+	char line[PATH_MAX];
+	const char* result = NULL;
 	
-	size_t i;
-	for(i = 0; i < ARRAYSIZE(vars); i++) {
-		unsetenv(vars[i]);
+	FILE* fp = fopen("/proc/self/cgroup", "r");
+	if(fp == NULL) {
+		return NULL;
+	}
+	
+	/* The unified hierarchy is the one listed with hierarchy ID 0 and no controllers */
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		if(strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(path, sizeof(path), "%s%s", CGROUP_MOUNT, &line[3]);
+			result = path;
+			break;
+		}
 	}
+	
+	fclose(fp);
+	return result;
 }
 
-
-static int serve_internal(
-	const char* user,
-	bool chrooted,
-	unsigned short port,
-	unsigned timeout,
-	conn_handler* handler,
-	const char* inject_lib,
-	const char* exec_prog,
-	int child_argc,
-	char** child_argv
-) {
-	if(handler == NULL && exec_prog == NULL) {
-		fprintf(stderr, "Handler function pointer is NULL and no program to exec was provided!\n");
-		return EXIT_FAILURE;
+/*! Removes the cgroups of sessions that have ended. A session's cgroup is
+ * named after its first process, and it can only be removed once it is empty.
+ */
+static void reap_session_cgroups(void) {
+	if(cgroup_fd == -1) {
+		return;
 	}
 	
-	/* 
-	 * For exec-ing servers, check for a marker environment variable.
-	 * If this is set, that means we have just been exec-ed to handle
-	 * a client connection. Therefore, instead of starting up the socket
-	 * server, just call the connection handler.
-	 */
-	char* marker = getenv(kEnvMarker);
-	if(marker != NULL || skipListen) {
-		/* Make sure these standard output streams are not buffered */
-		setvbuf(stdout, NULL, _IONBF, 0);
-		setvbuf(stderr, NULL, _IONBF, 0);
-		
-		/* Invoke actual challenge function */
-		handler(skipListen ? 0 : atoi(marker));
-		return EXIT_SUCCESS;
+	int fd = dup(cgroup_fd);
+	if(fd == -1) {
+		return;
 	}
 	
-	/* Elevate to root privileges before doing anything else */
-	if(setuid(0) != 0) {
-		fprintf(stderr, "Error: Unable to become root!\n");
-		perror("setuid(0)");
-		return EXIT_FAILURE;
+	DIR* dir = fdopendir(fd);
+	if(dir == NULL) {
+		close(fd);
+		return;
 	}
 	
-	/* Double check that we are root */
-	if(getuid() != 0) {
-		fprintf(stderr, "Error: Still not root!\n");
-		return EXIT_FAILURE;
+	struct dirent* ent;
+	while((ent = readdir(dir)) != NULL) {
+		if(strncmp(ent->d_name, "session-", 8) != 0) {
+			continue;
+		}
+		
+		/* Leave the cgroup alone while its session is still starting up or running */
+		pid_t pid = atoi(&ent->d_name[8]);
+		if(pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+			continue;
+		}
+		
+		/* Fails with EBUSY if any of the session's processes are still alive */
+		unlinkat(cgroup_fd, ent->d_name, AT_REMOVEDIR);
 	}
 	
-	/* Set LD_PRELOAD env var so that the library will be injected into exec-ed children */
-	if(inject_lib != NULL) {
-		setenv(PRELOAD_ENV_VAR, inject_lib, 1);
+	closedir(dir);
+}
+#endif /* __linux__ */
+
+/*! Prepares the cgroup that this server was started in to hold a child
+ * cgroup for each session, with the per-session resource limit controllers
+ * enabled.
+ * @note In cgroup v2, only cgroups without any processes of their own can
+ *   delegate controllers to their children, so the server first moves itself
+ *   into a leaf cgroup of its own.
+ * @return True on success
+ */
+static bool setup_session_cgroups(void) {
+	if(session_cpu <= 0 && session_mem == NULL && session_pids == 0) {
+		return true;
 	}
 	
-	/* Look up user struct */
-	struct passwd* pw = getpwnam(user);
-	if(!pw) {
-		fprintf(stderr, "Error: Couldn't find user '%s'.\n", user);
-		return EXIT_FAILURE;
+#ifdef __linux__
+	const char* path = cgroup_dir != NULL ? cgroup_dir : find_own_cgroup();
+	if(path == NULL) {
+		fprintf(stderr, "Error: Unable to find the cgroup v2 of the server process.\n");
+		return false;
 	}
 	
-	if(chrooted) {
-		/* Chroot into the user's home directory */
-		if(!enter_chroot(pw)) {
-			return EXIT_FAILURE;
-		}
+	cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(cgroup_fd == -1) {
+		perror(path);
+		return false;
 	}
 	
-	/* Ignore dead children so they don't turn into zombies */
-	if(signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-		perror("signal");
-		return EXIT_FAILURE;
+	if(mkdirat(cgroup_fd, CGROUP_SERVER, 0755) != 0) {
+		/* Docker mounts the cgroup filesystem read-only unless a delegated cgroup is bind-mounted in */
+		if(errno == EROFS) {
+			if(!cgroup_remount) {
+				fprintf(stderr, "Error: The cgroup filesystem is read-only. Per-session limits need a writable, delegated cgroup (or --cgroup-remount).\n");
+				return false;
+			}
+			
+			if(mount(NULL, CGROUP_MOUNT, NULL, MS_REMOUNT | MS_BIND, NULL) != 0) {
+				perror("mount(" CGROUP_MOUNT ")");
+				fprintf(stderr, "Error: The cgroup filesystem is read-only. Per-session limits require CAP_SYS_ADMIN.\n");
+				return false;
+			}
+			
+			if(mkdirat(cgroup_fd, CGROUP_SERVER, 0755) != 0 && errno != EEXIST) {
+				perror("mkdir(" CGROUP_SERVER ")");
+				return false;
+			}
+		}
+		else if(errno != EEXIST) {
+			perror("mkdir(" CGROUP_SERVER ")");
+			return false;
+		}
 	}
 	
-	/* Handle SIGTERM so that when running in Docker as PID 1 we properly exit */
-	if(signal(SIGTERM, &handle_term) == SIG_ERR) {
-		perror("signal");
-		return EXIT_FAILURE;
+	char procs[sizeof(CGROUP_SERVER) + sizeof("/cgroup.procs")];
+	snprintf(procs, sizeof(procs), "%s/cgroup.procs", CGROUP_SERVER);
+	if(!write_cgroup_file(cgroup_fd, procs, "0")) {
+		perror(procs);
+		return false;
 	}
 	
-	/* Create socket */
-	int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if(sock == -1) {
-		perror("socket");
-		return EXIT_FAILURE;
+	/* Enable only the controllers that are needed for the configured limits */
+	char controllers[32] = "";
+	if(session_cpu > 0) {
+		strcat(controllers, " +cpu");
 	}
-	
-	/* Allow socket to reuse the serv_addr */
-	int reuse = 1;
-	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0) {
-		perror("setsockopt");
-		return EXIT_FAILURE;
+	if(session_mem != NULL) {
+		strcat(controllers, " +memory");
+	}
+	if(session_pids > 0) {
+		strcat(controllers, " +pids");
 	}
 	
-	struct sockaddr_in serv_addr, cli_addr;
-	socklen_t cli_len = sizeof(cli_addr);
+	if(!write_cgroup_file(cgroup_fd, "cgroup.subtree_control", &controllers[1])) {
+		fprintf(stderr, "Error: Unable to enable the%s controllers in %s: %s\n", controllers, path, strerror(errno));
+		return false;
+	}
 	
-	/* Allow incoming connections from anywhere */
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = INADDR_ANY;
-	serv_addr.sin_port = htons(port);
+	/* Clean up after any previous server that was using this cgroup */
+	reap_session_cgroups();
+	return true;
+#else
+	fprintf(stderr, "Error: Per-session resource limits are only supported on Linux.\n");
+	return false;
+#endif
+}
+
+/*! Called in a newly forked session process to move it into its own cgroup
+ * with the per-session resource limits applied, before it runs any code
+ * belonging to the challenge.
+ * @param pid Session process to move, or 0 for the calling process
+ * @return True on success
+ */
+bool enter_session_cgroup(pid_t pid) {
+#ifdef __linux__
+	if(cgroup_fd == -1) {
+		return true;
+	}
 	
-	/* Bind to port */
-	if(bind(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
-		perror("bind");
-		return EXIT_FAILURE;
+	char name[32];
+	snprintf(name, sizeof(name), "session-%d", pid != 0 ? pid : getpid());
+	if(mkdirat(cgroup_fd, name, 0755) != 0 && errno != EEXIST) {
+		PERROR("mkdir(session cgroup)");
+		return false;
 	}
 	
-	/* Listen for connections, with a maximum backlog of 128 connections to accept */
-	if(listen(sock, 128) != 0) {
-		perror("listen");
-		return EXIT_FAILURE;
+	int fd = openat(cgroup_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		PERROR("open(session cgroup)");
+		return false;
 	}
 	
-	/* Move standard file descriptors away from their normal positions */
-	if(!move_stdio()) {
-		fprintf(stderr_fp, "Error: Unable to move standard file descriptors.\n");
-		return EXIT_FAILURE;
+	bool ok = true;
+	char value[64];
+	if(session_cpu > 0) {
+		/* Quota of CPU time in microseconds per 100ms period */
+		snprintf(value, sizeof(value), "%lu %u", (unsigned long)(session_cpu * CGROUP_CPU_PERIOD), CGROUP_CPU_PERIOD);
+		ok = ok && write_cgroup_file(fd, "cpu.max", value);
+	}
+	if(session_mem != NULL) {
+		ok = ok && write_cgroup_file(fd, "memory.max", session_mem);
+		
+		/* Don't let the session get around its memory limit by swapping */
+		write_cgroup_file(fd, "memory.swap.max", "0");
+	}
+	if(session_pids > 0) {
+		snprintf(value, sizeof(value), "%u", session_pids);
+		ok = ok && write_cgroup_file(fd, "pids.max", value);
 	}
 	
-	/* Display useful information about the server process */
-	fprintf(stderr_fp, "Server PID: %u\n", getpid());
-	fprintf(stderr_fp, "Now accepting connections on port %hu (0x%04hx)\n\n", port, port);
+	/* Writing 0 moves the calling process, and its future children follow it */
+	snprintf(value, sizeof(value), "%d", pid);
+	ok = ok && write_cgroup_file(fd, "cgroup.procs", value);
+	if(!ok) {
+		PERROR("write(session cgroup)");
+	}
 	
-	/* Accept connections */
-	int conn;
-	bool noclose;
-	do {
-		noclose = false;
-		
-		/* Wait for a client connection */
-		conn = accept(sock, (struct sockaddr*)&cli_addr, &cli_len);
-		if(conn == -1) {
-			PERROR("accept");
-			noclose = true;
-			continue;
-		}
+	close(fd);
+	return ok;
+#else
+	return true;
+#endif
+}
+
+/*! Signal handler for SIGTERM, which drains the server's sessions before it
+ * exits, and SIGHUP, which re-execs the server. Both are acted on by the
+ * event loop, which this wakes up.
+ */
+static void handle_term(int signum) {
+	int saved_errno = errno;
+	if(signum == SIGHUP) {
+		upgrade_requested = 1;
+	}
+	else {
+		stop_requested = 1;
 		
-		/* Handle the client connection in a subprocess */
-		pid_t pid = fork();
-		if(pid < 0) {
-			PERROR("fork");
-			return EXIT_FAILURE;
-		}
-		else if(pid == 0) {
-			/* Close the controlling socket descriptor so connections cannot be hijacked */
-			close(sock);
-			
-			/* Prevent long-running connections from hogging up the system */
-			if(timeout > 0) {
-				alarm(timeout);
-			}
-			
-			/* Create timestamp string */
-			time_t curtime = time(NULL);
-			char* timestamp = ctime(&curtime);
-			char* p = strchr(timestamp, '\n');
-			if(p != NULL) {
-				*p = '\0';
-			}
-			
-			/* Log timestamp and source IP for received connections */
-			uint32_t ip = ntohl(cli_addr.sin_addr.s_addr);
-			fprintf(
-				stderr_fp, "%u: [%s] Received connection from %u.%u.%u.%u.\n",
-				getpid(), timestamp, ip>>24, (ip>>16)&255, (ip>>8)&255, ip&255
-			);
-			
-			/* Redirect stdio to the socket */
-			if(!redirect_output(conn)) {
-				fprintf(stderr_fp, "Failed to redirect IO to socket.\n");
-				_exit(EXIT_FAILURE);
-			}
-			
-			/* Only the child process should drop privileges */
-			if(!drop_privileges(pw)) {
-				fprintf(stderr_fp, "Unable to drop privileges... Committing suicide.\n");
-				_exit(EXIT_FAILURE);
-			}
-			
-			/* Clear environment variables that may be present from the Dockerfile */
-			clean_env();
-			
-			/* Ask user for password if one is expected */
-			if(password != NULL) {
-				printf("Password: ");
-				fflush(stdout);
-				
-				char pass[100];
-				if(!fgets(pass, sizeof(pass), stdin)) {
-					printf("Must enter a password.\n");
-					fflush(stdout);
-					fprintf(stderr_fp, "%u: No password provided.\n", getpid());
-					_exit(EXIT_FAILURE);
-				}
-				
-				char* newline = strchr(pass, '\n');
-				if(newline) {
-					*newline = '\0';
-				}
-				
-				/* Not a constant-time comparison, but this doesn't need to be ultra secure */
-				if(strcmp(pass, password) != 0) {
-					printf("Incorrect password.\n");
-					fflush(stdout);
-					fprintf(stderr_fp, "%u: Incorrect password (%s)\n", getpid(), pass);
-					_exit(EXIT_FAILURE);
-				}
-				
-				fprintf(stderr_fp, "%u: Correct password.\n", getpid());
-			}
-			
-			/* Close real standard file handles */
-			fclose(stdin_fp);
-			fclose(stdout_fp);
-			fclose(stderr_fp);
-			
-			/* Exec ourselves or the target program to run the challenge code. */
-			if(exec_prog != NULL) {
-				/* Exec the target program */
-				if(child_argc > 0) {
-					/* Replace "--" in argv[0] with the target program */
-					child_argv[0] = (char*)exec_prog;
-					execv(exec_prog, child_argv);
-				}
-				else {
-					execl(exec_prog, exec_prog, NULL);
-				}
+		/* The supervisor passes it on to its acceptors, which drain on their own */
+		unsigned i;
+		for(i = 0; acceptor_pids != NULL && i < acceptor_count; i++) {
+			if(acceptor_pids[i] > 0) {
+				kill(acceptor_pids[i], SIGTERM);
 			}
-			else {
-				/* Set connection marker environment variable to the connection socket */
-				char conn_str[11];
-				snprintf(conn_str, sizeof(conn_str), "%u", conn);
-				if(setenv(kEnvMarker, conn_str, 0) != 0) {
-					_exit(EXIT_FAILURE);
-				}
-				
-				/* Exec ourselves to allow PIE to take effect */
-				execl(PROC_SELF_EXE(), PROGRAM_NAME(), NULL);
+		}
+		for(i = 0; i < retired_count; i++) {
+			if(retired_pids[i] > 0) {
+				kill(retired_pids[i], SIGTERM);
 			}
-			
-			/* Should hopefully never make it this far */
-			abort();
 		}
-	} while(noclose || close(conn) != -1);
+	}
 	
-	/* If this is reached, the connection couldn't be closed successfully. */
-	PERROR("close");
-	return EXIT_FAILURE;
+	char c = (char)signum;
+	if(sigchld_pipe[1] != -1 && write(sigchld_pipe[1], &c, 1) < 0) {
+		/* The loop is already awake if the pipe is full */
+	}
+	errno = saved_errno;
+}
+
+/*! Forgets about a retired acceptor once it has exited. */
+static void forget_retired(pid_t pid) {
+	unsigned i;
+	for(i = 0; i < retired_count; i++) {
+		if(retired_pids[i] == pid) {
+			retired_pids[i] = 0;
+		}
+	}
+}
+
+/*! Applies the limits that belong to each individual session process, in a
+ * newly forked session process.
+ */
+void limit_session_process(void) {
+	/* Lead a process group of our own, so the server can kill everything this session spawns */
+	setpgid(0, 0);
+	
+	/* RLIMIT_CPU is per process, so the cgroup's usage is also polled by the server */
+	if(cpu_limit > 0) {
+		struct rlimit rl;
+		rl.rlim_cur = cpu_limit;
+		rl.rlim_max = cpu_limit + 1;
+		if(setrlimit(RLIMIT_CPU, &rl) != 0) {
+			PERROR("setrlimit(RLIMIT_CPU)");
+		}
+	}
+}
+
+/*! Moves a newly forked session process into a PID namespace of its own.
+ *
+ * The calling process stays behind in the server's namespace as the session
+ * process the server knows about. It forks an init process for the new
+ * namespace, which just reaps orphans, and then the challenge process as the
+ * namespace's PID 2, so that the challenge keeps the normal signal handling
+ * that PID 1 wouldn't have. Once the challenge exits, the init process is
+ * killed, which makes the kernel kill everything left in the namespace at
+ * once, even processes that escaped the session's process group. Finally the
+ * calling process exits the same way the challenge did.
+ *
+ * @param conn Client connection, which only the challenge process keeps open
+ * @return True in the challenge process, or false on error
+ */
+static bool enter_pid_namespace(int conn) {
+#ifdef __linux__
+	pid_t self = getpid();
+	if(unshare(CLONE_NEWPID) != 0) {
+		PERROR("unshare(CLONE_NEWPID)");
+		return false;
+	}
+	
+	/* The first child becomes the namespace's init process */
+	pid_t init = fork();
+	if(init < 0) {
+		PERROR("fork");
+		return false;
+	}
+	else if(init == 0) {
+		close(conn);
+		signal(SIGCHLD, SIG_IGN);
+		for(;;) {
+			pause();
+		}
+	}
+	
+	/* Later children join the namespace while its init process lives */
+	pid_t child = fork();
+	if(child < 0) {
+		PERROR("fork");
+		kill(init, SIGKILL);
+		return false;
+	}
+	else if(child == 0) {
+		outer_pid = self;
+		return true;
+	}
+	
+	close(conn);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	
+	int status = 0;
+	while(waitpid(child, &status, 0) < 0 && errno == EINTR) {
+		/* Try again */
+	}
+	
+	kill(init, SIGKILL);
+	while(waitpid(init, NULL, 0) < 0 && errno == EINTR) {
+		/* Try again */
+	}
+	
+	if(WIFSIGNALED(status)) {
+		/* Die from the same signal, without leaving a core dump of this process */
+		struct rlimit rl;
+		rl.rlim_cur = rl.rlim_max = 0;
+		setrlimit(RLIMIT_CORE, &rl);
+		
+		sigset_t sigs;
+		sigemptyset(&sigs);
+		sigaddset(&sigs, WTERMSIG(status));
+		sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+		signal(WTERMSIG(status), SIG_DFL);
+		raise(WTERMSIG(status));
+	}
+	_exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+#else
+	(void)conn;
+	log_event(0, LOG_ERROR, NULL, 0, "PID namespaces are only supported on Linux");
+	return false;
+#endif
+}
+
+/*! Moves the server into a mount namespace of its own where no mount is
+ * shared with the host, so that the workdirs sessions mount never propagate
+ * out of their own namespaces. This needs to happen before the server chroots,
+ * while "/" is still a mount point.
+ * @return True on success, or if sessions don't get private workdirs
+ */
+static bool setup_session_mounts(void) {
+	if(session_workdir == NULL) {
+		return true;
+	}
+	
+#ifdef __linux__
+	if(unshare(CLONE_NEWNS) != 0) {
+		perror("unshare(CLONE_NEWNS)");
+		return false;
+	}
+	
+	if(mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+		perror("mount");
+		return false;
+	}
+	
+	return true;
+#else
+	fprintf(stderr, "Error: Private session workdirs are only supported on Linux.\n");
+	return false;
+#endif
+}
+
+/*! Gives a newly forked session process its own copy-on-write view of the
+ * session workdir, in a mount namespace that goes away along with the session.
+ *
+ * A tmpfs is mounted over the workdir to hold the session's changes, and then
+ * an overlay of those changes on top of the original directory is mounted over
+ * the tmpfs. The original directory stays reachable as the working directory
+ * after the tmpfs covers it. Nothing is copied, so this is just as fast for a
+ * large directory as for an empty one.
+ * @return True on success
+ */
+static bool enter_private_workdir(void) {
+#ifdef __linux__
+	/* The working directory is probably inside the workdir, so come back to it afterwards */
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) == NULL) {
+		PERROR("getcwd");
+		return false;
+	}
+	
+	if(unshare(CLONE_NEWNS) != 0) {
+		PERROR("unshare(CLONE_NEWNS)");
+		return false;
+	}
+	
+	/* The overlay's root directory takes its owner and mode from the upper directory */
+	struct stat st;
+	if(stat(session_workdir, &st) != 0) {
+		PERROR("stat");
+		return false;
+	}
+	
+	if(chdir(session_workdir) != 0) {
+		PERROR("chdir");
+		return false;
+	}
+	
+	char opts[PATH_MAX * 2 + 64];
+	snprintf(opts, sizeof(opts), "size=%um,mode=0700", workdir_size);
+	if(mount("tmpfs", session_workdir, "tmpfs", MS_NODEV, opts) != 0) {
+		PERROR("mount(tmpfs)");
+		return false;
+	}
+	
+	char upper[PATH_MAX];
+	char work[PATH_MAX];
+	snprintf(upper, sizeof(upper), "%s/upper", session_workdir);
+	snprintf(work, sizeof(work), "%s/work", session_workdir);
+	if(mkdir(upper, st.st_mode & 07777) != 0
+	   || chown(upper, st.st_uid, st.st_gid) != 0
+	   || chmod(upper, st.st_mode & 07777) != 0
+	   || mkdir(work, 0700) != 0) {
+		PERROR("mkdir");
+		return false;
+	}
+	
+	/* "." is the original directory underneath the tmpfs */
+	snprintf(opts, sizeof(opts), "lowerdir=.,upperdir=%s,workdir=%s", upper, work);
+	if(mount("overlay", session_workdir, "overlay", MS_NODEV, opts) != 0) {
+		PERROR("mount(overlay)");
+		return false;
+	}
+	
+	if(chdir(cwd) != 0) {
+		PERROR("chdir");
+		return false;
+	}
+	
+	return true;
+#else
+	log_event(0, LOG_ERROR, NULL, 0, "Private session workdirs are only supported on Linux");
+	return false;
+#endif
+}
+
+/*! Kills every process belonging to a session: its whole process group, and
+ * if sessions have their own cgroups, everything in the session's cgroup
+ * (including processes that left the process group).
+ */
+static void kill_session(pid_t pid) {
+	kill(-pid, SIGKILL);
+	
+#ifdef __linux__
+	if(cgroup_fd == -1) {
+		return;
+	}
+	
+	char path[64];
+	snprintf(path, sizeof(path), "session-%d/cgroup.kill", pid);
+	if(write_cgroup_file(cgroup_fd, path, "1")) {
+		return;
+	}
+	
+	/* Kernels before 5.14 don't have cgroup.kill, so kill the processes one by one */
+	snprintf(path, sizeof(path), "session-%d/cgroup.procs", pid);
+	int fd = openat(cgroup_fd, path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		return;
+	}
+	
+	FILE* fp = fdopen(fd, "r");
+	if(fp == NULL) {
+		close(fd);
+		return;
+	}
+	
+	int member;
+	while(fscanf(fp, "%d", &member) == 1) {
+		kill(member, SIGKILL);
+	}
+	fclose(fp);
+#endif /* __linux__ */
+}
+
+/*! Reads the total CPU time used by all processes in a session's cgroup.
+ * @return True on success
+ */
+static bool session_cpu_time(pid_t pid, double* seconds) {
+#ifdef __linux__
+	if(cgroup_fd == -1) {
+		return false;
+	}
+	
+	char path[64];
+	snprintf(path, sizeof(path), "session-%d/cpu.stat", pid);
+	int fd = openat(cgroup_fd, path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		return false;
+	}
+	
+	char buf[256];
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0) {
+		return false;
+	}
+	buf[n] = '\0';
+	
+	/* The first line is "usage_usec <microseconds>" */
+	unsigned long long usage_usec;
+	if(sscanf(buf, "usage_usec %llu", &usage_usec) != 1) {
+		return false;
+	}
+	
+	*seconds = usage_usec / 1e6;
+	return true;
+#else
+	(void)pid;
+	(void)seconds;
+	return false;
+#endif
+}
+
+/*! Sends a file descriptor along with a message over a Unix socket. */
+bool send_fd(int chan, int fd, const void* msg, size_t msg_size) {
+	struct iovec iov;
+	iov.iov_base = (void*)msg;
+	iov.iov_len = msg_size;
+	
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	/* A dead worker must not take down the server with SIGPIPE */
+	flags |= MSG_NOSIGNAL;
+#endif
+	
+	return sendmsg(chan, &mh, flags) == (ssize_t)msg_size;
+}
+
+/*! Receives a message over a Unix socket, which may come with a file descriptor.
+ * @param fd Set to the received file descriptor, or -1 if there was none
+ * @return Size of the message, 0 if the other end hung up, or -1 on error
+ */
+ssize_t recv_msg(int chan, void* msg, size_t msg_size, int* fd) {
+	*fd = -1;
+	
+	struct iovec iov;
+	iov.iov_base = msg;
+	iov.iov_len = msg_size;
+	
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	
+	ssize_t n;
+	do {
+		n = recvmsg(chan, &mh, 0);
+	} while(n == -1 && errno == EINTR);
+	
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+	if(n > 0
+	   && cmsg != NULL
+	   && cmsg->cmsg_level == SOL_SOCKET
+	   && cmsg->cmsg_type == SCM_RIGHTS
+	   && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return n;
+}
+
+/*! Receives a file descriptor along with a message over a Unix socket.
+ * @return The received file descriptor, or -1 on error
+ */
+int recv_fd(int chan, void* msg, size_t msg_size) {
+	int fd;
+	if(recv_msg(chan, msg, msg_size, &fd) != (ssize_t)msg_size) {
+		if(fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+/*! Removes this library from the preload list of a pool worker, so that
+ * nothing the challenge program runs has it loaded as well. Libraries
+ * injected with --inject stay.
+ */
+static void unpreload_harness(void) {
+	const char* preload = getenv(PRELOAD_ENV_VAR);
+	if(preload == NULL) {
+		return;
+	}
+	
+	char* list = strdup(preload);
+	char* kept = calloc(1, strlen(preload) + 1);
+	if(list == NULL || kept == NULL) {
+		free(list);
+		free(kept);
+		return;
+	}
+	
+	/* The dynamic loader separates preloaded libraries with colons or spaces */
+	char* save = NULL;
+	char* lib;
+	for(lib = strtok_r(list, ": ", &save); lib != NULL; lib = strtok_r(NULL, ": ", &save)) {
+		if(strcmp(lib, "libpwnableharness32.so") == 0 || strcmp(lib, "libpwnableharness64.so") == 0) {
+			continue;
+		}
+		if(kept[0] != '\0') {
+			strcat(kept, ":");
+		}
+		strcat(kept, lib);
+	}
+	
+	if(kept[0] != '\0') {
+		setenv(PRELOAD_ENV_VAR, kept, 1);
+	}
+	else {
+		unsetenv(PRELOAD_ENV_VAR);
+	}
+	free(list);
+	free(kept);
+}
+
+/*! Runs before main() in a pre-exec'd pool worker (for both the exec-ed
+ * challenge program, which has this library preloaded, and a re-exec-ed
+ * connection handler). The process is already deprivileged and fully loaded,
+ * so it just parks until the server hands it a connection, then redirects
+ * standard IO to that socket and lets the program start running.
+ * @note The preloaded library stays mapped in an exec-ed program, which
+ *   moves its other libraries and adds this one's code to its address space
+ *   compared to a session that isn't pooled.
+ */
+__attribute__((constructor))
+static void pool_worker_init(void) {
+	const char* chan_str = getenv(kEnvPool);
+	if(chan_str == NULL) {
+		return;
+	}
+	
+	int chan = atoi(chan_str);
+	unsetenv(kEnvPool);
+	unpreload_harness();
+	
+	/* Until a connection arrives, standard error still goes to the server's log */
+	pool_handoff msg;
+	int conn = recv_fd(chan, &msg, sizeof(msg));
+	close(chan);
+	if(conn == -1) {
+		/* The server went away or gave up on this worker */
+		_exit(EXIT_FAILURE);
+	}
+	
+	/* Keep a handle to the server's log for reporting a failure to redirect IO */
+	FILE* log_fp = NULL;
+	int log_fd = dup(STDERR_FILENO);
+	if(log_fd != -1) {
+		log_fp = fdopen(log_fd, "wb");
+	}
+	if(log_fp == NULL) {
+		_exit(EXIT_FAILURE);
+	}
+	setvbuf(log_fp, NULL, _IOLBF, 0);
+	stderr_fp = log_fp;
+	
+	if(dup2(conn, STDIN_FILENO) == -1
+	   || dup2(conn, STDOUT_FILENO) == -1
+	   || dup2(conn, STDERR_FILENO) == -1) {
+		log_event(0, LOG_ERROR, NULL, errno, "Failed to redirect IO to socket");
+		_exit(EXIT_FAILURE);
+	}
+	
+	fclose(log_fp);
+	stderr_fp = NULL;
+	pool_conn = conn;
+}
+
+void clean_env(void) {
+	const char* vars[] = {
+		"CHALLENGE_NAME",
+		"CHALLENGE_PASSWORD",
+		"PORT",
+		"TIMELIMIT",
+		"SESSION_CPULIMIT",
+		"SESSION_MEMLIMIT",
+		"SESSION_PIDSLIMIT",
+		"POW_BITS",
+		"POW_SCALE",
+		"PWNABLESERVER_EXTRA_ARGS"
+	};
+	
+	size_t i;
+	for(i = 0; i < ARRAYSIZE(vars); i++) {
+		unsetenv(vars[i]);
+	}
+}
+
+/*! Execs the target program, or re-execs ourselves to run the connection handler.
+ * @param conn Connection socket passed to the re-exec-ed handler, or -1 for a
+ *   pool worker, which instead receives its connection after it has started.
+ * @note This only returns by aborting.
+ */
+static void exec_challenge(const service* svc, int conn) {
+	if(svc->exec_prog != NULL) {
+		/* Exec the target program */
+		if(svc->child_argc > 0) {
+			/* Replace "--" in argv[0] with the target program */
+			svc->child_argv[0] = (char*)svc->exec_prog;
+			execv(svc->exec_prog, svc->child_argv);
+		}
+		else {
+			execl(svc->exec_prog, svc->exec_prog, NULL);
+		}
+	}
+	else {
+		if(conn != -1) {
+			/* The connection socket must survive the exec */
+			if(fcntl(conn, F_SETFD, 0) != 0) {
+				_exit(EXIT_FAILURE);
+			}
+			
+			/* Set connection marker environment variable to the connection socket */
+			char conn_str[11];
+			snprintf(conn_str, sizeof(conn_str), "%u", conn);
+			if(setenv(kEnvMarker, conn_str, 0) != 0) {
+				_exit(EXIT_FAILURE);
+			}
+		}
+		
+		/* Exec ourselves to allow PIE to take effect */
+		execl(PROC_SELF_EXE(), PROGRAM_NAME(), NULL);
+	}
+	
+	/* Should hopefully never make it this far */
+	abort();
+}
+
+/*! Undoes the CPU pinning of an acceptor process in a challenge process, so
+ * that the scheduler is free to balance challenges across all CPUs.
+ */
+void unpin_cpu(void) {
+#ifdef __linux__
+	if(pin_cpus) {
+		sched_setaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+	}
+#endif
+}
+
+/*! Logs the source address of a connection that a session was started for. */
+void log_connection(pid_t pid, const struct sockaddr_in* cli_addr) {
+	log_event(pid, LOG_CONNECTION, cli_addr, 0, NULL);
+}
+
+/*! Steps reported by a traced session over its trace pipe. Each report is a
+ * pair of 64-bit values: the step, then the monotonic time in nanoseconds.
+ * stdio_unbuffer.c reports TRACE_READY and TRACE_FIRST_BYTE using the same
+ * numbers.
+ */
+enum {
+	TRACE_EXEC = 1,                /*!< The session process is about to exec */
+	TRACE_READY = 2,               /*!< The challenge has been loaded and is about to run */
+	TRACE_FIRST_BYTE = 3,          /*!< The challenge is writing its first output */
+	TRACE_STEPS
+};
+
+/*! Appends an event to the trace file. Each event goes out in a single write()
+ * to the file, which is opened for appending, so events written at the same
+ * time by the acceptors and session processes don't get mixed up.
+ */
+static void write_trace(const char* fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+static void write_trace(const char* fmt, ...) {
+	char line[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+	va_end(ap);
+	if(len < 0 || len >= (int)sizeof(line) - 2) {
+		return;
+	}
+	
+	/* Chrome accepts a trailing comma and a missing "]" at the end of the array */
+	line[len++] = ',';
+	line[len++] = '\n';
+	if(write(trace_fd, line, len) < 0) {
+		/* Tracing is best effort */
+	}
+}
+
+/*! Appends a span covering one step of a connection to the trace file. */
+static void trace_span(const conn_trace* t, unsigned short port, const char* name, uint64_t start, uint64_t end) {
+	if(trace_fd == -1 || t->id == 0 || start == 0 || end < start) {
+		return;
+	}
+	
+	/* Each service is a process in the trace, and each of its connections is a thread */
+	write_trace(
+		"{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%hu,\"tid\":%u,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+		name, port, t->id,
+		(unsigned long long)(start / 1000), (unsigned long long)(start % 1000),
+		(unsigned long long)((end - start) / 1000), (unsigned long long)((end - start) % 1000)
+	);
+}
+
+/*! Ends the current step of a connection, appending its span to the trace file. */
+void trace_step(conn_trace* t, unsigned short port, const char* name) {
+	if(trace_fd == -1 || t == NULL || t->id == 0) {
+		return;
+	}
+	
+	uint64_t now = monotonic_ns();
+	trace_span(t, port, name, t->since, now);
+	t->since = now;
+}
+
+/*! Starts tracing a newly accepted connection, beginning with the time it
+ * spent in the listening socket's backlog.
+ */
+static void trace_accept(conn_trace* t, unsigned short port, int conn, const struct sockaddr_in* cli_addr) {
+	memset(t, 0, sizeof(*t));
+	if(trace_fd == -1) {
+		return;
+	}
+	
+	t->id = __atomic_add_fetch(&shared->traced_conns, 1, __ATOMIC_RELAXED);
+	t->accepted = monotonic_ns();
+	t->since = t->accepted;
+	
+	uint32_t ip = ntohl(cli_addr->sin_addr.s_addr);
+	write_trace(
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%hu,\"tid\":%u,\"args\":{\"name\":\"%u.%u.%u.%u:%u\"}}",
+		port, t->id, ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, ntohs(cli_addr->sin_port)
+	);
+	
+#if defined(__linux__) && defined(TCP_INFO)
+	/* The last ACK from the client completed the handshake, unless it has
+	 * sent data since. This is only as precise as the kernel's jiffies.
+	 */
+	struct tcp_info info;
+	socklen_t info_len = sizeof(info);
+	if(getsockopt(conn, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+		uint64_t waited = (uint64_t)info.tcpi_last_ack_recv * 1000000;
+		if(waited > 0 && waited < t->accepted) {
+			trace_span(t, port, "backlog", t->accepted - waited, t->accepted);
+		}
+	}
+#else
+	(void)conn;
+#endif
+}
+
+/*! Creates the pipe a traced session reports its progress on. The server
+ * keeps the non-blocking read end, and the write end is for the session.
+ * @return True on success, or when not tracing (with both ends set to -1)
+ */
+static bool open_trace_pipe(int fds[2]) {
+	fds[0] = fds[1] = -1;
+	if(trace_fd == -1) {
+		return true;
+	}
+	
+	if(pipe(fds) != 0) {
+		PERROR("pipe");
+		fds[0] = fds[1] = -1;
+		return false;
+	}
+	
+	if(fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0
+	   || fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0
+	   || fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		close(fds[0]);
+		close(fds[1]);
+		fds[0] = fds[1] = -1;
+		return false;
+	}
+	
+	return true;
+}
+
+/*! Reports that the exec is starting on the trace pipe, and then passes its
+ * write end on to the program about to be exec'd if it reports on it. The
+ * pipe is moved to the highest descriptor below 1024, so descriptors the
+ * challenge opens itself are numbered just like they are without --trace.
+ * @param reports Whether the program reports its progress, or else the pipe
+ *   is closed so that challenge code can't write fake reports to it
+ */
+static void pass_trace_pipe(int fd, bool reports) {
+	if(fd == -1) {
+		return;
+	}
+	
+	uint64_t report[2];
+	report[0] = TRACE_EXEC;
+	report[1] = monotonic_ns();
+	if(write(fd, report, sizeof(report)) < 0) {
+		/* Tracing is best effort */
+	}
+	if(!reports) {
+		close(fd);
+		return;
+	}
+	
+	int target = 1023;
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur <= (rlim_t)target) {
+		target = (int)rl.rlim_cur - 1;
+	}
+	
+	/* dup2() clears FD_CLOEXEC on the new descriptor */
+	char fd_str[11];
+	if(target <= STDERR_FILENO || dup2(fd, target) == -1) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	snprintf(fd_str, sizeof(fd_str), "%d", target);
+	if(setenv(kEnvTrace, fd_str, 1) != 0) {
+		close(target);
+	}
+}
+
+/*! Reports that a traced session's handler is about to run, for connection
+ * handlers built into the server program (exec'd challenges report this
+ * from stdio_unbuffer.c).
+ */
+static void report_trace_ready(void) {
+	const char* fd_str = getenv(kEnvTrace);
+	if(fd_str == NULL) {
+		return;
+	}
+	
+	int fd = atoi(fd_str);
+	unsetenv(kEnvTrace);
+	
+	uint64_t report[2];
+	report[0] = TRACE_READY;
+	report[1] = monotonic_ns();
+	if(write(fd, report, sizeof(report)) < 0) {
+		/* Tracing is best effort */
+	}
+	close(fd);
+}
+
+/*! Appends the spans of an ended session to the trace file: what it reported
+ * over its trace pipe, how long until the client got its first byte, and the
+ * whole connection from accept to end.
+ */
+static void trace_session_end(session* s, unsigned short port) {
+	if(trace_fd == -1 || s->trace.id == 0) {
+		return;
+	}
+	
+	/* The challenge could write anything here, so only trust times that make sense */
+	uint64_t now = monotonic_ns();
+	uint64_t steps[TRACE_STEPS];
+	uint64_t reports[16][2];
+	ssize_t n = 0;
+	memset(steps, 0, sizeof(steps));
+	if(s->trace_fd != -1) {
+		n = read(s->trace_fd, reports, sizeof(reports));
+		close(s->trace_fd);
+		s->trace_fd = -1;
+	}
+	
+	unsigned i;
+	for(i = 0; n > 0 && i < (size_t)n / sizeof(*reports); i++) {
+		uint64_t step = reports[i][0];
+		uint64_t when = reports[i][1];
+		if(step < TRACE_STEPS && steps[step] == 0 && when >= s->trace.since && when <= now) {
+			steps[step] = when;
+		}
+	}
+	if(steps[TRACE_FIRST_BYTE] == 0) {
+		steps[TRACE_FIRST_BYTE] = s->first_out;
+	}
+	
+	/* Pool workers exec'd long before the connection was handed to them */
+	uint64_t ready_from = s->pooled ? s->trace.since : steps[TRACE_EXEC];
+	trace_span(&s->trace, port, s->pooled ? "handoff" : "exec", ready_from, steps[TRACE_READY]);
+	
+	uint64_t first_from = steps[TRACE_READY] ? steps[TRACE_READY] : ready_from ? ready_from : s->trace.since;
+	trace_span(&s->trace, port, "first_byte", first_from, steps[TRACE_FIRST_BYTE]);
+	trace_span(&s->trace, port, "connection", s->trace.accepted, now);
+}
+
+/*! Finds the program a service execs as the server sees it, as sessions
+ * that chroot themselves see it at a different path.
+ * @return Path to the program, which the caller must free, or NULL on error
+ */
+static char* session_program_path(const service* svc) {
+	const char* prog = svc->exec_prog;
+	if(!svc->chroot_sessions) {
+		char* path = strdup(prog);
+		if(path == NULL) {
+			PERROR("strdup");
+		}
+		return path;
+	}
+	
+	const char* root = svc->pw->pw_dir;
+	const char* cwd = prog[0] == '/' ? "" : svc->pw->pw_dir;
+	size_t path_size = strlen(root) + strlen(cwd) + 1 + strlen(prog) + 1;
+	char* path = malloc(path_size);
+	if(path == NULL) {
+		PERROR("malloc");
+		return NULL;
+	}
+	snprintf(path, path_size, "%s%s%s%s", root, cwd, prog[0] == '/' ? "" : "/", prog);
+	return path;
+}
+
+/*! Decides which PwnableHarness library must be preloaded into the target
+ * program so that it can act as a pool worker.
+ * @return Library name matching the ELF class of the program, or NULL if unknown
+ */
+static const char* pool_preload_lib(const char* exec_prog) {
+	unsigned char ident[5];
+	int fd = open(exec_prog, O_RDONLY);
+	if(fd == -1) {
+		return NULL;
+	}
+	
+	ssize_t n = read(fd, ident, sizeof(ident));
+	close(fd);
+	if(n != (ssize_t)sizeof(ident) || memcmp(ident, "\x7f" "ELF", 4) != 0) {
+		return NULL;
+	}
+	
+	/* e_ident[EI_CLASS]: 1 is ELFCLASS32, 2 is ELFCLASS64 */
+	switch(ident[4]) {
+		case 1: return "libpwnableharness32.so";
+		case 2: return "libpwnableharness64.so";
+	}
+	
+	return NULL;
+}
+
+/*! Sets up a newly forked session process before it execs the challenge. It
+ * enters the session's cgroup, PID namespace, chroot, and workdir, sets up its
+ * standard file descriptors, drops privileges, clears the environment, and
+ * hands over the trace pipe. The process exits if any step fails, so a
+ * challenge never runs half confined.
+ * @param conn Client connection to use as stdio, or -1 for a pool worker,
+ *   which parks stdio on /dev/null until it is handed a connection
+ * @param chan Pool worker's channel to the server, which is moved past the
+ *   standard file descriptors, or NULL
+ * @param cli_addr Address of the client, or NULL for a pool worker
+ * @param trace Steps of the connection so far, or NULL for a pool worker
+ * @param trace_pipe Write end of the session's trace pipe, or -1
+ */
+static void prepare_session_child(const service* svc, int conn, int* chan, const struct sockaddr_in* cli_addr, conn_trace* trace, int trace_pipe) {
+	/* Close the controlling socket descriptor so connections cannot be hijacked */
+	close(svc->sock);
+	unpin_cpu();
+	
+	/* The server ignores SIGPIPE while relaying, which exec() would pass on */
+	signal(SIGPIPE, SIG_DFL);
+	
+	/* Confine this session to a cgroup of its own */
+	if(!enter_session_cgroup(0)) {
+		log_event(0, LOG_ERROR, NULL, 0, "Unable to enter a session cgroup... Committing suicide.");
+		_exit(EXIT_FAILURE);
+	}
+	limit_session_process();
+	trace_step(trace, svc->port, "cgroup");
+	
+	/* Everything the session spawns can be killed at once along with its PID namespace */
+	if(pid_namespaces) {
+		if(!enter_pid_namespace(conn != -1 ? conn : *chan)) {
+			log_event(0, LOG_ERROR, NULL, 0, "Unable to enter a PID namespace... Committing suicide.");
+			_exit(EXIT_FAILURE);
+		}
+		trace_step(trace, svc->port, "pid_namespace");
+	}
+	
+	/* Services hosted together each chroot their own sessions */
+	if(svc->chroot_sessions) {
+		if(!enter_chroot(svc->pw)) {
+			log_event(0, LOG_ERROR, NULL, 0, "Unable to chroot to '%s'... Committing suicide.", svc->pw->pw_dir);
+			_exit(EXIT_FAILURE);
+		}
+		trace_step(trace, svc->port, "chroot");
+	}
+	
+	/* Whatever this session writes to its workdir, no other session will see */
+	if(session_workdir != NULL) {
+		if(!enter_private_workdir()) {
+			log_event(0, LOG_ERROR, NULL, 0, "Unable to mount a private workdir at '%s'... Committing suicide.", session_workdir);
+			_exit(EXIT_FAILURE);
+		}
+		trace_step(trace, svc->port, "workdir");
+	}
+	
+	if(conn != -1) {
+		log_connection(0, cli_addr);
+		
+		/* Redirect stdio to the socket */
+		if(!redirect_output(conn)) {
+			log_event(0, LOG_ERROR, NULL, 0, "Failed to redirect IO to socket");
+			_exit(EXIT_FAILURE);
+		}
+		trace_step(trace, svc->port, "redirect_output");
+	}
+	else {
+		/* The standard file descriptors were closed, so the channel may be using one */
+		int moved = fcntl(*chan, F_DUPFD, STDERR_FILENO + 1);
+		if(moved == -1) {
+			PERROR("fcntl");
+			_exit(EXIT_FAILURE);
+		}
+		close(*chan);
+		*chan = moved;
+		
+		/* Park stdin and stdout on /dev/null, but keep logging to the server's stderr */
+		int devnull = open("/dev/null", O_RDWR);
+		if(devnull == -1
+		   || dup2(devnull, STDIN_FILENO) == -1
+		   || dup2(devnull, STDOUT_FILENO) == -1
+		   || dup2(real_stderr, STDERR_FILENO) == -1) {
+			PERROR("dup2");
+			_exit(EXIT_FAILURE);
+		}
+		if(devnull > STDERR_FILENO) {
+			close(devnull);
+		}
+	}
+	
+	/* Only the child process should drop privileges */
+	if(!drop_privileges(svc->pw)) {
+		log_event(0, LOG_ERROR, NULL, 0, "Unable to drop privileges... Committing suicide.");
+		_exit(EXIT_FAILURE);
+	}
+	trace_step(trace, svc->port, "drop_privileges");
+	
+	/* Clear environment variables that may be present from the Dockerfile */
+	clean_env();
+	trace_step(trace, svc->port, "clean_env");
+	
+	/* Close real standard file handles */
+	fclose(stdin_fp);
+	fclose(stdout_fp);
+	fclose(stderr_fp);
+	
+	/* The challenge reports when it is up and running, and when it first writes */
+	pass_trace_pipe(trace_pipe, svc->trace_reports);
+}
+
+/*! Spawns a pool worker process, which drops privileges and execs the
+ * challenge before any connection arrives.
+ * @return True if the worker process was created
+ */
+static bool pool_spawn(service* svc, pool_worker* worker) {
+	/* A seqpacket channel lets a parked worker see EOF when its acceptor dies */
+	int chans[2];
+	if(socketpair(AF_UNIX, POOL_CHAN_TYPE, 0, chans) != 0) {
+		PERROR("socketpair");
+		return false;
+	}
+	
+	/* Other workers must never inherit the server's end of this channel */
+	if(fcntl(chans[0], F_SETFD, FD_CLOEXEC) != 0) {
+		PERROR("fcntl");
+		close(chans[0]);
+		close(chans[1]);
+		return false;
+	}
+	
+	int trace_pipe[2];
+	if(!open_trace_pipe(trace_pipe)) {
+		close(chans[0]);
+		close(chans[1]);
+		return false;
+	}
+	
+	pid_t pid = fork();
+	if(pid < 0) {
+		STAT_ADD(fork_failures, 1);
+		PERROR("fork");
+		close(chans[0]);
+		close(chans[1]);
+		if(trace_pipe[0] != -1) {
+			close(trace_pipe[0]);
+			close(trace_pipe[1]);
+		}
+		return false;
+	}
+	else if(pid == 0) {
+		close(chans[0]);
+		prepare_session_child(svc, -1, &chans[1], NULL, NULL, trace_pipe[1]);
+		
+		char chan_str[11];
+		snprintf(chan_str, sizeof(chan_str), "%d", chans[1]);
+		if(setenv(kEnvPool, chan_str, 1) != 0) {
+			_exit(EXIT_FAILURE);
+		}
+		
+		if(svc->pool_preload != NULL && setenv(PRELOAD_ENV_VAR, svc->pool_preload, 1) != 0) {
+			_exit(EXIT_FAILURE);
+		}
+		
+		exec_challenge(svc, -1);
+	}
+	
+	/* Also set by the child, whichever runs first (the loser fails harmlessly) */
+	setpgid(pid, pid);
+	
+	close(chans[1]);
+	if(trace_pipe[1] != -1) {
+		close(trace_pipe[1]);
+	}
+	worker->pid = pid;
+	worker->chan = chans[0];
+	worker->trace_fd = trace_pipe[0];
+	return true;
+}
+
+/*! Allocates the worker pool and spawns the initial set of workers.
+ * @return True on success
+ */
+static bool pool_init(service* svc) {
+	svc->pool = calloc(pool_size, sizeof(*svc->pool));
+	if(svc->pool == NULL) {
+		PERROR("calloc");
+		return false;
+	}
+	svc->pool_next = 0;
+	svc->pool_preload = NULL;
+	
+	/* The exec-ed program needs this library preloaded to receive its connection */
+	if(svc->exec_prog != NULL) {
+		char* prog = session_program_path(svc);
+		if(prog == NULL) {
+			return false;
+		}
+		
+		const char* harness_lib = pool_preload_lib(prog);
+		free(prog);
+		if(harness_lib == NULL) {
+			log_event(0, LOG_ERROR, NULL, 0, "Unable to determine ELF class of '%s' for the worker pool", svc->exec_prog);
+			return false;
+		}
+		
+		if(svc->inject_lib != NULL) {
+			size_t preload_size = strlen(harness_lib) + 1 + strlen(svc->inject_lib) + 1;
+			char* preload_buf = malloc(preload_size);
+			if(preload_buf == NULL) {
+				PERROR("malloc");
+				return false;
+			}
+			snprintf(preload_buf, preload_size, "%s:%s", harness_lib, svc->inject_lib);
+			svc->pool_preload = preload_buf;
+		}
+		else {
+			svc->pool_preload = harness_lib;
+		}
+	}
+	
+	unsigned i;
+	for(i = 0; i < pool_size; i++) {
+		svc->pool[i].chan = -1;
+		svc->pool[i].trace_fd = -1;
+		pool_spawn(svc, &svc->pool[i]);
+	}
+	
+	return true;
+}
+
+/*! Hands an accepted connection off to the next parked pool worker. The
+ * worker's slot is left empty until pool_refill() runs, so that a burst of
+ * connections isn't held up by forking their replacements.
+ * @param trace_fd Set to the read end of the worker's trace pipe, which the
+ *   caller then owns, if the worker has one
+ * @return Process ID of the worker now handling the connection, or -1 if no
+ *   worker could take it
+ */
+static pid_t pool_dispatch(service* svc, int conn, const struct sockaddr_in* cli_addr, int* trace_fd) {
+	pool_handoff msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.cli_addr = *cli_addr;
+	
+	pid_t pid = -1;
+	unsigned tries;
+	for(tries = 0; tries < pool_size && pid == -1; tries++) {
+		pool_worker* worker = &svc->pool[svc->pool_next];
+		svc->pool_next = (svc->pool_next + 1) % pool_size;
+		
+		/* Slot used up by an earlier connection and not refilled yet */
+		if(worker->chan == -1) {
+			continue;
+		}
+		
+		/* Sending fails when the worker has already died */
+		if(send_fd(worker->chan, conn, &msg, sizeof(msg))) {
+			pid = worker->pid;
+			*trace_fd = worker->trace_fd;
+		}
+		else if(worker->trace_fd != -1) {
+			close(worker->trace_fd);
+		}
+		
+		/* Either way, this worker is used up */
+		close(worker->chan);
+		worker->chan = -1;
+		worker->trace_fd = -1;
+	}
+	
+	return pid;
+}
+
+/*! Spawns pool workers into the slots used up by connections or left empty
+ * by a failure to spawn. The accept loop calls this once it has handled
+ * everything that was ready, rather than for each connection.
+ */
+static void pool_refill(service* svc) {
+	unsigned i;
+	for(i = 0; svc->pool != NULL && i < pool_size; i++) {
+		if(svc->pool[i].chan == -1) {
+			pool_spawn(svc, &svc->pool[i]);
+		}
+	}
+}
+
+/*! Forks and execs a new challenge process to handle a connection.
+ * @return Process ID of the child process, or -1 on error
+ */
+static pid_t spawn_connection(service* svc, int conn, const struct sockaddr_in* cli_addr, conn_trace* trace, int trace_pipe) {
+	pid_t pid = fork();
+	if(pid < 0) {
+		STAT_ADD(fork_failures, 1);
+		PERROR("fork");
+		return -1;
+	}
+	else if(pid == 0) {
+		trace_step(trace, svc->port, "fork");
+		prepare_session_child(svc, conn, NULL, cli_addr, trace, trace_pipe);
+		
+		/* Inject the service's library into the exec-ed children */
+		if(svc->inject_lib != NULL && setenv(PRELOAD_ENV_VAR, svc->inject_lib, 1) != 0) {
+			_exit(EXIT_FAILURE);
+		}
+		
+		/* Exec ourselves or the target program to run the challenge code. */
+		exec_challenge(svc, conn);
+	}
+	
+	/* Also set by the child, whichever runs first (the loser fails harmlessly) */
+	setpgid(pid, pid);
+	return pid;
+}
+
+/*! Signal handler that wakes up the event loop when a child process exits. */
+static void handle_chld(int signum) {
+	int saved_errno = errno;
+	char c = (char)signum;
+	
+	/* The pipe is non-blocking, and a full pipe will wake up the loop anyway */
+	if(write(sigchld_pipe[1], &c, 1) < 0) {
+		/* Nothing can be done about it here */
+	}
+	errno = saved_errno;
+}
+
+/*! Opens the self-pipe that signal handlers write to to wake up the event loop.
+ * @return True on success
+ */
+bool open_wake_pipe(void) {
+	if(pipe(sigchld_pipe) != 0) {
+		PERROR("pipe");
+		return false;
+	}
+	
+	int i;
+	for(i = 0; i < 2; i++) {
+		if(fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC) != 0
+		   || fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK) != 0) {
+			PERROR("fcntl");
+			return false;
+		}
+	}
+	return true;
+}
+
+/*! Returns the number of seconds between two monotonic timestamps. */
+double elapsed_seconds(const struct timespec* since, const struct timespec* now) {
+	return (double)(now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*! Takes a token from the client IP's token bucket, refilling it first based
+ * on the time since it was last used.
+ * @note Buckets live in a fixed-size table indexed by a hash of the IP, and
+ *   a collision simply starts the new IP off with a full bucket. This can only
+ *   ever err on the side of admitting a connection.
+ * @return True if the connection is within the rate limit
+ */
+bool take_rate_token(service* svc, uint32_t ip, const struct timespec* now) {
+	if(conn_rate <= 0) {
+		return true;
+	}
+	
+	double burst = conn_burst > 0 ? conn_burst : (conn_rate < 1 ? 1 : conn_rate);
+	
+	/* Knuth's multiplicative hash */
+	rate_bucket* bucket = &svc->buckets[(ip * 2654435761u) % RATE_BUCKETS];
+	if(bucket->ip != ip || bucket->last.tv_sec == 0) {
+		bucket->ip = ip;
+		bucket->tokens = burst;
+	}
+	else {
+		bucket->tokens += elapsed_seconds(&bucket->last, now) * conn_rate;
+		if(bucket->tokens > burst) {
+			bucket->tokens = burst;
+		}
+	}
+	bucket->last = *now;
+	
+	if(bucket->tokens < 1) {
+		return false;
+	}
+	
+	bucket->tokens -= 1;
+	return true;
+}
+
+/*! Counts the connections from an IP address that are running, waiting in the
+ * queue, or authenticating.
+ */
+static unsigned count_from_ip(const service* svc, uint32_t ip) {
+	unsigned count = 0;
+	unsigned i;
+	for(i = 0; i < svc->session_count; i++) {
+		if(svc->sessions[i].cli_addr.sin_addr.s_addr == ip) {
+			count++;
+		}
+	}
+	for(i = 0; i < svc->queue_len; i++) {
+		if(svc->queue[i].cli_addr.sin_addr.s_addr == ip) {
+			count++;
+		}
+	}
+	for(i = 0; i < svc->auth_count; i++) {
+		if(svc->auths[i].cli_addr.sin_addr.s_addr == ip) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*! Claims one of the max_sessions slots, which are shared by all acceptors.
+ * @return True if a slot was available
+ */
+bool reserve_session_slot(void) {
+	unsigned live = __atomic_load_n(&shared->live_sessions, __ATOMIC_RELAXED);
+	do {
+		if(max_sessions > 0 && live >= max_sessions) {
+			return false;
+		}
+	} while(!__atomic_compare_exchange_n(&shared->live_sessions, &live, live + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	
+	return true;
+}
+
+/*! Gives back a slot claimed by reserve_session_slot(). */
+void release_session_slot(void) {
+	__atomic_sub_fetch(&shared->live_sessions, 1, __ATOMIC_RELAXED);
+}
+
+/*! Adds a running session to the service's table of live sessions.
+ * @return True on success
+ */
+static bool track_session(service* svc, pid_t pid, const struct sockaddr_in* cli_addr) {
+	if(svc->session_count == svc->session_cap) {
+		unsigned new_cap = svc->session_cap ? svc->session_cap * 2 : 64;
+		session* new_sessions = realloc(svc->sessions, new_cap * sizeof(*new_sessions));
+		if(new_sessions == NULL) {
+			PERROR("realloc");
+			return false;
+		}
+		svc->sessions = new_sessions;
+		svc->session_cap = new_cap;
+	}
+	
+	session* s = &svc->sessions[svc->session_count++];
+	s->pid = pid;
+	s->conn = -1;
+	s->cli_addr = *cli_addr;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	clock_gettime(CLOCK_REALTIME, &s->start_wall);
+	s->killed = false;
+	s->exited = false;
+	s->relay.sock = -1;
+	memset(&s->trace, 0, sizeof(s->trace));
+	s->trace_fd = -1;
+	s->pooled = false;
+	s->first_out = 0;
+	return true;
+}
+
+/*! Kills sessions that have run past their wall-clock time limit, have
+ * used up their CPU time budget, or have gone without traffic for too long.
+ */
+static void enforce_session_limits(service* svc) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	/* Reading every session's cpu.stat is done at most once per CPU_POLL_MS */
+	bool poll_cpu = false;
+	if(cpu_limit > 0 && cgroup_fd != -1 && elapsed_seconds(&svc->last_cpu_poll, &now) * 1000 >= CPU_POLL_MS) {
+		poll_cpu = true;
+		svc->last_cpu_poll = now;
+	}
+	
+	unsigned i;
+	for(i = 0; i < svc->session_count; i++) {
+		session* s = &svc->sessions[i];
+		bool idle = idle_timeout > 0 && s->relay.sock != -1
+			&& elapsed_seconds(&s->relay.last_active, &now) >= idle_timeout;
+		
+		/* Only the relay is left, so stop waiting on a client that isn't reading */
+		if(s->exited) {
+			if(idle) {
+				relay_abandon(&s->relay);
+			}
+			continue;
+		}
+		
+		if(s->killed) {
+			continue;
+		}
+		
+		if(svc->timeout > 0 && elapsed_seconds(&s->start, &now) >= svc->timeout) {
+			log_event(s->pid, LOG_TIMEOUT, &s->cli_addr, 0, "Wall-clock time limit of %u seconds reached", svc->timeout);
+			STAT_ADD(timeout_kills, 1);
+			kill_session(s->pid);
+			s->killed = true;
+			continue;
+		}
+		
+		double cpu_seconds;
+		if(poll_cpu && session_cpu_time(s->pid, &cpu_seconds) && cpu_seconds >= cpu_limit) {
+			log_event(s->pid, LOG_TIMEOUT, &s->cli_addr, 0, "CPU time limit of %u seconds reached", cpu_limit);
+			STAT_ADD(cpu_limit_kills, 1);
+			kill_session(s->pid);
+			s->killed = true;
+			continue;
+		}
+		
+		if(idle) {
+			log_event(s->pid, LOG_TIMEOUT, &s->cli_addr, 0, "No traffic for %u seconds", idle_timeout);
+			STAT_ADD(idle_kills, 1);
+			kill_session(s->pid);
+			s->killed = true;
+		}
+	}
+}
+
+/*! Lowers a poll() wait time to the given number of seconds if that is sooner. */
+static void wait_at_most(double* wait, bool* waiting, double seconds) {
+	if(!*waiting || seconds < *wait) {
+		*wait = seconds;
+		*waiting = true;
+	}
+}
+
+/*! Lowers a poll() wait time to when a service next needs attention: its
+ * nearest session or authentication deadline, or when a throttled relay may move
+ * more bytes.
+ */
+static void service_wait(const service* svc, const struct timespec* now, double* wait, bool* waiting) {
+	unsigned i;
+	for(i = 0; i < svc->auth_count; i++) {
+		const auth_conn* a = &svc->auths[i];
+		if(a->limit > 0) {
+			wait_at_most(wait, waiting, a->limit - elapsed_seconds(&a->start, now));
+		}
+	}
+	
+	for(i = 0; i < svc->session_count; i++) {
+		const session* s = &svc->sessions[i];
+		if(svc->timeout > 0 && !s->killed && !s->exited) {
+			wait_at_most(wait, waiting, svc->timeout - elapsed_seconds(&s->start, now));
+		}
+		
+		const relay* r = &s->relay;
+		if(r->sock == -1) {
+			continue;
+		}
+		
+		if(idle_timeout > 0 && !r->dirs[RELAY_OUT].shut) {
+			wait_at_most(wait, waiting, idle_timeout - elapsed_seconds(&r->last_active, now));
+		}
+		
+		unsigned dir;
+		for(dir = 0; relay_rate > 0 && dir < 2; dir++) {
+			const relay_dir* d = &r->dirs[dir];
+			if(!d->eof && d->pending == 0 && d->tokens < relay_min_tokens()) {
+				wait_at_most(wait, waiting, (relay_min_tokens() - d->tokens) / relay_rate);
+			}
+		}
+	}
+	
+	if(cpu_limit > 0 && cgroup_fd != -1 && svc->session_count > 0) {
+		wait_at_most(wait, waiting, CPU_POLL_MS / 1000.0 - elapsed_seconds(&svc->last_cpu_poll, now));
+	}
+	
+	/* A fork server's template that takes too long to answer is replaced */
+	if(svc->handoff_count > 0) {
+		wait_at_most(wait, waiting, FORK_SERVER_REPLY_TIMEOUT - elapsed_seconds(&svc->handoffs[0].sent, now));
+	}
+}
+
+/*! Computes how long the event loop may sleep before any of the services
+ * needs attention for a session limit or a throttled relay.
+ * @return Timeout in milliseconds for poll(), or -1 to wait indefinitely
+ */
+static int next_limit_check_ms(const service* svcs, unsigned svc_count) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	bool waiting = false;
+	double wait = 0;
+	unsigned k;
+	for(k = 0; k < svc_count; k++) {
+		service_wait(&svcs[k], &now, &wait, &waiting);
+	}
+	
+	/* Sessions still running at the drain deadline are killed */
+	if(shutting_down && !drain_killed) {
+		wait_at_most(&wait, &waiting, -elapsed_seconds(&drain_deadline, &now));
+	}
+	
+	if(!waiting) {
+		return -1;
+	}
+	if(wait <= 0) {
+		return 0;
+	}
+	
+	/* Round up so that the deadline has definitely passed when poll() returns */
+	return (int)(wait * 1000) + 1;
+}
+
+/*! Updates the statistics about ended sessions. */
+static void record_session_end(const session* s, int status) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record_duration(elapsed_seconds(&s->start, &now));
+	
+	if(WIFEXITED(status)) {
+		STAT_ADD(exit_codes[WEXITSTATUS(status) & 255], 1);
+	}
+	else if(WIFSIGNALED(status)) {
+		int sig = WTERMSIG(status);
+		if(sig >= 0 && sig < (int)ARRAYSIZE(shared->exit_signals)) {
+			STAT_ADD(exit_signals[sig], 1);
+		}
+	}
+}
+
+/*! Reads the number of bytes received from and sent to the client from the
+ * kernel's TCP statistics for a connection.
+ */
+static void connection_byte_counts(int conn, uint64_t* bytes_in, uint64_t* bytes_out) {
+	*bytes_in = 0;
+	*bytes_out = 0;
+	
+#if defined(__linux__) && defined(TCP_INFO)
+	/* The libc's struct tcp_info often predates these fields, so read them
+	 * from the kernel ABI directly: tcpi_bytes_acked is at offset 120 and
+	 * tcpi_bytes_received is at offset 128 (Linux 4.1+).
+	 */
+	unsigned char info[256];
+	socklen_t info_len = sizeof(info);
+	if(getsockopt(conn, IPPROTO_TCP, TCP_INFO, info, &info_len) == 0 && info_len >= 136) {
+		memcpy(bytes_out, &info[120], sizeof(*bytes_out));
+		memcpy(bytes_in, &info[128], sizeof(*bytes_in));
+	}
+#else
+	(void)conn;
+#endif
+}
+
+/*! Converts a timeval to microseconds. */
+static uint64_t timeval_us(const struct timeval* tv) {
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/*! Appends an accounting record for an ended session to the accounting file. */
+static void write_accounting(const session* s, int status, const struct rusage* ru) {
+	acct_record rec;
+	memset(&rec, 0, sizeof(rec));
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec.start_us = (uint64_t)s->start_wall.tv_sec * 1000000 + s->start_wall.tv_nsec / 1000;
+	rec.duration_us = (uint64_t)(elapsed_seconds(&s->start, &now) * 1e6);
+	rec.utime_us = timeval_us(&ru->ru_utime);
+	rec.stime_us = timeval_us(&ru->ru_stime);
+	rec.maxrss_kb = ru->ru_maxrss;
+	rec.minflt = ru->ru_minflt;
+	rec.majflt = ru->ru_majflt;
+	rec.nvcsw = ru->ru_nvcsw;
+	rec.nivcsw = ru->ru_nivcsw;
+	if(s->relay.sock != -1) {
+		rec.bytes_in = s->relay.dirs[RELAY_IN].bytes;
+		rec.bytes_out = s->relay.dirs[RELAY_OUT].bytes;
+	}
+	else if(s->conn != -1) {
+		connection_byte_counts(s->conn, &rec.bytes_in, &rec.bytes_out);
+	}
+	rec.pid = s->pid;
+	rec.ip = ntohl(s->cli_addr.sin_addr.s_addr);
+	rec.port = ntohs(s->cli_addr.sin_port);
+	if(WIFSIGNALED(status)) {
+		rec.exit_kind = ACCT_SIGNALED;
+		rec.exit_value = WTERMSIG(status);
+	}
+	else {
+		rec.exit_kind = ACCT_EXITED;
+		rec.exit_value = WEXITSTATUS(status);
+	}
+	
+	/* Each record is appended with a single write(), so acceptors never interleave */
+	ssize_t written;
+	if(accounting_binary) {
+		written = write(accounting_fd, &rec, sizeof(rec));
+	}
+	else {
+		char line[512];
+		int len = snprintf(
+			line, sizeof(line),
+			"%llu.%06llu,%d,%u.%u.%u.%u,%u,%llu.%06llu,%s,%u,%llu.%06llu,%llu.%06llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			(unsigned long long)(rec.start_us / 1000000), (unsigned long long)(rec.start_us % 1000000),
+			rec.pid,
+			rec.ip>>24, (rec.ip>>16)&255, (rec.ip>>8)&255, rec.ip&255, rec.port,
+			(unsigned long long)(rec.duration_us / 1000000), (unsigned long long)(rec.duration_us % 1000000),
+			rec.exit_kind == ACCT_SIGNALED ? "signal" : "exit", rec.exit_value,
+			(unsigned long long)(rec.utime_us / 1000000), (unsigned long long)(rec.utime_us % 1000000),
+			(unsigned long long)(rec.stime_us / 1000000), (unsigned long long)(rec.stime_us % 1000000),
+			(unsigned long long)rec.maxrss_kb,
+			(unsigned long long)rec.minflt, (unsigned long long)rec.majflt,
+			(unsigned long long)rec.nvcsw, (unsigned long long)rec.nivcsw,
+			(unsigned long long)rec.bytes_in, (unsigned long long)rec.bytes_out
+		);
+		written = write(accounting_fd, line, len);
+	}
+	
+	if(written < 0) {
+		PERROR("write(accounting)");
+	}
+}
+
+/*! Records a session whose process has exited and removes it from the
+ * table of live sessions, freeing up its session slot.
+ */
+static void end_session(service* svc, unsigned index) {
+	session* s = &svc->sessions[index];
+	record_session_end(s, s->status);
+	if(accounting_fd != -1) {
+		write_accounting(s, s->status, &s->usage);
+	}
+	if(capture_fd != -1 && s->relay.sock != -1) {
+		write_capture(s, svc, CAPTURE_END, NULL, 0);
+	}
+	trace_session_end(s, svc->port);
+	if(s->conn != -1) {
+		close(s->conn);
+	}
+	relay_close(&s->relay);
+	
+	*s = svc->sessions[--svc->session_count];
+	release_session_slot();
+}
+
+/*! Ends the relayed sessions whose process has exited and whose output has
+ * all been passed on to the client.
+ * @return True if any sessions ended
+ */
+static bool end_drained_sessions(service* svc) {
+	bool ended = false;
+	unsigned i = svc->session_count;
+	while(i-- > 0) {
+		session* s = &svc->sessions[i];
+		if(s->exited && s->relay.sock != -1 && s->relay.dirs[RELAY_OUT].shut) {
+			end_session(svc, i);
+			ended = true;
+		}
+	}
+	return ended;
+}
+
+/*! Records that the process of a session has exited, and ends the session
+ * unless its output is still being relayed to the client.
+ */
+void session_exited(service* svc, unsigned index, int status, const struct rusage* ru) {
+	session* s = &svc->sessions[index];
+	s->exited = true;
+	s->status = status;
+	s->usage = *ru;
+	
+	/* Don't let anything the session left behind outlive it */
+	kill_session(s->pid);
+	
+	/* A relayed session lives on until its last output reaches the client */
+	if(s->relay.sock == -1 || s->relay.dirs[RELAY_OUT].shut) {
+		end_session(svc, index);
+	}
+}
+
+/*! Reaps all child processes that have exited, removing any of them that
+ * were running a session from its service's table of live sessions.
+ */
+static void reap_children(service* svcs, unsigned svc_count) {
+	pid_t pid;
+	int status;
+	struct rusage ru;
+	unsigned k;
+	while((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		service* svc = NULL;
+		unsigned i = 0;
+		for(k = 0; k < svc_count && svc == NULL; k++) {
+			for(i = 0; i < svcs[k].session_count; i++) {
+				if(svcs[k].sessions[i].pid == pid) {
+					svc = &svcs[k];
+					break;
+				}
+			}
+		}
+		
+		/* Idle pool workers, fork server templates and retired acceptors aren't sessions */
+		if(svc == NULL) {
+			forget_retired(pid);
+			for(k = 0; k < svc_count; k++) {
+				if(svcs[k].template_pid == pid) {
+					svcs[k].template_pid = -1;
+				}
+			}
+			continue;
+		}
+		
+		session_exited(svc, i, status, &ru);
+	}
+	
+	/* Sessions forked by a fork server's template are reaped by the template */
+	for(k = 0; handler_mode == SERVER_FORK_SERVER && k < svc_count; k++) {
+		reap_fork_server(&svcs[k]);
+	}
+	
+#ifdef __linux__
+	/* Clean up the cgroups of sessions that have ended */
+	reap_session_cgroups();
+#endif
+}
+
+/*! Sends a short message to a client if its socket has room for it right now.
+ * Never waiting on the client keeps one connection from stalling all others.
+ */
+void send_message(int conn, const char* message) {
+	int flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	
+	if(send(conn, message, strlen(message), flags) < 0) {
+		/* Don't care, the client can't be waited on anyway */
+	}
+}
+
+/*! Quickly tells a client that the server can't take its connection right
+ * now, and then hangs up on it.
+ */
+void reject_connection(int conn, const struct sockaddr_in* cli_addr, reject_reason reason) {
+	send_message(conn, "Server busy, please try again later.\n");
+	close(conn);
+	
+	STAT_ADD(rejected[reason], 1);
+	log_event(0, LOG_REJECTED, cli_addr, 0, "%s", reject_messages[reason]);
+}
+
+/*! Adds a session to the service's table once its process has been handed
+ * the connection, or else spawns a process for it.
+ * @param pid Process already handling the session, or -1 to spawn one
+ * @param session_conn Socket the session process talks on, which is the
+ *   connection unless relaying
+ * @param r Relay between the connection and session_conn when relaying
+ * @param trace_read Read end of the session's trace pipe, or -1
+ * @param pooled Whether the process is a pool worker
+ * @note This takes ownership of both sockets.
+ */
+void launch_session(service* svc, pid_t pid, int conn, int session_conn, relay* r,
+                    const struct sockaddr_in* cli_addr, conn_trace* trace, int trace_read, bool pooled) {
+	/* Handle the client connection in a subprocess */
+	if(pid == -1) {
+		int trace_pipe[2] = {-1, -1};
+		if(trace->id != 0) {
+			open_trace_pipe(trace_pipe);
+		}
+		pid = spawn_connection(svc, session_conn, cli_addr, trace, trace_pipe[1]);
+		if(trace_pipe[1] != -1) {
+			close(trace_pipe[1]);
+		}
+		trace_read = trace_pipe[0];
+	}
+	
+	if(relay_mode) {
+		close(session_conn);
+	}
+	
+	if(pid == -1 || !track_session(svc, pid, cli_addr)) {
+		release_session_slot();
+		if(trace_read != -1) {
+			close(trace_read);
+		}
+		if(relay_mode) {
+			relay_close(r);
+		}
+		if(pid == -1) {
+			reject_connection(conn, cli_addr, REJECT_SPAWN);
+			return;
+		}
+	}
+	else {
+		session* s = &svc->sessions[svc->session_count - 1];
+		s->trace = *trace;
+		s->trace_fd = trace_read;
+		s->pooled = pooled;
+		if(relay_mode) {
+			/* The server is the only one talking to the client */
+			s->conn = conn;
+			s->relay = *r;
+			if(capture_fd != -1) {
+				s->capture_id = __atomic_fetch_add(&shared->captured_sessions, 1, __ATOMIC_RELAXED);
+				write_capture(s, svc, CAPTURE_START, NULL, 0);
+			}
+			return;
+		}
+		else if(accounting_fd != -1) {
+			/* Hold on to the connection to read how many bytes went through it once the session ends */
+			s->conn = conn;
+			return;
+		}
+	}
+	
+	/* The session process has its own copy of the connection */
+	close(conn);
+}
+
+/*! Hands a connection to the fork server's template process, which forks a
+ * session for it. The session is added once the template answers, from the
+ * event loop.
+ * @return True if the template took the connection
+ * @note This takes ownership of both sockets if it succeeds.
+ */
+static bool fork_server_dispatch(service* svc, int conn, int session_conn, const relay* r,
+                                 const struct sockaddr_in* cli_addr, const conn_trace* trace) {
+	if(svc->template_chan == -1 || !svc->template_ready) {
+		return false;
+	}
+	
+	if(svc->handoff_count == svc->handoff_cap) {
+		unsigned cap = svc->handoff_cap ? svc->handoff_cap * 2 : 16;
+		fork_handoff* handoffs = realloc(svc->handoffs, cap * sizeof(*handoffs));
+		if(handoffs == NULL) {
+			PERROR("realloc");
+			return false;
+		}
+		svc->handoffs = handoffs;
+		svc->handoff_cap = cap;
+	}
+	
+	pool_handoff msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.cli_addr = *cli_addr;
+	if(!send_fd(svc->template_chan, session_conn, &msg, sizeof(msg))) {
+		return false;
+	}
+	
+	fork_handoff* h = &svc->handoffs[svc->handoff_count++];
+	h->conn = conn;
+	h->session_conn = session_conn;
+	if(relay_mode) {
+		h->r = *r;
+	}
+	h->cli_addr = *cli_addr;
+	h->trace = *trace;
+	clock_gettime(CLOCK_MONOTONIC, &h->sent);
+	return true;
+}
+
+/*! Starts a session for a connection that has already been given a session slot.
+ * @note This takes ownership of the connection socket.
+ */
+static void start_session(service* svc, int conn, const struct sockaddr_in* cli_addr, conn_trace* trace) {
+	pid_t pid = -1;
+	int trace_read = -1;
+	bool pooled = false;
+	
+	/* When relaying, the session gets one end of a socket pair instead of the connection */
+	relay r;
+	int session_conn = conn;
+	if(relay_mode && !relay_open(&r, conn, &session_conn)) {
+		release_session_slot();
+		reject_connection(conn, cli_addr, REJECT_SPAWN);
+		return;
+	}
+	
+	/* The session's own spans start with the handoff or fork */
+	if(trace->id != 0) {
+		trace->since = monotonic_ns();
+	}
+	
+	/* Fork the session from the fork server's template, which has already run the init function */
+	if(handler_mode == SERVER_FORK_SERVER) {
+		if(fork_server_dispatch(svc, conn, session_conn, &r, cli_addr, trace)) {
+			return;
+		}
+		log_event(0, LOG_MESSAGE, cli_addr, 0, "Fork server unavailable, spawning a process for this connection");
+	}
+	
+	/* Prefer handing the connection to an already running pool worker */
+	if(pool_size > 0) {
+		pid = pool_dispatch(svc, session_conn, cli_addr, &trace_read);
+		if(pid != -1) {
+			log_connection(pid, cli_addr);
+			pooled = true;
+		}
+		else {
+			/* No worker could take this connection, so fall back to fork/exec */
+			log_event(0, LOG_MESSAGE, cli_addr, 0, "Worker pool exhausted, spawning a process for this connection");
+		}
+	}
+	
+	launch_session(svc, pid, conn, session_conn, &r, cli_addr, trace, trace_read, pooled);
+}
+
+/*! Decides whether sessions of a service can start right now. A fork
+ * server's template must first finish running the init function, and
+ * connections wait until it has. Without a template, sessions are spawned.
+ */
+static bool sessions_can_start(const service* svc) {
+	return handler_mode != SERVER_FORK_SERVER || svc->template_chan == -1 || svc->template_ready;
+}
+
+/*! Starts a session for a connection now if there is a free session slot,
+ * otherwise puts it in the queue or turns it away when the queue is full.
+ * @note This takes ownership of the connection socket.
+ */
+void admit_session(service* svc, int conn, const struct sockaddr_in* cli_addr, conn_trace* trace) {
+	/* Connections must wait their turn behind those already in the queue */
+	if(svc->queue_len == 0 && sessions_can_start(svc) && reserve_session_slot()) {
+		start_session(svc, conn, cli_addr, trace);
+		return;
+	}
+	
+	if(svc->queue_len < queue_size) {
+		svc->queue[svc->queue_len].conn = conn;
+		svc->queue[svc->queue_len].cli_addr = *cli_addr;
+		svc->queue[svc->queue_len].trace = *trace;
+		svc->queue_len++;
+		STAT_ADD(queued, 1);
+		return;
+	}
+	
+	reject_connection(conn, cli_addr, REJECT_BUSY);
+}
+
+/*! Decides whether a newly accepted connection can start a session now,
+ * should wait in the queue for a free session slot, or must be turned away.
+ * Connections to a service with a proof of work or password must pass those first.
+ * @note This takes ownership of the connection socket.
+ */
+static void admit_connection(service* svc, int conn, const struct sockaddr_in* cli_addr, conn_trace* trace) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	uint32_t ip = cli_addr->sin_addr.s_addr;
+	if(!take_rate_token(svc, ip, &now)) {
+		reject_connection(conn, cli_addr, REJECT_RATE);
+		return;
+	}
+	
+	if(max_per_ip > 0 && count_from_ip(svc, ip) >= max_per_ip) {
+		reject_connection(conn, cli_addr, REJECT_PER_IP);
+		return;
+	}
+	
+	if(svc->password != NULL || svc->pow_bits > 0) {
+		begin_auth(svc, conn, cli_addr, trace);
+		return;
+	}
+	
+	admit_session(svc, conn, cli_addr, trace);
+}
+
+/*! Starts sessions for queued connections, oldest first, while there are
+ * session slots available.
+ */
+void admit_queued(service* svc) {
+	unsigned started = 0;
+	while(started < svc->queue_len && sessions_can_start(svc) && reserve_session_slot()) {
+		pending_conn* p = &svc->queue[started];
+		trace_step(&p->trace, svc->port, "queue");
+		start_session(svc, p->conn, &p->cli_addr, &p->trace);
+		started++;
+	}
+	
+	if(started > 0) {
+		__atomic_sub_fetch(&shared->queued, started, __ATOMIC_RELAXED);
+		svc->queue_len -= started;
+		memmove(&svc->queue[0], &svc->queue[started], svc->queue_len * sizeof(*svc->queue));
+	}
+}
+
+/*! Accepts a connection that is waiting on a service's listening socket. */
+static void accept_connection(service* svc) {
+	struct sockaddr_in cli_addr;
+	socklen_t cli_len = sizeof(cli_addr);
+	int conn = accept(svc->sock, (struct sockaddr*)&cli_addr, &cli_len);
+	if(conn == -1) {
+		STAT_ADD(accept_errors, 1);
+		PERROR("accept");
+		return;
+	}
+	
+	STAT_ADD(accepts, 1);
+	
+	/* Pool workers and other sessions spawned while the server still holds this must not inherit it */
+	if(fcntl(conn, F_SETFD, FD_CLOEXEC) != 0) {
+		PERROR("fcntl");
+		close(conn);
+		return;
+	}
+#ifndef __linux__
+	tune_socket(conn, false);
+#endif
+	
+	conn_trace trace;
+	trace_accept(&trace, svc->port, conn, &cli_addr);
+	admit_connection(svc, conn, &cli_addr, &trace);
+}
+
+/*! Adds a service's poll entries: its listening socket, its metrics socket,
+ * its fork server's channel, its metrics clients, its authenticating
+ * connections, and two entries per session when relaying.
+ * @return Number of entries added
+ */
+static unsigned service_poll_fds(service* svc, struct pollfd* fds) {
+	unsigned nfds = 0;
+	
+	/* New connections wait in the backlog until the fork server's template is ready */
+	fds[nfds].fd = sessions_can_start(svc) ? svc->sock : -1;
+	fds[nfds].events = POLLIN;
+	nfds++;
+	fds[nfds].fd = svc->metrics_sock;
+	fds[nfds].events = POLLIN;
+	nfds++;
+	fds[nfds].fd = svc->template_chan;
+	fds[nfds].events = POLLIN;
+	nfds++;
+	
+	/* Metrics clients waiting to send their request */
+	unsigned j;
+	for(j = 0; j < svc->metrics_client_count; j++) {
+		fds[nfds].fd = svc->metrics_clients[j];
+		fds[nfds].events = POLLIN;
+		nfds++;
+	}
+	
+	/* Clients that haven't finished authenticating */
+	for(j = 0; j < svc->auth_count; j++) {
+		fds[nfds].fd = svc->auths[j].conn;
+		fds[nfds].events = POLLIN;
+		nfds++;
+	}
+	
+	/* Traffic of relayed sessions, in session table order */
+	if(relay_mode) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for(j = 0; j < svc->session_count; j++) {
+			session* s = &svc->sessions[j];
+			relay_refill(&s->relay, &now);
+			relay_poll_fds(s, &fds[nfds], &fds[nfds + 1]);
+			nfds += 2;
+		}
+	}
+	
+	return nfds;
+}
+
+/*! Handles the fork server's template, authenticating clients, new
+ * connections and metrics requests for a service after poll().
+ */
+static void serve_ready(service* svc, const struct pollfd* fds) {
+	if(fds[2].revents != 0 && !serve_fork_server(svc)) {
+		fork_server_lost(svc, "exited");
+	}
+	
+	/* Before accepting, which may add more clients that must authenticate */
+	serve_auths(svc, &fds[3 + svc->metrics_client_count]);
+	
+	if(fds[0].revents & POLLIN) {
+		accept_connection(svc);
+	}
+	
+	/* Answer metrics clients whose request has arrived, oldest first */
+	unsigned answered = 0;
+	unsigned j;
+	for(j = 0; j < svc->metrics_client_count; j++) {
+		if(fds[3 + j].revents != 0) {
+			serve_metrics_client(svc->metrics_clients[j]);
+			svc->metrics_clients[j] = -1;
+			answered++;
+		}
+		else if(answered > 0) {
+			svc->metrics_clients[j - answered] = svc->metrics_clients[j];
+		}
+	}
+	svc->metrics_client_count -= answered;
+	
+	if(fds[1].revents & POLLIN) {
+		accept_metrics_client(svc);
+	}
+}
+
+/*! Gets rid of an idle pool worker, which no connection will be handed to. */
+void retire_pool_worker(pool_worker* worker) {
+	if(worker->chan == -1) {
+		return;
+	}
+	
+	close(worker->chan);
+	worker->chan = -1;
+	if(worker->trace_fd != -1) {
+		close(worker->trace_fd);
+		worker->trace_fd = -1;
+	}
+	kill_session(worker->pid);
+}
+
+/*! Stops accepting connections, so that this process exits once it has no
+ * more sessions. When shutting down on SIGTERM, clients that haven't started
+ * a session are hung up on, and sessions get drain_timeout seconds to finish.
+ * An acceptor that retires after its server was re-exec'd lets all of them
+ * finish instead, as the new server is already taking new connections.
+ */
+static void begin_drain(service* svcs, unsigned svc_count, bool shutdown) {
+	unsigned sessions = 0;
+	unsigned k, j;
+	for(k = 0; k < svc_count; k++) {
+		service* svc = &svcs[k];
+		sessions += svc->session_count;
+		if(draining) {
+			continue;
+		}
+		
+		/* Any server taking over keeps its own copies of the listening sockets open */
+		if(svc->sock != -1) {
+			close(svc->sock);
+			svc->sock = -1;
+		}
+		if(svc->metrics_sock != -1) {
+			close(svc->metrics_sock);
+			svc->metrics_sock = -1;
+		}
+		
+		for(j = 0; svc->pool != NULL && j < pool_size; j++) {
+			retire_pool_worker(&svc->pool[j]);
+		}
+		fork_server_stop(svc);
+	}
+	
+	if(!draining) {
+		/* Queued connections that still get a session are forked for it */
+		pool_size = 0;
+		draining = true;
+	}
+	
+	if(!shutdown) {
+		log_event(0, LOG_MESSAGE, NULL, 0, "Retiring, with %u sessions left to finish", sessions);
+		return;
+	}
+	
+	for(k = 0; k < svc_count; k++) {
+		service* svc = &svcs[k];
+		for(j = 0; j < svc->queue_len; j++) {
+			send_message(svc->queue[j].conn, "Server shutting down, please try again later.\n");
+			close(svc->queue[j].conn);
+		}
+		__atomic_sub_fetch(&shared->queued, svc->queue_len, __ATOMIC_RELAXED);
+		svc->queue_len = 0;
+		
+		for(j = 0; j < svc->auth_count; j++) {
+			send_message(svc->auths[j].conn, "\nServer shutting down, please try again later.\n");
+			close(svc->auths[j].conn);
+		}
+		svc->auth_count = 0;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &drain_deadline);
+	drain_deadline.tv_sec += drain_timeout;
+	shutting_down = true;
+	log_event(0, LOG_MESSAGE, NULL, 0, "Shutting down, giving %u sessions up to %u seconds to finish", sessions, drain_timeout);
+}
+
+/*! Kills the sessions of a server that is shutting down once the drain
+ * deadline has passed.
+ * @return True once the process has nothing left to wait for
+ */
+static bool finish_drain(service* svcs, unsigned svc_count) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bool kill_all = shutting_down && !drain_killed && elapsed_seconds(&drain_deadline, &now) >= 0;
+	bool done = true;
+	
+	unsigned k, j;
+	for(k = 0; k < svc_count; k++) {
+		service* svc = &svcs[k];
+		if(svc->session_count > 0 || svc->queue_len > 0 || svc->auth_count > 0) {
+			done = false;
+		}
+		
+		for(j = 0; kill_all && j < svc->session_count; j++) {
+			session* s = &svc->sessions[j];
+			if(s->exited) {
+				/* Stop waiting on a client that isn't reading the last of its output */
+				relay_abandon(&s->relay);
+			}
+			else if(!s->killed) {
+				log_event(s->pid, LOG_TIMEOUT, &s->cli_addr, 0, "Server shut down before the session ended");
+				kill_session(s->pid);
+				s->killed = true;
+			}
+		}
+	}
+	
+	if(kill_all) {
+		drain_killed = true;
+	}
+	return done;
+}
+
+/*! Accepts connections on the listening sockets of the given services
+ * forever, spawning a challenge process for each one that is admitted.
+ * @return Exit code for the server process, as this only returns on error
+ */
+static int accept_loop(service* svcs, unsigned svc_count) {
+	/* Child exits are delivered to the event loop through a self-pipe */
+	if(!open_wake_pipe()) {
+		return EXIT_FAILURE;
+	}
+	
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &handle_chld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGCHLD, &sa, NULL) != 0) {
+		PERROR("sigaction");
+		return EXIT_FAILURE;
+	}
+	
+	unsigned k;
+	for(k = 0; k < svc_count; k++) {
+		service* svc = &svcs[k];
+		svc->buckets = calloc(RATE_BUCKETS, sizeof(*svc->buckets));
+		svc->queue = calloc(queue_size + 1, sizeof(*svc->queue));
+		svc->auths = calloc(svc->password != NULL || svc->pow_bits > 0 ? AUTH_PENDING_MAX : 1, sizeof(*svc->auths));
+		if(svc->buckets == NULL || svc->queue == NULL || svc->auths == NULL) {
+			PERROR("calloc");
+			return EXIT_FAILURE;
+		}
+		
+		/* Only sessions that report on it get a trace pipe, so nothing else can forge reports.
+		 * Handlers built into the server always do, and exec'd programs only when told so.
+		 */
+		svc->trace_reports = trace_fd != -1 && (svc->exec_prog == NULL || svc->trace_reports);
+		
+		/* Spawn the initial pool of pre-exec'd workers */
+		if(pool_size > 0 && !pool_init(svc)) {
+			return EXIT_FAILURE;
+		}
+		
+		/* Start the fork server's template, which every session is forked from */
+		svc->template_pid = -1;
+		svc->template_chan = -1;
+		svc->template_exits = -1;
+		if(handler_mode == SERVER_FORK_SERVER && !fork_server_spawn(svc)) {
+			return EXIT_FAILURE;
+		}
+	}
+	
+#ifdef PR_SET_CHILD_SUBREAPER
+	/* Sessions of a fork server's template become our children if the template exits first */
+	if(handler_mode == SERVER_FORK_SERVER && prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+		PERROR("prctl(PR_SET_CHILD_SUBREAPER)");
+		return EXIT_FAILURE;
+	}
+#endif
+	
+	/* Take over the sessions of the server that re-exec'd this one, some of
+	 * which may have exited while it was exec-ing
+	 */
+	adopt_inherited_tables(svcs, svc_count);
+	reap_children(svcs, svc_count);
+	
+	/* A relay's socket errors must be seen as errors rather than kill the server */
+	if(relay_mode) {
+		signal(SIGPIPE, SIG_IGN);
+	}
+	
+	/* Each service's listening socket, in case the server re-execs itself */
+	int* socks = calloc(svc_count, sizeof(*socks));
+	
+	/* Where each service's entries start in the poll set */
+	unsigned* bases = calloc(svc_count, sizeof(*bases));
+	unsigned fds_cap = 1 + svc_count * (3 + METRICS_CLIENTS_MAX);
+	struct pollfd* fds = calloc(fds_cap, sizeof(*fds));
+	if(socks == NULL || bases == NULL || fds == NULL) {
+		PERROR("calloc");
+		return EXIT_FAILURE;
+	}
+	for(k = 0; k < svc_count; k++) {
+		socks[k] = svcs[k].sock;
+	}
+	
+	while(1) {
+		/* Act on SIGTERM and SIGHUP here rather than in the signal handler */
+		if(stop_requested && !shutting_down) {
+			begin_drain(svcs, svc_count, true);
+		}
+		if(upgrade_requested) {
+			upgrade_requested = 0;
+			if(is_acceptor) {
+				begin_drain(svcs, svc_count, false);
+			}
+			else if(!draining) {
+				upgrade_server(svcs, svc_count, socks, svc_count);
+			}
+		}
+		if(draining && finish_drain(svcs, svc_count)) {
+			return EXIT_SUCCESS;
+		}
+		
+		/* Authenticating clients add their connection, and relayed
+		 * sessions each add their client connection and challenge socket
+		 */
+		unsigned needed = 1 + svc_count * (3 + METRICS_CLIENTS_MAX);
+		for(k = 0; k < svc_count; k++) {
+			needed += svcs[k].auth_count;
+			if(relay_mode) {
+				needed += 2 * svcs[k].session_count;
+			}
+		}
+		if(needed > fds_cap) {
+			struct pollfd* new_fds = realloc(fds, needed * sizeof(*fds));
+			if(new_fds == NULL) {
+				PERROR("realloc");
+				return EXIT_FAILURE;
+			}
+			fds = new_fds;
+			fds_cap = needed;
+		}
+		
+		fds[0].fd = sigchld_pipe[0];
+		fds[0].events = POLLIN;
+		unsigned nfds = 1;
+		for(k = 0; k < svc_count; k++) {
+			bases[k] = nfds;
+			nfds += service_poll_fds(&svcs[k], &fds[nfds]);
+		}
+		
+		/* Negative fds (like a disabled metrics socket) are ignored by poll().
+		 * Wake up in time to enforce the nearest session deadline.
+		 */
+		if(poll(fds, nfds, next_limit_check_ms(svcs, svc_count)) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			PERROR("poll");
+			return EXIT_FAILURE;
+		}
+		
+		/* Move relayed traffic before anything can change the session tables */
+		for(k = 0; relay_mode && k < svc_count; k++) {
+			service* svc = &svcs[k];
+			const struct pollfd* relay_fds = &fds[bases[k] + 3 + svc->metrics_client_count + svc->auth_count];
+			unsigned j;
+			for(j = 0; j < svc->session_count; j++) {
+				relay_session(svc, &svc->sessions[j], &relay_fds[2 * j], &relay_fds[2 * j + 1]);
+			}
+		}
+		
+		/* Kill sessions that have exceeded their time limits */
+		bool ended = false;
+		for(k = 0; k < svc_count; k++) {
+			enforce_session_limits(&svcs[k]);
+			enforce_fork_server_deadline(&svcs[k]);
+			if(relay_mode && end_drained_sessions(&svcs[k])) {
+				ended = true;
+			}
+		}
+		
+		if(fds[0].revents & POLLIN) {
+			char buf[64];
+			while(read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+				/* Just draining the pipe */
+			}
+			
+			reap_children(svcs, svc_count);
+			ended = true;
+		}
+		
+		/* Sessions have ended, so make room for the ones waiting in the queues */
+		for(k = 0; ended && k < svc_count; k++) {
+			admit_queued(&svcs[k]);
+		}
+		
+		for(k = 0; k < svc_count; k++) {
+			serve_ready(&svcs[k], &fds[bases[k]]);
+		}
+		
+		/* Replace the pool workers that were just handed connections */
+		for(k = 0; k < svc_count; k++) {
+			pool_refill(&svcs[k]);
+		}
+	}
+}
+
+/*! Sets a socket option for the TCP tuning profile. Listening sockets are
+ * tuned before standard error has been moved, and connections after.
+ * @return True on success
+ */
+static bool set_tcp_option(int sock, bool listening, int level, int name, int value, const char* what) {
+	if(setsockopt(sock, level, name, &value, sizeof(value)) != 0) {
+		if(listening) {
+			perror(what);
+		}
+		else {
+			PERROR(what);
+		}
+		return false;
+	}
+	return true;
+}
+
+/*! Applies the TCP tuning profile (--tcp-profile and friends) to a socket.
+ * Listening sockets get all of it, and on Linux each accepted connection starts
+ * out with a copy of the listener's options, so nothing needs to be done per
+ * connection. Elsewhere, accepted connections are tuned one at a time.
+ * @return True on success
+ */
+bool tune_socket(int sock, bool listening) {
+	bool ok = true;
+	if(listening && tcp_defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_DEFER_ACCEPT, tcp_defer_accept, "setsockopt(TCP_DEFER_ACCEPT)");
+#else
+		fprintf(stderr, "Error: TCP_DEFER_ACCEPT is not supported on this platform.\n");
+		ok = false;
+#endif
+	}
+	if(listening && tcp_fastopen > 0) {
+#ifdef TCP_FASTOPEN
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_FASTOPEN, tcp_fastopen, "setsockopt(TCP_FASTOPEN)");
+#else
+		fprintf(stderr, "Error: TCP_FASTOPEN is not supported on this platform.\n");
+		ok = false;
+#endif
+	}
+	
+	/* The receive buffer must be sized before listen() for the kernel to pick a large enough window scale */
+	if(tcp_sndbuf > 0) {
+		ok &= set_tcp_option(sock, listening, SOL_SOCKET, SO_SNDBUF, tcp_sndbuf, "setsockopt(SO_SNDBUF)");
+	}
+	if(tcp_rcvbuf > 0) {
+		ok &= set_tcp_option(sock, listening, SOL_SOCKET, SO_RCVBUF, tcp_rcvbuf, "setsockopt(SO_RCVBUF)");
+	}
+	if(tcp_nodelay) {
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt(TCP_NODELAY)");
+	}
+	
+	/* Probe every third of the idle time, and give up after three unanswered probes */
+	int interval = tcp_keepalive >= 3 ? tcp_keepalive / 3 : 1;
+	int probes = 3;
+	if(tcp_keepalive > 0) {
+		ok &= set_tcp_option(sock, listening, SOL_SOCKET, SO_KEEPALIVE, 1, "setsockopt(SO_KEEPALIVE)");
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_KEEPIDLE, tcp_keepalive, "setsockopt(TCP_KEEPIDLE)");
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_KEEPINTVL, interval, "setsockopt(TCP_KEEPINTVL)");
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_KEEPCNT, probes, "setsockopt(TCP_KEEPCNT)");
+#elif defined(TCP_KEEPALIVE)
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_KEEPALIVE, tcp_keepalive, "setsockopt(TCP_KEEPALIVE)");
+#endif
+	}
+	
+	/* Unless told otherwise, drop stuck writes as soon as keepalive would drop an idle connection */
+	int user_timeout = tcp_user_timeout;
+	if(user_timeout < 0) {
+		user_timeout = tcp_keepalive > 0 ? tcp_keepalive + interval * probes : 0;
+	}
+	if(user_timeout > 0) {
+#ifdef TCP_USER_TIMEOUT
+		ok &= set_tcp_option(sock, listening, IPPROTO_TCP, TCP_USER_TIMEOUT, user_timeout * 1000, "setsockopt(TCP_USER_TIMEOUT)");
+#else
+		if(listening && tcp_user_timeout > 0) {
+			fprintf(stderr, "Error: TCP_USER_TIMEOUT is not supported on this platform.\n");
+			ok = false;
+		}
+#endif
+	}
+	
+	return ok;
+}
+
+/*! Choices made by a named TCP tuning profile. Buffer sizes and the user
+ * timeout are always left to the kernel and to --keepalive.
+ */
+typedef struct tcp_profile {
+	const char* name;
+	int backlog;
+	int defer_accept;
+	int fastopen;
+	bool nodelay;
+	int keepalive;
+} tcp_profile;
+
+static const tcp_profile tcp_profiles[] = {
+	/* Leaves everything to the kernel */
+	{"default", 128, 0, 0, false, 0},
+	/* Menu-driven challenges answer each line right away, and dead clients are noticed within two minutes */
+	{"interactive", 128, 0, 0, true, 60},
+	/* During a rush of connections, don't turn clients away or keep sessions for dead clients as long */
+	{"busy", 1024, 0, 256, true, 30},
+};
+
+/*! Looks up one of the named TCP tuning profiles.
+ * @return The profile, or NULL if there is none by that name
+ */
+static const tcp_profile* find_tcp_profile(const char* name) {
+	size_t i;
+	for(i = 0; name != NULL && i < ARRAYSIZE(tcp_profiles); i++) {
+		if(strcmp(tcp_profiles[i].name, name) == 0) {
+			return &tcp_profiles[i];
+		}
+	}
+	return NULL;
+}
+
+/*! Applies a TCP tuning profile to every option that wasn't given explicitly,
+ * so --tcp-profile may come before or after the options it presets.
+ */
+static void apply_tcp_profile(const tcp_profile* profile) {
+	if(!(tcp_options_set & TCP_SET_BACKLOG)) {
+		listen_backlog = profile->backlog;
+	}
+	if(!(tcp_options_set & TCP_SET_DEFER_ACCEPT)) {
+		tcp_defer_accept = profile->defer_accept;
+	}
+	if(!(tcp_options_set & TCP_SET_FASTOPEN)) {
+		tcp_fastopen = profile->fastopen;
+	}
+	if(!(tcp_options_set & TCP_SET_NODELAY)) {
+		tcp_nodelay = profile->nodelay;
+	}
+	if(!(tcp_options_set & TCP_SET_KEEPALIVE)) {
+		tcp_keepalive = profile->keepalive;
+	}
+}
+
+/*! Creates a socket listening for incoming connections on the given port.
+ * @return The listening socket, or -1 on error
+ */
+static int create_listener(unsigned short port) {
+	/* Create socket */
+	int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sock == -1) {
+		perror("socket");
+		return -1;
+	}
+	
+	/* Challenge processes must never inherit the listening socket */
+	if(fcntl(sock, F_SETFD, FD_CLOEXEC) != 0) {
+		perror("fcntl");
+		close(sock);
+		return -1;
+	}
+	
+	/* Allow socket to reuse the serv_addr */
+	int reuse = 1;
+	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0) {
+		perror("setsockopt");
+		close(sock);
+		return -1;
+	}
+	
+	/* Multiple acceptors each bind their own socket to the same port */
+	if(acceptor_count > 1) {
+#ifdef SO_REUSEPORT
+		if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+			perror("setsockopt(SO_REUSEPORT)");
+			close(sock);
+			return -1;
+		}
+#else
+		fprintf(stderr, "Error: SO_REUSEPORT is not supported on this platform.\n");
+		close(sock);
+		return -1;
+#endif
+	}
+	
+	struct sockaddr_in serv_addr;
+	
+	/* Allow incoming connections from anywhere */
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	serv_addr.sin_port = htons(port);
+	
+	/* Bind to port */
+	if(bind(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+	
+	if(!tune_socket(sock, true)) {
+		close(sock);
+		return -1;
+	}
+	
+	/* Listen for connections, with a configurable maximum backlog of connections to accept */
+	if(listen(sock, listen_backlog) != 0) {
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+	
+	return sock;
+}
+
+/*! Attaches a classic BPF program to the SO_REUSEPORT group that decides which
+ * acceptor's socket receives each incoming connection.
+ * @return True on success
+ */
+static bool attach_steering(int sock) {
+#ifdef __linux__
+	struct sock_filter code[] = {
+		/* A = CPU handling the packet, or the packet's IPv4 source address */
+		steer_mode == STEER_CPU
+			? (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU)
+			: (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		/* A %= number of acceptors */
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, acceptor_count),
+		/* Return A as the index of the socket within the group */
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog;
+	prog.len = ARRAYSIZE(code);
+	prog.filter = code;
+	
+	if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+		return false;
+	}
+	
+	return true;
+#else
+	(void)sock;
+	fprintf(stderr, "Error: Steering connections is only supported on Linux.\n");
+	return false;
+#endif
+}
+
+/*! Pins the calling acceptor process to one of the CPUs it is allowed to run on. */
+static void pin_acceptor(unsigned index) {
+#ifdef __linux__
+	int cpu_count = CPU_COUNT(&allowed_cpus);
+	if(cpu_count <= 0) {
+		return;
+	}
+	
+	/* Find the (index % cpu_count)-th allowed CPU */
+	int target = index % cpu_count;
+	int cpu;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu, &allowed_cpus) && target-- == 0) {
+			break;
+		}
+	}
+	
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set) != 0) {
+		PERROR("sched_setaffinity");
+	}
+#else
+	(void)index;
+#endif
+}
+
+/*! Forks an acceptor process that serves connections from one socket of the group.
+ * @return Process ID of the acceptor, or -1 on error
+ */
+static pid_t spawn_acceptor(service* svcs, unsigned svc_count, int* socks, unsigned index) {
+	pid_t pid = fork();
+	if(pid < 0) {
+		PERROR("fork");
+		return -1;
+	}
+	else if(pid == 0) {
+		/* Only the supervisor is responsible for the other acceptors */
+		acceptor_pids = NULL;
+		retired_pids = NULL;
+		retired_count = 0;
+		is_acceptor = true;
+		
+		/* Each acceptor only keeps its own socket from each service's group */
+		unsigned i;
+		for(i = 0; i < acceptor_count * svc_count; i++) {
+			if(i / svc_count != index) {
+				close(socks[i]);
+			}
+		}
+		for(i = 0; i < svc_count; i++) {
+			svcs[i].sock = socks[index * svc_count + i];
+		}
+		
+		if(index != 0 && svcs[0].metrics_sock != -1) {
+			close(svcs[0].metrics_sock);
+			svcs[0].metrics_sock = -1;
+		}
+		
+		if(pin_cpus) {
+			pin_acceptor(index);
+		}
+		
+		_exit(accept_loop(svcs, svc_count));
+	}
+	
+	return pid;
+}
+
+/*! Supervises a group of acceptor processes that all listen on the same port,
+ * restarting any that die.
+ * @return Exit code for the server process, as this only returns on error
+ */
+static int run_acceptors(service* svcs, unsigned svc_count, int* socks) {
+	acceptor_pids = calloc(acceptor_count, sizeof(*acceptor_pids));
+	if(acceptor_pids == NULL) {
+		PERROR("calloc");
+		return EXIT_FAILURE;
+	}
+	
+	unsigned i;
+	for(i = 0; i < acceptor_count; i++) {
+		acceptor_pids[i] = spawn_acceptor(svcs, svc_count, socks, i);
+		if(acceptor_pids[i] == -1) {
+			return EXIT_FAILURE;
+		}
+	}
+	
+	while(1) {
+		/* The acceptors retire once the re-exec'd supervisor has started new ones */
+		if(upgrade_requested) {
+			upgrade_requested = 0;
+			if(!stop_requested) {
+				upgrade_server(svcs, svc_count, socks, acceptor_count * svc_count);
+			}
+		}
+		
+		/* When shutting down, wait for every acceptor to finish draining */
+		if(stop_requested) {
+			bool running = false;
+			for(i = 0; i < acceptor_count; i++) {
+				running = running || acceptor_pids[i] > 0;
+			}
+			for(i = 0; i < retired_count; i++) {
+				running = running || retired_pids[i] > 0;
+			}
+			if(!running) {
+				return EXIT_SUCCESS;
+			}
+		}
+		
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if(pid == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			PERROR("waitpid");
+			return EXIT_FAILURE;
+		}
+		
+		forget_retired(pid);
+		for(i = 0; i < acceptor_count; i++) {
+			if(acceptor_pids[i] == pid) {
+				break;
+			}
+		}
+		if(i == acceptor_count) {
+			continue;
+		}
+		
+		if(stop_requested) {
+			acceptor_pids[i] = 0;
+			continue;
+		}
+		
+		log_event(pid, LOG_ERROR, NULL, 0, "Acceptor %u died, restarting it", i);
+		
+		/* Don't spin if acceptors are failing immediately */
+		sleep(1);
+		acceptor_pids[i] = spawn_acceptor(svcs, svc_count, socks, i);
+		if(acceptor_pids[i] == -1) {
+			return EXIT_FAILURE;
+		}
+	}
+}
+
+/*! Looks up a user, keeping a private copy of the parts of its passwd entry
+ * that the server uses, as getpwnam() reuses its storage on every call.
+ * @return The user's passwd entry, or NULL on error
+ */
+static struct passwd* lookup_user(const char* user) {
+	struct passwd* found = getpwnam(user);
+	if(found == NULL) {
+		fprintf(stderr, "Error: Couldn't find user '%s'.\n", user);
+		return NULL;
+	}
+	
+	struct passwd* pw = malloc(sizeof(*pw));
+	if(pw == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	
+	*pw = *found;
+	pw->pw_passwd = NULL;
+	pw->pw_gecos = NULL;
+	pw->pw_shell = NULL;
+	pw->pw_name = strdup(found->pw_name);
+	pw->pw_dir = strdup(found->pw_dir);
+	if(pw->pw_name == NULL || pw->pw_dir == NULL) {
+		perror("strdup");
+		return NULL;
+	}
+	
+	return pw;
+}
+
+/*! Strips whitespace from both ends of a string in place. */
+static char* trim(char* str) {
+	while(*str == ' ' || *str == '\t') {
+		str++;
+	}
+	
+	size_t len = strlen(str);
+	while(len > 0 && (str[len - 1] == ' ' || str[len - 1] == '\t' || str[len - 1] == '\n' || str[len - 1] == '\r')) {
+		str[--len] = '\0';
+	}
+	return str;
+}
+
+/*! Checks that a service from the config file has everything it needs and
+ * looks up the user it runs as.
+ * @return True if the service is complete
+ */
+static bool finish_service(service* svc, const char* name, const char* user) {
+	if(svc->port == 0) {
+		fprintf(stderr, "Error: Service [%s] has no port.\n", name);
+		return false;
+	}
+	
+	if(svc->exec_prog == NULL) {
+		fprintf(stderr, "Error: Service [%s] has no program to exec.\n", name);
+		return false;
+	}
+	
+	svc->pw = lookup_user(user);
+	return svc->pw != NULL;
+}
+
+/*! Reads the services to host from a config file. Each service starts with
+ * a "[name]" line, followed by "key = value" lines:
+ *
+ *     [stack0]
+ *     port = 32101
+ *     user = stack0
+ *     exec = /home/stack0/stack0
+ *     arg = --verbose
+ *     timelimit = 30
+ *     password = hunter2
+ *     pow = 20
+ *     inject = /home/stack0/preload.so
+ *     chroot = yes
+ *     tracereports = yes
+ *
+ * "arg" may be repeated, once per argument. Only "port" and "exec" are
+ * required; the others default to the command line's options. An empty
+ * "password" or "inject" turns off the command line's for that service.
+ * "tracereports" is like --trace-reports, for a program built with
+ * COALESCED_STDIO.
+ * @return True on success
+ */
+static bool load_services(
+	const char* path,
+	const char* default_user,
+	bool default_chroot,
+	unsigned default_timeout,
+	const char* default_password,
+	const char* default_inject,
+	service** out_svcs,
+	unsigned* out_count
+) {
+	FILE* fp = fopen(path, "r");
+	if(fp == NULL) {
+		perror(path);
+		return false;
+	}
+	
+	service* svcs = NULL;
+	unsigned count = 0;
+	service* svc = NULL;
+	char* name = NULL;
+	const char* user = default_user;
+	char line[1024];
+	unsigned lineno = 0;
+	bool ok = true;
+	
+	while(ok && fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		char* str = trim(line);
+		if(str[0] == '\0' || str[0] == '#') {
+			continue;
+		}
+		
+		/* Start of a new service */
+		if(str[0] == '[') {
+			char* end = strchr(str, ']');
+			if(end == NULL) {
+				fprintf(stderr, "Error: %s:%u: Missing ']'.\n", path, lineno);
+				ok = false;
+				break;
+			}
+			*end = '\0';
+			
+			if(svc != NULL && !finish_service(svc, name, user)) {
+				ok = false;
+				break;
+			}
+			
+			service* new_svcs = realloc(svcs, (count + 1) * sizeof(*svcs));
+			name = strdup(str + 1);
+			if(new_svcs == NULL || name == NULL) {
+				perror("realloc");
+				ok = false;
+				break;
+			}
+			svcs = new_svcs;
+			svc = &svcs[count++];
+			memset(svc, 0, sizeof(*svc));
+			svc->timeout = default_timeout;
+			svc->password = default_password;
+			svc->pow_bits = pow_bits;
+			svc->inject_lib = default_inject;
+			svc->chroot_sessions = default_chroot;
+			svc->trace_reports = exec_reports_trace;
+			svc->metrics_sock = -1;
+			user = default_user;
+			continue;
+		}
+		
+		char* eq = strchr(str, '=');
+		if(eq == NULL || svc == NULL) {
+			fprintf(stderr, "Error: %s:%u: Expected \"[name]\" or \"key = value\".\n", path, lineno);
+			ok = false;
+			break;
+		}
+		*eq = '\0';
+		char* key = trim(str);
+		char* value = strdup(trim(eq + 1));
+		if(value == NULL) {
+			perror("strdup");
+			ok = false;
+			break;
+		}
+		
+		if(strcmp(key, "port") == 0) {
+			svc->port = atoi(value);
+		}
+		else if(strcmp(key, "user") == 0) {
+			user = value;
+		}
+		else if(strcmp(key, "exec") == 0) {
+			svc->exec_prog = value;
+		}
+		else if(strcmp(key, "arg") == 0) {
+			/* Like the command line, argv[0] is a "--" placeholder and the array ends with NULL */
+			unsigned argc = svc->child_argc ? svc->child_argc : 1;
+			char** argv = realloc(svc->child_argv, (argc + 2) * sizeof(*argv));
+			if(argv == NULL) {
+				perror("realloc");
+				ok = false;
+				break;
+			}
+			argv[0] = "--";
+			argv[argc++] = value;
+			argv[argc] = NULL;
+			svc->child_argv = argv;
+			svc->child_argc = argc;
+		}
+		else if(strcmp(key, "timelimit") == 0) {
+			svc->timeout = atoi(value);
+		}
+		else if(strcmp(key, "password") == 0) {
+			svc->password = value[0] != '\0' ? value : NULL;
+		}
+		else if(strcmp(key, "pow") == 0) {
+			svc->pow_bits = atoi(value);
+		}
+		else if(strcmp(key, "inject") == 0) {
+			svc->inject_lib = value[0] != '\0' ? value : NULL;
+		}
+		else if(strcmp(key, "chroot") == 0) {
+			svc->chroot_sessions = strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0;
+		}
+		else if(strcmp(key, "tracereports") == 0) {
+			svc->trace_reports = strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0;
+		}
+		else {
+			fprintf(stderr, "Error: %s:%u: Unknown key '%s'.\n", path, lineno, key);
+			ok = false;
+		}
+	}
+	fclose(fp);
+	
+	if(ok && svc == NULL) {
+		fprintf(stderr, "Error: %s: No services defined.\n", path);
+		ok = false;
+	}
+	if(ok && !finish_service(svc, name, user)) {
+		ok = false;
+	}
+	if(!ok) {
+		return false;
+	}
+	
+	*out_svcs = svcs;
+	*out_count = count;
+	return true;
+}
+
+static int serve_internal(
+	const char* user,
+	bool chrooted,
+	unsigned short port,
+	unsigned timeout,
+	conn_handler* handler,
+	const char* inject_lib,
+	const char* exec_prog,
+	int child_argc,
+	char** child_argv
+) {
+	if(handler == NULL && exec_prog == NULL && config_path == NULL) {
+		fprintf(stderr, "Handler function pointer is NULL and no program to exec was provided!\n");
+		return EXIT_FAILURE;
+	}
+	
+	/* 
+	 * For exec-ing servers, check for a marker environment variable.
+	 * If this is set, that means we have just been exec-ed to handle
+	 * a client connection. Therefore, instead of starting up the socket
+	 * server, just call the connection handler.
+	 */
+	char* marker = getenv(kEnvMarker);
+	if(marker != NULL || skipListen || pool_conn != -1) {
+		/* Make sure these standard output streams are not buffered */
+		setvbuf(stdout, NULL, _IONBF, 0);
+		setvbuf(stderr, NULL, _IONBF, 0);
+		
+		report_trace_ready();
+		
+		/* Without a fork server, each connection's process sets up the challenge for itself */
+		if(init_hook != NULL) {
+			init_hook();
+		}
+		
+		/* Invoke actual challenge function */
+		if(pool_conn != -1) {
+			handler(pool_conn);
+		}
+		else {
+			handler(skipListen ? 0 : atoi(marker));
+		}
+		return EXIT_SUCCESS;
+	}
+	
+	/* Fork server sessions are forked from a template that's already deprivileged */
+	challenge_handler = handler;
+	if(handler_mode == SERVER_FORK_SERVER) {
+		if(handler == NULL || exec_prog != NULL || config_path != NULL) {
+			fprintf(stderr, "Error: Fork server mode only runs a handler function, not a program or config file.\n");
+			return EXIT_FAILURE;
+		}
+		if(pid_namespaces || session_workdir != NULL) {
+			fprintf(stderr, "Error: PID namespaces and session workdirs aren't supported in fork server mode.\n");
+			return EXIT_FAILURE;
+		}
+#ifndef __linux__
+		fprintf(stderr, "Error: Fork server mode is only supported on Linux.\n");
+		return EXIT_FAILURE;
+#endif
+		
+		pool_size = 0;
+	}
+	
+	/* Threaded handlers run within the server, with nothing between them and the client */
+	if(handler_mode == SERVER_THREADED) {
+		if(handler == NULL || exec_prog != NULL || config_path != NULL) {
+			fprintf(stderr, "Error: Threaded mode only runs a handler function, not a program or config file.\n");
+			return EXIT_FAILURE;
+		}
+		if(password != NULL || pow_bits > 0) {
+			fprintf(stderr, "Error: Passwords and proofs of work aren't supported in threaded mode.\n");
+			return EXIT_FAILURE;
+		}
+		
+		/* Nothing that needs a process per session can be promised and then quietly skipped */
+		if(relay_mode) {
+			fprintf(stderr, "Error: Relaying (--relay, --relay-rate, --idle-timeout and --capture) isn't supported in threaded mode.\n");
+			return EXIT_FAILURE;
+		}
+		if(session_cpu > 0 || session_mem != NULL || session_pids > 0 || cpu_limit > 0) {
+			fprintf(stderr, "Error: Per-session resource limits aren't supported in threaded mode.\n");
+			return EXIT_FAILURE;
+		}
+		if(pid_namespaces || session_workdir != NULL) {
+			fprintf(stderr, "Error: PID namespaces and session workdirs aren't supported in threaded mode.\n");
+			return EXIT_FAILURE;
+		}
+		if(queue_size > 0 || accounting_path != NULL || trace_path != NULL) {
+			fprintf(stderr, "Error: --queue, --accounting and --trace aren't supported in threaded mode.\n");
+			return EXIT_FAILURE;
+		}
+		if(pool_size > 0 || acceptor_count > 1) {
+			fprintf(stderr, "Error: --pool and --acceptors aren't supported in threaded mode.\n");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	/* Pick up where the server that re-exec'd this one left off */
+	if(!load_upgrade_state()) {
+		return EXIT_FAILURE;
+	}
+	
+	/* Elevate to root privileges before doing anything else */
+	if(setuid(0) != 0) {
+		fprintf(stderr, "Error: Unable to become root!\n");
+		perror("setuid(0)");
+		return EXIT_FAILURE;
+	}
+	
+	/* Double check that we are root */
+	if(getuid() != 0) {
+		fprintf(stderr, "Error: Still not root!\n");
+		return EXIT_FAILURE;
+	}
+	
+	/* Everything to serve, either from a config file or from the command line */
+	service* svcs;
+	unsigned svc_count;
+	if(config_path != NULL) {
+		if(!load_services(config_path, user, chrooted, timeout, password, inject_lib, &svcs, &svc_count)) {
+			return EXIT_FAILURE;
+		}
+		
+		/* Services needn't share a home directory, so each one chroots its own sessions */
+		chrooted = false;
+	}
+	else {
+		svc_count = 1;
+		svcs = calloc(1, sizeof(*svcs));
+		if(svcs == NULL) {
+			perror("calloc");
+			return EXIT_FAILURE;
+		}
+		
+		svcs->pw = lookup_user(user);
+		if(svcs->pw == NULL) {
+			return EXIT_FAILURE;
+		}
+		svcs->port = port;
+		svcs->timeout = timeout;
+		svcs->password = password;
+		svcs->pow_bits = pow_bits;
+		svcs->inject_lib = inject_lib;
+		svcs->exec_prog = exec_prog;
+		svcs->child_argc = child_argc;
+		svcs->child_argv = child_argv;
+		svcs->trace_reports = exec_reports_trace;
+		svcs->metrics_sock = -1;
+	}
+	
+	/* Proofs of work need the secret from /dev/urandom, which the chroot lacks */
+	unsigned i;
+	for(i = 0; i < svc_count; i++) {
+		if(svcs[i].pow_bits > 0) {
+			if(!init_pow_secret()) {
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+	}
+	
+	/* Scaling only raises the difficulty of an existing proof of work, rather than adding one */
+	if(pow_scale > 0 && i == svc_count) {
+		fprintf(stderr, "Error: --pow-scale needs a service with a proof of work (--pow).\n");
+		return EXIT_FAILURE;
+	}
+	
+	/* Pooled programs run with this library preloaded, which changes what the challenge's process contains */
+	for(i = 0; pool_size > 0 && !pool_exec && i < svc_count; i++) {
+		if(svcs[i].exec_prog != NULL) {
+			fprintf(stderr, "Error: --pool preloads this library into '%s'. Pass --pool-exec to allow it.\n", svcs[i].exec_prog);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	/* Stamps already being worked on must stay valid across a re-exec */
+	for(i = 0; inherited != NULL && i < sizeof(pow_secret); i++) {
+		if(inherited->pow_secret[i] != 0) {
+			memcpy(pow_secret, inherited->pow_secret, sizeof(pow_secret));
+			break;
+		}
+	}
+	
+	/* Create the cgroup that holds per-session cgroups while the cgroup filesystem is still reachable */
+	if(!setup_session_cgroups()) {
+		return EXIT_FAILURE;
+	}
+	
+	/* Session workdirs are mounted in namespaces copied from the server's */
+	if(!setup_session_mounts()) {
+		return EXIT_FAILURE;
+	}
+	
+	if(chrooted) {
+		/* Chroot into the user's home directory */
+		if(!enter_chroot(svcs[0].pw)) {
+			return EXIT_FAILURE;
+		}
+		server_chrooted = true;
+	}
+	
+	/* Handle SIGTERM so that when running in Docker as PID 1 we properly exit,
+	 * and SIGHUP to upgrade. They must interrupt the supervisor's waitpid().
+	 */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &handle_term;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGTERM, &sa, NULL) != 0 || sigaction(SIGHUP, &sa, NULL) != 0) {
+		perror("sigaction");
+		return EXIT_FAILURE;
+	}
+	
+	if(acceptor_count == 0) {
+		acceptor_count = 1;
+	}
+	
+#ifdef __linux__
+	/* Remember which CPUs we may use before any acceptor gets pinned */
+	if(sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
+		perror("sched_getaffinity");
+		return EXIT_FAILURE;
+	}
+#endif
+	
+	/* Session counts must be visible to every acceptor, including those of a previous server */
+	if(inherited != NULL) {
+		if(inherited->sizes[3] == sizeof(*shared)) {
+			shared = map_inherited(inherited->shared_fd, sizeof(*shared));
+		}
+		else if(inherited->shared_fd != -1) {
+			close(inherited->shared_fd);
+		}
+		
+		if(shared != NULL) {
+			shared_fd = inherited->shared_fd;
+			shared_inherited = true;
+		}
+	}
+	if(shared == NULL) {
+		shared = map_shared(sizeof(*shared), &shared_fd);
+		if(shared == NULL) {
+			perror("mmap");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	/* Create one listening socket per service for each acceptor, with acceptor i's at socks[i * svc_count] */
+	unsigned sock_count = acceptor_count * svc_count;
+	int* socks = calloc(sock_count, sizeof(*socks));
+	if(socks == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	
+	for(i = 0; i < sock_count; i++) {
+		socks[i] = take_inherited_listener(svcs[i % svc_count].port);
+		if(socks[i] == -1) {
+			socks[i] = create_listener(svcs[i % svc_count].port);
+		}
+		if(socks[i] == -1) {
+			return EXIT_FAILURE;
+		}
+	}
+	close_inherited_listeners();
+	
+	/* The program is shared by every socket in a port's group, so attach it once per port */
+	for(i = 0; steer_mode != STEER_NONE && acceptor_count > 1 && i < svc_count; i++) {
+		if(!attach_steering(socks[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	
+	/* Every acceptor appends to the same accounting file */
+	if(accounting_path != NULL) {
+		accounting_fd = open(accounting_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+		if(accounting_fd == -1) {
+			perror(accounting_path);
+			return EXIT_FAILURE;
+		}
+		
+		/* Start a new CSV file with a header row */
+		struct stat st;
+		if(!accounting_binary && fstat(accounting_fd, &st) == 0 && st.st_size == 0) {
+			if(write(accounting_fd, ACCT_CSV_HEADER, sizeof(ACCT_CSV_HEADER) - 1) < 0) {
+				perror(accounting_path);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	
+	/* Every acceptor appends to the same capture file too */
+	if(capture_path != NULL) {
+		capture_fd = open(capture_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+		if(capture_fd == -1) {
+			perror(capture_path);
+			return EXIT_FAILURE;
+		}
+		
+		struct stat st;
+		if(fstat(capture_fd, &st) == 0 && st.st_size == 0) {
+			if(write(capture_fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) < 0) {
+				perror(capture_path);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	
+	if(trace_path != NULL) {
+		trace_fd = open(trace_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+		if(trace_fd == -1) {
+			perror(trace_path);
+			return EXIT_FAILURE;
+		}
+		
+		/* A JSON array of trace events, which is never closed as more events may come */
+		struct stat st;
+		if(fstat(trace_fd, &st) == 0 && st.st_size == 0) {
+			if(write(trace_fd, "[\n", 2) < 0) {
+				perror(trace_path);
+				return EXIT_FAILURE;
+			}
+		}
+		
+		for(i = 0; i < svc_count; i++) {
+			write_trace(
+				"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%hu,\"args\":{\"name\":\"port %hu\"}}",
+				svcs[i].port, svcs[i].port
+			);
+		}
+	}
+	
+	/* Only the first acceptor serves metrics, as the counters are shared anyway */
+	int metrics_sock = -1;
+	if(inherited != NULL && inherited->metrics_sock != -1) {
+		if(metrics_port != 0 || metrics_path != NULL) {
+			metrics_sock = inherited->metrics_sock;
+			fcntl(metrics_sock, F_SETFD, FD_CLOEXEC);
+		}
+		else {
+			close(inherited->metrics_sock);
+		}
+	}
+	if(metrics_sock == -1 && (metrics_port != 0 || metrics_path != NULL)) {
+		metrics_sock = create_metrics_listener();
+		if(metrics_sock == -1) {
+			return EXIT_FAILURE;
+		}
+	}
+	
+	/* Move standard file descriptors away from their normal positions */
+	if(!move_stdio()) {
+		fprintf(stderr_fp, "Error: Unable to move standard file descriptors.\n");
+		return EXIT_FAILURE;
+	}
+	
+	for(i = 0; i < svc_count; i++) {
+		svcs[i].sock = socks[i];
+	}
+	svcs[0].metrics_sock = metrics_sock;
+	
+	/* From now on, log records are written out by a separate logger process */
+	if(!start_logger(socks, sock_count, metrics_sock)) {
+		return EXIT_FAILURE;
+	}
+	
+	/* Display useful information about the server process */
+	fprintf(stderr_fp, "Server PID: %u\n", getpid());
+	for(i = 0; i < svc_count; i++) {
+		fprintf(stderr_fp, "Now accepting connections on port %hu (0x%04hx)\n", svcs[i].port, svcs[i].port);
+	}
+	fprintf(stderr_fp, "\n");
+	
+	/* Acceptors of the previous server finish their sessions while this one takes new connections */
+	for(i = 0; i < retired_count; i++) {
+		if(retired_pids[i] > 0) {
+			kill(retired_pids[i], SIGHUP);
+		}
+	}
+	
+	if(handler_mode == SERVER_THREADED) {
+		return serve_threaded(svcs, handler);
+	}
+	
+	if(acceptor_count > 1) {
+		/* The supervisor doesn't track sessions, so any handed down to it run on untracked */
+		adopt_inherited_tables(svcs, 0);
+		return run_acceptors(svcs, svc_count, socks);
+	}
+	
+	return accept_loop(svcs, svc_count);
 }
 
 static void show_usage(server_options* opts) {
@@ -521,7 +4152,15 @@ static void show_usage(server_options* opts) {
 		"    -l, --listen                          "
 			"Run the server and listen for incoming connections\n"
 		"    -a, --alarm <seconds=%d>%*s"
-			"Time limit for child processes to run, or 0 to disable\n"
+			"Wall-clock time limit for each session, or 0 to disable\n"
+		"    --cpu-limit <seconds>                 "
+			"Kill sessions after they use this much CPU time, or 0 for no limit\n"
+		"    --relay                               "
+			"Pass traffic between clients and sessions through the server with splice()\n"
+		"    --relay-rate <bytes-per-second>       "
+			"Limit the traffic in each direction of each session (implies --relay)\n"
+		"    --idle-timeout <seconds>              "
+			"Kill sessions that go this long without traffic (implies --relay)\n"
 		"    --no-chroot                           "
 			"Prevent the server from entering a chroot and changing directory\n"
 		"    -p, --port <port=%hu>%*s"
@@ -533,7 +4172,87 @@ static void show_usage(server_options* opts) {
 		"    -e, --exec <program=%s>%*s"
 			"Program to execute upon receiving a connection\n"
 		"    -k, --password <password>             "
-			"Require that clients enter the provided password after connecting\n",
+			"Require that clients enter the provided password after connecting\n"
+		"    --auth-timeout <seconds=10>           "
+			"Hang up on clients that take longer than this to enter the password, or 0\n"
+		"    --pow <bits>                          "
+			"Require a hashcash stamp with this many bits before anything else, or 0\n"
+		"    --pow-scale <connections-per-second>  "
+			"Add a bit to --pow each time the connection rate doubles past this (needs --pow)\n"
+		"    --config <file>                       "
+			"Host every service listed in this file instead of a single challenge\n"
+		"    --pool <count>                        "
+			"Keep this many pre-exec'd processes waiting to handle connections\n"
+		"    --pool-exec                           "
+			"Allow --pool with --exec, which preloads this library into the challenge program\n"
+		"    --acceptors <count>                   "
+			"Accept connections in this many processes, each with a SO_REUSEPORT socket\n"
+		"    --backlog <count=128>                 "
+			"Maximum number of pending connections on each listening socket\n"
+		"    --tcp-profile <profile>               "
+			"Preset for --backlog and the TCP options below that aren't given: default, interactive, or busy\n"
+		"    --nodelay                             "
+			"Send small writes to clients right away instead of coalescing them\n"
+		"    --keepalive <seconds>                 "
+			"Probe idle clients after this long and drop them once they stop answering\n"
+		"    --user-timeout <seconds>              "
+			"Drop clients that leave sent data unacknowledged this long (default: --keepalive)\n"
+		"    --defer-accept <seconds>              "
+			"Wait for the client to send data before accepting (only if clients speak first)\n"
+		"    --fastopen <count>                    "
+			"Allow this many pending TCP Fast Open connections on each listening socket\n"
+		"    --sndbuf <bytes>                      "
+			"Size of each connection's send buffer (default: chosen by the kernel)\n"
+		"    --rcvbuf <bytes>                      "
+			"Size of each connection's receive buffer (default: chosen by the kernel)\n"
+		"    --pin-cpus                            "
+			"Pin each acceptor process to its own CPU\n"
+		"    --steer <cpu|ip>                      "
+			"Steer connections to the acceptor for the receiving CPU or the client's IP\n"
+		"    --session-cpu <cpus>                  "
+			"Limit each session to this fraction of a CPU using its own cgroup, or 0\n"
+		"    --session-mem <bytes>                 "
+			"Limit the memory usage of each session (like \"50m\"), or 0\n"
+		"    --session-pids <count>                "
+			"Limit the number of processes and threads in each session, or 0\n"
+		"    --pid-namespace                       "
+			"Run each session in its own PID namespace, so it can be killed all at once\n"
+		"    --session-workdir <directory>         "
+			"Give each session a private copy-on-write view of this directory\n"
+		"    --workdir-size <megabytes>            "
+			"Limit how much each session can write to its workdir (default: 64)\n"
+		"    --cgroup <directory>                  "
+			"Cgroup v2 directory to create session cgroups in (default: our own cgroup)\n"
+		"    --cgroup-remount                      "
+			"Remount a read-only cgroup filesystem read-write for session limits (needs CAP_SYS_ADMIN)\n"
+		"    --drain-timeout <seconds=8>           "
+			"Time sessions get to finish on SIGTERM before they are killed (SIGHUP re-execs)\n"
+		"    --max-sessions <count>                "
+			"Maximum number of sessions running at once, or 0 for no limit\n"
+		"    --threads <count=16>                  "
+			"Number of handler threads, if the challenge runs its handler in threaded mode\n"
+		"    --max-per-ip <count>                  "
+			"Maximum number of running or queued sessions from one IP, or 0 for no limit\n"
+		"    --rate <connections-per-second>       "
+			"Rate limit new connections from each IP, or 0 for no limit\n"
+		"    --burst <count>                       "
+			"Number of connections each IP may make in a burst when rate limited\n"
+		"    --queue <count>                       "
+			"Number of connections that may wait for a session when at --max-sessions\n"
+		"    --metrics-port <port>                 "
+			"Serve Prometheus metrics over HTTP on this TCP port\n"
+		"    --metrics-socket <path>               "
+			"Serve Prometheus metrics on a Unix socket at this path instead\n"
+		"    --accounting <path>                   "
+			"Append a resource accounting record for each ended session to this file\n"
+		"    --accounting-format <csv|binary>      "
+			"Format of the accounting records (default: csv)\n"
+		"    --capture <path>                      "
+			"Append each session's traffic from the client to this file (implies --relay)\n"
+		"    --trace <path>                        "
+			"Append the steps of each connection to this file in Chrome's trace format\n"
+		"    --trace-reports                       "
+			"The --exec program reports its own progress with --trace (built with COALESCED_STDIO)\n",
 		progname,
 		opts->time_limit_seconds, alarmpad, "",
 		opts->port, portpad, "",
@@ -549,9 +4268,19 @@ int serve(const char* user, bool chrooted, unsigned short port, unsigned timeout
 int server_main(int argc, char** argv, server_options opts, conn_handler* handler) {
 	const char* inject_lib = NULL;
 	const char* exec_prog = NULL;
+	const tcp_profile* tcp_profile_choice = NULL;
 	int child_argc = 0;
 	char** child_argv = NULL;
 	
+	/* Remember how to re-exec the server for an upgrade */
+	server_argv = argv;
+	server_exe = realpath(PROC_SELF_EXE(), NULL);
+	
+	handler_mode = opts.mode;
+	init_hook = opts.init;
+	thread_count = opts.threads;
+	max_sessions = opts.max_sessions;
+	
 	int i;
 	for(i = 1; i < argc; i++) {
 		if(strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
@@ -585,6 +4314,191 @@ int server_main(int argc, char** argv, server_options opts, conn_handler* handle
 				password = NULL;
 			}
 		}
+		else if(strcmp(argv[i], "--auth-timeout") == 0) {
+			auth_timeout = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pow") == 0) {
+			pow_bits = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pow-scale") == 0) {
+			pow_scale = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--config") == 0) {
+			config_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--pool") == 0) {
+			pool_size = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pool-exec") == 0) {
+			pool_exec = true;
+		}
+		else if(strcmp(argv[i], "--acceptors") == 0) {
+			acceptor_count = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--backlog") == 0) {
+			listen_backlog = atoi(argv[++i]);
+			tcp_options_set |= TCP_SET_BACKLOG;
+		}
+		else if(strcmp(argv[i], "--tcp-profile") == 0) {
+			const char* profile = argv[++i];
+			tcp_profile_choice = find_tcp_profile(profile);
+			if(tcp_profile_choice == NULL) {
+				printf("Error: Unknown TCP profile '%s'\n", profile ? profile : "");
+				show_usage(&opts);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--defer-accept") == 0) {
+			tcp_defer_accept = atoi(argv[++i]);
+			tcp_options_set |= TCP_SET_DEFER_ACCEPT;
+		}
+		else if(strcmp(argv[i], "--fastopen") == 0) {
+			tcp_fastopen = atoi(argv[++i]);
+			tcp_options_set |= TCP_SET_FASTOPEN;
+		}
+		else if(strcmp(argv[i], "--nodelay") == 0) {
+			tcp_nodelay = true;
+			tcp_options_set |= TCP_SET_NODELAY;
+		}
+		else if(strcmp(argv[i], "--sndbuf") == 0) {
+			tcp_sndbuf = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--rcvbuf") == 0) {
+			tcp_rcvbuf = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--keepalive") == 0) {
+			tcp_keepalive = atoi(argv[++i]);
+			tcp_options_set |= TCP_SET_KEEPALIVE;
+		}
+		else if(strcmp(argv[i], "--user-timeout") == 0) {
+			tcp_user_timeout = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pin-cpus") == 0) {
+			pin_cpus = true;
+		}
+		else if(strcmp(argv[i], "--max-sessions") == 0) {
+			max_sessions = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--threads") == 0) {
+			thread_count = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--max-per-ip") == 0) {
+			max_per_ip = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--rate") == 0) {
+			conn_rate = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--burst") == 0) {
+			conn_burst = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--queue") == 0) {
+			queue_size = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--accounting") == 0) {
+			accounting_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--accounting-format") == 0) {
+			const char* format = argv[++i];
+			if(format != NULL && strcmp(format, "csv") == 0) {
+				accounting_binary = false;
+			}
+			else if(format != NULL && strcmp(format, "binary") == 0) {
+				accounting_binary = true;
+			}
+			else {
+				printf("Error: Unknown accounting format '%s'\n", format ? format : "");
+				show_usage(&opts);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--capture") == 0) {
+			capture_path = argv[++i];
+			relay_mode = true;
+		}
+		else if(strcmp(argv[i], "--trace") == 0) {
+			trace_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--trace-reports") == 0) {
+			exec_reports_trace = true;
+		}
+		else if(strcmp(argv[i], "--metrics-port") == 0) {
+			metrics_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--metrics-socket") == 0) {
+			metrics_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--session-cpu") == 0) {
+			session_cpu = atof(argv[++i]);
+			
+			/* Otherwise, every session would fail to set up its cgroup */
+			if(session_cpu > 0 && session_cpu * CGROUP_CPU_PERIOD < CGROUP_CPU_QUOTA_MIN) {
+				printf("Error: The session CPU limit must be at least %g CPUs\n", (double)CGROUP_CPU_QUOTA_MIN / CGROUP_CPU_PERIOD);
+				show_usage(&opts);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--session-mem") == 0) {
+			session_mem = argv[++i];
+			if(atol(session_mem) <= 0) {
+				session_mem = NULL;
+			}
+		}
+		else if(strcmp(argv[i], "--cpu-limit") == 0) {
+			cpu_limit = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--relay") == 0) {
+			relay_mode = true;
+		}
+		else if(strcmp(argv[i], "--relay-rate") == 0) {
+			relay_rate = atoi(argv[++i]);
+			relay_mode = true;
+		}
+		else if(strcmp(argv[i], "--idle-timeout") == 0) {
+			idle_timeout = atoi(argv[++i]);
+			relay_mode = true;
+		}
+		else if(strcmp(argv[i], "--session-pids") == 0) {
+			session_pids = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--pid-namespace") == 0) {
+			pid_namespaces = true;
+		}
+		else if(strcmp(argv[i], "--session-workdir") == 0) {
+			session_workdir = argv[++i];
+			
+			/* The directory is named in overlayfs's comma-separated mount options */
+			if(session_workdir == NULL || session_workdir[0] != '/' || strpbrk(session_workdir, ",:\\") != NULL) {
+				printf("Error: The session workdir must be an absolute path without ',', ':', or '\\'\n");
+				show_usage(&opts);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--workdir-size") == 0) {
+			workdir_size = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--cgroup") == 0) {
+			cgroup_dir = argv[++i];
+		}
+		else if(strcmp(argv[i], "--cgroup-remount") == 0) {
+			cgroup_remount = true;
+		}
+		else if(strcmp(argv[i], "--drain-timeout") == 0) {
+			drain_timeout = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--steer") == 0) {
+			const char* mode = argv[++i];
+			if(mode != NULL && strcmp(mode, "cpu") == 0) {
+				steer_mode = STEER_CPU;
+			}
+			else if(mode != NULL && strcmp(mode, "ip") == 0) {
+				steer_mode = STEER_IP;
+			}
+			else {
+				printf("Error: Unknown steering mode '%s'\n", mode ? mode : "");
+				show_usage(&opts);
+				return EXIT_FAILURE;
+			}
+		}
 		else if(strcmp(argv[i], "--") == 0) {
 			/* Intentionally make argv[0] be this "--" arg, so we can overwrite it later */
 			child_argc = argc - i;
@@ -598,6 +4512,11 @@ int server_main(int argc, char** argv, server_options opts, conn_handler* handle
 		}
 	}
 	
+	/* The profile only fills in options that weren't given, wherever it appears */
+	if(tcp_profile_choice != NULL) {
+		apply_tcp_profile(tcp_profile_choice);
+	}
+	
 	return serve_internal(
 		opts.user, opts.chrooted, opts.port, opts.time_limit_seconds,
 		handler, inject_lib,
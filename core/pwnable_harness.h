@@ -16,12 +16,54 @@
  */
 typedef void conn_handler(int sock);
 
-/*! Options given to the server to change how it runs. */
+/*! Signature of the function used to set up a challenge before it handles
+ * connections, like loading tables, parsing files or generating keys.
+ */
+typedef void challenge_init(void);
+
+/*! Ways the server can run the handler for each connection. */
+typedef enum server_mode {
+	SERVER_FORK_EXEC = 0,        /*!< Fork and re-exec a new process to handle each connection */
+	SERVER_THREADED,             /*!< Call the handler on a pool of threads within the server process */
+	SERVER_FORK_SERVER,          /*!< Fork a process for each connection from a template that ran init once */
+} server_mode;
+
+/*! Options given to the server to change how it runs.
+ * @note SERVER_THREADED is meant for challenges without memory corruption,
+ *   like crypto or misc challenges. Every connection shares the server's
+ *   address space and runs as the user without a process of its own, so the
+ *   handler must be thread-safe, return instead of exiting, and talk to the
+ *   client only through its socket, as stdin and stdout aren't redirected.
+ *   A connection is shut down once it reaches the time limit, which a
+ *   handler that never reads or writes won't notice. The server refuses to
+ *   start with options that need a process per session, like per-session
+ *   resource limits, passwords, proofs of work or relaying, and SIGHUP
+ *   doesn't re-exec it.
+ *
+ * @note With SERVER_FORK_SERVER, init runs only once, in a template process
+ *   that has already dropped privileges (and entered the chroot). Each
+ *   connection is handled by a fork() of the template, without an exec, so
+ *   every session shares the template's memory: the PIE base and library
+ *   addresses, the stack and heap layout, the stack canary, and anything init
+ *   generated, like keys. A leak in one session applies to all of them, so a
+ *   challenge using this mode should say so in its description. The template
+ *   is itself a plain fork of the server, so every session can also read the
+ *   server's settings from memory. The password and the proof of work secret
+ *   are wiped before init runs, but nothing else is. Connections wait until
+ *   init has finished, however long it takes. PID namespaces and session
+ *   workdirs aren't supported. In the other modes, init runs in each
+ *   connection's process before the handler, or once before the threads
+ *   start with SERVER_THREADED.
+ */
 typedef struct server_options {
 	const char* user;            /*!< Username of the account used to run child processes */
 	bool chrooted;               /*!< True if the server should run within a chroot */
 	unsigned short port;         /*!< Port bound for receiving incoming connections */
 	unsigned time_limit_seconds; /*!< Max number of seconds to run child processes for before they're killed */
+	server_mode mode;            /*!< How each connection is handled, SERVER_FORK_EXEC by default */
+	unsigned threads;            /*!< Number of handler threads with SERVER_THREADED, or 0 for 16 */
+	unsigned max_sessions;       /*!< Max number of connections handled at once, or 0 for no limit (1024 with SERVER_THREADED) */
+	challenge_init* init;        /*!< Function called before handling connections, or NULL */
 } server_options;
 
 
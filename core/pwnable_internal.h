@@ -0,0 +1,563 @@
+//
+//  pwnable_internal.h
+//  PwnableHarness
+//
+//  Declarations shared by the source files of libpwnableharness. None of
+//  these are exported from the library.
+//
+
+#ifndef PWNABLE_INTERNAL_H
+#define PWNABLE_INTERNAL_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* For sched_setaffinity() */
+#endif
+#include "pwnable_harness.h"
+#include "pwnable_capture.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <grp.h>
+#include <pwd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <linux/capability.h>
+#include <linux/filter.h>
+#endif
+
+#define ARRAYSIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#ifdef __linux__
+/* Missing from the headers of older Ubuntu versions */
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#ifndef BPF_MOD
+#define BPF_MOD 0x90
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif /* __linux__ */
+
+/*! Actually output to standard error after it has been moved. */
+#define PERROR(msg) log_event(0, LOG_ERROR, NULL, errno, "%s", (msg))
+
+/* Keep everything below out of the library's exported symbols */
+#pragma GCC visibility push(hidden)
+
+/* Original file descriptors */
+extern int real_stdin, real_stdout, real_stderr;
+extern FILE* stdin_fp, *stdout_fp, *stderr_fp;
+
+/*! Password that must be entered by the user after connecting. */
+extern const char* password;
+
+/*! Number of pre-exec'd worker processes to keep waiting for connections, or 0 to disable. */
+extern unsigned pool_size;
+
+/*! Maximum length of the password that can be entered by the user. */
+#define PASSWORD_MAX 100
+
+/*! Number of seconds a client has to enter the password, or 0 for no limit. */
+extern unsigned auth_timeout;
+
+/*! Number of leading zero bits required of a client's hashcash stamp, or 0 to not require one. */
+extern unsigned pow_bits;
+
+/*! Connection rate above which the proof of work gets harder, or 0 to keep it fixed. */
+extern double pow_scale;
+
+/*! Length of the random resource string that a client's hashcash stamp must be for. */
+#define POW_RESOURCE_LEN 16
+
+/*! Secret mixed into the resource strings so that clients can't predict them. */
+extern uint8_t pow_secret[20];
+
+/*! Message sent to a pool worker along with the connection's file descriptor. */
+typedef struct pool_handoff {
+	struct sockaddr_in cli_addr;   /*!< Address of the client, which the worker may not be able to get from its socket */
+} pool_handoff;
+
+/*! Socket type of the channel between the server and each pool worker. */
+#ifdef __linux__
+#define POOL_CHAN_TYPE SOCK_SEQPACKET
+#else
+#define POOL_CHAN_TYPE SOCK_DGRAM
+#endif
+
+/*! A pre-exec'd process parked on a Unix socket waiting for a connection. */
+typedef struct pool_worker {
+	pid_t pid;                     /*!< Process ID of the worker */
+	int chan;                      /*!< Server's end of the socket pair shared with the worker */
+	int trace_fd;                  /*!< Read end of the worker's trace pipe with --trace, or -1 */
+} pool_worker;
+
+/*! Where a connection is on its way to and through a session, for --trace. */
+typedef struct conn_trace {
+	uint32_t id;                   /*!< Row of the connection in the trace, or 0 when it isn't traced */
+	uint64_t accepted;             /*!< Monotonic time in nanoseconds when the connection was accepted */
+	uint64_t since;                /*!< Monotonic time in nanoseconds when its current step began */
+} conn_trace;
+
+/*! Directions of traffic through a relayed session. */
+enum {
+	RELAY_IN,                      /*!< From the client to the challenge */
+	RELAY_OUT,                     /*!< From the challenge to the client */
+};
+
+/*! One direction of a relayed session, moved from its source socket to its
+ * destination socket through a pipe with splice().
+ */
+typedef struct relay_dir {
+	int pipe[2];                   /*!< Pipe holding bytes read from the source but not yet written */
+	size_t pending;                /*!< Number of bytes in the pipe */
+	bool eof;                      /*!< Whether nothing more will be relayed in this direction */
+	bool shut;                     /*!< Whether the destination has been shut down for writing */
+	uint64_t bytes;                /*!< Bytes read from the source */
+	double tokens;                 /*!< Bytes that may be read now without exceeding the rate limit */
+} relay_dir;
+
+/*! Server's side of a session that talks to its client through the server. */
+typedef struct relay {
+	int sock;                      /*!< Server's end of the socket pair connected to the challenge, or -1 when not relayed */
+	relay_dir dirs[2];             /*!< Traffic in each direction, indexed by RELAY_IN and RELAY_OUT */
+	struct timespec last_active;   /*!< Monotonic time when bytes were last relayed */
+	struct timespec last_refill;   /*!< Monotonic time when the rate limit tokens were last refilled */
+} relay;
+
+/*! A running session and the client it is serving. */
+typedef struct session {
+	pid_t pid;                     /*!< Process ID of the challenge process */
+	int conn;                      /*!< Server's copy of the client connection, or -1 */
+	struct sockaddr_in cli_addr;   /*!< Address of the client */
+	struct timespec start;         /*!< Monotonic time when the session started */
+	struct timespec start_wall;    /*!< Wall-clock time when the session started */
+	bool killed;                   /*!< Whether the server already killed it for exceeding a limit */
+	bool exited;                   /*!< Whether its process has been reaped, while the relay drains */
+	int status;                    /*!< Wait status of the process once it has exited */
+	struct rusage usage;           /*!< Resource usage of the process once it has exited */
+	relay relay;                   /*!< Traffic between the client and the challenge, when relaying */
+	uint32_t capture_id;           /*!< Number identifying the session's records in the capture file */
+	conn_trace trace;              /*!< Steps the connection went through before the session started */
+	int trace_fd;                  /*!< Read end of the pipe the session reports its progress on, or -1 */
+	bool pooled;                   /*!< Whether a pool worker took the session instead of a fork/exec */
+	uint64_t first_out;            /*!< Monotonic time in nanoseconds when the first byte was relayed to the client, or 0 */
+} session;
+
+/*! A connection waiting in the queue for a free session slot. */
+typedef struct pending_conn {
+	int conn;                      /*!< Connection socket */
+	struct sockaddr_in cli_addr;   /*!< Address of the client */
+	conn_trace trace;              /*!< Steps the connection went through so far */
+} pending_conn;
+
+/*! A connection handed to a fork server's template process, waiting for it
+ * to answer with the session it forked.
+ */
+typedef struct fork_handoff {
+	int conn;                      /*!< Connection socket */
+	int session_conn;              /*!< Socket handed to the template, which is the connection unless relaying */
+	relay r;                       /*!< Relay between the two when relaying */
+	struct sockaddr_in cli_addr;   /*!< Address of the client */
+	conn_trace trace;              /*!< Steps the connection went through so far */
+	struct timespec sent;          /*!< Monotonic time when the connection was handed over */
+} fork_handoff;
+
+/*! Seconds a fork server's template process that has run the init function
+ * may take to fork a session before it's considered stuck.
+ */
+#define FORK_SERVER_REPLY_TIMEOUT 1
+
+/*! A connection that must send a proof of work or enter the password before
+ * it may start a session.
+ */
+typedef struct auth_conn {
+	int conn;                      /*!< Connection socket, non-blocking until it is authenticated */
+	struct sockaddr_in cli_addr;   /*!< Address of the client */
+	struct timespec start;         /*!< Monotonic time when the client was asked for the current line */
+	unsigned limit;                /*!< Number of seconds the client has to send the current line, or 0 */
+	unsigned pow_bits;             /*!< Proof of work difficulty still to be met, or 0 once met */
+	char resource[POW_RESOURCE_LEN + 1]; /*!< Resource string the client's hashcash stamp must be for */
+	char entered[PASSWORD_MAX];    /*!< Line received so far, without a NUL terminator */
+	size_t len;                    /*!< Number of bytes in entered */
+	conn_trace trace;              /*!< Steps the connection went through so far */
+} auth_conn;
+
+/*! Maximum number of connections of a service authenticating at once. */
+#define AUTH_PENDING_MAX 256
+
+/*! Token bucket used to rate limit the connections from an IP address. */
+typedef struct rate_bucket {
+	uint32_t ip;                   /*!< IP address (network byte order) owning this bucket */
+	double tokens;                 /*!< Number of connections that may be made right now */
+	struct timespec last;          /*!< Monotonic time when the bucket was last refilled */
+} rate_bucket;
+
+/*! Number of entries in the table of per-IP token buckets. */
+#define RATE_BUCKETS 1024
+
+/*! Reasons that admission control turns away a connection. */
+typedef enum reject_reason {
+	REJECT_RATE,                   /*!< Over its IP's connection rate limit */
+	REJECT_PER_IP,                 /*!< Too many sessions from its IP */
+	REJECT_BUSY,                   /*!< At --max-sessions and the queue is full */
+	REJECT_SPAWN,                  /*!< Unable to start a session process */
+	REJECT_REASONS
+} reject_reason;
+
+/*! Upper bounds in seconds of the session duration histogram's buckets, not counting +Inf. */
+static const double duration_bounds[] = {0.1, 1, 5, 10, 30, 60, 120, 300, 600};
+
+/*! State shared by the server and all acceptor processes. The counters are
+ * served from the metrics endpoint.
+ */
+typedef struct shared_state {
+	unsigned live_sessions;        /*!< Number of running sessions across all acceptors */
+	unsigned queued;               /*!< Number of connections waiting for a session slot */
+	unsigned long accepts;         /*!< Connections accepted */
+	unsigned long accept_errors;   /*!< Failed calls to accept() */
+	unsigned long fork_failures;   /*!< Failed calls to fork() */
+	unsigned long password_failures; /*!< Sessions that didn't enter the right password */
+	unsigned long pow_failures;    /*!< Connections that didn't send a valid proof of work */
+	unsigned long timeout_kills;   /*!< Sessions killed for running past their wall-clock time limit */
+	unsigned long cpu_limit_kills; /*!< Sessions killed for using up their CPU time budget */
+	unsigned long idle_kills;      /*!< Relayed sessions killed for going without traffic */
+	unsigned long relay_bytes[2];  /*!< Bytes relayed in each direction */
+	unsigned long rejected[REJECT_REASONS]; /*!< Connections rejected, by reason */
+	unsigned long exit_codes[256]; /*!< Sessions that exited, by exit status */
+	unsigned long exit_signals[128]; /*!< Sessions killed by a signal, by signal number */
+	unsigned long duration_buckets[ARRAYSIZE(duration_bounds) + 1]; /*!< Session durations (not cumulative) */
+	unsigned long duration_sum_ms; /*!< Total duration of all ended sessions in milliseconds */
+	uint32_t captured_sessions;    /*!< Sessions started with --capture, used to number them */
+	uint32_t traced_conns;         /*!< Connections accepted with --trace, used to number their rows */
+} shared_state;
+
+/*! Atomically adds to one of the counters in the shared state, if there is one. */
+#define STAT_ADD(field, n) do { \
+	if(shared != NULL) { \
+		__atomic_add_fetch(&shared->field, (n), __ATOMIC_RELAXED); \
+	} \
+} while(0)
+
+/*! Maximum number of metrics clients waiting to send their request. */
+#define METRICS_CLIENTS_MAX 4
+
+/*! Everything needed to accept connections for a challenge and spawn processes to handle them. */
+typedef struct service {
+	struct passwd* pw;             /*!< User that challenge processes run as */
+	unsigned short port;           /*!< Port number to listen on */
+	unsigned timeout;              /*!< Number of seconds a connection may run, or 0 */
+	const char* password;          /*!< Password clients must enter, or NULL */
+	unsigned pow_bits;             /*!< Proof of work difficulty clients must meet first, or 0 */
+	const char* inject_lib;        /*!< Library preloaded into the challenge, or NULL */
+	const char* exec_prog;         /*!< Program to exec, or NULL to re-exec ourselves */
+	int child_argc;                /*!< Number of arguments in child_argv */
+	char** child_argv;             /*!< Arguments for exec_prog, starting with "--" */
+	bool chroot_sessions;          /*!< Whether sessions chroot into the user's home directory themselves */
+	int sock;                      /*!< Listening socket */
+	pool_worker* pool;             /*!< Array of pool_size pre-exec'd workers */
+	unsigned pool_next;            /*!< Index of the next worker to hand a connection to */
+	const char* pool_preload;      /*!< Value of LD_PRELOAD for pool workers */
+	bool trace_reports;            /*!< Whether the sessions report their progress on the trace pipe */
+	pid_t template_pid;            /*!< Fork server's template process, or -1 */
+	int template_chan;             /*!< Channel for handing connections to the template process, or -1 */
+	int template_exits;            /*!< Read end of the pipe the template reports exited sessions on, or -1 */
+	bool template_ready;           /*!< Whether the template has run the init function */
+	fork_handoff* handoffs;        /*!< Connections handed to the template that it hasn't answered for, oldest first */
+	unsigned handoff_count;        /*!< Number of entries in handoffs */
+	unsigned handoff_cap;          /*!< Allocated capacity of handoffs */
+	session* sessions;             /*!< Table of live sessions started by this process */
+	unsigned session_count;        /*!< Number of entries in sessions */
+	unsigned session_cap;          /*!< Allocated capacity of sessions */
+	pending_conn* queue;           /*!< Connections waiting for a free session slot, oldest first */
+	unsigned queue_len;            /*!< Number of entries in queue */
+	auth_conn* auths;              /*!< Connections sending a proof of work or password, oldest first */
+	unsigned auth_count;           /*!< Number of entries in auths */
+	rate_bucket* buckets;          /*!< Table of RATE_BUCKETS per-IP token buckets */
+	int metrics_sock;              /*!< Listening socket for the metrics endpoint, or -1 */
+	int metrics_clients[METRICS_CLIENTS_MAX]; /*!< Metrics connections awaiting their request */
+	unsigned metrics_client_count; /*!< Number of entries in metrics_clients */
+	struct timespec last_cpu_poll; /*!< Monotonic time when session CPU usage was last checked */
+} service;
+
+/*! Number of processes accepting connections on their own SO_REUSEPORT sockets. */
+extern unsigned acceptor_count;
+
+/*! Process IDs of the acceptors, owned by the supervising server process. */
+extern pid_t* acceptor_pids;
+
+/*! Maximum number of pending connections on each listening socket. */
+extern int listen_backlog;
+
+/*! Maximum number of sessions that may run at once across all acceptors, or 0 for no limit. */
+extern unsigned max_sessions;
+
+/*! Maximum number of running or queued sessions from a single IP address, or 0 for no limit. */
+extern unsigned max_per_ip;
+
+/*! Maximum number of connections that may wait for a free session slot. */
+extern unsigned queue_size;
+
+/*! Mapping shared between the server and all of its acceptors. */
+extern shared_state* shared;
+
+/*! Self-pipe written to by the SIGCHLD handler to wake up the event loop. */
+extern int sigchld_pipe[2];
+
+/*! Open capture file, or -1 when disabled. */
+extern int capture_fd;
+
+/*! TCP port to serve metrics on, or 0 to disable. */
+extern unsigned short metrics_port;
+
+/*! Path of a Unix socket to serve metrics on, or NULL to disable. */
+extern const char* metrics_path;
+
+/*! Process ID of this session process as the server knows it, once it has
+ * entered its own PID namespace, or 0.
+ */
+extern pid_t outer_pid;
+
+/*! Maximum number of bytes per second relayed in each direction of a session, or 0 for no limit. */
+extern unsigned relay_rate;
+
+/*! Seconds that sessions get to finish after SIGTERM before they are killed. */
+extern unsigned drain_timeout;
+
+/*! Set by the signal handler when SIGTERM asks the server to drain its sessions and exit. */
+extern volatile sig_atomic_t stop_requested;
+
+/*! Set by the signal handler when SIGHUP asks the server to re-exec itself. */
+extern volatile sig_atomic_t upgrade_requested;
+
+/*! Whether this process has stopped accepting connections and exits once its sessions are gone. */
+extern bool draining;
+
+/*! Whether the drain is for shutting down, which gives sessions until drain_deadline. */
+extern bool shutting_down;
+
+/*! Monotonic time when a server that is shutting down kills its remaining sessions. */
+extern struct timespec drain_deadline;
+
+/*! How connections are handled, from server_options.mode. */
+extern server_mode handler_mode;
+
+/*! Function called to handle each connection, from server_main(). */
+extern conn_handler* challenge_handler;
+
+/*! Function called to set up the challenge before it handles connections, from server_options.init. */
+extern challenge_init* init_hook;
+
+/*! Number of handler threads in threaded mode, or 0 for THREADS_DEFAULT. */
+extern unsigned thread_count;
+
+/*! Acceptors of earlier servers that are retiring, still finishing their sessions. */
+extern pid_t* retired_pids;
+
+/*! Number of entries in retired_pids. */
+extern unsigned retired_count;
+
+/*! Arguments the server was started with, used to re-exec it. */
+extern char** server_argv;
+
+/*! Absolute path of the server's executable, used to re-exec it. This is
+ * resolved at startup, so that a new build installed at the same path is
+ * what gets run.
+ */
+extern char* server_exe;
+
+/*! Whether the server process chrooted itself, which leaves it unable to re-exec. */
+extern bool server_chrooted;
+
+/*! Memory file backing the shared state, or -1 when it can't be handed down. */
+extern int shared_fd;
+
+/*! Whether the shared state, including its session counts, was handed down
+ * by the server that re-exec'd this one.
+ */
+extern bool shared_inherited;
+
+/*! Header of the state that a server hands down when it re-execs itself on
+ * SIGHUP. It's followed by the listening sockets and the retired acceptors
+ * as int32_t arrays, and then by an upgrade_service for each service. Every
+ * file descriptor in it is inherited across the exec.
+ */
+typedef struct upgrade_header {
+	char magic[8];                 /*!< UPGRADE_MAGIC */
+	uint32_t sizes[5];             /*!< Sizes of session, pending_conn, auth_conn, shared_state and log_ring */
+	int32_t shared_fd;             /*!< Memory file backing the shared state */
+	int32_t logs_fd;               /*!< Memory file backing the log ring */
+	int32_t logger_pid;            /*!< Logger process, which carries on draining the log ring */
+	int32_t metrics_sock;          /*!< Metrics listening socket, or -1 */
+	uint32_t sock_count;           /*!< Number of listening sockets */
+	uint32_t retired_count;        /*!< Number of acceptors that are retiring */
+	uint32_t svc_count;            /*!< Number of upgrade_service records */
+	uint8_t pow_secret[20];        /*!< Proof of work secret, so that stamps already being worked on stay valid */
+} upgrade_header;
+
+/*! State handed down by the server that re-exec'd this one, or NULL. */
+extern upgrade_header* inherited;
+
+/*! Kinds of events written to the server's log. */
+typedef enum log_type {
+	LOG_MESSAGE,                   /*!< Informational message from the server */
+	LOG_ERROR,                     /*!< Something failed, possibly with an errno value */
+	LOG_CONNECTION,                /*!< A session was started for a connection */
+	LOG_REJECTED,                  /*!< A connection was turned away by admission control */
+	LOG_PASSWORD_OK,               /*!< The client entered the correct password */
+	LOG_PASSWORD_BAD,              /*!< The client entered the wrong password */
+	LOG_PASSWORD_MISSING,          /*!< The client hung up or ran out of time before entering a password */
+	LOG_TIMEOUT,                   /*!< A session was killed for exceeding its time limit */
+	LOG_POW_FAILED,                /*!< The client didn't send a valid proof of work in time */
+} log_type;
+
+/*! Maximum length of the free-form text of a log record. */
+#define LOG_DETAIL_MAX 96
+
+/*! Number of records in the log ring. Must be a power of two. */
+#define LOG_RING_SIZE 1024
+
+/*! Fixed-size binary log record, written by any process into the log ring. */
+typedef struct log_record {
+	unsigned seq;                  /*!< Ring position this slot is ready for, see log_ring */
+	unsigned short type;           /*!< A log_type value */
+	unsigned short port;           /*!< Client's port (host byte order), or 0 */
+	uint32_t ip;                   /*!< Client's IPv4 address (host byte order), or 0 */
+	int pid;                       /*!< Process that the event is about */
+	int err;                       /*!< errno value, or 0 */
+	uint64_t time_ns;              /*!< Monotonic timestamp in nanoseconds */
+	char detail[LOG_DETAIL_MAX];   /*!< NUL-terminated free-form text */
+} log_record;
+
+/*! Lock-free bounded multi-producer, single-consumer queue of log records,
+ * placed in a shared mapping so that every process forked from the server
+ * can log without ever blocking on standard error.
+ * @note Each slot's seq is the position it's ready for. A producer claims
+ *   position pos from head when the slot's seq == pos, and publishes the
+ *   record by setting seq to pos + 1. The logger consumes it when seq ==
+ *   pos + 1 and releases the slot for the next lap by setting it to
+ *   pos + LOG_RING_SIZE. When the ring is full, records are dropped.
+ */
+typedef struct log_ring {
+	unsigned head;                 /*!< Next position to be claimed by a producer */
+	char pad1[60];                 /*!< Keep producers and the consumer on separate cache lines */
+	unsigned tail;                 /*!< Next position to be read by the logger */
+	unsigned dropped;              /*!< Number of records dropped because the ring was full */
+	char pad2[56];
+	log_record records[LOG_RING_SIZE];
+} log_ring;
+
+/*! Shared log ring, or NULL to write log lines directly to standard error. */
+extern log_ring* logs;
+
+/*! Memory file backing the log ring, or -1 when it can't be handed down. */
+extern int logs_fd;
+
+/*! Process ID of the logger process. */
+extern pid_t logger_pid;
+
+/* pwnable_harness.c */
+uint64_t monotonic_ns(void);
+void* map_shared(size_t size, int* fd);
+void* map_inherited(int fd, size_t size);
+bool drop_privileges(struct passwd* pw);
+void park_stdio(void);
+bool redirect_output(int sock);
+bool enter_session_cgroup(pid_t pid);
+void limit_session_process(void);
+bool send_fd(int chan, int fd, const void* msg, size_t msg_size);
+ssize_t recv_msg(int chan, void* msg, size_t msg_size, int* fd);
+int recv_fd(int chan, void* msg, size_t msg_size);
+void clean_env(void);
+void unpin_cpu(void);
+void log_connection(pid_t pid, const struct sockaddr_in* cli_addr);
+void trace_step(conn_trace* t, unsigned short port, const char* name);
+bool open_wake_pipe(void);
+double elapsed_seconds(const struct timespec* since, const struct timespec* now);
+bool take_rate_token(service* svc, uint32_t ip, const struct timespec* now);
+bool reserve_session_slot(void);
+void release_session_slot(void);
+void session_exited(service* svc, unsigned index, int status, const struct rusage* ru);
+void send_message(int conn, const char* message);
+void reject_connection(int conn, const struct sockaddr_in* cli_addr, reject_reason reason);
+void launch_session(service* svc, pid_t pid, int conn, int session_conn, relay* r,
+                    const struct sockaddr_in* cli_addr, conn_trace* trace, int trace_read, bool pooled);
+void admit_session(service* svc, int conn, const struct sockaddr_in* cli_addr, conn_trace* trace);
+void admit_queued(service* svc);
+void retire_pool_worker(pool_worker* worker);
+bool tune_socket(int sock, bool listening);
+
+/* pwnable_log.c */
+void log_event(pid_t pid, log_type type, const struct sockaddr_in* addr, int err, const char* fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+bool start_logger(const int* socks, unsigned sock_count, int metrics_sock);
+
+/* pwnable_relay.c */
+void relay_close(relay* r);
+bool relay_open(relay* r, int conn, int* peer);
+void relay_abandon(relay* r);
+double relay_min_tokens(void);
+void relay_refill(relay* r, const struct timespec* now);
+void write_capture(const session* s, const service* svc, uint8_t type, const void* data, size_t len);
+void relay_poll_fds(const session* s, struct pollfd* conn_fd, struct pollfd* sock_fd);
+void relay_session(const service* svc, session* s, const struct pollfd* conn_fd, const struct pollfd* sock_fd);
+
+/* pwnable_fork_server.c */
+void reap_fork_server(service* svc);
+bool fork_server_spawn(service* svc);
+bool serve_fork_server(service* svc);
+void fork_server_lost(service* svc, const char* why);
+void enforce_fork_server_deadline(service* svc);
+void fork_server_stop(service* svc);
+
+/* pwnable_auth.c */
+bool init_pow_secret(void);
+void begin_auth(service* svc, int conn, const struct sockaddr_in* cli_addr, const conn_trace* trace);
+void serve_auths(service* svc, const struct pollfd* fds);
+
+/* pwnable_metrics.c */
+void record_duration(double duration);
+void accept_metrics_client(service* svc);
+void serve_metrics_client(int client);
+int create_metrics_listener(void);
+
+/* pwnable_upgrade.c */
+void upgrade_server(service* svcs, unsigned svc_count, const int* socks, unsigned sock_count);
+void adopt_inherited_tables(service* svcs, unsigned svc_count);
+bool load_upgrade_state(void);
+int take_inherited_listener(unsigned short port);
+void close_inherited_listeners(void);
+
+/* pwnable_threaded.c */
+int serve_threaded(service* svc, conn_handler* handler);
+
+#pragma GCC visibility pop
+
+#endif /* PWNABLE_INTERNAL_H */
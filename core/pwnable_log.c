@@ -0,0 +1,288 @@
+//
+//  pwnable_log.c
+//  PwnableHarness
+//
+//  Event log: a lock-free ring of log records in shared memory, drained to
+//  standard error as JSON lines by a logger process.
+//
+
+#include "pwnable_internal.h"
+
+/* Shared with the rest of the library, documented in pwnable_internal.h */
+log_ring* logs = NULL;
+int logs_fd = -1;
+pid_t logger_pid = -1;
+
+/*! Names of each log_type as they appear in the JSON output. */
+static const char* const log_type_names[] = {
+	"message",
+	"error",
+	"connection",
+	"rejected",
+	"password_ok",
+	"password_bad",
+	"password_missing",
+	"timeout",
+	"pow_failed",
+};
+
+/*! Nanoseconds to wait for a claimed record to be published before skipping
+ * it, in case the process that claimed it was killed partway through.
+ */
+#define LOG_STALL_NS 1000000000ull
+
+/*! Writes a log record to a stream as a single line of JSON. */
+static void write_log_json(FILE* fp, const log_record* rec) {
+	fprintf(
+		fp, "{\"time\":%llu.%06llu,\"pid\":%d,\"event\":\"%s\"",
+		(unsigned long long)(rec->time_ns / 1000000000ull),
+		(unsigned long long)(rec->time_ns % 1000000000ull / 1000),
+		rec->pid,
+		rec->type < ARRAYSIZE(log_type_names) ? log_type_names[rec->type] : "unknown"
+	);
+	
+	if(rec->ip != 0 || rec->port != 0) {
+		fprintf(
+			fp, ",\"ip\":\"%u.%u.%u.%u\",\"port\":%u",
+			rec->ip>>24, (rec->ip>>16)&255, (rec->ip>>8)&255, rec->ip&255, rec->port
+		);
+	}
+	
+	if(rec->err != 0) {
+		fprintf(fp, ",\"errno\":%d,\"error\":\"%s\"", rec->err, strerror(rec->err));
+	}
+	
+	if(rec->detail[0] != '\0') {
+		/* Escape everything that isn't printable ASCII, as the detail may contain client input */
+		fputs(",\"detail\":\"", fp);
+		const unsigned char* p;
+		for(p = (const unsigned char*)rec->detail; *p != '\0'; p++) {
+			if(*p == '"' || *p == '\\') {
+				fprintf(fp, "\\%c", *p);
+			}
+			else if(*p < 0x20 || *p > 0x7e) {
+				fprintf(fp, "\\u%04x", *p);
+			}
+			else {
+				fputc(*p, fp);
+			}
+		}
+		fputc('"', fp);
+	}
+	
+	fputs("}\n", fp);
+}
+
+/*! Logs an event. From any process forked from the server, this just copies
+ * a record into the shared log ring, and the logger process writes it out.
+ * @param pid Process the event is about, or 0 for the calling process
+ * @param addr Client address the event is about, or NULL
+ * @param err errno value describing a failure, or 0
+ * @param fmt printf-style format for the record's detail text
+ */
+void log_event(pid_t pid, log_type type, const struct sockaddr_in* addr, int err, const char* fmt, ...) {
+	log_record rec;
+	rec.type = type;
+	rec.pid = pid != 0 ? pid : outer_pid != 0 ? outer_pid : getpid();
+	rec.err = err;
+	rec.ip = addr != NULL ? ntohl(addr->sin_addr.s_addr) : 0;
+	rec.port = addr != NULL ? ntohs(addr->sin_port) : 0;
+	rec.time_ns = monotonic_ns();
+	
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(rec.detail, sizeof(rec.detail), fmt, ap);
+	va_end(ap);
+	
+	if(logs == NULL) {
+		if(stderr_fp != NULL) {
+			write_log_json(stderr_fp, &rec);
+		}
+		return;
+	}
+	
+	/* Claim a slot */
+	log_record* slot;
+	unsigned pos = __atomic_load_n(&logs->head, __ATOMIC_RELAXED);
+	while(1) {
+		slot = &logs->records[pos % LOG_RING_SIZE];
+		unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int diff = (int)(seq - pos);
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&logs->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if(diff < 0) {
+			/* The ring is full, so drop this record rather than wait for the logger */
+			__atomic_add_fetch(&logs->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else {
+			pos = __atomic_load_n(&logs->head, __ATOMIC_RELAXED);
+		}
+	}
+	
+	/* Fill it in and publish it, unless the logger gave up waiting on us */
+	memcpy((char*)slot + sizeof(slot->seq), (char*)&rec + sizeof(rec.seq), sizeof(rec) - sizeof(rec.seq));
+	unsigned expected = pos;
+	__atomic_compare_exchange_n(&slot->seq, &expected, pos + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/*! Writes out all published records from the log ring.
+ * @return Number of records written
+ */
+static unsigned drain_logs(void) {
+	static uint64_t stall_start = 0;
+	unsigned count = 0;
+	
+	while(1) {
+		unsigned pos = logs->tail;
+		log_record* slot = &logs->records[pos % LOG_RING_SIZE];
+		unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq != pos + 1) {
+			/* Has this slot been claimed by a process that hasn't published it yet? */
+			if(seq != pos || __atomic_load_n(&logs->head, __ATOMIC_RELAXED) == pos) {
+				stall_start = 0;
+				break;
+			}
+			
+			uint64_t now = monotonic_ns();
+			if(stall_start == 0) {
+				stall_start = now;
+			}
+			if(now - stall_start < LOG_STALL_NS) {
+				break;
+			}
+			
+			/* Its producer probably died, so skip the slot unless it just got published */
+			unsigned expected = pos;
+			if(__atomic_compare_exchange_n(&slot->seq, &expected, pos + LOG_RING_SIZE, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				stall_start = 0;
+				logs->tail = pos + 1;
+				continue;
+			}
+		}
+		
+		stall_start = 0;
+		write_log_json(stderr_fp, slot);
+		__atomic_store_n(&slot->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		logs->tail = pos + 1;
+		count++;
+	}
+	
+	unsigned dropped = __atomic_exchange_n(&logs->dropped, 0, __ATOMIC_RELAXED);
+	if(dropped > 0) {
+		log_record rec;
+		memset(&rec, 0, sizeof(rec));
+		rec.type = LOG_ERROR;
+		rec.pid = getpid();
+		rec.time_ns = monotonic_ns();
+		snprintf(rec.detail, sizeof(rec.detail), "Log ring full, dropped %u records", dropped);
+		write_log_json(stderr_fp, &rec);
+	}
+	
+	if(count > 0 || dropped > 0) {
+		fflush(stderr_fp);
+	}
+	
+	return count;
+}
+
+/*! Body of the logger process, which writes records from the log ring to
+ * standard error until the server process exits.
+ */
+static void run_logger(pid_t server_pid) {
+	/* Only write out whole batches of lines */
+	setvbuf(stderr_fp, NULL, _IOFBF, 0);
+	
+	/* Keep going until the server is gone so its last words get logged,
+	 * which includes any servers that it re-execs itself as
+	 */
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	
+	while(1) {
+		bool server_alive = getppid() == server_pid;
+		if(drain_logs() == 0) {
+			if(!server_alive) {
+				break;
+			}
+			
+			/* Nothing to do, so check again in 10ms */
+			struct timespec delay = {0, 10000000};
+			nanosleep(&delay, NULL);
+		}
+	}
+	
+	fflush(stderr_fp);
+}
+/*! Creates the shared log ring and forks the logger process that drains it.
+ * A server that was re-exec'd keeps using the ring and logger of the server
+ * before it instead.
+ * @param socks Listening sockets, which the logger process closes
+ * @param metrics_sock Metrics listening socket, which the logger also closes
+ * @return True on success
+ */
+bool start_logger(const int* socks, unsigned sock_count, int metrics_sock) {
+	log_ring* ring = NULL;
+	if(inherited != NULL) {
+		if(inherited->sizes[4] == sizeof(*ring)) {
+			ring = map_inherited(inherited->logs_fd, sizeof(*ring));
+		}
+		else if(inherited->logs_fd != -1) {
+			close(inherited->logs_fd);
+		}
+		
+		if(ring != NULL) {
+			logs = ring;
+			logs_fd = inherited->logs_fd;
+			logger_pid = inherited->logger_pid;
+			return true;
+		}
+		
+		/* The old logger would otherwise wait on a ring that nothing writes to anymore */
+		if(inherited->logger_pid > 0) {
+			kill(inherited->logger_pid, SIGKILL);
+		}
+	}
+	
+	ring = map_shared(sizeof(*ring), &logs_fd);
+	if(ring == NULL) {
+		PERROR("mmap");
+		return false;
+	}
+	
+	unsigned i;
+	for(i = 0; i < LOG_RING_SIZE; i++) {
+		ring->records[i].seq = i;
+	}
+	
+	pid_t server_pid = getpid();
+	pid_t pid = fork();
+	if(pid < 0) {
+		PERROR("fork");
+		munmap(ring, sizeof(*ring));
+		if(logs_fd != -1) {
+			close(logs_fd);
+			logs_fd = -1;
+		}
+		return false;
+	}
+	else if(pid == 0) {
+		for(i = 0; i < sock_count; i++) {
+			close(socks[i]);
+		}
+		if(metrics_sock != -1) {
+			close(metrics_sock);
+		}
+		
+		logs = ring;
+		run_logger(server_pid);
+		_exit(EXIT_SUCCESS);
+	}
+	
+	logs = ring;
+	logger_pid = pid;
+	return true;
+}
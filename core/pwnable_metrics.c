@@ -0,0 +1,242 @@
+//
+//  pwnable_metrics.c
+//  PwnableHarness
+//
+//  Metrics endpoint serving the shared counters in the Prometheus text format.
+//
+
+#include "pwnable_internal.h"
+
+/*! Label of each reject_reason in the metrics. */
+static const char* const reject_labels[REJECT_REASONS] = {
+	"rate",
+	"per_ip",
+	"busy",
+	"spawn",
+};
+
+/*! Adds the duration in seconds of an ended session to its histogram. */
+void record_duration(double duration) {
+	unsigned bucket;
+	for(bucket = 0; bucket < ARRAYSIZE(duration_bounds); bucket++) {
+		if(duration <= duration_bounds[bucket]) {
+			break;
+		}
+	}
+	STAT_ADD(duration_buckets[bucket], 1);
+	STAT_ADD(duration_sum_ms, (unsigned long)(duration * 1000));
+}
+/*! Writes a metric's HELP and TYPE lines. */
+static size_t metrics_header(char* buf, size_t size, size_t len, const char* name, const char* type, const char* help) {
+	if(len < size) {
+		len += snprintf(&buf[len], size - len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	}
+	return len;
+}
+
+/*! Appends one sample line to the metrics text. */
+static size_t metrics_sample(char* buf, size_t size, size_t len, const char* fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+static size_t metrics_sample(char* buf, size_t size, size_t len, const char* fmt, ...) {
+	if(len < size) {
+		va_list ap;
+		va_start(ap, fmt);
+		len += vsnprintf(&buf[len], size - len, fmt, ap);
+		va_end(ap);
+	}
+	return len;
+}
+
+/*! Formats the server's statistics in the Prometheus text exposition format.
+ * @return Length of the text, which is truncated if it's at least size
+ */
+static size_t format_metrics(char* buf, size_t size) {
+	size_t len = 0;
+	unsigned i;
+	
+#define COUNTER(name, field, help) \
+	len = metrics_header(buf, size, len, "pwnableserver_" name, "counter", help); \
+	len = metrics_sample(buf, size, len, "pwnableserver_" name " %lu\n", __atomic_load_n(&shared->field, __ATOMIC_RELAXED))
+	
+	COUNTER("accepts_total", accepts, "Connections accepted.");
+	COUNTER("accept_errors_total", accept_errors, "Failed calls to accept().");
+	COUNTER("fork_failures_total", fork_failures, "Failed attempts to fork a session or pool worker.");
+	COUNTER("password_failures_total", password_failures, "Sessions that entered a wrong password or none at all.");
+	COUNTER("pow_failures_total", pow_failures, "Connections that didn't send a valid proof of work in time.");
+	COUNTER("timeout_kills_total", timeout_kills, "Sessions killed for running past their wall-clock time limit.");
+	COUNTER("cpu_limit_kills_total", cpu_limit_kills, "Sessions killed for using up their CPU time budget.");
+	COUNTER("idle_kills_total", idle_kills, "Relayed sessions killed for going without traffic.");
+	COUNTER("relay_bytes_in_total", relay_bytes[RELAY_IN], "Bytes relayed from clients to challenges.");
+	COUNTER("relay_bytes_out_total", relay_bytes[RELAY_OUT], "Bytes relayed from challenges to clients.");
+#undef COUNTER
+	
+	len = metrics_header(buf, size, len, "pwnableserver_rejected_total", "counter", "Connections turned away by admission control.");
+	for(i = 0; i < REJECT_REASONS; i++) {
+		len = metrics_sample(buf, size, len, "pwnableserver_rejected_total{reason=\"%s\"} %lu\n", reject_labels[i], shared->rejected[i]);
+	}
+	
+	len = metrics_header(buf, size, len, "pwnableserver_live_sessions", "gauge", "Sessions currently running.");
+	len = metrics_sample(buf, size, len, "pwnableserver_live_sessions %u\n", __atomic_load_n(&shared->live_sessions, __ATOMIC_RELAXED));
+	len = metrics_header(buf, size, len, "pwnableserver_queued_connections", "gauge", "Connections waiting for a free session slot.");
+	len = metrics_sample(buf, size, len, "pwnableserver_queued_connections %u\n", __atomic_load_n(&shared->queued, __ATOMIC_RELAXED));
+	
+	/* Histogram buckets are cumulative */
+	len = metrics_header(buf, size, len, "pwnableserver_session_duration_seconds", "histogram", "Wall-clock duration of ended sessions.");
+	unsigned long cumulative = 0;
+	for(i = 0; i < ARRAYSIZE(duration_bounds); i++) {
+		cumulative += shared->duration_buckets[i];
+		len = metrics_sample(buf, size, len, "pwnableserver_session_duration_seconds_bucket{le=\"%g\"} %lu\n", duration_bounds[i], cumulative);
+	}
+	cumulative += shared->duration_buckets[i];
+	len = metrics_sample(buf, size, len, "pwnableserver_session_duration_seconds_bucket{le=\"+Inf\"} %lu\n", cumulative);
+	len = metrics_sample(buf, size, len, "pwnableserver_session_duration_seconds_sum %.3f\n", shared->duration_sum_ms / 1000.0);
+	len = metrics_sample(buf, size, len, "pwnableserver_session_duration_seconds_count %lu\n", cumulative);
+	
+	len = metrics_header(buf, size, len, "pwnableserver_session_exits_total", "counter", "Sessions that exited normally, by exit status.");
+	for(i = 0; i < ARRAYSIZE(shared->exit_codes); i++) {
+		if(shared->exit_codes[i] != 0) {
+			len = metrics_sample(buf, size, len, "pwnableserver_session_exits_total{code=\"%u\"} %lu\n", i, shared->exit_codes[i]);
+		}
+	}
+	
+	len = metrics_header(buf, size, len, "pwnableserver_session_signals_total", "counter", "Sessions that were killed by a signal, by signal number.");
+	for(i = 0; i < ARRAYSIZE(shared->exit_signals); i++) {
+		if(shared->exit_signals[i] != 0) {
+			len = metrics_sample(buf, size, len, "pwnableserver_session_signals_total{signal=\"%u\"} %lu\n", i, shared->exit_signals[i]);
+		}
+	}
+	
+	return len;
+}
+
+/*! Accepts a connection to the metrics endpoint, to be answered once its request arrives. */
+void accept_metrics_client(service* svc) {
+	int client = accept(svc->metrics_sock, NULL, NULL);
+	if(client == -1) {
+		PERROR("accept(metrics)");
+		return;
+	}
+	
+	if(fcntl(client, F_SETFD, FD_CLOEXEC) != 0 || fcntl(client, F_SETFL, O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		close(client);
+		return;
+	}
+	
+	/* Make room by dropping the oldest client that never sent its request */
+	if(svc->metrics_client_count == METRICS_CLIENTS_MAX) {
+		close(svc->metrics_clients[0]);
+		memmove(&svc->metrics_clients[0], &svc->metrics_clients[1], (METRICS_CLIENTS_MAX - 1) * sizeof(svc->metrics_clients[0]));
+		svc->metrics_client_count--;
+	}
+	
+	svc->metrics_clients[svc->metrics_client_count++] = client;
+}
+
+/*! Answers a metrics request with the current statistics, then hangs up.
+ * @note Any request at all is answered the same way, so this works both for
+ *   HTTP scrapers like Prometheus and for something like `nc`.
+ */
+void serve_metrics_client(int client) {
+	char request[1024];
+	if(read(client, request, sizeof(request)) < 0 && errno == EAGAIN) {
+		/* Nothing to answer yet */
+	}
+	
+	static char body[32768];
+	size_t body_len = format_metrics(body, sizeof(body));
+	if(body_len >= sizeof(body)) {
+		body_len = sizeof(body) - 1;
+	}
+	
+	char header[128];
+	int header_len = snprintf(
+		header, sizeof(header),
+		"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n",
+		(unsigned long)body_len
+	);
+	
+	/* Never wait on a slow scraper, as that would stall accepting connections */
+	int flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	if(send(client, header, header_len, flags) == header_len) {
+		if(send(client, body, body_len, flags) < 0) {
+			/* The scraper can try again later */
+		}
+	}
+	
+	shutdown(client, SHUT_WR);
+	close(client);
+}
+/*! Creates the listening socket for the metrics endpoint, either on a TCP
+ * port or at the path of a Unix socket.
+ * @return The listening socket, or -1 on error
+ */
+int create_metrics_listener(void) {
+	int sock;
+	if(metrics_path != NULL) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(metrics_path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "Error: Metrics socket path '%s' is too long.\n", metrics_path);
+			return -1;
+		}
+		strcpy(addr.sun_path, metrics_path);
+		
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(sock == -1) {
+			perror("socket");
+			return -1;
+		}
+		
+		/* Replace the socket left behind by a previous server */
+		unlink(metrics_path);
+		if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+			perror(metrics_path);
+			close(sock);
+			return -1;
+		}
+	}
+	else {
+		sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if(sock == -1) {
+			perror("socket");
+			return -1;
+		}
+		
+		int reuse = 1;
+		if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0) {
+			perror("setsockopt");
+			close(sock);
+			return -1;
+		}
+		
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = INADDR_ANY;
+		addr.sin_port = htons(metrics_port);
+		if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+			perror("bind(metrics)");
+			close(sock);
+			return -1;
+		}
+	}
+	
+	if(fcntl(sock, F_SETFD, FD_CLOEXEC) != 0) {
+		perror("fcntl");
+		close(sock);
+		return -1;
+	}
+	
+	if(listen(sock, METRICS_CLIENTS_MAX) != 0) {
+		perror("listen(metrics)");
+		close(sock);
+		return -1;
+	}
+	
+	return sock;
+}
@@ -0,0 +1,295 @@
+//
+//  pwnable_relay.c
+//  PwnableHarness
+//
+//  Relaying of sessions through the server with --relay, including rate
+//  limiting and capturing client traffic with --capture.
+//
+
+#include "pwnable_internal.h"
+
+/*! Most client data captured at once. A single page always fits in an empty
+ * pipe, so it can be passed on with one write().
+ */
+#define CAPTURE_CHUNK 4096
+
+/*! Maximum number of bytes moved by a single splice() call, matching the default pipe size. */
+#define RELAY_CHUNK 65536
+
+/*! Closes the server's side of a relayed session, if it has one. */
+void relay_close(relay* r) {
+	if(r->sock == -1) {
+		return;
+	}
+	
+	close(r->sock);
+	r->sock = -1;
+	
+	unsigned dir;
+	for(dir = 0; dir < 2; dir++) {
+		relay_dir* d = &r->dirs[dir];
+		if(d->pipe[0] != -1) {
+			close(d->pipe[0]);
+		}
+		if(d->pipe[1] != -1) {
+			close(d->pipe[1]);
+		}
+	}
+}
+
+/*! Sets up the server's side of a relayed session.
+ * @param conn Client connection, which the server keeps instead of handing it to the session
+ * @param peer Set to the socket that the session process should use in place of the connection
+ * @return True on success
+ */
+bool relay_open(relay* r, int conn, int* peer) {
+	r->sock = -1;
+	unsigned dir;
+	for(dir = 0; dir < 2; dir++) {
+		relay_dir* d = &r->dirs[dir];
+		d->pipe[0] = d->pipe[1] = -1;
+		d->pending = 0;
+		d->eof = false;
+		d->shut = false;
+		d->bytes = 0;
+		d->tokens = relay_rate;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &r->last_active);
+	r->last_refill = r->last_active;
+	
+#ifdef __linux__
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+		PERROR("socketpair");
+		return false;
+	}
+	r->sock = pair[0];
+	*peer = pair[1];
+	
+	for(dir = 0; dir < 2; dir++) {
+		if(pipe2(r->dirs[dir].pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+			PERROR("pipe2");
+			goto fail;
+		}
+	}
+	
+	/* One slow side of a session must never stall the server */
+	if(fcntl(r->sock, F_SETFL, O_NONBLOCK) != 0 || fcntl(conn, F_SETFL, O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		goto fail;
+	}
+	
+	return true;
+	
+fail:
+	relay_close(r);
+	close(*peer);
+	return false;
+#else
+	(void)conn;
+	(void)peer;
+	log_event(0, LOG_ERROR, NULL, 0, "Relaying connections is only supported on Linux");
+	return false;
+#endif
+}
+
+/*! Gives up on relaying anything more in either direction. */
+void relay_abandon(relay* r) {
+	unsigned dir;
+	for(dir = 0; dir < 2; dir++) {
+		r->dirs[dir].eof = true;
+		r->dirs[dir].shut = true;
+		r->dirs[dir].pending = 0;
+	}
+}
+
+/*! Smallest amount of rate limit tokens worth reading with, so that a
+ * throttled session moves reasonably sized chunks rather than single bytes.
+ */
+double relay_min_tokens(void) {
+	return relay_rate < RELAY_CHUNK ? relay_rate : RELAY_CHUNK;
+}
+
+/*! Adds the rate limit tokens earned since the last refill, up to one second's worth. */
+void relay_refill(relay* r, const struct timespec* now) {
+	if(relay_rate == 0) {
+		return;
+	}
+	
+	double earned = elapsed_seconds(&r->last_refill, now) * relay_rate;
+	r->last_refill = *now;
+	
+	unsigned dir;
+	for(dir = 0; dir < 2; dir++) {
+		relay_dir* d = &r->dirs[dir];
+		d->tokens += earned;
+		if(d->tokens > relay_rate) {
+			d->tokens = relay_rate;
+		}
+	}
+}
+
+/*! Checks whether the source of one direction of a relay should be read from. */
+static bool relay_wants_input(const relay_dir* d) {
+	return !d->eof && d->pending == 0 && (relay_rate == 0 || d->tokens >= relay_min_tokens());
+}
+
+/*! Appends a record about a session to the capture file.
+ * @param data Client data following a CAPTURE_DATA record
+ */
+void write_capture(const session* s, const service* svc, uint8_t type, const void* data, size_t len) {
+	capture_record rec;
+	memset(&rec, 0, sizeof(rec));
+	
+	if(type == CAPTURE_START) {
+		rec.time_us = (uint64_t)s->start_wall.tv_sec * 1000000 + s->start_wall.tv_nsec / 1000;
+	}
+	else {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rec.time_us = (uint64_t)(elapsed_seconds(&s->start, &now) * 1e6);
+	}
+	rec.session = s->capture_id;
+	rec.len = len;
+	rec.port = svc->port;
+	rec.type = type;
+	
+	/* Each record is appended with a single write, so acceptors never interleave */
+	struct iovec iov[2];
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = len;
+	if(writev(capture_fd, iov, len > 0 ? 2 : 1) < 0) {
+		PERROR("write(capture)");
+	}
+}
+
+/*! Reads client data for a relayed session that is being captured, copying
+ * it to the capture file on its way to the relay pipe.
+ * @return Number of bytes read, or like splice() 0 at the end of the stream and -1 on error
+ */
+static ssize_t capture_input(const session* s, const service* svc, int src, int dst_pipe, size_t len) {
+	char buf[CAPTURE_CHUNK];
+	if(len > sizeof(buf)) {
+		len = sizeof(buf);
+	}
+	
+	ssize_t n = recv(src, buf, len, 0);
+	if(n <= 0) {
+		return n;
+	}
+	
+	write_capture(s, svc, CAPTURE_DATA, buf, n);
+	if(write(dst_pipe, buf, n) != n) {
+		PERROR("write(relay pipe)");
+		errno = EPIPE;
+		return -1;
+	}
+	return n;
+}
+
+/*! Moves as many bytes as possible in one direction of a relayed session
+ * without blocking.
+ * @param src Socket the bytes come from
+ * @param dst Socket the bytes go to
+ */
+static void relay_pump(session* s, const service* svc, unsigned dir, int src, int dst) {
+#ifdef __linux__
+	relay* r = &s->relay;
+	relay_dir* d = &r->dirs[dir];
+	ssize_t n;
+	
+	if(relay_wants_input(d)) {
+		size_t len = RELAY_CHUNK;
+		if(relay_rate > 0 && d->tokens < len) {
+			len = (size_t)d->tokens;
+		}
+		
+		if(capture_fd != -1 && dir == RELAY_IN) {
+			n = capture_input(s, svc, src, d->pipe[1], len);
+		}
+		else {
+			n = splice(src, NULL, d->pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		}
+		if(n > 0) {
+			if(dir == RELAY_OUT && d->bytes == 0 && s->trace.id != 0) {
+				s->first_out = monotonic_ns();
+			}
+			d->pending += n;
+			d->bytes += n;
+			d->tokens -= n;
+			clock_gettime(CLOCK_MONOTONIC, &r->last_active);
+			STAT_ADD(relay_bytes[dir], n);
+		}
+		else if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			d->eof = true;
+		}
+	}
+	
+	if(d->pending > 0) {
+		n = splice(d->pipe[0], NULL, dst, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n > 0) {
+			d->pending -= n;
+		}
+		else if(n < 0 && errno != EAGAIN && errno != EINTR) {
+			/* Nobody is reading anymore, so make further writes by the source fail like they would have */
+			d->eof = true;
+			d->pending = 0;
+			shutdown(src, SHUT_RD);
+		}
+	}
+	
+	/* Pass on the end of the stream once everything before it was delivered */
+	if(d->eof && d->pending == 0 && !d->shut) {
+		shutdown(dst, SHUT_WR);
+		d->shut = true;
+		if(capture_fd != -1 && dir == RELAY_IN) {
+			write_capture(s, svc, CAPTURE_EOF, NULL, 0);
+		}
+	}
+#else
+	(void)s;
+	(void)svc;
+	(void)dir;
+	(void)src;
+	(void)dst;
+#endif
+}
+
+/*! Fills in the poll entries for a relayed session's client connection and
+ * its socket to the challenge.
+ */
+void relay_poll_fds(const session* s, struct pollfd* conn_fd, struct pollfd* sock_fd) {
+	const relay* r = &s->relay;
+	
+	conn_fd->events = 0;
+	sock_fd->events = 0;
+	if(relay_wants_input(&r->dirs[RELAY_IN])) {
+		conn_fd->events |= POLLIN;
+	}
+	if(r->dirs[RELAY_IN].pending > 0) {
+		sock_fd->events |= POLLOUT;
+	}
+	if(relay_wants_input(&r->dirs[RELAY_OUT])) {
+		sock_fd->events |= POLLIN;
+	}
+	if(r->dirs[RELAY_OUT].pending > 0) {
+		conn_fd->events |= POLLOUT;
+	}
+	
+	/* Sockets with nothing to wait for are skipped, or a hangup would wake the loop forever */
+	conn_fd->fd = conn_fd->events != 0 ? s->conn : -1;
+	sock_fd->fd = sock_fd->events != 0 ? r->sock : -1;
+	conn_fd->revents = 0;
+	sock_fd->revents = 0;
+}
+
+/*! Relays whatever traffic a session's poll entries say is ready to move. */
+void relay_session(const service* svc, session* s, const struct pollfd* conn_fd, const struct pollfd* sock_fd) {
+	relay* r = &s->relay;
+	if(conn_fd->revents != 0 || sock_fd->revents != 0) {
+		relay_pump(s, svc, RELAY_IN, s->conn, r->sock);
+		relay_pump(s, svc, RELAY_OUT, r->sock, s->conn);
+	}
+}
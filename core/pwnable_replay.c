@@ -0,0 +1,628 @@
+//
+//  pwnable_replay.c
+//  PwnableHarness
+//
+//  Replays client traffic captured by `pwnableserver --capture` against a
+//  server, either with the original timing or as fast as possible, to
+//  benchmark it with realistic sessions.
+//
+
+#include "pwnable_bench_common.h"
+#include "pwnable_capture.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*! Data the client sent at one point during a recorded session. */
+typedef struct replay_chunk {
+	uint64_t time_us;              /*!< Microseconds since the session started */
+	const char* data;              /*!< Bytes sent, pointing into the loaded capture file */
+	size_t len;                    /*!< Number of bytes in data */
+} replay_chunk;
+
+/*! A session loaded from the capture file. */
+typedef struct replay_session {
+	uint32_t id;                   /*!< Number of the session in the capture file */
+	uint64_t start_us;             /*!< Wall-clock start time in microseconds since the epoch */
+	uint16_t port;                 /*!< Port of the service it was captured on */
+	replay_chunk* chunks;          /*!< Data sent by the client, in order */
+	size_t chunk_count;            /*!< Number of entries in chunks */
+	size_t chunk_cap;              /*!< Allocated capacity of chunks */
+	bool has_eof;                  /*!< Whether the client shut down its side of the connection */
+	uint64_t eof_us;               /*!< When the client shut down its side, if has_eof */
+	bool ended;                    /*!< Whether the end of the session was recorded */
+	uint64_t end_us;               /*!< Duration of the session, if ended */
+} replay_session;
+
+/*! State of one replayed connection. */
+typedef enum conn_state {
+	CONN_CONNECTING,               /*!< Waiting for the TCP handshake to finish */
+	CONN_RUNNING,                  /*!< Sending the recorded data and reading output */
+} conn_state;
+
+/*! A connection replaying a recorded session. */
+typedef struct replay_conn {
+	int sock;                      /*!< Socket, or -1 for a free slot */
+	conn_state state;              /*!< What the connection is waiting for */
+	const replay_session* session; /*!< Recorded session being replayed */
+	size_t chunk;                  /*!< Index of the next chunk to send */
+	size_t sent;                   /*!< Bytes of that chunk already sent */
+	size_t password_sent;          /*!< Bytes of the password line already sent */
+	bool shut;                     /*!< Whether the connection was shut down for writing */
+	bool got_byte;                 /*!< Whether any output has been received */
+	double start;                  /*!< Time when the connection was started */
+	double connected;              /*!< Time when the connection was established */
+} replay_conn;
+
+/*! Recorded sessions, in the order they started. */
+static replay_session* sessions = NULL;
+static size_t session_count = 0;
+
+/*! Speed factor for the recorded timing, or 0 to send everything right away. */
+static double speed = 1;
+
+/*! Line sent before the recorded data, for servers that ask for a password. */
+static char* password_line = NULL;
+static size_t password_len = 0;
+
+static samples connect_times;
+static samples first_byte_times;
+static samples session_times;
+static samples recorded_times;
+static unsigned long failures[FAIL_KINDS];
+static unsigned long long bytes_sent;
+static unsigned long long bytes_received;
+
+/*! Converts a time recorded in a session to a delay in seconds at the replay speed. */
+static double replay_delay(uint64_t time_us) {
+	return speed > 0 ? time_us / 1e6 / speed : 0;
+}
+
+/*! Finds a session that has started but not yet ended in the capture file. */
+static replay_session* find_open_session(uint32_t id, size_t* open_ids, size_t open_count) {
+	size_t i = open_count;
+	while(i-- > 0) {
+		if(sessions[open_ids[i]].id == id) {
+			return &sessions[open_ids[i]];
+		}
+	}
+	return NULL;
+}
+
+static int compare_sessions(const void* a, const void* b) {
+	const replay_session* x = a;
+	const replay_session* y = b;
+	return x->start_us < y->start_us ? -1 : x->start_us > y->start_us;
+}
+
+/*! Loads the sessions recorded in a capture file.
+ * @param port Only load sessions captured on this port, or 0 for all
+ * @return True on success
+ */
+static bool load_capture(const char* path, unsigned port) {
+	FILE* fp = fopen(path, "rb");
+	if(fp == NULL) {
+		perror(path);
+		return false;
+	}
+	
+	/* The whole file stays in memory, and chunks point into it */
+	char* contents = NULL;
+	size_t size = 0;
+	size_t cap = 0;
+	while(!feof(fp)) {
+		if(size == cap) {
+			cap = cap ? cap * 2 : 1 << 20;
+			contents = realloc(contents, cap);
+			if(contents == NULL) {
+				perror("realloc");
+				fclose(fp);
+				return false;
+			}
+		}
+		size += fread(contents + size, 1, cap - size, fp);
+		if(ferror(fp)) {
+			perror(path);
+			fclose(fp);
+			return false;
+		}
+	}
+	fclose(fp);
+	
+	if(size < sizeof(CAPTURE_MAGIC) - 1 || memcmp(contents, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) != 0) {
+		fprintf(stderr, "Error: %s is not a pwnableserver capture file\n", path);
+		return false;
+	}
+	
+	/* Sessions recorded as started but not yet as ended, by index */
+	size_t* open_ids = NULL;
+	size_t open_count = 0;
+	size_t session_cap = 0;
+	
+	size_t pos = sizeof(CAPTURE_MAGIC) - 1;
+	while(pos + sizeof(capture_record) <= size) {
+		capture_record rec;
+		memcpy(&rec, contents + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if(rec.type == CAPTURE_DATA && rec.len > size - pos) {
+			break;
+		}
+		
+		replay_session* s = find_open_session(rec.session, open_ids, open_count);
+		if(rec.type == CAPTURE_START) {
+			/* A restarted server numbers its sessions from 0 again */
+			if(s != NULL) {
+				s->id = UINT32_MAX;
+			}
+			
+			if(port != 0 && rec.port != port) {
+				continue;
+			}
+			
+			if(session_count == session_cap) {
+				session_cap = session_cap ? session_cap * 2 : 256;
+				sessions = realloc(sessions, session_cap * sizeof(*sessions));
+				open_ids = realloc(open_ids, session_cap * sizeof(*open_ids));
+				if(sessions == NULL || open_ids == NULL) {
+					perror("realloc");
+					return false;
+				}
+			}
+			
+			s = &sessions[session_count];
+			memset(s, 0, sizeof(*s));
+			s->id = rec.session;
+			s->start_us = rec.time_us;
+			s->port = rec.port;
+			open_ids[open_count++] = session_count++;
+			continue;
+		}
+		
+		if(s == NULL) {
+			/* Started before the capture file was opened, or filtered out */
+			if(rec.type == CAPTURE_DATA) {
+				pos += rec.len;
+			}
+			continue;
+		}
+		
+		switch(rec.type) {
+			case CAPTURE_DATA:
+				if(s->chunk_count == s->chunk_cap) {
+					s->chunk_cap = s->chunk_cap ? s->chunk_cap * 2 : 16;
+					s->chunks = realloc(s->chunks, s->chunk_cap * sizeof(*s->chunks));
+					if(s->chunks == NULL) {
+						perror("realloc");
+						return false;
+					}
+				}
+				s->chunks[s->chunk_count].time_us = rec.time_us;
+				s->chunks[s->chunk_count].data = contents + pos;
+				s->chunks[s->chunk_count].len = rec.len;
+				s->chunk_count++;
+				pos += rec.len;
+				break;
+			
+			case CAPTURE_EOF:
+				s->has_eof = true;
+				s->eof_us = rec.time_us;
+				break;
+			
+			case CAPTURE_END: {
+				s->ended = true;
+				s->end_us = rec.time_us;
+				
+				size_t i;
+				for(i = 0; i < open_count; i++) {
+					if(&sessions[open_ids[i]] == s) {
+						open_ids[i] = open_ids[--open_count];
+						break;
+					}
+				}
+				break;
+			}
+			
+			default:
+				fprintf(stderr, "Error: Unknown record type %u in %s\n", rec.type, path);
+				return false;
+		}
+	}
+	free(open_ids);
+	
+	if(pos != size) {
+		fprintf(stderr, "Warning: Ignoring a truncated record at the end of %s\n", path);
+	}
+	
+	qsort(sessions, session_count, sizeof(*sessions), &compare_sessions);
+	return true;
+}
+
+/*! Starts a non-blocking connection to the server to replay a session.
+ * @return True if the connection was started
+ */
+static bool start_conn(replay_conn* c, const replay_session* s) {
+	c->start = now_seconds();
+	c->session = s;
+	c->state = CONN_CONNECTING;
+	c->chunk = 0;
+	c->sent = 0;
+	c->password_sent = 0;
+	c->shut = false;
+	c->got_byte = false;
+	if(!connect_server(&c->sock)) {
+		return false;
+	}
+	if(c->sock == -1) {
+		failures[FAIL_CONNECT]++;
+	}
+	return true;
+}
+
+/*! Closes a connection, counting it as a failure of the given kind, or as a
+ * completed session if kind is -1.
+ */
+static void finish_conn(replay_conn* c, int kind, double now) {
+	if(kind < 0) {
+		add_sample(&session_times, now - c->start);
+		if(c->session->ended) {
+			add_sample(&recorded_times, c->session->end_us / 1e6);
+		}
+	}
+	else {
+		failures[kind]++;
+	}
+	
+	close(c->sock);
+	c->sock = -1;
+}
+
+/*! Sends bytes, counting them.
+ * @return Number of bytes sent, or -1 if the connection should be given up on
+ */
+static ssize_t send_some(replay_conn* c, const char* data, size_t len, double now) {
+	ssize_t n = send(c->sock, data, len, MSG_NOSIGNAL);
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EINTR) {
+			return 0;
+		}
+		finish_conn(c, FAIL_RESET, now);
+		return -1;
+	}
+	
+	bytes_sent += n;
+	return n;
+}
+
+/*! Sends everything that is due by now, as far as the socket will take it. */
+static void send_due(replay_conn* c, double now) {
+	const replay_session* s = c->session;
+	
+	while(c->password_sent < password_len) {
+		ssize_t n = send_some(c, password_line + c->password_sent, password_len - c->password_sent, now);
+		if(n <= 0) {
+			return;
+		}
+		c->password_sent += n;
+	}
+	
+	while(c->chunk < s->chunk_count) {
+		const replay_chunk* chunk = &s->chunks[c->chunk];
+		if(c->connected + replay_delay(chunk->time_us) > now) {
+			return;
+		}
+		
+		ssize_t n = send_some(c, chunk->data + c->sent, chunk->len - c->sent, now);
+		if(n <= 0) {
+			return;
+		}
+		
+		c->sent += n;
+		if(c->sent == chunk->len) {
+			c->chunk++;
+			c->sent = 0;
+		}
+	}
+	
+	if(s->has_eof && !c->shut && c->connected + replay_delay(s->eof_us) <= now) {
+		shutdown(c->sock, SHUT_WR);
+		c->shut = true;
+	}
+}
+
+/*! Time when a connection next has something to send, or 0 if never. */
+static double next_due(const replay_conn* c) {
+	const replay_session* s = c->session;
+	if(c->state != CONN_RUNNING) {
+		return 0;
+	}
+	if(c->chunk < s->chunk_count) {
+		return c->connected + replay_delay(s->chunks[c->chunk].time_us);
+	}
+	if(s->has_eof && !c->shut) {
+		return c->connected + replay_delay(s->eof_us);
+	}
+	return 0;
+}
+
+/*! Handles a poll() event on a connection. */
+static void service_conn(replay_conn* c, short revents, double now) {
+	if(c->state == CONN_CONNECTING) {
+		if(revents == 0) {
+			return;
+		}
+		
+		if(!server_connected(c->sock)) {
+			finish_conn(c, FAIL_CONNECT, now);
+			return;
+		}
+		
+		add_sample(&connect_times, now - c->start);
+		c->connected = now;
+		c->state = CONN_RUNNING;
+	}
+	
+	send_due(c, now);
+	if(c->sock == -1 || !(revents & (POLLIN | POLLHUP | POLLERR))) {
+		return;
+	}
+	
+	/* Output is discarded, as only its timing matters */
+	char buf[4096];
+	while(1) {
+		ssize_t n = recv(c->sock, buf, sizeof(buf), 0);
+		if(n > 0) {
+			if(!c->got_byte) {
+				c->got_byte = true;
+				add_sample(&first_byte_times, now - c->start);
+			}
+			bytes_received += n;
+			continue;
+		}
+		
+		if(n == 0) {
+			finish_conn(c, -1, now);
+		}
+		else if(errno != EAGAIN && errno != EINTR) {
+			finish_conn(c, FAIL_RESET, now);
+		}
+		return;
+	}
+}
+
+static void show_usage(const char* progname) {
+	printf("Usage: %s [options] <capture-file>\n"
+		"  Options:\n"
+		"    -h, --help                            "
+			"Display this help message\n"
+		"    -H, --host <host=127.0.0.1>           "
+			"Host that pwnableserver is running on\n"
+		"    -p, --port <port=32323>               "
+			"Port that pwnableserver is listening on\n"
+		"    -f, --filter-port <port>              "
+			"Only replay sessions that were captured on this port\n"
+		"    -c, --concurrency <count=50>          "
+			"Maximum number of sessions replayed at once\n"
+		"    -x, --speed <factor=1>                "
+			"Replay this many times faster than recorded, or 0 for as fast as possible\n"
+		"    -n, --repeat <count=1>                "
+			"Replay the recorded sessions this many times\n"
+		"    -k, --password <password>             "
+			"Enter this password before sending the recorded data\n"
+		"    -t, --timeout <seconds=60>            "
+			"Give up on sessions that take longer than this\n",
+		progname);
+}
+
+int main(int argc, char** argv) {
+	const char* host = "127.0.0.1";
+	const char* port = "32323";
+	const char* path = NULL;
+	unsigned filter_port = 0;
+	unsigned concurrency = 50;
+	unsigned repeat = 1;
+	double timeout = 60;
+	
+	int i;
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if(argv[i][0] != '-' && path == NULL) {
+			path = argv[i];
+		}
+		else if(i + 1 == argc) {
+			printf("Error: Missing value for argument '%s'\n", argv[i]);
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if(strcmp(argv[i], "--host") == 0 || strcmp(argv[i], "-H") == 0) {
+			host = argv[++i];
+		}
+		else if(strcmp(argv[i], "--port") == 0 || strcmp(argv[i], "-p") == 0) {
+			port = argv[++i];
+		}
+		else if(strcmp(argv[i], "--filter-port") == 0 || strcmp(argv[i], "-f") == 0) {
+			filter_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--concurrency") == 0 || strcmp(argv[i], "-c") == 0) {
+			concurrency = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--speed") == 0 || strcmp(argv[i], "-x") == 0) {
+			speed = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--repeat") == 0 || strcmp(argv[i], "-n") == 0) {
+			repeat = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--password") == 0 || strcmp(argv[i], "-k") == 0) {
+			const char* password = argv[++i];
+			password_len = strlen(password) + 1;
+			password_line = malloc(password_len + 1);
+			if(password_line == NULL) {
+				perror("malloc");
+				return EXIT_FAILURE;
+			}
+			snprintf(password_line, password_len + 1, "%s\n", password);
+		}
+		else if(strcmp(argv[i], "--timeout") == 0 || strcmp(argv[i], "-t") == 0) {
+			timeout = atof(argv[++i]);
+		}
+		else {
+			printf("Error: Unknown argument '%s'\n", argv[i]);
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	if(path == NULL) {
+		printf("Error: Missing the capture file to replay\n");
+		show_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	if(concurrency == 0 || repeat == 0 || speed < 0) {
+		printf("Error: The concurrency and repeat count must be positive, and the speed can't be negative\n");
+		return EXIT_FAILURE;
+	}
+	
+	if(!load_capture(path, filter_port) || !resolve_server(host, port)) {
+		return EXIT_FAILURE;
+	}
+	
+	if(session_count == 0) {
+		printf("Error: No sessions to replay in %s\n", path);
+		return EXIT_FAILURE;
+	}
+	
+	size_t total = session_count * repeat;
+	connect_times.values = calloc(total, sizeof(double));
+	first_byte_times.values = calloc(total, sizeof(double));
+	session_times.values = calloc(total, sizeof(double));
+	recorded_times.values = calloc(total, sizeof(double));
+	replay_conn* conns = calloc(concurrency, sizeof(*conns));
+	struct pollfd* fds = calloc(concurrency, sizeof(*fds));
+	if(connect_times.values == NULL || first_byte_times.values == NULL || session_times.values == NULL
+	   || recorded_times.values == NULL || conns == NULL || fds == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	
+	unsigned c;
+	for(c = 0; c < concurrency; c++) {
+		conns[c].sock = -1;
+	}
+	
+	/* Sessions start at their recorded offsets from the first one, and each repeat follows the last */
+	uint64_t first_us = sessions[0].start_us;
+	double span = replay_delay(sessions[session_count - 1].start_us - first_us);
+	
+	printf("Replaying %lu sessions from %s against %s:%s, %u at a time",
+		(unsigned long)session_count, path, host, port, concurrency);
+	if(repeat > 1) {
+		printf(", %u times", repeat);
+	}
+	if(speed > 0) {
+		printf(", at %gx speed", speed);
+	}
+	else {
+		printf(", as fast as possible");
+	}
+	printf("\n");
+	
+	size_t started = 0;
+	unsigned open_conns = 0;
+	double begin = now_seconds();
+	double now = begin;
+	while(started < total || open_conns > 0) {
+		/* Start the sessions that are due, as far as the concurrency allows */
+		for(c = 0; c < concurrency && started < total; c++) {
+			if(conns[c].sock != -1) {
+				continue;
+			}
+			
+			const replay_session* s = &sessions[started % session_count];
+			double due = begin + (started / session_count) * span + replay_delay(s->start_us - first_us);
+			if(due > now) {
+				break;
+			}
+			if(!start_conn(&conns[c], s)) {
+				return EXIT_FAILURE;
+			}
+			started++;
+		}
+		
+		/* Wake up for the next session start, the next data to send, and to check timeouts */
+		double wake = now + 0.1;
+		if(started < total) {
+			const replay_session* s = &sessions[started % session_count];
+			double due = begin + (started / session_count) * span + replay_delay(s->start_us - first_us);
+			if(due < wake) {
+				wake = due;
+			}
+		}
+		
+		open_conns = 0;
+		for(c = 0; c < concurrency; c++) {
+			replay_conn* conn = &conns[c];
+			fds[c].fd = conn->sock;
+			fds[c].events = 0;
+			fds[c].revents = 0;
+			if(conn->sock == -1) {
+				continue;
+			}
+			
+			open_conns++;
+			double due = next_due(conn);
+			if(conn->state == CONN_CONNECTING || (due != 0 && due <= now)) {
+				fds[c].events |= POLLOUT;
+			}
+			else if(due != 0 && due < wake) {
+				wake = due;
+			}
+			fds[c].events |= POLLIN;
+		}
+		
+		if(open_conns == 0 && started == total) {
+			break;
+		}
+		
+		int wait_ms = wake > now ? (int)((wake - now) * 1000) + 1 : 0;
+		if(poll(fds, concurrency, wait_ms) < 0 && errno != EINTR) {
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+		
+		now = now_seconds();
+		for(c = 0; c < concurrency; c++) {
+			replay_conn* conn = &conns[c];
+			if(conn->sock == -1) {
+				continue;
+			}
+			
+			/* Data may have come due without the socket being ready for anything */
+			if(fds[c].revents != 0 || conn->state == CONN_RUNNING) {
+				service_conn(conn, fds[c].revents, now);
+			}
+			if(conn->sock != -1 && timeout > 0 && now - conn->start > timeout) {
+				finish_conn(conn, FAIL_TIMEOUT, now);
+			}
+		}
+	}
+	
+	double elapsed = now_seconds() - begin;
+	unsigned long failed = report_results(session_times.count, elapsed, failures);
+	printf("Traffic:       %llu bytes sent, %llu bytes received\n\n", bytes_sent, bytes_received);
+	report_samples("Connect", &connect_times);
+	report_samples("First byte", &first_byte_times);
+	report_samples("Session", &session_times);
+	report_samples("Recorded", &recorded_times);
+	
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
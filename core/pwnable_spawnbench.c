@@ -0,0 +1,570 @@
+//
+//  pwnable_spawnbench.c
+//  PwnableHarness
+//
+//  Microbenchmark comparing ways of spawning a challenge process. Every
+//  strategy runs the same child setup as a session spawned by pwnableserver:
+//  stdio is redirected to a socket, privileges are dropped, the environment
+//  is cleaned up, and libraries are preloaded before the target is exec-ed.
+//
+
+#define _GNU_SOURCE /* For clone() */
+#include "pwnable_bench_common.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <spawn.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#define ARRAYSIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#ifdef __linux__
+/* Missing from the headers of older Ubuntu versions */
+#if !defined(SYS_clone3) && (defined(__x86_64__) || defined(__i386__))
+#define SYS_clone3 435
+#endif
+
+/*! Arguments to clone3(), matching the first version of struct clone_args. */
+typedef struct clone3_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+} clone3_args;
+#endif /* __linux__ */
+
+/*! Argument that makes this program act as the default spawn target. */
+#define CHILD_ARG "--spawned-child"
+
+/*! Spawns done before measuring each strategy, to warm up caches. */
+#define WARMUP_SPAWNS 10
+
+/*! Size of the stack used by children created with clone(CLONE_VM). */
+#define CLONE_STACK_SIZE (64 * 1024)
+
+/*! Ways of creating a child process. */
+typedef enum spawn_strategy {
+	SPAWN_FORK,                    /*!< fork() then exec, as pwnableserver does now */
+	SPAWN_VFORK,                   /*!< vfork() then exec, sharing memory until the exec */
+	SPAWN_CLONE_VM,                /*!< clone(CLONE_VM | CLONE_VFORK) with a separate stack */
+	SPAWN_CLONE3,                  /*!< clone3() without glibc's fork handlers */
+	SPAWN_POSIX_SPAWN,             /*!< posix_spawn(), which can't drop privileges */
+	SPAWN_STRATEGIES
+} spawn_strategy;
+
+static const char* const strategy_names[SPAWN_STRATEGIES] = {
+	"fork",
+	"vfork",
+	"clone-vm",
+	"clone3",
+	"posix_spawn",
+};
+
+/*! Everything a child needs, prepared up front by the parent so that the child
+ * only makes system calls. This keeps it safe after vfork() and clone(CLONE_VM).
+ */
+typedef struct spawn_plan {
+	const char* path;              /*!< Program to exec */
+	char* argv[3];                 /*!< Arguments for the program */
+	char** envp;                   /*!< Cleaned environment, including the preload */
+	bool drop;                     /*!< Whether to drop privileges to the user below */
+	uid_t uid;                     /*!< User to run the child as */
+	gid_t gid;                     /*!< Primary group of that user */
+	gid_t* groups;                 /*!< Supplementary groups of that user */
+	int group_count;               /*!< Number of entries in groups */
+	int sock;                      /*!< Socket to use as the child's stdio */
+} spawn_plan;
+
+static spawn_plan plan;
+
+/*! Stack for children created with clone(CLONE_VM). */
+static char* clone_stack = NULL;
+
+extern char** environ;
+
+/*! Sets up the child like pwnableserver's spawn_connection() does, then execs
+ * the target. Only system calls are made here, so it works for every strategy.
+ * @note This never returns.
+ */
+static int child_exec(void* unused) {
+	(void)unused;
+	
+	/* Redirect stdio to the socket */
+	if(dup2(plan.sock, STDIN_FILENO) == -1
+	   || dup2(plan.sock, STDOUT_FILENO) == -1
+	   || dup2(plan.sock, STDERR_FILENO) == -1) {
+		_exit(126);
+	}
+	
+	/* Drop privileges, the same as initgroups(), setgid() and setuid() */
+	if(plan.drop) {
+		if(setgroups(plan.group_count, plan.groups) != 0
+		   || setgid(plan.gid) != 0
+		   || setuid(plan.uid) != 0
+		   || setuid(0) != -1) {
+			_exit(126);
+		}
+	}
+	
+	execve(plan.path, plan.argv, plan.envp);
+	_exit(127);
+}
+
+/*! Creates a child process running the target with the given strategy.
+ * @return Process ID of the child, -1 on error, or 0 if the strategy isn't
+ *   supported here
+ */
+static pid_t spawn_child(spawn_strategy strategy) {
+	pid_t pid = -1;
+	switch(strategy) {
+		case SPAWN_FORK:
+			pid = fork();
+			if(pid == 0) {
+				child_exec(NULL);
+			}
+			break;
+		
+		case SPAWN_VFORK:
+			pid = vfork();
+			if(pid == 0) {
+				child_exec(NULL);
+			}
+			break;
+		
+		case SPAWN_CLONE_VM:
+#ifdef __linux__
+			/* The stack grows down on every architecture PwnableHarness targets */
+			pid = clone(&child_exec, clone_stack + CLONE_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, NULL);
+#else
+			pid = 0;
+#endif
+			break;
+		
+		case SPAWN_CLONE3: {
+#if defined(__linux__) && defined(SYS_clone3)
+			clone3_args args;
+			memset(&args, 0, sizeof(args));
+			args.exit_signal = SIGCHLD;
+			pid = syscall(SYS_clone3, &args, sizeof(args));
+			if(pid == 0) {
+				child_exec(NULL);
+			}
+			else if(pid == -1 && errno == ENOSYS) {
+				pid = 0;
+			}
+#else
+			pid = 0;
+#endif
+			break;
+		}
+		
+		case SPAWN_POSIX_SPAWN: {
+			posix_spawn_file_actions_t actions;
+			posix_spawn_file_actions_init(&actions);
+			posix_spawn_file_actions_adddup2(&actions, plan.sock, STDIN_FILENO);
+			posix_spawn_file_actions_adddup2(&actions, plan.sock, STDOUT_FILENO);
+			posix_spawn_file_actions_adddup2(&actions, plan.sock, STDERR_FILENO);
+			
+			int err = posix_spawn(&pid, plan.path, &actions, NULL, plan.argv, plan.envp);
+			posix_spawn_file_actions_destroy(&actions);
+			if(err != 0) {
+				errno = err;
+				pid = -1;
+			}
+			break;
+		}
+		
+		default:
+			break;
+	}
+	
+	return pid;
+}
+
+/*! Spawns the target once, measuring how long the parent was blocked, how long
+ * until the target wrote its first byte, and how long until it exited.
+ * @return True on success, false if the spawn failed or isn't supported
+ */
+static bool spawn_once(spawn_strategy strategy, double* spawn_time, double* ready_time, double* total_time) {
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+		perror("socketpair");
+		return false;
+	}
+	
+	/* dup2() clears close-on-exec, so only the child's stdio stays open */
+	plan.sock = sv[1];
+	double start = now_seconds();
+	pid_t pid = spawn_child(strategy);
+	double spawned = now_seconds();
+	close(sv[1]);
+	if(pid <= 0) {
+		if(pid < 0) {
+			perror(strategy_names[strategy]);
+		}
+		close(sv[0]);
+		return false;
+	}
+	
+	/* Output is discarded, as only its timing matters */
+	double ready = 0;
+	char buf[256];
+	ssize_t n;
+	while((n = read(sv[0], buf, sizeof(buf))) != 0) {
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if(ready == 0) {
+			ready = now_seconds();
+		}
+	}
+	close(sv[0]);
+	
+	int status;
+	while(waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+	}
+	double end = now_seconds();
+	
+	if(!WIFEXITED(status) || WEXITSTATUS(status) >= 126) {
+		fprintf(stderr, "Error: The child spawned with %s failed (status %#x)\n",
+			strategy_names[strategy], status);
+		return false;
+	}
+	
+	*spawn_time = spawned - start;
+	*ready_time = (ready != 0 ? ready : end) - start;
+	*total_time = end - start;
+	return true;
+}
+
+/*! Measures one strategy and prints a line with its results. */
+static void run_strategy(spawn_strategy strategy, unsigned count) {
+	samples spawn_times = {NULL, 0};
+	samples ready_times = {NULL, 0};
+	samples total_times = {NULL, 0};
+	spawn_times.values = calloc(count, sizeof(double));
+	ready_times.values = calloc(count, sizeof(double));
+	total_times.values = calloc(count, sizeof(double));
+	if(spawn_times.values == NULL || ready_times.values == NULL || total_times.values == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	
+	double spawn_time, ready_time, total_time;
+	unsigned i;
+	for(i = 0; i < WARMUP_SPAWNS; i++) {
+		if(!spawn_once(strategy, &spawn_time, &ready_time, &total_time)) {
+			printf("%-12s (not supported)\n", strategy_names[strategy]);
+			goto out;
+		}
+	}
+	
+	double begin = now_seconds();
+	for(i = 0; i < count; i++) {
+		if(!spawn_once(strategy, &spawn_time, &ready_time, &total_time)) {
+			break;
+		}
+		spawn_times.values[spawn_times.count++] = spawn_time;
+		ready_times.values[ready_times.count++] = ready_time;
+		total_times.values[total_times.count++] = total_time;
+	}
+	double elapsed = now_seconds() - begin;
+	
+	if(total_times.count == 0) {
+		printf("%-12s (failed)\n", strategy_names[strategy]);
+		goto out;
+	}
+	
+	sort_samples(&spawn_times);
+	sort_samples(&ready_times);
+	sort_samples(&total_times);
+	printf("%-12s %8.1f %8.1f  %8.1f %8.1f  %8.1f %8.1f  %9.1f%s\n",
+		strategy_names[strategy],
+		percentile(&spawn_times, 50) * 1e6,
+		percentile(&spawn_times, 99) * 1e6,
+		percentile(&ready_times, 50) * 1e6,
+		percentile(&ready_times, 99) * 1e6,
+		percentile(&total_times, 50) * 1e6,
+		percentile(&total_times, 99) * 1e6,
+		total_times.count / elapsed,
+		strategy == SPAWN_POSIX_SPAWN && plan.drop ? "  (no privilege drop)" : "");
+	
+out:
+	free(spawn_times.values);
+	free(ready_times.values);
+	free(total_times.values);
+}
+
+/*! Builds the child's environment: the current one without the variables that
+ * pwnableserver's clean_env() removes, plus the libraries to preload.
+ * @return True on success
+ */
+static bool build_env(const char* preload) {
+	const char* removed[] = {
+		"CHALLENGE_NAME=",
+		"CHALLENGE_PASSWORD=",
+		"PORT=",
+		"TIMELIMIT=",
+		"SESSION_CPULIMIT=",
+		"SESSION_MEMLIMIT=",
+		"SESSION_PIDSLIMIT=",
+		"POW_BITS=",
+		"POW_SCALE=",
+		"PWNABLESERVER_EXTRA_ARGS=",
+		"LD_PRELOAD="
+	};
+	
+	size_t count = 0;
+	while(environ[count] != NULL) {
+		count++;
+	}
+	
+	plan.envp = calloc(count + 2, sizeof(*plan.envp));
+	if(plan.envp == NULL) {
+		perror("calloc");
+		return false;
+	}
+	
+	size_t i, j, out = 0;
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < ARRAYSIZE(removed); j++) {
+			if(strncmp(environ[i], removed[j], strlen(removed[j])) == 0) {
+				break;
+			}
+		}
+		if(j == ARRAYSIZE(removed)) {
+			plan.envp[out++] = environ[i];
+		}
+	}
+	
+	if(preload != NULL) {
+		size_t size = strlen("LD_PRELOAD=") + strlen(preload) + 1;
+		char* var = malloc(size);
+		if(var == NULL) {
+			perror("malloc");
+			return false;
+		}
+		snprintf(var, size, "LD_PRELOAD=%s", preload);
+		plan.envp[out++] = var;
+	}
+	
+	return true;
+}
+
+/*! Looks up the user to drop privileges to, along with its groups.
+ * @return True on success
+ */
+static bool prepare_user(const char* user) {
+	if(geteuid() != 0) {
+		fprintf(stderr, "Error: Must be run as root to drop privileges to '%s'\n", user);
+		return false;
+	}
+	
+	struct passwd* pw = getpwnam(user);
+	if(pw == NULL) {
+		fprintf(stderr, "Error: No such user '%s'\n", user);
+		return false;
+	}
+	
+	plan.drop = true;
+	plan.uid = pw->pw_uid;
+	plan.gid = pw->pw_gid;
+	
+	int count = 0;
+	getgrouplist(pw->pw_name, pw->pw_gid, NULL, &count);
+	plan.groups = calloc(count > 0 ? count : 1, sizeof(gid_t));
+	if(plan.groups == NULL) {
+		perror("calloc");
+		return false;
+	}
+	if(getgrouplist(pw->pw_name, pw->pw_gid, plan.groups, &count) < 0) {
+		fprintf(stderr, "Error: Couldn't look up the groups of '%s'\n", user);
+		return false;
+	}
+	plan.group_count = count;
+	return true;
+}
+
+/*! Grows this process by mapping and touching memory, since the cost of fork()
+ * grows with the size of the parent's page tables.
+ * @return True on success
+ */
+static bool inflate_parent(unsigned megabytes) {
+	size_t size = (size_t)megabytes * 1024 * 1024;
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	
+	memset(mem, 0x41, size);
+	return true;
+}
+
+static void show_usage(const char* progname) {
+	printf("Usage: %s [options]\n"
+		"  Options:\n"
+		"    -h, --help                            "
+			"Display this help message\n"
+		"    -n, --count <spawns=1000>             "
+			"Number of spawns to time for each strategy\n"
+		"    -s, --strategy <name>                 "
+			"Only time this strategy (can be repeated): fork, vfork,\n"
+		"                                          "
+			"clone-vm, clone3, or posix_spawn\n"
+		"    -u, --user <user>                     "
+			"Drop privileges to this user in each child (requires root)\n"
+		"    -P, --preload <libs>                  "
+			"Set LD_PRELOAD in each child, like --inject does\n"
+		"    -e, --exec <program>                  "
+			"Program to spawn instead of this one. It should exit on its own\n"
+		"    -m, --map-mb <megabytes>              "
+			"Map and touch this much memory first to grow the parent\n",
+		progname);
+}
+
+int main(int argc, char** argv) {
+	/* Act as the spawn target: report being ready, then exit */
+	if(argc == 2 && strcmp(argv[1], CHILD_ARG) == 0) {
+		return write(STDOUT_FILENO, ".", 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	
+	unsigned count = 1000;
+	bool chosen[SPAWN_STRATEGIES] = {false};
+	bool any_chosen = false;
+	const char* user = NULL;
+	const char* preload = NULL;
+	const char* exec_prog = NULL;
+	unsigned map_mb = 0;
+	
+	int i;
+	unsigned s;
+	for(i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if(i + 1 == argc) {
+			printf("Error: Missing value for argument '%s'\n", argv[i]);
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		else if(strcmp(argv[i], "--count") == 0 || strcmp(argv[i], "-n") == 0) {
+			count = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--strategy") == 0 || strcmp(argv[i], "-s") == 0) {
+			const char* name = argv[++i];
+			for(s = 0; s < SPAWN_STRATEGIES; s++) {
+				if(strcmp(name, strategy_names[s]) == 0) {
+					break;
+				}
+			}
+			if(s == SPAWN_STRATEGIES) {
+				printf("Error: Unknown strategy '%s'\n", name);
+				show_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			chosen[s] = true;
+			any_chosen = true;
+		}
+		else if(strcmp(argv[i], "--user") == 0 || strcmp(argv[i], "-u") == 0) {
+			user = argv[++i];
+		}
+		else if(strcmp(argv[i], "--preload") == 0 || strcmp(argv[i], "-P") == 0) {
+			preload = argv[++i];
+		}
+		else if(strcmp(argv[i], "--exec") == 0 || strcmp(argv[i], "-e") == 0) {
+			exec_prog = argv[++i];
+		}
+		else if(strcmp(argv[i], "--map-mb") == 0 || strcmp(argv[i], "-m") == 0) {
+			map_mb = atoi(argv[++i]);
+		}
+		else {
+			printf("Error: Unknown argument '%s'\n", argv[i]);
+			show_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	
+	if(count == 0) {
+		printf("Error: The spawn count must be positive\n");
+		return EXIT_FAILURE;
+	}
+	
+	/* By default, spawn this program again so that the target has the same bitness */
+	if(exec_prog != NULL) {
+		plan.path = exec_prog;
+		plan.argv[0] = (char*)exec_prog;
+	}
+	else {
+		static char self_path[4096];
+		ssize_t len = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+		if(len < 0) {
+			perror("readlink(/proc/self/exe)");
+			return EXIT_FAILURE;
+		}
+		self_path[len] = '\0';
+		plan.path = self_path;
+		plan.argv[0] = argv[0];
+		plan.argv[1] = CHILD_ARG;
+	}
+	
+	if(!build_env(preload) || (user != NULL && !prepare_user(user))) {
+		return EXIT_FAILURE;
+	}
+	
+	clone_stack = malloc(CLONE_STACK_SIZE);
+	if(clone_stack == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	
+	if(map_mb != 0 && !inflate_parent(map_mb)) {
+		return EXIT_FAILURE;
+	}
+	
+	printf("Spawning %s %u times per strategy (%u-bit", plan.path, count, (unsigned)(sizeof(void*) * 8));
+	if(user != NULL) {
+		printf(", as %s", user);
+	}
+	if(preload != NULL) {
+		printf(", preloading %s", preload);
+	}
+	if(map_mb != 0) {
+		printf(", parent grown by %u MB", map_mb);
+	}
+	printf(")\n\n");
+	
+	printf("%-12s %17s  %17s  %17s\n", "", "spawn (us)", "ready (us)", "total (us)");
+	printf("%-12s %8s %8s  %8s %8s  %8s %8s  %9s\n",
+		"strategy", "p50", "p99", "p50", "p99", "p50", "p99", "per sec");
+	for(s = 0; s < SPAWN_STRATEGIES; s++) {
+		if(!any_chosen || chosen[s]) {
+			run_strategy((spawn_strategy)s, count);
+		}
+	}
+	
+	return EXIT_SUCCESS;
+}
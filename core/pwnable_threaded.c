@@ -0,0 +1,469 @@
+//
+//  pwnable_threaded.c
+//  PwnableHarness
+//
+//  SERVER_THREADED mode: handler threads within the server process, fed from
+//  an epoll loop that enforces the time limits.
+//
+
+#include "pwnable_internal.h"
+
+/*! Default number of handler threads in threaded mode. */
+#define THREADS_DEFAULT 16
+
+/*! Default for max_sessions in threaded mode, which needs a bound for its table of connections. */
+#define THREADED_SESSIONS_DEFAULT 1024
+
+/*! Maximum number of connections accepted at once by a threaded server before it checks on its time limits. */
+#define THREADED_ACCEPT_BATCH 64
+
+#ifdef __linux__
+/*! A connection handled by, or waiting for, a thread of a threaded server. */
+typedef struct thread_conn {
+	int conn;                      /*!< Connection socket, or -1 if the slot is free */
+	struct sockaddr_in cli_addr;   /*!< Client's address */
+	uint64_t accepted;             /*!< Monotonic time in nanoseconds when the connection was accepted */
+	bool timed_out;                /*!< Whether the connection was shut down at its time limit */
+} thread_conn;
+
+/*! Connections of a threaded server, shared by its event loop and handler threads. */
+typedef struct thread_table {
+	pthread_mutex_t lock;          /*!< Protects everything below */
+	pthread_cond_t ready;          /*!< Signaled when a connection is queued or the threads should exit */
+	conn_handler* handler;         /*!< Function called to handle each connection */
+	thread_conn* conns;            /*!< Table of max_sessions connection slots */
+	unsigned* free_slots;          /*!< Stack of the indexes of free slots in conns */
+	unsigned free_count;           /*!< Number of entries in free_slots */
+	unsigned* queue;               /*!< Ring of the indexes of slots waiting for a thread, oldest first */
+	unsigned queue_head;           /*!< Position in queue of the oldest waiting slot */
+	unsigned queue_len;            /*!< Number of entries in queue */
+	bool draining;                 /*!< Whether the event loop wants to hear about each connection that ends */
+	bool stopping;                 /*!< Whether the threads exit once the queue is empty */
+} thread_table;
+
+/*! Kinds of descriptors in a threaded server's epoll set, stored in the
+ * upper half of each event's data next to the descriptor.
+ */
+enum {
+	EPOLL_WAKE,                    /*!< Self-pipe written to by the signal handlers and handler threads */
+	EPOLL_LISTEN,                  /*!< Listening socket */
+	EPOLL_METRICS,                 /*!< Listening socket for the metrics endpoint */
+	EPOLL_METRICS_CLIENT,          /*!< Metrics connection awaiting its request */
+};
+
+/*! Adds a descriptor to a threaded server's epoll set.
+ * @return True on success
+ */
+static bool epoll_watch(int ep, unsigned kind, int fd) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)kind << 32 | (uint32_t)fd;
+	if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		PERROR("epoll_ctl");
+		return false;
+	}
+	return true;
+}
+
+/*! Body of each handler thread of a threaded server, which handles the
+ * connections from the queue until the server stops.
+ */
+static void* thread_main(void* arg) {
+	thread_table* t = arg;
+	
+	pthread_mutex_lock(&t->lock);
+	while(1) {
+		while(t->queue_len == 0 && !t->stopping) {
+			pthread_cond_wait(&t->ready, &t->lock);
+		}
+		if(t->queue_len == 0) {
+			break;
+		}
+		
+		unsigned slot = t->queue[t->queue_head];
+		t->queue_head = (t->queue_head + 1) % max_sessions;
+		t->queue_len--;
+		__atomic_sub_fetch(&shared->queued, 1, __ATOMIC_RELAXED);
+		int conn = t->conns[slot].conn;
+		uint64_t accepted = t->conns[slot].accepted;
+		pthread_mutex_unlock(&t->lock);
+		
+		t->handler(conn);
+		
+		/* The slot is freed before the connection is closed, so the event loop
+		 * never shuts down a descriptor that has been reused
+		 */
+		pthread_mutex_lock(&t->lock);
+		t->conns[slot].conn = -1;
+		t->free_slots[t->free_count++] = slot;
+		if(t->draining) {
+			char c = 0;
+			if(write(sigchld_pipe[1], &c, 1) < 0) {
+				/* The loop is already awake if the pipe is full */
+			}
+		}
+		pthread_mutex_unlock(&t->lock);
+		
+		close(conn);
+		release_session_slot();
+		record_duration((monotonic_ns() - accepted) / 1e9);
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+/*! Counts the connections from an IP address that a threaded server is
+ * handling or has queued. The table must be locked.
+ */
+static unsigned count_thread_conns(const thread_table* t, uint32_t ip) {
+	unsigned count = 0;
+	unsigned i;
+	for(i = 0; i < max_sessions; i++) {
+		if(t->conns[i].conn != -1 && t->conns[i].cli_addr.sin_addr.s_addr == ip) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*! Accepts the connections waiting on a threaded server's listening socket
+ * and queues the admitted ones for the handler threads.
+ */
+static void accept_threaded(service* svc, thread_table* t) {
+	unsigned n;
+	for(n = 0; n < THREADED_ACCEPT_BATCH; n++) {
+		struct sockaddr_in cli_addr;
+		socklen_t cli_len = sizeof(cli_addr);
+		int conn = accept4(svc->sock, (struct sockaddr*)&cli_addr, &cli_len, SOCK_CLOEXEC);
+		if(conn == -1) {
+			if(errno == ECONNABORTED || errno == EINTR) {
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				STAT_ADD(accept_errors, 1);
+				PERROR("accept");
+			}
+			return;
+		}
+		
+		STAT_ADD(accepts, 1);
+		
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(!take_rate_token(svc, cli_addr.sin_addr.s_addr, &now)) {
+			reject_connection(conn, &cli_addr, REJECT_RATE);
+			continue;
+		}
+		
+		/* Only this thread adds connections, so the count can't go up before this one is added */
+		if(max_per_ip > 0) {
+			pthread_mutex_lock(&t->lock);
+			unsigned from_ip = count_thread_conns(t, cli_addr.sin_addr.s_addr);
+			pthread_mutex_unlock(&t->lock);
+			if(from_ip >= max_per_ip) {
+				reject_connection(conn, &cli_addr, REJECT_PER_IP);
+				continue;
+			}
+		}
+		
+		/* A slot in the table is free for every session slot */
+		if(!reserve_session_slot()) {
+			reject_connection(conn, &cli_addr, REJECT_BUSY);
+			continue;
+		}
+		log_connection(0, &cli_addr);
+		
+		pthread_mutex_lock(&t->lock);
+		unsigned slot = t->free_slots[--t->free_count];
+		thread_conn* c = &t->conns[slot];
+		c->conn = conn;
+		c->cli_addr = cli_addr;
+		c->accepted = monotonic_ns();
+		c->timed_out = false;
+		t->queue[(t->queue_head + t->queue_len) % max_sessions] = slot;
+		t->queue_len++;
+		__atomic_add_fetch(&shared->queued, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&t->ready);
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+/*! Shuts down the connections of a threaded server that have reached their
+ * wall-clock time limit, so that handlers blocked on them return.
+ * @param next Monotonic time in nanoseconds of the next check, which is updated
+ * @return Milliseconds until the next check, or -1 to wait indefinitely
+ */
+static int enforce_thread_limits(thread_table* t, unsigned timeout, uint64_t* next) {
+	if(timeout == 0) {
+		return -1;
+	}
+	
+	uint64_t now = monotonic_ns();
+	uint64_t limit = (uint64_t)timeout * 1000000000ull;
+	if(now >= *next) {
+		/* Connections accepted from now on reach their limits after any current one */
+		*next = now + limit;
+		
+		pthread_mutex_lock(&t->lock);
+		unsigned i;
+		for(i = 0; i < max_sessions; i++) {
+			thread_conn* c = &t->conns[i];
+			if(c->conn == -1 || c->timed_out) {
+				continue;
+			}
+			
+			if(now - c->accepted >= limit) {
+				shutdown(c->conn, SHUT_RDWR);
+				c->timed_out = true;
+				STAT_ADD(timeout_kills, 1);
+				log_event(0, LOG_TIMEOUT, &c->cli_addr, 0, "Wall-clock time limit of %u seconds reached", timeout);
+			}
+			else if(c->accepted + limit < *next) {
+				*next = c->accepted + limit;
+			}
+		}
+		pthread_mutex_unlock(&t->lock);
+	}
+	
+	/* Round up so that the limit has definitely been reached on waking */
+	return (int)((*next - now) / 1000000) + 1;
+}
+
+/*! Stops a threaded server from taking new connections and hangs up on the
+ * ones still waiting for a thread, leaving the running handlers until the
+ * drain deadline to finish.
+ */
+static void begin_thread_drain(service* svc, thread_table* t) {
+	close(svc->sock);
+	svc->sock = -1;
+	if(svc->metrics_sock != -1) {
+		close(svc->metrics_sock);
+		svc->metrics_sock = -1;
+	}
+	
+	pthread_mutex_lock(&t->lock);
+	while(t->queue_len > 0) {
+		unsigned slot = t->queue[t->queue_head];
+		t->queue_head = (t->queue_head + 1) % max_sessions;
+		t->queue_len--;
+		__atomic_sub_fetch(&shared->queued, 1, __ATOMIC_RELAXED);
+		
+		send_message(t->conns[slot].conn, "Server shutting down, please try again later.\n");
+		close(t->conns[slot].conn);
+		t->conns[slot].conn = -1;
+		t->free_slots[t->free_count++] = slot;
+		release_session_slot();
+	}
+	t->draining = true;
+	unsigned running = max_sessions - t->free_count;
+	pthread_mutex_unlock(&t->lock);
+	
+	clock_gettime(CLOCK_MONOTONIC, &drain_deadline);
+	drain_deadline.tv_sec += drain_timeout;
+	draining = true;
+	shutting_down = true;
+	log_event(0, LOG_MESSAGE, NULL, 0, "Shutting down, giving %u connections up to %u seconds to finish", running, drain_timeout);
+}
+
+/*! Hands a ready metrics connection of a threaded server its response. */
+static void serve_thread_metrics(service* svc, int client) {
+	/* It may have been dropped for a newer client since this event was collected */
+	unsigned j;
+	for(j = 0; j < svc->metrics_client_count; j++) {
+		if(svc->metrics_clients[j] == client) {
+			break;
+		}
+	}
+	if(j == svc->metrics_client_count) {
+		return;
+	}
+	
+	memmove(&svc->metrics_clients[j], &svc->metrics_clients[j + 1], (svc->metrics_client_count - j - 1) * sizeof(svc->metrics_clients[0]));
+	svc->metrics_client_count--;
+	serve_metrics_client(client);
+}
+#endif /* __linux__ */
+
+/*! Handles the connections of a service by calling the handler on a pool of
+ * threads in this process, which first drops its privileges to the service's
+ * user. Connections are accepted by an epoll loop, which also enforces their
+ * time limits and serves metrics.
+ * @return Exit code for the server process
+ */
+int serve_threaded(service* svc, conn_handler* handler) {
+#ifdef __linux__
+	/* Signals are delivered to the event loop through a self-pipe */
+	if(!open_wake_pipe()) {
+		return EXIT_FAILURE;
+	}
+	
+	/* Handlers writing to a client that hung up must get an error instead of killing the server */
+	signal(SIGPIPE, SIG_IGN);
+	
+	if(max_sessions == 0) {
+		max_sessions = THREADED_SESSIONS_DEFAULT;
+	}
+	if(thread_count == 0) {
+		thread_count = THREADS_DEFAULT;
+	}
+	
+	thread_table t;
+	memset(&t, 0, sizeof(t));
+	t.handler = handler;
+	t.conns = calloc(max_sessions, sizeof(*t.conns));
+	t.free_slots = calloc(max_sessions, sizeof(*t.free_slots));
+	t.queue = calloc(max_sessions, sizeof(*t.queue));
+	svc->buckets = calloc(RATE_BUCKETS, sizeof(*svc->buckets));
+	pthread_t* threads = calloc(thread_count, sizeof(*threads));
+	if(t.conns == NULL || t.free_slots == NULL || t.queue == NULL || svc->buckets == NULL || threads == NULL) {
+		PERROR("calloc");
+		return EXIT_FAILURE;
+	}
+	
+	/* Slots are handed out lowest first */
+	unsigned i;
+	for(i = 0; i < max_sessions; i++) {
+		t.conns[i].conn = -1;
+		t.free_slots[i] = max_sessions - 1 - i;
+	}
+	t.free_count = max_sessions;
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.ready, NULL);
+	
+	/* Waiting connections are accepted in batches until there are no more */
+	if(fcntl(svc->sock, F_SETFL, O_NONBLOCK) != 0) {
+		PERROR("fcntl");
+		return EXIT_FAILURE;
+	}
+	
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if(ep == -1) {
+		PERROR("epoll_create1");
+		return EXIT_FAILURE;
+	}
+	if(!epoll_watch(ep, EPOLL_WAKE, sigchld_pipe[0]) || !epoll_watch(ep, EPOLL_LISTEN, svc->sock)) {
+		return EXIT_FAILURE;
+	}
+	if(svc->metrics_sock != -1 && !epoll_watch(ep, EPOLL_METRICS, svc->metrics_sock)) {
+		return EXIT_FAILURE;
+	}
+	
+	/* Handlers run as the challenge's user, just like they would in their own processes */
+	if(!drop_privileges(svc->pw)) {
+		log_event(0, LOG_ERROR, NULL, 0, "Unable to drop privileges for the handler threads");
+		return EXIT_FAILURE;
+	}
+	
+	/* Every thread shares what the init function sets up */
+	if(init_hook != NULL) {
+		init_hook();
+	}
+	
+	for(i = 0; i < thread_count; i++) {
+		int err = pthread_create(&threads[i], NULL, &thread_main, &t);
+		if(err != 0) {
+			log_event(0, LOG_ERROR, NULL, err, "pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	
+	uint64_t next_check = 0;
+	while(1) {
+		/* Act on SIGTERM and SIGHUP here rather than in the signal handler */
+		if(stop_requested && !draining) {
+			begin_thread_drain(svc, &t);
+		}
+		if(upgrade_requested) {
+			upgrade_requested = 0;
+			log_event(0, LOG_MESSAGE, NULL, 0, "Ignoring SIGHUP, as threaded servers can't re-exec themselves");
+		}
+		
+		int wait_ms = enforce_thread_limits(&t, svc->timeout, &next_check);
+		if(draining) {
+			pthread_mutex_lock(&t.lock);
+			bool done = t.free_count == max_sessions;
+			pthread_mutex_unlock(&t.lock);
+			if(done) {
+				break;
+			}
+			
+			/* Handlers still running at the deadline are cut off when the process exits */
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double left = -elapsed_seconds(&drain_deadline, &now);
+			if(left <= 0) {
+				log_event(0, LOG_MESSAGE, NULL, 0, "Server shut down before every connection ended");
+				return EXIT_SUCCESS;
+			}
+			if(wait_ms < 0 || left * 1000 < wait_ms) {
+				wait_ms = (int)(left * 1000) + 1;
+			}
+		}
+		
+		struct epoll_event events[16];
+		int n = epoll_wait(ep, events, ARRAYSIZE(events), wait_ms);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			PERROR("epoll_wait");
+			return EXIT_FAILURE;
+		}
+		
+		int j;
+		for(j = 0; j < n; j++) {
+			int fd = (int)(uint32_t)events[j].data.u64;
+			switch(events[j].data.u64 >> 32) {
+				case EPOLL_WAKE: {
+					char buf[64];
+					while(read(fd, buf, sizeof(buf)) > 0) {
+						/* Just draining the pipe */
+					}
+					break;
+				}
+				
+				case EPOLL_LISTEN:
+					if(svc->sock != -1) {
+						accept_threaded(svc, &t);
+					}
+					break;
+				
+				case EPOLL_METRICS: {
+					if(svc->metrics_sock == -1) {
+						break;
+					}
+					
+					/* Wait for the new client's request, unless accepting it failed */
+					int newest = svc->metrics_client_count > 0 ? svc->metrics_clients[svc->metrics_client_count - 1] : -1;
+					accept_metrics_client(svc);
+					if(svc->metrics_client_count > 0 && svc->metrics_clients[svc->metrics_client_count - 1] != newest) {
+						epoll_watch(ep, EPOLL_METRICS_CLIENT, svc->metrics_clients[svc->metrics_client_count - 1]);
+					}
+					break;
+				}
+				
+				case EPOLL_METRICS_CLIENT:
+					serve_thread_metrics(svc, fd);
+					break;
+			}
+		}
+	}
+	
+	/* Every connection has ended, so let the threads go */
+	pthread_mutex_lock(&t.lock);
+	t.stopping = true;
+	pthread_cond_broadcast(&t.ready);
+	pthread_mutex_unlock(&t.lock);
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	return EXIT_SUCCESS;
+#else /* __linux__ */
+	(void)svc;
+	(void)handler;
+	log_event(0, LOG_ERROR, NULL, 0, "Threaded mode is only supported on Linux");
+	return EXIT_FAILURE;
+#endif /* __linux__ */
+}
@@ -0,0 +1,572 @@
+//
+//  pwnable_upgrade.c
+//  PwnableHarness
+//
+//  Re-exec on SIGHUP: handing the listening sockets, shared state and session
+//  tables down to the new server, and adopting them there.
+//
+
+#include "pwnable_internal.h"
+
+/*! Environment variable holding the file descriptor of the state handed down
+ * by the server that re-exec'd this one.
+ */
+static const char* kEnvUpgrade = "PWNABLE_UPGRADE";
+
+/*! Bytes at the start of the state handed down to a re-exec'd server. */
+#define UPGRADE_MAGIC "PHUPG01\n"
+
+/*! A service's part of the upgrade state. It's followed by fd_count file
+ * descriptors (int32_t), and then by its tables of sessions, queued
+ * connections and authenticating connections as they were in memory. The
+ * tables are only adopted when the sizes in the header match this build.
+ */
+typedef struct upgrade_service {
+	uint16_t port;                 /*!< Port of the service */
+	uint16_t reserved;
+	uint32_t fd_count;             /*!< Number of file descriptors used by the tables */
+	uint32_t session_count;        /*!< Number of sessions */
+	uint32_t queue_len;            /*!< Number of queued connections */
+	uint32_t auth_count;           /*!< Number of authenticating connections */
+} upgrade_service;
+
+/*! Size in bytes of inherited. */
+static size_t inherited_size = 0;
+
+/*! Lists the file descriptors used by a service's tables of sessions,
+ * queued connections and authenticating connections.
+ * @param fds Array with room for 6 entries per session and 1 per connection
+ * @return Number of entries written to fds
+ */
+static unsigned service_table_fds(const service* svc, int32_t* fds) {
+	unsigned count = 0;
+	unsigned j;
+	for(j = 0; j < svc->session_count; j++) {
+		const session* s = &svc->sessions[j];
+		if(s->conn != -1) {
+			fds[count++] = s->conn;
+		}
+		if(s->relay.sock == -1) {
+			continue;
+		}
+		
+		fds[count++] = s->relay.sock;
+		unsigned dir;
+		for(dir = 0; dir < 2; dir++) {
+			if(s->relay.dirs[dir].pipe[0] != -1) {
+				fds[count++] = s->relay.dirs[dir].pipe[0];
+			}
+			if(s->relay.dirs[dir].pipe[1] != -1) {
+				fds[count++] = s->relay.dirs[dir].pipe[1];
+			}
+		}
+	}
+	for(j = 0; j < svc->queue_len; j++) {
+		fds[count++] = svc->queue[j].conn;
+	}
+	for(j = 0; j < svc->auth_count; j++) {
+		fds[count++] = svc->auths[j].conn;
+	}
+	return count;
+}
+
+/*! Allocates an array big enough for service_table_fds(). */
+static int32_t* alloc_table_fds(const service* svc) {
+	return malloc((6 * svc->session_count + svc->queue_len + svc->auth_count + 1) * sizeof(int32_t));
+}
+
+/*! Lets every file descriptor named in the upgrade state survive exec(), or
+ * makes them close-on-exec again after a failed exec().
+ */
+static void pass_on_exec(const service* svcs, unsigned svc_count, const int* socks, unsigned sock_count, bool pass) {
+	int flags = pass ? 0 : FD_CLOEXEC;
+	unsigned i;
+	for(i = 0; i < sock_count; i++) {
+		fcntl(socks[i], F_SETFD, flags);
+	}
+	if(svcs[0].metrics_sock != -1) {
+		fcntl(svcs[0].metrics_sock, F_SETFD, flags);
+	}
+	fcntl(shared_fd, F_SETFD, flags);
+	fcntl(logs_fd, F_SETFD, flags);
+	
+	unsigned k;
+	for(k = 0; k < svc_count; k++) {
+		int32_t* fds = alloc_table_fds(&svcs[k]);
+		if(fds == NULL) {
+			PERROR("malloc");
+			continue;
+		}
+		
+		unsigned count = service_table_fds(&svcs[k], fds);
+		for(i = 0; i < count; i++) {
+			fcntl(fds[i], F_SETFD, flags);
+		}
+		free(fds);
+	}
+}
+
+/*! Writes an array to the upgrade state.
+ * @return True on success
+ */
+static bool write_state(FILE* fp, const void* data, size_t size, size_t count) {
+	return count == 0 || fwrite(data, size, count, fp) == count;
+}
+
+/*! Writes the state that a re-exec'd server takes over to a memory file.
+ * @return File descriptor of the memory file, or -1 on error
+ */
+static int save_upgrade_state(const service* svcs, unsigned svc_count, const int* socks, unsigned sock_count) {
+	int fd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+	fd = syscall(SYS_memfd_create, "pwnableserver-upgrade", 0);
+#else
+	errno = ENOSYS;
+#endif
+	if(fd == -1) {
+		PERROR("memfd_create");
+		return -1;
+	}
+	
+	int fp_fd = dup(fd);
+	FILE* fp = fp_fd != -1 ? fdopen(fp_fd, "wb") : NULL;
+	if(fp == NULL) {
+		PERROR("fdopen");
+		if(fp_fd != -1) {
+			close(fp_fd);
+		}
+		close(fd);
+		return -1;
+	}
+	
+	/* The supervisor's current acceptors retire along with any that were already retiring */
+	pid_t* acceptors = acceptor_pids;
+	unsigned acceptors_count = acceptors != NULL ? acceptor_count : 0;
+	unsigned i;
+	
+	upgrade_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UPGRADE_MAGIC, sizeof(hdr.magic));
+	hdr.sizes[0] = sizeof(session);
+	hdr.sizes[1] = sizeof(pending_conn);
+	hdr.sizes[2] = sizeof(auth_conn);
+	hdr.sizes[3] = sizeof(shared_state);
+	hdr.sizes[4] = sizeof(log_ring);
+	hdr.shared_fd = shared_fd;
+	hdr.logs_fd = logs_fd;
+	hdr.logger_pid = logger_pid;
+	hdr.metrics_sock = svcs[0].metrics_sock;
+	hdr.sock_count = sock_count;
+	for(i = 0; i < acceptors_count; i++) {
+		hdr.retired_count += acceptors[i] > 0;
+	}
+	for(i = 0; i < retired_count; i++) {
+		hdr.retired_count += retired_pids[i] > 0;
+	}
+	hdr.svc_count = svc_count;
+	memcpy(hdr.pow_secret, pow_secret, sizeof(hdr.pow_secret));
+	bool ok = write_state(fp, &hdr, sizeof(hdr), 1);
+	
+	for(i = 0; i < sock_count; i++) {
+		int32_t sock = socks[i];
+		ok = ok && write_state(fp, &sock, sizeof(sock), 1);
+	}
+	for(i = 0; i < acceptors_count; i++) {
+		int32_t pid = acceptors[i];
+		ok = ok && (pid <= 0 || write_state(fp, &pid, sizeof(pid), 1));
+	}
+	for(i = 0; i < retired_count; i++) {
+		int32_t pid = retired_pids[i];
+		ok = ok && (pid <= 0 || write_state(fp, &pid, sizeof(pid), 1));
+	}
+	
+	unsigned k;
+	for(k = 0; ok && k < svc_count; k++) {
+		const service* svc = &svcs[k];
+		int32_t* fds = alloc_table_fds(svc);
+		if(fds == NULL) {
+			PERROR("malloc");
+			ok = false;
+			break;
+		}
+		
+		upgrade_service us;
+		memset(&us, 0, sizeof(us));
+		us.port = svc->port;
+		us.fd_count = service_table_fds(svc, fds);
+		us.session_count = svc->session_count;
+		us.queue_len = svc->queue_len;
+		us.auth_count = svc->auth_count;
+		ok = write_state(fp, &us, sizeof(us), 1)
+			&& write_state(fp, fds, sizeof(*fds), us.fd_count)
+			&& write_state(fp, svc->sessions, sizeof(*svc->sessions), svc->session_count)
+			&& write_state(fp, svc->queue, sizeof(*svc->queue), svc->queue_len)
+			&& write_state(fp, svc->auths, sizeof(*svc->auths), svc->auth_count);
+		free(fds);
+	}
+	
+	if(fclose(fp) != 0 || !ok) {
+		PERROR("write(upgrade state)");
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/*! Checks whether this server is able to re-exec itself, logging why not. */
+static bool can_upgrade(void) {
+	const char* problem = NULL;
+	if(server_argv == NULL || server_exe == NULL) {
+		problem = "the server wasn't started by server_main()";
+	}
+	else if(server_chrooted) {
+		problem = "the server is running in a chroot";
+	}
+	else if(shared_fd == -1 || logs_fd == -1) {
+		problem = "memory files aren't supported";
+	}
+	
+	if(problem != NULL) {
+		log_event(0, LOG_ERROR, NULL, 0, "Unable to upgrade, as %s", problem);
+		return false;
+	}
+	return true;
+}
+
+/*! Re-execs the server in place on SIGHUP, handing the listening sockets and
+ * the tables of sessions down to the new server. A new build of the server or
+ * of the challenge then takes over without ever refusing a connection or
+ * cutting off a session. The supervisor's acceptors keep their sessions, and
+ * retire once the new server has started its own.
+ * @param socks Listening sockets
+ * @note This only returns if the server couldn't be re-exec'd.
+ */
+void upgrade_server(service* svcs, unsigned svc_count, const int* socks, unsigned sock_count) {
+	if(!can_upgrade()) {
+		return;
+	}
+	
+	/* Sessions of the fork server's templates must become our own children to be handed down */
+	unsigned k, j;
+	for(k = 0; k < svc_count; k++) {
+		fork_server_stop(&svcs[k]);
+	}
+	
+	int state = save_upgrade_state(svcs, svc_count, socks, sock_count);
+	if(state == -1) {
+		goto fail;
+	}
+	
+	char state_str[11];
+	snprintf(state_str, sizeof(state_str), "%d", state);
+	if(setenv(kEnvUpgrade, state_str, 1) != 0) {
+		PERROR("setenv");
+		close(state);
+		goto fail;
+	}
+	
+	/* Idle pool workers and metrics clients belong to this process alone */
+	for(k = 0; k < svc_count; k++) {
+		service* svc = &svcs[k];
+		for(j = 0; svc->pool != NULL && j < pool_size; j++) {
+			retire_pool_worker(&svc->pool[j]);
+		}
+		for(j = 0; j < svc->metrics_client_count; j++) {
+			close(svc->metrics_clients[j]);
+		}
+		svc->metrics_client_count = 0;
+	}
+	
+	log_event(0, LOG_MESSAGE, NULL, 0, "Upgrading by re-executing %s", server_exe);
+	pass_on_exec(svcs, svc_count, socks, sock_count, true);
+	
+	/* The new server starts out with the original standard IO */
+	fflush(stderr_fp);
+	if(dup2(real_stdin, STDIN_FILENO) != -1
+	   && dup2(real_stdout, STDOUT_FILENO) != -1
+	   && dup2(real_stderr, STDERR_FILENO) != -1) {
+		fcntl(real_stdin, F_SETFD, FD_CLOEXEC);
+		fcntl(real_stdout, F_SETFD, FD_CLOEXEC);
+		fcntl(real_stderr, F_SETFD, FD_CLOEXEC);
+		execv(server_exe, server_argv);
+	}
+	PERROR("execv");
+	
+	/* Carry on as before, with pool workers respawned as they are needed */
+	fcntl(real_stdin, F_SETFD, 0);
+	fcntl(real_stdout, F_SETFD, 0);
+	fcntl(real_stderr, F_SETFD, 0);
+	park_stdio();
+	pass_on_exec(svcs, svc_count, socks, sock_count, false);
+	unsetenv(kEnvUpgrade);
+	close(state);
+	
+fail:
+	/* New templates run the init function again before taking connections */
+	for(k = 0; handler_mode == SERVER_FORK_SERVER && k < svc_count; k++) {
+		fork_server_spawn(&svcs[k]);
+	}
+}
+
+/*! Reads an int32_t at an offset into the inherited upgrade state. */
+static int32_t inherited_int(size_t pos) {
+	int32_t value;
+	memcpy(&value, (const char*)inherited + pos, sizeof(value));
+	return value;
+}
+
+/*! Reads the next service record of the inherited upgrade state.
+ * @param pos Offset of the record, which is advanced past its tables
+ * @param data Set to the offset of the record's file descriptors, which its tables follow
+ * @return True if the record and its tables are all there
+ */
+static bool next_inherited_service(size_t* pos, upgrade_service* us, size_t* data) {
+	if(inherited_size - *pos < sizeof(*us)) {
+		return false;
+	}
+	memcpy(us, (const char*)inherited + *pos, sizeof(*us));
+	*data = *pos + sizeof(*us);
+	
+	size_t tables = (size_t)us->fd_count * sizeof(int32_t)
+		+ (size_t)us->session_count * inherited->sizes[0]
+		+ (size_t)us->queue_len * inherited->sizes[1]
+		+ (size_t)us->auth_count * inherited->sizes[2];
+	if(inherited_size - *data < tables) {
+		return false;
+	}
+	*pos = *data + tables;
+	return true;
+}
+
+/*! Takes over the sessions, queued connections and authenticating
+ * connections handed down by the server that re-exec'd this one. The tables
+ * of a service that is gone or that were saved by a build with a different
+ * layout can't be used, so their sessions run on untracked.
+ */
+void adopt_inherited_tables(service* svcs, unsigned svc_count) {
+	if(inherited == NULL) {
+		return;
+	}
+	
+	bool same_layout = inherited->sizes[0] == sizeof(session)
+		&& inherited->sizes[1] == sizeof(pending_conn)
+		&& inherited->sizes[2] == sizeof(auth_conn);
+	
+	size_t pos = sizeof(*inherited) + (size_t)(inherited->sock_count + inherited->retired_count) * sizeof(int32_t);
+	unsigned k, j;
+	for(k = 0; k < inherited->svc_count; k++) {
+		upgrade_service us;
+		size_t data;
+		if(!next_inherited_service(&pos, &us, &data)) {
+			break;
+		}
+		
+		service* svc = NULL;
+		for(j = 0; j < svc_count && same_layout; j++) {
+			if(svcs[j].port == us.port) {
+				svc = &svcs[j];
+				break;
+			}
+		}
+		
+		/* Make room for the sessions in the table */
+		if(svc != NULL && svc->session_count + us.session_count > svc->session_cap) {
+			unsigned new_cap = svc->session_count + us.session_count;
+			session* new_sessions = realloc(svc->sessions, new_cap * sizeof(*new_sessions));
+			if(new_sessions == NULL) {
+				PERROR("realloc");
+				svc = NULL;
+			}
+			else {
+				svc->sessions = new_sessions;
+				svc->session_cap = new_cap;
+			}
+		}
+		
+		for(j = 0; j < us.fd_count; j++) {
+			int fd = inherited_int(data + j * sizeof(int32_t));
+			if(svc == NULL) {
+				close(fd);
+			}
+			else {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+			}
+		}
+		
+		if(svc == NULL) {
+			if(shared_inherited) {
+				__atomic_sub_fetch(&shared->live_sessions, us.session_count, __ATOMIC_RELAXED);
+				__atomic_sub_fetch(&shared->queued, us.queue_len, __ATOMIC_RELAXED);
+			}
+			if(us.session_count + us.queue_len + us.auth_count > 0) {
+				log_event(0, LOG_ERROR, NULL, 0, "Unable to take over %u sessions on port %hu from the previous server", us.session_count, us.port);
+			}
+			continue;
+		}
+		
+		const char* table = (const char*)inherited + data + us.fd_count * sizeof(int32_t);
+		memcpy(&svc->sessions[svc->session_count], table, us.session_count * sizeof(session));
+		for(j = 0; j < us.session_count; j++) {
+			/* Trace pipes are closed by the exec, so these sessions only get their connection span */
+			svc->sessions[svc->session_count + j].trace_fd = -1;
+		}
+		svc->session_count += us.session_count;
+		table += us.session_count * sizeof(session);
+		if(!shared_inherited) {
+			STAT_ADD(live_sessions, us.session_count);
+		}
+		
+		/* Queued connections beyond a smaller --queue are turned away */
+		for(j = 0; j < us.queue_len; j++) {
+			pending_conn p;
+			memcpy(&p, table + j * sizeof(p), sizeof(p));
+			if(svc->queue_len < queue_size) {
+				svc->queue[svc->queue_len++] = p;
+				if(!shared_inherited) {
+					STAT_ADD(queued, 1);
+				}
+			}
+			else {
+				if(shared_inherited) {
+					__atomic_sub_fetch(&shared->queued, 1, __ATOMIC_RELAXED);
+				}
+				reject_connection(p.conn, &p.cli_addr, REJECT_BUSY);
+			}
+		}
+		table += us.queue_len * sizeof(pending_conn);
+		
+		/* So are clients authenticating to a service that no longer asks them to */
+		unsigned auth_cap = svc->password != NULL || svc->pow_bits > 0 ? AUTH_PENDING_MAX : 0;
+		for(j = 0; j < us.auth_count; j++) {
+			auth_conn a;
+			memcpy(&a, table + j * sizeof(a), sizeof(a));
+			if(svc->auth_count < auth_cap) {
+				svc->auths[svc->auth_count++] = a;
+			}
+			else {
+				send_message(a.conn, "\nServer restarted, please try again.\n");
+				close(a.conn);
+			}
+		}
+		
+		if(us.session_count > 0) {
+			log_event(0, LOG_MESSAGE, NULL, 0, "Took over %u sessions on port %hu from the previous server", us.session_count, us.port);
+		}
+	}
+	
+	free(inherited);
+	inherited = NULL;
+}
+/*! Reads the state handed down by the server that re-exec'd this one, if any.
+ * @return True on success, including when there is no state
+ */
+bool load_upgrade_state(void) {
+	const char* fd_str = getenv(kEnvUpgrade);
+	if(fd_str == NULL) {
+		return true;
+	}
+	
+	int fd = atoi(fd_str);
+	unsetenv(kEnvUpgrade);
+	
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*inherited)) {
+		fprintf(stderr, "Error: Invalid upgrade state from the previous server.\n");
+		return false;
+	}
+	
+	inherited_size = st.st_size;
+	inherited = malloc(inherited_size);
+	if(inherited == NULL) {
+		perror("malloc");
+		return false;
+	}
+	
+	if(pread(fd, inherited, inherited_size, 0) != (ssize_t)inherited_size
+	   || memcmp(inherited->magic, UPGRADE_MAGIC, sizeof(inherited->magic)) != 0) {
+		fprintf(stderr, "Error: Invalid upgrade state from the previous server.\n");
+		return false;
+	}
+	close(fd);
+	
+	/* Make sure everything is there before using any of it */
+	size_t pos = sizeof(*inherited) + (size_t)(inherited->sock_count + inherited->retired_count) * sizeof(int32_t);
+	if(pos > inherited_size) {
+		fprintf(stderr, "Error: Truncated upgrade state from the previous server.\n");
+		return false;
+	}
+	
+	unsigned i;
+	for(i = 0; i < inherited->svc_count; i++) {
+		upgrade_service us;
+		size_t data;
+		if(!next_inherited_service(&pos, &us, &data)) {
+			fprintf(stderr, "Error: Truncated upgrade state from the previous server.\n");
+			return false;
+		}
+	}
+	
+	/* This server's supervisor or accept loop tells them to retire once it's ready */
+	retired_count = inherited->retired_count;
+	retired_pids = calloc(retired_count + 1, sizeof(*retired_pids));
+	if(retired_pids == NULL) {
+		perror("calloc");
+		return false;
+	}
+	for(i = 0; i < retired_count; i++) {
+		retired_pids[i] = inherited_int(sizeof(*inherited) + (inherited->sock_count + i) * sizeof(int32_t));
+	}
+	
+	return true;
+}
+
+/*! Takes the listening socket for a port from those handed down by the
+ * server that re-exec'd this one, so that the port never stops listening.
+ * @return The listening socket, or -1 if there is none
+ */
+int take_inherited_listener(unsigned short port) {
+	unsigned i;
+	for(i = 0; inherited != NULL && i < inherited->sock_count; i++) {
+		size_t pos = sizeof(*inherited) + i * sizeof(int32_t);
+		int sock = inherited_int(pos);
+		struct sockaddr_in addr;
+		socklen_t addr_len = sizeof(addr);
+		if(sock == -1
+		   || getsockname(sock, (struct sockaddr*)&addr, &addr_len) != 0
+		   || addr.sin_family != AF_INET
+		   || ntohs(addr.sin_port) != port) {
+			continue;
+		}
+		
+		int32_t taken = -1;
+		memcpy((char*)inherited + pos, &taken, sizeof(taken));
+		
+		/* Challenge processes must never inherit it, and --backlog or the TCP profile may have changed */
+		if(!tune_socket(sock, true)) {
+			close(sock);
+			continue;
+		}
+		if(fcntl(sock, F_SETFD, FD_CLOEXEC) != 0 || listen(sock, listen_backlog) != 0) {
+			perror("listen");
+			close(sock);
+			continue;
+		}
+		return sock;
+	}
+	
+	return -1;
+}
+
+/*! Closes the inherited listening sockets that no service took, such as for
+ * ports that are no longer served.
+ */
+void close_inherited_listeners(void) {
+	unsigned i;
+	for(i = 0; inherited != NULL && i < inherited->sock_count; i++) {
+		int sock = inherited_int(sizeof(*inherited) + i * sizeof(int32_t));
+		if(sock != -1) {
+			close(sock);
+		}
+	}
+}
@@ -5,3 +5,16 @@ DOCKER_PORTS := 11111
 DOCKER_CPULIMIT := 0.1
 DOCKER_MEMLIMIT := 1000m
 DOCKER_TIMELIMIT := 45
+DOCKER_SESSION_CPULIMIT := 0.05
+DOCKER_SESSION_MEMLIMIT := 200m
+DOCKER_SESSION_PIDSLIMIT := 32
+
+# The session cgroups are created in a cgroup delegated to the container. The
+# host must have /sys/fs/cgroup/pwnable.slice with the cpu, memory, and pids
+# controllers enabled in its cgroup.subtree_control.
+DOCKER_CGROUP_PARENT := pwnable.slice
+
+# Without a delegated cgroup, this opts in to running the container with
+# CAP_SYS_ADMIN and without AppArmor so pwnableserver can remount the cgroup
+# filesystem itself. Read the warning about it in stack0's Build.mk first.
+#DOCKER_ALLOW_SYS_ADMIN := true
@@ -23,6 +23,13 @@
 # Note: It is an error to define both TARGET and TARGETS.
 TARGET := stack0
 
+# OPTIONAL_TARGETS are built just like TARGETS, but only when another rule
+# depends on them, such as a helper tool used by a custom rule. They aren't
+# built by `make build` or copied into Docker images.
+#
+# OPTIONAL_TARGETS := solver
+# solve: $(BUILD_DIR)/solver
+
 
 ## Target-specific variables: Each of the following variables of the format
 # target_VAR are specific to that target. PwnableHarness attempts to resolve
@@ -140,6 +147,24 @@ BITS := 32
 #                        that don't end in a newline will not be sent over the
 #                        connection socket without calling `fflush(stdout)`.
 #
+# COALESCED_STDIO: Set this to build stdio_unbuffer.c in coalesced mode. Rather
+#                    than being unbuffered, stdout is fully buffered and then
+#                    flushed right before the challenge reads from stdin,
+#                    writes to stdout or stderr with write() or the like, runs
+#                    another program, exits, or is killed by a signal, as well
+#                    as every 20ms. Prompts still show up, but a menu printed
+#                    with many printf() calls goes out in one write() and one
+#                    packet. The wrappers that flush stdout are only linked in
+#                    for the libc functions that the challenge already calls,
+#                    so it never gains a function like system() or gets() that
+#                    it didn't have. This adds a thread to the process and
+#                    links it with -pthread and -ldl, so it may change the
+#                    memory layout of heap challenges. When pwnableserver runs
+#                    with --trace, this also reports when the challenge starts
+#                    running and when it first writes output. The Docker image
+#                    passes --trace-reports for this, as other challenges
+#                    don't get the trace pipe.
+#
 # NO_RPATH:        Set this if you don't want PwnableHarness to add the binary's
 #                    origin directory to its rpath. This will prevent it from
 #                    using any libraries (like libc.so.6) from its directory.
@@ -252,6 +277,77 @@ DOCKER_TIMELIMIT := 30
 # like "m" allows using different units.
 #DOCKER_MEMLIMIT := 500m
 
+# DOCKER_SESSION_CPULIMIT, DOCKER_SESSION_MEMLIMIT, and DOCKER_SESSION_PIDSLIMIT
+# limit the resources of each individual connection, unlike DOCKER_CPULIMIT and
+# DOCKER_MEMLIMIT which apply to the whole container. Each connection's process
+# (and everything it spawns) is placed in its own cgroup, so a session that
+# fork-bombs or leaks memory is throttled or killed on its own without starving
+# the other players' sessions. These use the same units as their container-wide
+# equivalents, and DOCKER_SESSION_PIDSLIMIT is the maximum number of processes
+# and threads. All are unlimited if left undefined.
+#
+# Note: pwnableserver needs a writable cgroup filesystem to create the session
+# cgroups, and Docker mounts it read-only. Setting any of these requires one of
+# DOCKER_CGROUP_PARENT or DOCKER_ALLOW_SYS_ADMIN below.
+#DOCKER_SESSION_CPULIMIT := 0.1
+#DOCKER_SESSION_MEMLIMIT := 50m
+#DOCKER_SESSION_PIDSLIMIT := 32
+
+# DOCKER_CGROUP_PARENT is the preferred way to give the per-session limits a
+# writable cgroup. It names a cgroup under /sys/fs/cgroup on the host, which the
+# container is started in (with --cgroup-parent), and only that subtree is
+# bind-mounted writable into the container. The host must create it and enable
+# the cpu, memory, and pids controllers in its cgroup.subtree_control. Root in
+# the container can change the limits of everything else in that cgroup, so
+# give each challenge a cgroup of its own.
+#DOCKER_CGROUP_PARENT := stack0.slice
+
+# DOCKER_ALLOW_SYS_ADMIN opts in to running the container with CAP_SYS_ADMIN.
+# DOCKER_PID_NAMESPACE and DOCKER_SESSION_WORKDIR need it, and the per-session
+# limits use it instead of DOCKER_CGROUP_PARENT when that isn't set.
+#
+# WARNING: With the per-session limits or DOCKER_SESSION_WORKDIR, this also runs
+# the container without AppArmor confinement, since Docker's default profile
+# denies every mount, including the cgroup remount pwnableserver then does.
+# Challenge processes never have CAP_SYS_ADMIN: they run as an unprivileged
+# user, and pwnableserver drops the capability from their bounding set, so not
+# even a setuid root program in the image can get it back. Anything else running
+# as root in the container does have it, so don't add other services to a
+# container that sets this.
+#DOCKER_ALLOW_SYS_ADMIN := true
+
+# DOCKER_PID_NAMESPACE runs each connection in a PID namespace of its own.
+# When the challenge process exits or is killed, everything it left running is
+# killed along with the namespace, even background processes that called
+# setsid() to leave the session's process group. The challenge itself sees its
+# PID as 2. Creating the namespaces needs CAP_SYS_ADMIN, so this also requires
+# DOCKER_ALLOW_SYS_ADMIN.
+#DOCKER_PID_NAMESPACE := true
+
+# DOCKER_SESSION_WORKDIR gives each connection its own copy-on-write view of a
+# directory, so challenges that write files don't need DOCKER_WRITEABLE and
+# players can't see or clobber each other's files. The session starts with the
+# directory's contents from the image, and its changes are kept in memory and
+# thrown away when it ends. The path is as seen by the challenge, and the
+# directory's owner and mode decide whether the challenge can write to it. Each
+# session may write DOCKER_SESSION_WORKDIR_SIZE megabytes (default 64). Mounting
+# the directory needs CAP_SYS_ADMIN, so this also requires DOCKER_ALLOW_SYS_ADMIN.
+#DOCKER_SESSION_WORKDIR := /home/stack0
+#DOCKER_SESSION_WORKDIR_SIZE := 16
+
+# DOCKER_POW_BITS makes each connection send a hashcash stamp with this many
+# bits of proof of work before the challenge is started. This is checked by
+# pwnableserver itself, so bots that reconnect in a tight loop (like to brute
+# force ASLR) pay for each attempt instead of costing the server a fork+exec.
+# Around 20 bits takes about a second with the `hashcash` command line tool.
+# DOCKER_POW_SCALE is a connection rate (per second) past which the difficulty
+# goes up by one bit each time the rate doubles. It only scales the proof of
+# work that DOCKER_POW_BITS asks for, so setting it without DOCKER_POW_BITS is
+# an error, and a challenge with just a password never starts asking for one.
+# Neither is enabled if left undefined.
+#DOCKER_POW_BITS := 20
+#DOCKER_POW_SCALE := 10
+
 # DOCKER_RUN_ARGS is a list of extra arguments to pass to "docker run".
 #DOCKER_RUN_ARGS := --env SOMETHING=42
 
@@ -267,6 +363,19 @@ DOCKER_TIMELIMIT := 30
 # pwnableserver when it is launched in the Docker container.
 #
 #DOCKER_PWNABLESERVER_ARGS := --inject my_preload_library.so
+#
+# WARNING: --pool keeps challenge processes exec'd ahead of time, but each one
+# runs with libpwnableharness preloaded so it can be handed its connection later.
+# That library's code and symbols are then in the challenge's address space and
+# can change its memory layout, which matters for exploits that depend on them.
+# pwnableserver refuses --pool with the challenge unless --pool-exec is also given:
+#DOCKER_PWNABLESERVER_ARGS := --pool 8 --pool-exec
+#
+# Or, to tune TCP for a menu-driven challenge so replies aren't
+# delayed and sessions of clients that vanished end within a minute.
+# A --tcp-profile only presets the options that aren't given explicitly,
+# so the --keepalive here wins no matter which comes first:
+#DOCKER_PWNABLESERVER_ARGS := --tcp-profile interactive --keepalive 30
 
 # DOCKER_CHALLENGE_ARGS is a list of arguments to pass to the challenge when it
 # is run in Docker under pwnableserver.
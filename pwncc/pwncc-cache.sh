@@ -0,0 +1,102 @@
+#!/bin/bash
+# Content-addressed object cache for compiler commands run in pwncc containers.
+#
+# Usage: pwncc-cache.sh <pwncc image ID> <compiler> <arguments...>
+#
+# PwnableHarness runs this in place of a compiler command like
+# "gcc ... -MD -MP -MF foo.d -c -o foo.o foo.c". The object file is looked up
+# by a hash of the pwncc image's ID, the compiler command (minus the names of
+# its output files), and the preprocessed source, which covers every macro and
+# header that went into it. On a hit, the cached object and compiler warnings
+# are reused without compiling. On a miss, the compiler runs as usual and its
+# object is added to the cache. Anything else runs the command unchanged, which
+# is also what happens when the image ID is unknown or there's no cache volume.
+
+cache_dir=${PWNCC_CACHE_DIR:-/pwncc-cache}
+image_id=$1
+shift
+
+if [[ -z "$image_id" || ! -d "$cache_dir" || ! -w "$cache_dir" ]]; then
+	exec "$@"
+fi
+
+# Only commands that compile a single object file are cached
+if [[ " $* " != *" -c "* || " $* " != *" -o "* ]]; then
+	exec "$@"
+fi
+
+tmp=$(mktemp "$cache_dir/.tmp.XXXXXX") || exec "$@"
+trap 'rm -f "$tmp" "$tmp.err"' EXIT
+
+# Build the preprocessor command and the key from the compiler command
+preprocess=()
+key=("$image_id")
+out=
+deps=
+prev=
+for arg in "$@"; do
+	case "$prev" in
+	-o)
+		out=$arg
+		preprocess+=("$tmp")
+		prev=
+		continue
+		;;
+	-MF)
+		deps=1
+		preprocess+=("$arg")
+		prev=
+		continue
+		;;
+	esac
+
+	case "$arg" in
+	-c)
+		preprocess+=(-E)
+		key+=("$arg")
+		;;
+	-o|-MF)
+		preprocess+=("$arg")
+		;;
+	*)
+		preprocess+=("$arg")
+		key+=("$arg")
+		;;
+	esac
+	prev=$arg
+done
+
+# The dependency file written while preprocessing must name the object file
+if [[ -n "$deps" ]]; then
+	preprocess+=(-MQ "$out")
+fi
+
+# Leave reporting errors in the source to the compiler
+if ! "${preprocess[@]}" 2>/dev/null; then
+	rm -f "$tmp"
+	exec "$@"
+fi
+
+hash=$( (printf '%s\0' "${key[@]}"; cat "$tmp") | sha256sum)
+hash=${hash%% *}
+entry=$cache_dir/${hash:0:2}/$hash
+
+if [[ -f "$entry.o" ]] && cp "$entry.o" "$out"; then
+	if [[ -s "$entry.err" ]]; then
+		cat "$entry.err" >&2
+	fi
+	exit 0
+fi
+
+"$@" 2>"$tmp.err"
+status=$?
+cat "$tmp.err" >&2
+if [[ $status -ne 0 ]]; then
+	exit $status
+fi
+
+# Renaming makes the entry appear all at once to any parallel compiles
+mkdir -p "${entry%/*}" \
+	&& cp "$tmp.err" "$tmp" && mv -f "$tmp" "$entry.err" \
+	&& cp "$out" "$tmp" && mv -f "$tmp" "$entry.o"
+exit 0
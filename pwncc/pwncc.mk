@@ -163,8 +163,35 @@ endif #C0deH4cker
 
 ifdef CONFIG_USE_PWNCC
 
+# Objects compiled in pwncc containers are cached in this Docker volume, which
+# is shared by every project and Ubuntu version. Cached objects are looked up
+# by the pwncc image's ID, the compiler flags, and the preprocessed source (see
+# pwncc-cache.sh), so a clean build only compiles what was never compiled
+# before. Define CONFIG_PWNCC_CACHE as empty to disable the cache.
+CONFIG_PWNCC_CACHE ?= pwncc-cache
+
+ifdef CONFIG_PWNCC_CACHE
+ifdef CONTAINER_BUILD
+PWNCC_CACHE_SCRIPT := $(BUILD)/pwncc-cache.sh
+
+# Copy from pwnmake's ROOT_DIR to the workspace's .build directory, where the
+# pwncc containers can access it.
+$(PWNCC_CACHE_SCRIPT): $(PWNCC_DIR)/pwncc-cache.sh | $(BUILD)/.dir
+	$(_v)cp $< $@
+
+else #CONTAINER_BUILD
+PWNCC_CACHE_SCRIPT := $(PWNCC_DIR)/pwncc-cache.sh
+endif #CONTAINER_BUILD
+
+$(call add_phony_target,pwncc-cache-clean)
+pwncc-cache-clean:
+	$(_V)echo "Deleting the pwncc object cache"
+	$(_v)$(DOCKER) volume rm -f $(CONFIG_PWNCC_CACHE) >/dev/null
+endif #CONFIG_PWNCC_CACHE
+
 #####
-# pwncc_prepare($1: project dir, $2: ubuntu version, $3: out_pwncc_cmd_prefix, $4: out_pwncc_deps)
+# pwncc_prepare($1: project dir, $2: ubuntu version, $3: out_pwncc_cmd_prefix, $4: out_pwncc_deps,
+#               $5: out_pwncc_compile_prefix)
 #####
 define _pwncc_prepare
 
@@ -212,14 +239,30 @@ $1+PWNCC_ARGS := \
 	--workdir=/PwnableHarness
 endif
 
+ifdef CONFIG_PWNCC_CACHE
+$1+PWNCC_ARGS += -v $$(CONFIG_PWNCC_CACHE):/pwncc-cache
+$4 += $$(PWNCC_CACHE_SCRIPT)
+endif
+
 # Return pwncc command prefix
 $3 := $$(DOCKER) run --rm \
 	$$($1+PWNCC_ARGS) \
 	$$(PWNABLEHARNESS_REPO):$$($1+PWNCC_TAG) \
 	$$(SPACE)
 
+# Return the command prefix for compiling, which goes through the object cache.
+# The image ID is looked up by the shell each time, as the image may not have
+# been built or pulled yet (then that compile isn't cached).
+ifdef CONFIG_PWNCC_CACHE
+$5 := $$($3)/bin/bash $$(PWNCC_CACHE_SCRIPT) \
+	"$$$$($$(DOCKER) image inspect -f '{{.Id}}' $$(PWNABLEHARNESS_REPO):$$($1+PWNCC_TAG) 2>/dev/null)" \
+	$$(SPACE)
+else
+$5 := $$($3)
+endif
+
 endef #pwncc_prepare
-pwncc_prepare = $(eval $(call _pwncc_prepare,$1,$2,$3,$4))
+pwncc_prepare = $(eval $(call _pwncc_prepare,$1,$2,$3,$4,$5))
 #####
 
 endif #CONFIG_USE_PWNCC
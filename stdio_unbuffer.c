@@ -6,6 +6,8 @@
 //  Copyright (c) 2019 C0deH4cker. All rights reserved.
 //
 
+#ifndef PWNABLE_COALESCED_STDIO
+
 #include <stdio.h>
 
 __attribute__((constructor))
@@ -14,3 +16,624 @@ static void pwnable_unbuffer_init(void) {
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
 }
+
+#else /* PWNABLE_COALESCED_STDIO */
+
+/*
+ * Coalesced mode (COALESCED_STDIO in Build.mk). Instead of turning off
+ * buffering, stdout is fully buffered and flushed whenever the output could
+ * matter to the player: right before the process blocks reading stdin, before
+ * it writes to stdout or stderr without going through the buffer, before it
+ * runs another program, when it exits or dies from a signal, and from a timer
+ * thread in case it's busy doing something else. This turns a menu that
+ * is printed with dozens of printf() calls into a single write() and packet.
+ *
+ * These functions are linked into the executable, so they take precedence over
+ * the libc functions of the same names for all calls made by the challenge.
+ * Each wrapper is built separately (with PWNABLE_STDIO_WRAPPER and
+ * PWNABLE_WRAP_<name> defined) as one member of an archive, so the linker only
+ * adds the wrappers for functions the challenge already calls. A challenge
+ * that never calls system() doesn't gain one at a fixed address. Without those
+ * macros, this builds the part that is always linked in.
+ *
+ * When pwnableserver runs with --trace, this also reports when the challenge
+ * starts running and when it first writes output, as every write of stdout
+ * goes through pwnable_flush_output().
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#undef _FORTIFY_SOURCE
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*! Shared by the members of the wrapper archive, but not exported from the executable */
+#define PWNABLE_HIDDEN __attribute__((visibility("hidden")))
+
+PWNABLE_HIDDEN void pwnable_flush_output(void);
+PWNABLE_HIDDEN void pwnable_flush_before_reading(FILE* stream);
+PWNABLE_HIDDEN void pwnable_flush_before_writing(int fd);
+PWNABLE_HIDDEN void* pwnable_real_symbol(void** cache, const char* name);
+
+#define REAL(type, name) ((type)pwnable_real_symbol(&real_##name, #name))
+
+
+#ifndef PWNABLE_STDIO_WRAPPER
+
+/*! How often the timer thread flushes stdout */
+#define COALESCE_FLUSH_MS 20
+
+/*! Size of the stdout buffer */
+#define COALESCE_BUFFER_SIZE 16384
+
+/*! Steps reported to pwnableserver, numbered like TRACE_READY and TRACE_FIRST_BYTE in pwnable_harness.c */
+#define TRACE_READY 2
+#define TRACE_FIRST_BYTE 3
+
+static char stdout_buffer[COALESCE_BUFFER_SIZE];
+
+/*! Server's trace pipe until the first output has been reported, or -1 */
+static int trace_fd = -1;
+
+/*! Reached through dlsym() so that the write() wrapper isn't linked in for this */
+static void* real_write;
+
+
+/*! Report a step to the server as the step number and the monotonic time in nanoseconds. */
+static void report_trace(int fd, uint64_t step) {
+	struct timespec now;
+	uint64_t report[2];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	report[0] = step;
+	report[1] = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	if(REAL(ssize_t (*)(int, const void*, size_t), write)(fd, report, sizeof(report)) < 0) {
+		/* Tracing is best effort */
+	}
+}
+
+/*! Flush anything the challenge has printed but not yet written. */
+void pwnable_flush_output(void) {
+	int fd;
+
+	/* Only one thread gets to report the first output */
+	if(trace_fd != -1 && __fpending(stdout) > 0) {
+		fd = __atomic_exchange_n(&trace_fd, -1, __ATOMIC_RELAXED);
+		if(fd != -1) {
+			report_trace(fd, TRACE_FIRST_BYTE);
+			close(fd);
+		}
+	}
+
+	fflush(stdout);
+}
+
+/*! Flush output only when about to read from stdin. */
+void pwnable_flush_before_reading(FILE* stream) {
+	if(stream == stdin) {
+		pwnable_flush_output();
+	}
+}
+
+/*! Flush output only when about to write to stdout or stderr directly. */
+void pwnable_flush_before_writing(int fd) {
+	if(fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+		pwnable_flush_output();
+	}
+}
+
+/*! Look up the libc implementation of an interposed function. */
+void* pwnable_real_symbol(void** cache, const char* name) {
+	if(*cache == NULL) {
+		*cache = dlsym(RTLD_NEXT, name);
+		if(*cache == NULL) {
+			abort();
+		}
+	}
+
+	return *cache;
+}
+
+
+/*
+ * Fatal signals: flush what we can before dying the same way we would have.
+ * This is best effort, as the signal may have interrupted a stdio call.
+ */
+static void flush_on_signal(int sig) {
+	if(ftrylockfile(stdout) == 0) {
+		fflush_unlocked(stdout);
+		funlockfile(stdout);
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void install_signal_flushers(void) {
+	static const int sigs[] = {SIGABRT, SIGALRM, SIGBUS, SIGFPE, SIGILL, SIGSEGV, SIGTERM};
+	struct sigaction sa;
+	struct sigaction old;
+	unsigned i;
+
+	for(i = 0; i < sizeof(sigs) / sizeof(*sigs); i++) {
+		/* Leave ignored signals (inherited across exec) alone */
+		if(sigaction(sigs[i], NULL, &old) != 0 || old.sa_handler != SIG_DFL) {
+			continue;
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = &flush_on_signal;
+		sa.sa_flags = SA_RESETHAND | SA_NODEFER | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(sigs[i], &sa, NULL);
+	}
+}
+
+/*! Flushes output periodically, in case the challenge isn't reading input. */
+static void* flush_timer(void* arg) {
+	struct timespec interval;
+	(void)arg;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = COALESCE_FLUSH_MS * 1000000L;
+	for(;;) {
+		nanosleep(&interval, NULL);
+		pwnable_flush_output();
+	}
+
+	return NULL;
+}
+
+/*! Tell a server running with --trace that the challenge is up and running. */
+static void start_trace(void) {
+	const char* fd_str = getenv("PWNABLE_TRACE_FD");
+	int fd;
+
+	if(fd_str == NULL) {
+		return;
+	}
+
+	fd = atoi(fd_str);
+	unsetenv("PWNABLE_TRACE_FD");
+
+	/* Programs run by the challenge must not inherit it */
+	if(fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+		return;
+	}
+
+	report_trace(fd, TRACE_READY);
+	trace_fd = fd;
+}
+
+static void start_flush_timer(void) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t all;
+	sigset_t old;
+
+	/* Signals meant for the challenge must not be delivered to this thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	pthread_create(&thread, &attr, &flush_timer, NULL);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+__attribute__((constructor))
+static void pwnable_coalesce_init(void) {
+	/* stdout gathers output until something needs it, stderr stays unbuffered */
+	setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+	setvbuf(stderr, NULL, _IONBF, 0);
+
+	/* A forked child would write out its own copy of anything still buffered */
+	pthread_atfork(&pwnable_flush_output, NULL, NULL);
+
+	install_signal_flushers();
+	start_trace();
+	start_flush_timer();
+}
+
+#else /* PWNABLE_STDIO_WRAPPER */
+
+/* Input functions: flush before (possibly) blocking on stdin */
+
+#ifdef PWNABLE_WRAP_read
+static void* real_read;
+ssize_t pwnable_read(int fd, void* buf, size_t count) __asm__("read");
+ssize_t pwnable_read(int fd, void* buf, size_t count) {
+	if(fd == STDIN_FILENO) {
+		pwnable_flush_output();
+	}
+	return REAL(ssize_t (*)(int, void*, size_t), read)(fd, buf, count);
+}
+#endif
+
+#ifdef PWNABLE_WRAP___read_chk
+static void* real___read_chk;
+ssize_t pwnable___read_chk(int fd, void* buf, size_t count, size_t buflen) __asm__("__read_chk");
+ssize_t pwnable___read_chk(int fd, void* buf, size_t count, size_t buflen) {
+	if(fd == STDIN_FILENO) {
+		pwnable_flush_output();
+	}
+	return REAL(ssize_t (*)(int, void*, size_t, size_t), __read_chk)(fd, buf, count, buflen);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fgets
+static void* real_fgets;
+char* pwnable_fgets(char* s, int size, FILE* stream) __asm__("fgets");
+char* pwnable_fgets(char* s, int size, FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(char* (*)(char*, int, FILE*), fgets)(s, size, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP___fgets_chk
+static void* real___fgets_chk;
+char* pwnable___fgets_chk(char* s, size_t buflen, int size, FILE* stream) __asm__("__fgets_chk");
+char* pwnable___fgets_chk(char* s, size_t buflen, int size, FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(char* (*)(char*, size_t, int, FILE*), __fgets_chk)(s, buflen, size, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_gets
+static void* real_gets;
+char* pwnable_gets(char* s) __asm__("gets");
+char* pwnable_gets(char* s) {
+	pwnable_flush_output();
+	return REAL(char* (*)(char*), gets)(s);
+}
+#endif
+
+#ifdef PWNABLE_WRAP___gets_chk
+static void* real___gets_chk;
+char* pwnable___gets_chk(char* s, size_t buflen) __asm__("__gets_chk");
+char* pwnable___gets_chk(char* s, size_t buflen) {
+	pwnable_flush_output();
+	return REAL(char* (*)(char*, size_t), __gets_chk)(s, buflen);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_getchar
+static void* real_getchar;
+int pwnable_getchar(void) __asm__("getchar");
+int pwnable_getchar(void) {
+	pwnable_flush_output();
+	return REAL(int (*)(void), getchar)();
+}
+#endif
+
+#ifdef PWNABLE_WRAP_getc
+static void* real_getc;
+int pwnable_getc(FILE* stream) __asm__("getc");
+int pwnable_getc(FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(int (*)(FILE*), getc)(stream);
+}
+#endif
+
+/* Older glibc headers turn getc() into a call to _IO_getc() */
+#ifdef PWNABLE_WRAP__IO_getc
+static void* real__IO_getc;
+int pwnable__IO_getc(FILE* stream) __asm__("_IO_getc");
+int pwnable__IO_getc(FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(int (*)(FILE*), _IO_getc)(stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fgetc
+static void* real_fgetc;
+int pwnable_fgetc(FILE* stream) __asm__("fgetc");
+int pwnable_fgetc(FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(int (*)(FILE*), fgetc)(stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fread
+static void* real_fread;
+size_t pwnable_fread(void* ptr, size_t size, size_t nmemb, FILE* stream) __asm__("fread");
+size_t pwnable_fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(size_t (*)(void*, size_t, size_t, FILE*), fread)(ptr, size, nmemb, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_getdelim
+static void* real_getdelim;
+ssize_t pwnable_getdelim(char** line, size_t* n, int delim, FILE* stream) __asm__("getdelim");
+ssize_t pwnable_getdelim(char** line, size_t* n, int delim, FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(ssize_t (*)(char**, size_t*, int, FILE*), getdelim)(line, n, delim, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_getline
+static void* real_getline;
+ssize_t pwnable_getline(char** line, size_t* n, FILE* stream) __asm__("getline");
+ssize_t pwnable_getline(char** line, size_t* n, FILE* stream) {
+	pwnable_flush_before_reading(stream);
+	return REAL(ssize_t (*)(char**, size_t*, FILE*), getline)(line, n, stream);
+}
+#endif
+
+/*
+ * Depending on the C standard and feature macros used to build the challenge,
+ * glibc's headers redirect scanf() and fscanf() to one of these variants.
+ */
+#define DEFINE_SCANF(name, vname) \
+static void* real_##vname; \
+int pwnable_##name(const char* format, ...) __asm__(#name); \
+int pwnable_##name(const char* format, ...) { \
+	va_list ap; \
+	int ret; \
+	\
+	pwnable_flush_output(); \
+	va_start(ap, format); \
+	ret = REAL(int (*)(const char*, va_list), vname)(format, ap); \
+	va_end(ap); \
+	return ret; \
+}
+
+#define DEFINE_FSCANF(name, vname) \
+static void* real_##vname; \
+int pwnable_##name(FILE* stream, const char* format, ...) __asm__(#name); \
+int pwnable_##name(FILE* stream, const char* format, ...) { \
+	va_list ap; \
+	int ret; \
+	\
+	pwnable_flush_before_reading(stream); \
+	va_start(ap, format); \
+	ret = REAL(int (*)(FILE*, const char*, va_list), vname)(stream, format, ap); \
+	va_end(ap); \
+	return ret; \
+}
+
+#ifdef PWNABLE_WRAP_scanf
+DEFINE_SCANF(scanf, vscanf)
+#endif
+#ifdef PWNABLE_WRAP___isoc99_scanf
+DEFINE_SCANF(__isoc99_scanf, __isoc99_vscanf)
+#endif
+#ifdef PWNABLE_WRAP___isoc23_scanf
+DEFINE_SCANF(__isoc23_scanf, __isoc23_vscanf)
+#endif
+#ifdef PWNABLE_WRAP_fscanf
+DEFINE_FSCANF(fscanf, vfscanf)
+#endif
+#ifdef PWNABLE_WRAP___isoc99_fscanf
+DEFINE_FSCANF(__isoc99_fscanf, __isoc99_vfscanf)
+#endif
+#ifdef PWNABLE_WRAP___isoc23_fscanf
+DEFINE_FSCANF(__isoc23_fscanf, __isoc23_vfscanf)
+#endif
+
+
+
+/* Unbuffered output: what's already in the stdout buffer must come first */
+
+#ifdef PWNABLE_WRAP_write
+static void* real_write;
+ssize_t pwnable_write(int fd, const void* buf, size_t count) __asm__("write");
+ssize_t pwnable_write(int fd, const void* buf, size_t count) {
+	pwnable_flush_before_writing(fd);
+	return REAL(ssize_t (*)(int, const void*, size_t), write)(fd, buf, count);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fputs
+static void* real_fputs;
+int pwnable_fputs(const char* str, FILE* stream) __asm__("fputs");
+int pwnable_fputs(const char* str, FILE* stream) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(int (*)(const char*, FILE*), fputs)(str, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fputc
+static void* real_fputc;
+int pwnable_fputc(int c, FILE* stream) __asm__("fputc");
+int pwnable_fputc(int c, FILE* stream) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(int (*)(int, FILE*), fputc)(c, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_putc
+static void* real_putc;
+int pwnable_putc(int c, FILE* stream) __asm__("putc");
+int pwnable_putc(int c, FILE* stream) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(int (*)(int, FILE*), putc)(c, stream);
+}
+#endif
+
+/* Older glibc headers turn putc() into a call to _IO_putc() */
+#ifdef PWNABLE_WRAP__IO_putc
+static void* real__IO_putc;
+int pwnable__IO_putc(int c, FILE* stream) __asm__("_IO_putc");
+int pwnable__IO_putc(int c, FILE* stream) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(int (*)(int, FILE*), _IO_putc)(c, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fwrite
+static void* real_fwrite;
+size_t pwnable_fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream) __asm__("fwrite");
+size_t pwnable_fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(size_t (*)(const void*, size_t, size_t, FILE*), fwrite)(ptr, size, nmemb, stream);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_perror
+static void* real_perror;
+void pwnable_perror(const char* str) __asm__("perror");
+void pwnable_perror(const char* str) {
+	pwnable_flush_output();
+	REAL(void (*)(const char*), perror)(str);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_vfprintf
+static void* real_vfprintf;
+int pwnable_vfprintf(FILE* stream, const char* format, va_list ap) __asm__("vfprintf");
+int pwnable_vfprintf(FILE* stream, const char* format, va_list ap) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(int (*)(FILE*, const char*, va_list), vfprintf)(stream, format, ap);
+}
+#endif
+
+#ifdef PWNABLE_WRAP___vfprintf_chk
+static void* real___vfprintf_chk;
+int pwnable___vfprintf_chk(FILE* stream, int flag, const char* format, va_list ap) __asm__("__vfprintf_chk");
+int pwnable___vfprintf_chk(FILE* stream, int flag, const char* format, va_list ap) {
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	return REAL(int (*)(FILE*, int, const char*, va_list), __vfprintf_chk)(stream, flag, format, ap);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_fprintf
+static void* real_vfprintf;
+int pwnable_fprintf(FILE* stream, const char* format, ...) __asm__("fprintf");
+int pwnable_fprintf(FILE* stream, const char* format, ...) {
+	va_list ap;
+	int ret;
+
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	va_start(ap, format);
+	ret = REAL(int (*)(FILE*, const char*, va_list), vfprintf)(stream, format, ap);
+	va_end(ap);
+	return ret;
+}
+#endif
+
+#ifdef PWNABLE_WRAP___fprintf_chk
+static void* real___vfprintf_chk;
+int pwnable___fprintf_chk(FILE* stream, int flag, const char* format, ...) __asm__("__fprintf_chk");
+int pwnable___fprintf_chk(FILE* stream, int flag, const char* format, ...) {
+	va_list ap;
+	int ret;
+
+	pwnable_flush_before_writing(stream == stderr ? STDERR_FILENO : -1);
+	va_start(ap, format);
+	ret = REAL(int (*)(FILE*, int, const char*, va_list), __vfprintf_chk)(stream, flag, format, ap);
+	va_end(ap);
+	return ret;
+}
+#endif
+
+#ifdef PWNABLE_WRAP_dprintf
+static void* real_vdprintf;
+int pwnable_dprintf(int fd, const char* format, ...) __asm__("dprintf");
+int pwnable_dprintf(int fd, const char* format, ...) {
+	va_list ap;
+	int ret;
+
+	pwnable_flush_before_writing(fd);
+	va_start(ap, format);
+	ret = REAL(int (*)(int, const char*, va_list), vdprintf)(fd, format, ap);
+	va_end(ap);
+	return ret;
+}
+#endif
+
+#ifdef PWNABLE_WRAP___dprintf_chk
+static void* real___vdprintf_chk;
+int pwnable___dprintf_chk(int fd, int flag, const char* format, ...) __asm__("__dprintf_chk");
+int pwnable___dprintf_chk(int fd, int flag, const char* format, ...) {
+	va_list ap;
+	int ret;
+
+	pwnable_flush_before_writing(fd);
+	va_start(ap, format);
+	ret = REAL(int (*)(int, int, const char*, va_list), __vdprintf_chk)(fd, flag, format, ap);
+	va_end(ap);
+	return ret;
+}
+#endif
+
+
+/* Running other programs: their output must come after ours */
+
+#ifdef PWNABLE_WRAP_system
+static void* real_system;
+int pwnable_system(const char* command) __asm__("system");
+int pwnable_system(const char* command) {
+	pwnable_flush_output();
+	return REAL(int (*)(const char*), system)(command);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_popen
+static void* real_popen;
+FILE* pwnable_popen(const char* command, const char* type) __asm__("popen");
+FILE* pwnable_popen(const char* command, const char* type) {
+	pwnable_flush_output();
+	return REAL(FILE* (*)(const char*, const char*), popen)(command, type);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_execve
+static void* real_execve;
+int pwnable_execve(const char* path, char* const argv[], char* const envp[]) __asm__("execve");
+int pwnable_execve(const char* path, char* const argv[], char* const envp[]) {
+	pwnable_flush_output();
+	return REAL(int (*)(const char*, char* const[], char* const[]), execve)(path, argv, envp);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_execv
+static void* real_execv;
+int pwnable_execv(const char* path, char* const argv[]) __asm__("execv");
+int pwnable_execv(const char* path, char* const argv[]) {
+	pwnable_flush_output();
+	return REAL(int (*)(const char*, char* const[]), execv)(path, argv);
+}
+#endif
+
+#ifdef PWNABLE_WRAP_execvp
+static void* real_execvp;
+int pwnable_execvp(const char* file, char* const argv[]) __asm__("execvp");
+int pwnable_execvp(const char* file, char* const argv[]) {
+	pwnable_flush_output();
+	return REAL(int (*)(const char*, char* const[]), execvp)(file, argv);
+}
+#endif
+
+
+/* Leaving without running exit handlers */
+
+#ifdef PWNABLE_WRAP__exit
+static void* real__exit;
+void pwnable__exit(int status) __asm__("_exit");
+void pwnable__exit(int status) {
+	pwnable_flush_output();
+	REAL(void (*)(int), _exit)(status);
+	abort();
+}
+#endif
+
+#endif /* PWNABLE_STDIO_WRAPPER */
+
+#endif /* PWNABLE_COALESCED_STDIO */